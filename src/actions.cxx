@@ -3,6 +3,8 @@
 // SPDX-FileContributor: Written by Rachel Mant <git@dragonmux.network>
 #include <string>
 #include <string_view>
+#include <algorithm>
+#include <memory>
 #include <substrate/span>
 #include <substrate/fd>
 #include <substrate/index_sequence>
@@ -10,10 +12,18 @@
 #include <substrate/console>
 #include <substrate/units>
 #include "actions.hxx"
-#include "flashVendors.hxx"
 #include "sfdp.hxx"
 #include "provisionELF.hxx"
+#include "manifest.hxx"
+#include "progress.hxx"
+#include "imageFormats.hxx"
+#include "profileCache.hxx"
+#include "crc32.hxx"
 #include "units.hxx"
+#include "trace.hxx"
+#include "spiNand.hxx"
+#include "sdCard.hxx"
+#include "digest.hxx"
 
 using namespace std::literals::string_literals;
 using namespace std::literals::string_view_literals;
@@ -23,12 +33,27 @@ using substrate::indexedIterator_t;
 using substrate::span;
 using substrate::fd_t;
 using substrate::normalMode;
+using substrate::asHex_t;
 using substrate::operator ""_KiB;
 using bmpflash::utils::humanReadableSize;
-using elfProvision_t = bmpflash::elf::provision_t;
+using bmpflash::spiFlash::spiFlash_t;
+using bmpflash::spiNand::spiNand_t;
+using bmpflash::sdCard::sdCard_t;
+using bmpflash::manifest::manifest_t;
+using bmpflash::progress::progress_t;
+using bmpflash::progress::phase_t;
+using bmpflash::digest::digestWorker_t;
+using bmpflash::imageFormats::format_t;
+using bmpflash::imageFormats::isSparse;
+using bmpflash::imageFormats::formatName;
+using bmpflash::imageFormats::estimateDataLength;
 
 namespace bmpflash
 {
+	constexpr static size_t maxWriteRunLength{256_KiB};
+	// SD cards have no erase sectors we can see, so their per-sector CRCs cover this much of the card each
+	constexpr static size_t sdCardDigestSectorSize{64_KiB};
+
 	void displayInfo(size_t idx, const usbDevice_t &device);
 
 	[[nodiscard]] inline bool contains(const std::string_view &searchIn, const std::string_view &searchFor) noexcept
@@ -65,77 +90,10 @@ namespace bmpflash
 		return std::nullopt;
 	}
 
-	[[nodiscard]] spiDevice_t busToDevice(const spiBus_t &bus)
-	{
-		switch (bus)
-		{
-			case spiBus_t::internal:
-				return spiDevice_t::intFlash;
-			case spiBus_t::external:
-				return spiDevice_t::extFlash;
-			case spiBus_t::none:
-			default:
-				throw std::domain_error{"SPI bus requested is unhandled or unknown"};
-		}
-	}
-
-	[[nodiscard]] std::optional<bmp_t> beginComms(const usbDevice_t &device, const spiBus_t &spiBus)
-	{
-		// Use the found device to then build the communications structure
-		bmp_t probe{device};
-		if (!probe.valid())
-			return std::nullopt;
-
-		// Initialise remote communications
-		const auto probeVersion{probe.init()};
-		console.info("Remote is "sv, probeVersion);
-
-		// Convert the bus to use to a device too
-		const auto spiDevice{busToDevice(spiBus)};
-
-		// Start by checking the BMP is running a new enough remote protocol
-		const auto protocolVersion{probe.readProtocolVersion()};
-		if (protocolVersion < 3U || !probe.begin(spiBus, spiDevice))
-		{
-			console.error("Probe is running firmware that is too old, please update it");
-			return std::nullopt;
-		}
-		return probe;
-	}
-
 	// This allows feeding a flag_t in for the bus instead of a raw spiBus_t
 	[[nodiscard]] std::optional<bmp_t> beginComms(const usbDevice_t &device, const flag_t &bus)
 		{ return beginComms(device, std::any_cast<spiBus_t>(bus.value())); }
 
-	[[nodiscard]] std::string_view lookupFlashVendor(const uint8_t manufacturer) noexcept
-	{
-		// Look the Flash manufacturer up by MFR ID
-		const auto vendor{flashVendors.find(manufacturer)};
-		if (vendor == flashVendors.cend())
-			return "<Unknown>"sv;
-		return vendor->second;
-	}
-
-	bool identifyFlash(const bmp_t &probe) noexcept
-	{
-		const auto chipID{probe.identifyFlash()};
-		// If we got a bad all-highs read back, or the capacity is 0, then there's no device there.
-		if ((chipID.manufacturer == 0xffU && chipID.type == 0xffU && chipID.capacity == 0xffU) ||
-			chipID.capacity == 0U)
-		{
-			console.error("Could not identify a valid Flash device on the requested SPI bus"sv);
-			return false;
-		}
-		// Display some useful information about the Flash
-		console.info("SPI Flash ID: ", asHex_t<2, '0'>{chipID.manufacturer}, ' ',
-			asHex_t<2, '0'>{chipID.type}, ' ', asHex_t<2, '0'>{chipID.capacity});
-		const auto flashSize{UINT32_C(1) << chipID.capacity};
-		const auto [capacityValue, capacityUnits] = humanReadableSize(flashSize);
-		console.info("Device is a "sv, capacityValue, capacityUnits, " device from "sv,
-			lookupFlashVendor(chipID.manufacturer));
-		return true;
-	}
-
 	void displayInfo(const size_t idx, const usbDevice_t &device)
 	{
 		const auto handle{device.open()};
@@ -181,37 +139,90 @@ namespace bmpflash
 
 	bool displaySFDP(const usbDevice_t &device, const arguments_t &sfdpArguments)
 	{
+		const auto *const busArg{sfdpArguments["bus"sv]};
+		if (!busArg)
+		{
+			console.error("A bus must be specified with --bus to read SFDP data from a device"sv);
+			return false;
+		}
 		// Try to begin communications with the BMP
-		auto probe{beginComms(device, std::get<flag_t>(*sfdpArguments["bus"sv]))};
+		auto probe{beginComms(device, std::get<flag_t>(*busArg))};
+		if (!probe)
+			return false;
 		// If we got good comms, then try and identify the Flash
-		if (!probe || !identifyFlash(*probe))
+		const auto chipID{identifyFlash(*probe)};
+		if (!chipID)
 			return false;
 
+		const auto *const saveArg{sfdpArguments["save"sv]};
+		const auto saveFile
+		{
+			[&]() -> std::optional<path>
+			{
+				if (!saveArg)
+					return std::nullopt;
+				return std::any_cast<path>(std::get<flag_t>(*saveArg).value());
+			}()
+		};
 		// Ask for the SFDP data and display it then clean up
-		sfdp::readAndDisplay(*probe, sfdpArguments["display-raw"sv] != nullptr);
-		return probe->end();
+		const auto result{sfdp::readAndDisplay(*probe, *chipID, sfdpArguments["display-raw"sv] != nullptr, saveFile)};
+		return probe->end() && result;
+	}
+
+	bool displaySFDPFromFile(const arguments_t &sfdpArguments)
+	{
+		const auto fileName{std::any_cast<path>(std::get<flag_t>(*sfdpArguments["from-file"sv]).value())};
+		console.info("Reading SFDP data from "sv, fileName.string());
+		const auto sfdpData{sfdp::load(fileName)};
+		if (!sfdpData)
+			return false;
+		return sfdp::display({sfdpData->data(), sfdpData->size()}, sfdpArguments["display-raw"sv] != nullptr);
+	}
+
+	[[nodiscard]] std::vector<elf::imageSpec_t> imageSpecsFrom(const arguments_t &provisionArguments)
+	{
+		std::vector<elf::imageSpec_t> specs{};
+		for (const auto *const fileArg : provisionArguments.findAll("fileName"sv))
+			specs.push_back(std::any_cast<elf::imageSpec_t>(std::get<flag_t>(*fileArg).value()));
+		return specs;
 	}
 
 	bool provision(const usbDevice_t &device, const arguments_t &provisionArguments)
 	{
+		// Start reading in the ELF files in the background while we bring up the probe
+		auto loading{elf::loadImages(imageSpecsFrom(provisionArguments))};
+
 		// Try to begin communications with the BMP
 		auto probe{beginComms(device, spiBus_t::internal)};
+		if (!probe)
+			return false;
 		// If we got good comms, then try and identify the Flash
-		if (!probe || !identifyFlash(*probe))
+		const auto chipID{identifyFlash(*probe)};
+		if (!chipID)
 			return false;
 
-		// Try and open the requested file, checking that it's a valid ELF file
-		const elfProvision_t elf{std::any_cast<path>(std::get<flag_t>(*provisionArguments["fileName"sv]).value())};
-		if (!elf.valid())
+		auto spiFlash{sfdp::read(*probe, *chipID)};
+		if (!spiFlash)
 		{
-			console.error("Cannot read requested file as an ELF binary"sv);
+			console.error("Could not setup SPI Flash control structures"sv);
 			return false;
 		}
-		// Now try and provision the requested binary to the on-board Flash
-		console.info("Repacking ELF file for on-board SPI Flash and provisioning it to BMP"sv);
-		if (!elf.repack(*probe))
+
+		const auto images{loading.get()};
+		if (!images)
+			return false;
+
+		// Now try and provision the requested binaries to the on-board Flash
+		console.info("Repacking ELF files for on-board SPI Flash and provisioning them to BMP"sv);
+		const auto image{elf::packedImageFor(*images, *spiFlash)};
+		if (!image)
 		{
-			console.error("Failed to successfully repack ELF file"sv);
+			console.error("Failed to successfully repack ELF files"sv);
+			return false;
+		}
+		if (!elf::writeImage(*probe, *spiFlash, {image->data(), image->size()}))
+		{
+			console.error("Failed to provision the packed image to the on-board Flash"sv);
 			return false;
 		}
 
@@ -220,23 +231,164 @@ namespace bmpflash
 		return probe->end();
 	}
 
-	bool read(const usbDevice_t &device, const arguments_t &readArguments)
+	bool provisionToFile(const arguments_t &provisionArguments)
 	{
-		// Try to begin communications with the BMP
-		auto probe{beginComms(device, std::get<flag_t>(*readArguments["bus"sv]))};
-		// If we got good comms, then try and identify the Flash
-		if (!probe || !identifyFlash(*probe))
+		// Work out what Flash chip we're packing the image for from either SFDP data or a JEDEC ID
+		const auto *const sfdpArg{provisionArguments["sfdp"sv]};
+		const auto *const chipArg{provisionArguments["chip"sv]};
+		const auto spiFlash
+		{
+			[&]() -> std::optional<spiFlash_t>
+			{
+				if (sfdpArg)
+				{
+					const auto sfdpData{sfdp::load(std::any_cast<path>(std::get<flag_t>(*sfdpArg).value()))};
+					if (!sfdpData)
+						return std::nullopt;
+					return sfdp::parse({sfdpData->data(), sfdpData->size()});
+				}
+				if (chipArg)
+				{
+					const auto chipID{std::any_cast<spiFlashID_t>(std::get<flag_t>(*chipArg).value())};
+					// With no device to check the SFDP headers against, the best that can be done is to say
+					// where the geometry came from so a stale profile can be spotted
+					if (const auto profile{profileCache::loadChipProfile(chipID)}; profile)
+					{
+						console.info("Using the SFDP profile cached from the last device seen with this JEDEC ID"sv);
+						return profile->spiFlash;
+					}
+					return sfdp::spiFlashFromID(chipID);
+				}
+				console.error("The Flash chip to pack the image for must be given using either --sfdp or --chip"sv);
+				return std::nullopt;
+			}()
+		};
+		if (!spiFlash)
 			return false;
 
-		auto spiFlash{sfdp::read(*probe)};
-		if (!spiFlash)
+		console.info("Repacking ELF files for on-board SPI Flash"sv);
+		const auto image{elf::packedImageFor(imageSpecsFrom(provisionArguments), *spiFlash)};
+		if (!image)
 		{
-			console.error("Could not setup SPI Flash control structures"sv);
+			console.error("Failed to successfully repack ELF files"sv);
 			return false;
 		}
 
-		const fd_t file{std::any_cast<path>(std::get<flag_t>(*readArguments["fileName"sv]).value()),
-			O_WRONLY | O_CREAT | O_NOCTTY, normalMode};
+		const auto outputFile{std::any_cast<path>(std::get<flag_t>(*provisionArguments["output"sv]).value())};
+		const fd_t file{outputFile, O_WRONLY | O_CREAT | O_TRUNC | O_NOCTTY, normalMode};
+		if (!file.valid() || !file.write(image->data(), image->size()))
+		{
+			console.error("Failed to write packed image to "sv, outputFile.string());
+			return false;
+		}
+		const auto [imageLength, imageUnits] = humanReadableSize(image->size());
+		console.info("Wrote "sv, imageLength, imageUnits, " packed image to "sv, outputFile.string());
+		return true;
+	}
+
+	// The span of a device that a write has erased or programmed so far
+	struct modifiedRange_t final
+	{
+		uint64_t begin{UINT64_MAX};
+		uint64_t end{0U};
+
+		[[nodiscard]] bool empty() const noexcept { return begin >= end; }
+		void add(const uint64_t address, const uint64_t length) noexcept
+		{
+			begin = std::min(begin, address);
+			end = std::max(end, address + length);
+		}
+	};
+
+	// When the input turns out to be bad part way through a write, say what state that's left the device in
+	static void reportParseFailure(const std::string_view device, const modifiedRange_t &modified)
+	{
+		if (modified.empty())
+		{
+			console.error("Write abandoned as the input file could not be read or parsed, the "sv, device,
+				" was not modified"sv);
+			return;
+		}
+		console.error("Write abandoned as the input file could not be read or parsed part way through"sv);
+		console.error("The "sv, device, " was left partially written between 0x"sv,
+			asHex_t<8, '0'>{modified.begin}, " and 0x"sv, asHex_t<8, '0'>{modified.end},
+			", and data decoded before the bad record may not have been written"sv);
+	}
+
+	// Pull what's to be reported about a read or write out of its arguments
+	[[nodiscard]] static reportOptions_t reportOptions(const arguments_t &arguments)
+	{
+		const auto *const statsArg{arguments["stats-json"sv]};
+		return
+		{
+			arguments["digest"sv] != nullptr,
+			statsArg ? std::optional{std::any_cast<path>(std::get<flag_t>(*statsArg).value())} : std::nullopt,
+		};
+	}
+
+	// Start hashing the data as it's transferred if anything is going to be reported about it
+	[[nodiscard]] static std::unique_ptr<digestWorker_t> startDigest(const reportOptions_t &report,
+		const size_t sectorSize)
+	{
+		if (!report.wanted())
+			return nullptr;
+		return std::make_unique<digestWorker_t>(sectorSize);
+	}
+
+	/*
+	 * The records of the sparse formats can come in any order and revisit addresses, so hashing them as
+	 * they stream past would describe neither the file nor what ends up on the device. Digests are refused
+	 * for them, and any statistics requested are written without one.
+	 */
+	[[nodiscard]] static bool digestSupported(const reportOptions_t &report, const format_t format)
+	{
+		if (report.digest && isSparse(format))
+		{
+			console.error("--digest is not supported for "sv, formatName(format), " input"sv);
+			return false;
+		}
+		return true;
+	}
+
+	[[nodiscard]] static std::unique_ptr<digestWorker_t> startDigest(const reportOptions_t &report,
+		const size_t sectorSize, const format_t format)
+		{ return isSparse(format) ? nullptr : startDigest(report, sectorSize); }
+
+	// Collect up the data's digests once the transfers are done, and write out the requested reports
+	[[nodiscard]] static bool finishReports(const reportOptions_t &report, const std::string_view operation,
+		const path &fileName, const progress_t &progress, digestWorker_t *const worker)
+	{
+		if (!report.wanted())
+			return true;
+		const auto stats{progress.stats()};
+		// Sparse inputs are written without a digest, so there may only be statistics to report
+		std::optional<digest::digest_t> digest{};
+		if (worker)
+		{
+			digest = worker->finish();
+			if (!digest)
+				return false;
+			console.info("Data CRC32 is 0x"sv, asHex_t<8, '0'>{digest->crc32});
+		}
+		if (report.digest && digest && !digest::writeSidecar(fileName, *digest))
+			return false;
+		if (report.statsFile &&
+			!digest::writeStats(*report.statsFile, operation, fileName, stats, digest ? &*digest : nullptr))
+			return false;
+		return true;
+	}
+
+	bool readFlash(const bmp_t &probe, flashTarget_t &target, const path &fileName, const size_t address,
+		const size_t length, const reportOptions_t &report)
+	{
+		auto &spiFlash{target.spiFlash};
+		if (address > spiFlash.capacity() || length > spiFlash.capacity() - address)
+		{
+			console.error("Requested region exceeds the target Flash's capacity"sv);
+			return false;
+		}
+
+		const fd_t file{fileName, O_WRONLY | O_CREAT | O_NOCTTY, normalMode};
 		if (!file.valid())
 		{
 			console.error("Failed to open output file"sv);
@@ -244,79 +396,651 @@ namespace bmpflash
 		}
 
 		console.info("Reading back SPI Flash chip contents"sv);
-		const auto capacity{spiFlash->capacity()};
+		progress_t progress{"read"sv, length};
+		const auto digest{startDigest(report, spiFlash.sectorSize())};
 		std::array<uint8_t, 4_KiB> buffer{};
-		for (const auto address : indexSequence_t{capacity}.step(buffer.size()))
+		for (const auto offset : indexSequence_t{length}.step(buffer.size()))
 		{
-			const auto amount{std::min(capacity - address, buffer.size())};
+			const auto amount{std::min(length - offset, buffer.size())};
 			const span subspan{buffer.data(), amount};
-			if (!spiFlash->readBlock(*probe, address, subspan))
+			progress.begin(phase_t::read);
+			if (!spiFlash.readBlock(probe, address + offset, subspan))
 			{
 				console.error("SPI Flash readout failed"sv);
 				return false;
 			}
+			progress.end(amount);
+			if (digest)
+				digest->push(address + offset, subspan);
+			const trace::span_t span{"file"sv, "write output"sv};
 			if (!file.write(subspan.data(), subspan.size()))
 			{
 				console.error("Failed to write data block to output file"sv);
 				return false;
 			}
 		}
-
-		// Finish up by cleaning up the session
+		progress.finish();
+		if (!finishReports(report, "read"sv, fileName, progress, digest.get()))
+			return false;
 		console.info("SPI Flash chip read complete"sv);
-		return probe->end();
+		return true;
 	}
 
-	bool write(const usbDevice_t &device, const arguments_t &writeArguments)
+	// Identify the SPI NAND device on the bus and get it ready for use, including finding its bad blocks
+	[[nodiscard]] static std::optional<spiNand_t> discoverNand(const bmp_t &probe)
 	{
-		// Try to begin communications with the BMP
-		auto probe{beginComms(device, std::get<flag_t>(*writeArguments["bus"sv]))};
-		// If we got good comms, then try and identify the Flash
-		if (!probe || !identifyFlash(*probe))
+		auto nand{spiNand_t::identify(probe)};
+		if (!nand || !nand->prepare(probe) || !nand->scanBadBlocks(probe))
+			return std::nullopt;
+		const auto [capacityValue, capacityUnits] = humanReadableSize(nand->usableCapacity());
+		console.info("SPI NAND has "sv, capacityValue, capacityUnits, " usable across "sv,
+			nand->blockCount() - nand->badBlockCount(), " good blocks"sv);
+		return nand;
+	}
+
+	// Read back every good block of the SPI NAND in order, skipping over the bad ones
+	[[nodiscard]] static bool readNand(const bmp_t &probe, const path &fileName, const reportOptions_t &report)
+	{
+		const auto nand{discoverNand(probe)};
+		if (!nand)
 			return false;
 
-		auto spiFlash{sfdp::read(*probe)};
-		if (!spiFlash)
+		const fd_t file{fileName, O_WRONLY | O_CREAT | O_TRUNC | O_NOCTTY, normalMode};
+		if (!file.valid())
 		{
-			console.error("Could not setup SPI Flash control structures"sv);
+			console.error("Failed to open output file"sv);
 			return false;
 		}
-		const auto capacity{spiFlash->capacity()};
 
-		const fd_t file{std::any_cast<path>(std::get<flag_t>(*writeArguments["fileName"sv]).value()),
-			O_RDONLY | O_NOCTTY};
+		console.info("Reading back SPI NAND contents"sv);
+		progress_t progress{"read"sv, nand->usableCapacity()};
+		const auto digest{startDigest(report, nand->blockSize())};
+		std::vector<uint8_t> buffer(nand->blockSize());
+		uint64_t offset{0U};
+		for (const auto index : indexSequence_t{nand->blockCount()})
+		{
+			const auto block{static_cast<uint32_t>(index)};
+			if (nand->isBad(block))
+				continue;
+			progress.begin(phase_t::read);
+			if (!nand->readBlock(probe, block, {buffer.data(), buffer.size()}))
+			{
+				console.error("SPI NAND readout failed"sv);
+				return false;
+			}
+			progress.end(buffer.size());
+			if (digest)
+				digest->push(offset, {buffer.data(), buffer.size()});
+			offset += buffer.size();
+			const trace::span_t span{"file"sv, "write output"sv};
+			if (!file.write(buffer.data(), buffer.size()))
+			{
+				console.error("Failed to write data block to output file"sv);
+				return false;
+			}
+		}
+		progress.finish();
+		if (!finishReports(report, "read"sv, fileName, progress, digest.get()))
+			return false;
+		console.info("SPI NAND read complete"sv);
+		return true;
+	}
+
+	/*
+	 * Write the file into the good blocks of the SPI NAND in order. Any block that fails to erase or program
+	 * is marked bad and the data it was to hold moves on to the next good block, so the image always reads
+	 * back the same way readNand() lays it out.
+	 */
+	[[nodiscard]] static bool writeNand(const bmp_t &probe, const path &fileName, const reportOptions_t &report)
+	{
+		const fd_t file{fileName, O_RDONLY | O_NOCTTY};
 		if (!file.valid())
 		{
 			console.error("Failed to open input file"sv);
 			return false;
 		}
-		const auto fileLength{static_cast<size_t>(file.length())};
-		if (file.length() < 0 || fileLength > capacity)
+		auto nand{discoverNand(probe)};
+		if (!nand)
+			return false;
+
+		const auto fileLength{file.length()};
+		if (fileLength < 0 || static_cast<size_t>(fileLength) > nand->usableCapacity())
 		{
-			console.error("Unable to assertain file length or it exeeds the target Flash's capacity"sv);
+			console.error("Unable to assertain file length or it exeeds the usable capacity of the SPI NAND"sv);
 			return false;
 		}
+		const auto length{static_cast<size_t>(fileLength)};
 
-		console.info("Writing file contents to SPI Flash chip"sv);
-		std::array<uint8_t, 4_KiB> buffer{};
-		for (const auto address : indexSequence_t{fileLength}.step(buffer.size()))
+		console.info("Writing file contents to SPI NAND"sv);
+		progress_t progress{"write"sv, length};
+		const auto digest{startDigest(report, nand->blockSize())};
+		std::vector<uint8_t> buffer(nand->blockSize());
+		uint32_t block{0U};
+		for (const auto offset : indexSequence_t{length}.step(buffer.size()))
 		{
-			const auto amount{std::min(fileLength - address, buffer.size())};
-			const span subspan{buffer.data(), amount};
-			if (!file.read(subspan.data(), subspan.size()))
+			const auto amount{std::min(length - offset, buffer.size())};
+			const span<const uint8_t> data{buffer.data(), amount};
+			if (!file.read(buffer.data(), amount))
 			{
-				console.error("Failed to read data block from input file"sv);
+				console.error("Failed to read data from input file"sv);
 				return false;
 			}
-			if (!spiFlash->writeBlock(*probe, address, subspan))
+			if (digest)
+				digest->push(offset, data);
+			while (true)
 			{
-				console.error("Failed to write data block to target SPI Flash"sv);
+				while (block < nand->blockCount() && nand->isBad(block))
+					++block;
+				if (block == nand->blockCount())
+				{
+					console.error("Ran out of good blocks to write to on the SPI NAND"sv);
+					return false;
+				}
+				progress.begin(phase_t::erase);
+				const auto erased{nand->eraseBlock(probe, block)};
+				progress.end();
+				progress.begin(phase_t::program);
+				const auto programmed{erased && nand->programBlock(probe, block, data)};
+				progress.end(programmed ? amount : 0U);
+				if (programmed)
+					break;
+				nand->markBad(probe, block);
+			}
+			++block;
+		}
+		progress.finish();
+		if (!finishReports(report, "write"sv, fileName, progress, digest.get()))
+			return false;
+		console.info("SPI NAND write complete"sv);
+		return true;
+	}
+
+	// SD cards only ever hang off the external bus, so make sure that's where we're looking for one
+	[[nodiscard]] static std::optional<bmp_t> beginSDCardComms(const usbDevice_t &device, const spiBus_t spiBus)
+	{
+		if (spiBus != spiBus_t::external)
+		{
+			console.error("SD cards can only be accessed on the external bus"sv);
+			return std::nullopt;
+		}
+		return beginComms(device, spiBus, spiDevice_t::sdcard);
+	}
+
+	[[nodiscard]] static bool readSDCard(const bmp_t &probe, const path &fileName, const reportOptions_t &report)
+	{
+		auto card{sdCard_t::initialise(probe)};
+		if (!card)
+			return false;
+
+		const fd_t file{fileName, O_WRONLY | O_CREAT | O_TRUNC | O_NOCTTY, normalMode};
+		if (!file.valid())
+		{
+			console.error("Failed to open output file"sv);
+			return false;
+		}
+
+		console.info("Reading back SD card contents"sv);
+		const auto capacity{card->capacity()};
+		progress_t progress{"read"sv, capacity};
+		const auto digest{startDigest(report, sdCardDigestSectorSize)};
+		std::vector<uint8_t> buffer(maxWriteRunLength);
+		for (uint64_t offset{0U}; offset < capacity; offset += buffer.size())
+		{
+			const span<uint8_t> data{buffer.data(), static_cast<size_t>(std::min<uint64_t>(capacity - offset,
+				buffer.size()))};
+			progress.begin(phase_t::read);
+			if (!card->readBlocks(probe, offset / sdCard::blockSize, data))
+			{
+				console.error("SD card readout failed"sv);
+				return false;
+			}
+			progress.end(data.size());
+			if (digest)
+				digest->push(offset, data);
+			const trace::span_t span{"file"sv, "write output"sv};
+			if (!file.write(data.data(), data.size()))
+			{
+				console.error("Failed to write data block to output file"sv);
 				return false;
 			}
 		}
+		progress.finish();
+		if (!finishReports(report, "read"sv, fileName, progress, digest.get()))
+			return false;
+		console.info("SD card read complete"sv);
+		return true;
+	}
+
+	[[nodiscard]] static bool writeSDCard(const bmp_t &probe, writeInput_t &input, const reportOptions_t &report)
+	{
+		auto card{sdCard_t::initialise(probe)};
+		if (!card)
+			return false;
+
+		auto &reader{input.reader};
+		const auto format{reader.format()};
+		const auto fileLength{reader.fileLength()};
+		if (!isSparse(format) && fileLength > card->capacity())
+		{
+			console.error("Unable to assertain file length or it exeeds the SD card's capacity"sv);
+			return false;
+		}
+		if (!digestSupported(report, format))
+			return false;
+		if (isSparse(format))
+			console.info("Reading input file as "sv, formatName(format));
+
+		console.info("Writing file contents to SD card"sv);
+		progress_t progress{"write"sv, estimateDataLength(format, fileLength)};
+		const auto digest{startDigest(report, sdCardDigestSectorSize, format)};
+		// Contiguous extents are gathered into runs so each goes to the card as a single multi-block write,
+		// with any partial blocks at either end of a run filled in from what's already on the card
+		std::vector<uint8_t> run{};
+		uint64_t runAddress{0U};
+		modifiedRange_t modified{};
+		const auto flushRun
+		{
+			[&]() -> bool
+			{
+				if (run.empty())
+					return true;
+				constexpr auto blockSize{sdCard::blockSize};
+				const auto firstBlock{runAddress / blockSize};
+				const auto headLength{static_cast<size_t>(runAddress % blockSize)};
+				const auto blocks{(headLength + run.size() + blockSize - 1U) / blockSize};
+				std::vector<uint8_t> data(blocks * blockSize);
+				const span<uint8_t> lastBlock{data.data() + data.size() - blockSize, blockSize};
+				if (headLength && !card->readBlocks(probe, firstBlock, {data.data(), blockSize}))
+					return false;
+				if ((headLength + run.size()) % blockSize && (blocks > 1U || !headLength) &&
+					!card->readBlocks(probe, firstBlock + blocks - 1U, lastBlock))
+					return false;
+				std::copy(run.begin(), run.end(), data.begin() + static_cast<std::ptrdiff_t>(headLength));
+				progress.begin(phase_t::program);
+				modified.add(firstBlock * blockSize, data.size());
+				if (!card->writeBlocks(probe, firstBlock, data))
+					return false;
+				progress.end(run.size());
+				run.clear();
+				return true;
+			}
+		};
+
+		while (auto extent{reader.next()})
+		{
+			if (extent->end() > card->capacity())
+			{
+				console.error("Input file contains data past the end of the SD card"sv);
+				return false;
+			}
+			if (digest)
+				digest->push(extent->address, {extent->data.data(), extent->data.size()});
+			if (!run.empty() && (extent->address != runAddress + run.size() || run.size() >= maxWriteRunLength) &&
+				!flushRun())
+			{
+				console.error("Failed to write data block to SD card"sv);
+				return false;
+			}
+			if (run.empty())
+				runAddress = extent->address;
+			run.insert(run.end(), extent->data.begin(), extent->data.end());
+		}
+		if (!reader.succeeded())
+		{
+			reportParseFailure("SD card"sv, modified);
+			return false;
+		}
+		if (!flushRun())
+		{
+			console.error("Failed to write data block to SD card"sv);
+			return false;
+		}
+		progress.totalBytes(reader.dataLength());
+		progress.finish();
+		if (!finishReports(report, "write"sv, input.fileName, progress, digest.get()))
+			return false;
+		console.info("SD card write complete"sv);
+		return true;
+	}
+
+	bool read(const usbDevice_t &device, const arguments_t &readArguments)
+	{
+		const auto spiBus{std::any_cast<spiBus_t>(std::get<flag_t>(*readArguments["bus"sv]).value())};
+		const auto fileName{std::any_cast<path>(std::get<flag_t>(*readArguments["fileName"sv]).value())};
+		const auto report{reportOptions(readArguments)};
+		if (readArguments["sdcard"sv])
+		{
+			auto probe{beginSDCardComms(device, spiBus)};
+			if (!probe || !readSDCard(*probe, fileName, report))
+				return false;
+			return probe->end();
+		}
+		// Try to begin communications with the BMP
+		auto probe{beginComms(device, spiBus)};
+		if (!probe)
+			return false;
+		if (readArguments["nand"sv])
+		{
+			if (!readNand(*probe, fileName, report))
+				return false;
+			return probe->end();
+		}
+		// If we got good comms, then try and identify the Flash
+		auto target{discoverFlash(*probe, spiBus)};
+		if (!target)
+			return false;
+
+		if (!readFlash(*probe, *target, fileName, 0U, target->spiFlash.capacity(), report))
+			return false;
 
 		// Finish up by cleaning up the session
+		return probe->end();
+	}
+
+	bool writeInput_t::open(const path &inputFile, const std::optional<path> &manifestFileName)
+	{
+		// Start decoding the input on a background thread so it runs ahead of the transfers to the Flash
+		if (!reader.open(inputFile))
+			return false;
+		fileName = inputFile;
+		manifestFile = manifestFileName;
+		if (manifestFile)
+			previousManifest = std::async(std::launch::async, manifest_t::load, *manifestFile);
+		return true;
+	}
+
+	bool writeFlash(const bmp_t &probe, flashTarget_t &target, const std::string_view serialNumber,
+		writeInput_t &input, const reportOptions_t &report)
+	{
+		auto &spiFlash{target.spiFlash};
+		const auto capacity{spiFlash.capacity()};
+		const auto sectorSize{spiFlash.sectorSize()};
+
+		auto &reader{input.reader};
+		const auto &manifestFile{input.manifestFile};
+		const auto format{reader.format()};
+		const auto fileLength{reader.fileLength()};
+		if (!isSparse(format) && fileLength > capacity)
+		{
+			console.error("Unable to assertain file length or it exeeds the target Flash's capacity"sv);
+			return false;
+		}
+		if (!digestSupported(report, format))
+			return false;
+		if (isSparse(format))
+			console.info("Reading input file as "sv, formatName(format));
+
+		// Build a manifest for what we're about to write, and if we were given one from a previous write,
+		// check that it describes the same device so we can use it to skip unchanged sectors
+		manifest_t manifest{std::string{serialNumber}, target.bus, target.chipID, sectorSize};
+		const auto previousManifest
+		{
+			[&]() -> std::optional<manifest_t>
+			{
+				if (!manifestFile)
+					return std::nullopt;
+				auto result{input.previousManifest.get()};
+				if (result && !result->describesSameTarget(manifest))
+				{
+					console.warn("Manifest describes a different probe, bus or Flash chip, ignoring it"sv);
+					return std::nullopt;
+				}
+				return result;
+			}()
+		};
+
+		console.info("Writing file contents to SPI Flash chip"sv);
+		const auto dataLength{estimateDataLength(format, fileLength)};
+		progress_t progress{"write"sv, dataLength};
+		const auto digest{startDigest(report, sectorSize, format)};
+		if (const auto writeTime{spiFlash.writeTime(0U, std::min<size_t>(dataLength, capacity))}; writeTime)
+			progress.expectedTime(writeTime->typical);
+		// Changed sectors are gathered into runs so each run can be erased with the largest erases the
+		// device's region map allows, rather than one sector at a time
+		std::vector<uint8_t> run{};
+		size_t runAddress{0U};
+		size_t runDataLength{0U};
+		modifiedRange_t modified{};
+		const auto pageSize{spiFlash.pageSize()};
+		const auto pageErased
+		{
+			[&](const size_t offset)
+			{
+				const auto length{std::min<size_t>(pageSize, run.size() - offset)};
+				const auto begin{run.begin() + static_cast<std::ptrdiff_t>(offset)};
+				return std::all_of(begin, begin + static_cast<std::ptrdiff_t>(length),
+					[](const uint8_t value) { return value == 0xffU; });
+			}
+		};
+		const auto flushRun
+		{
+			[&]() -> bool
+			{
+				if (run.empty())
+					return true;
+				const auto plan{spiFlash.planErase(runAddress, run.size())};
+				if (!plan)
+					return false;
+				for (const auto &operation : *plan)
+				{
+					progress.begin(phase_t::erase);
+					modified.add(operation.address, operation.type.size);
+					if (!spiFlash.erase(probe, operation))
+						return false;
+					progress.end();
+				}
+				// Pages that are to be left erased need no programming, so only send the spans of pages between them
+				progress.begin(phase_t::program);
+				for (size_t offset{0U}; offset < run.size();)
+				{
+					const auto begin{offset};
+					while (offset < run.size() && !pageErased(offset))
+						offset += pageSize;
+					const auto end{std::min<size_t>(offset, run.size())};
+					if (end != begin &&
+						!spiFlash.programBlock(probe, runAddress + begin, {run.data() + begin, end - begin}))
+						return false;
+					while (offset < run.size() && pageErased(offset))
+						offset += pageSize;
+				}
+				progress.end(runDataLength);
+				run.clear();
+				runDataLength = 0U;
+				return true;
+			}
+		};
+
+		// The sector currently being assembled from the input, and which of its bytes the input covers.
+		// The Flash will be left erased anywhere in a sector a raw binary doesn't cover, so those bytes start out
+		// as 0xff to match before hashing
+		std::vector<uint8_t> sector{};
+		std::vector<bool> sectorCoverage{};
+		size_t sectorAddress{0U};
+		size_t sectorCovered{0U};
+		size_t sectorsSkipped{0U};
+		const auto flushSector
+		{
+			[&]() -> bool
+			{
+				if (sector.empty())
+					return true;
+				// The sparse formats only describe part of the Flash, so anything they don't cover in the sector
+				// has to be preserved by reading it back first
+				if (isSparse(format) && sectorCovered != sector.size())
+				{
+					// If the input went back on itself and the sector is still in the pending run, write that out first
+					if (!run.empty() && sectorAddress >= runAddress && sectorAddress < runAddress + run.size() &&
+						!flushRun())
+						return false;
+					std::vector<uint8_t> existing(sector.size());
+					progress.begin(phase_t::read);
+					if (!spiFlash.readBlock(probe, sectorAddress, {existing.data(), existing.size()}))
+						return false;
+					progress.end();
+					for (const auto offset : indexSequence_t{sector.size()})
+					{
+						if (!sectorCoverage[offset])
+							sector[offset] = existing[offset];
+					}
+				}
+				uint32_t crc{0U};
+				crc32_t::crc(crc, {sector.data(), sector.size()});
+				manifest.sector(static_cast<uint32_t>(sectorAddress), static_cast<uint32_t>(sector.size()), crc);
+
+				// If the sector's contents match what's already on the Flash, skip it
+				if (previousManifest && previousManifest->sectorMatches(static_cast<uint32_t>(sectorAddress),
+					static_cast<uint32_t>(sector.size()), crc))
+				{
+					if (!flushRun())
+						return false;
+					++sectorsSkipped;
+					progress.skip(sectorCovered);
+				}
+				else
+				{
+					// Otherwise add it to the current run, flushing the run once it's reached a reasonable size
+					// or if this sector doesn't follow on from it
+					if (!run.empty() && runAddress + run.size() != sectorAddress && !flushRun())
+						return false;
+					if (run.empty())
+						runAddress = sectorAddress;
+					run.insert(run.end(), sector.begin(), sector.end());
+					runDataLength += sectorCovered;
+					if (run.size() >= maxWriteRunLength && !flushRun())
+						return false;
+				}
+				sector.clear();
+				return true;
+			}
+		};
+
+		while (auto extent{reader.next()})
+		{
+			if (extent->end() > capacity)
+			{
+				console.error("Input file contains data past the end of the target Flash"sv);
+				return false;
+			}
+			if (digest)
+				digest->push(extent->address, {extent->data.data(), extent->data.size()});
+			// Spread the extent over the sectors it covers, writing each sector out as the input moves past it
+			auto address{static_cast<size_t>(extent->address)};
+			for (span<const uint8_t> data{extent->data.data(), extent->data.size()}; !data.empty();)
+			{
+				if (sector.empty() || address < sectorAddress || address >= sectorAddress + sector.size())
+				{
+					if (!flushSector())
+					{
+						console.error("Failed to write data block to target SPI Flash"sv);
+						return false;
+					}
+					// Work out how big the smallest erasable unit is here, and where it starts
+					const auto granularity{spiFlash.eraseGranularity(address)};
+					sectorAddress = address - (address % granularity);
+					sector.assign(granularity, static_cast<uint8_t>(0xffU));
+					sectorCoverage.assign(granularity, false);
+					sectorCovered = 0U;
+				}
+				const auto offset{address - sectorAddress};
+				const auto amount{std::min(data.size(), sector.size() - offset)};
+				std::copy_n(data.begin(), amount, sector.begin() + static_cast<std::ptrdiff_t>(offset));
+				for (const auto index : indexSequence_t{offset, offset + amount})
+				{
+					if (!sectorCoverage[index])
+					{
+						sectorCoverage[index] = true;
+						++sectorCovered;
+					}
+				}
+				data = data.subspan(amount);
+				address += amount;
+			}
+		}
+		if (!reader.succeeded())
+		{
+			reportParseFailure("SPI Flash"sv, modified);
+			return false;
+		}
+		if (!flushSector() || !flushRun())
+		{
+			console.error("Failed to write data block to target SPI Flash"sv);
+			return false;
+		}
+		// Now all the input has been seen, we know exactly how much data there was
+		progress.totalBytes(reader.dataLength());
+		progress.finish();
+		if (!finishReports(report, "write"sv, input.fileName, progress, digest.get()))
+			return false;
+		if (previousManifest)
+			console.info("Skipped "sv, sectorsSkipped, " unchanged sectors"sv);
+
+		// Now the write has completed, record the manifest for it if requested
+		if (manifestFile)
+		{
+			if (previousManifest)
+				manifest.merge(*previousManifest);
+			if (!manifest.store(*manifestFile))
+				return false;
+		}
+
 		console.info("SPI Flash chip write complete"sv);
+		return true;
+	}
+
+	bool write(const usbDevice_t &device, const arguments_t &writeArguments)
+	{
+		const auto spiBus{std::any_cast<spiBus_t>(std::get<flag_t>(*writeArguments["bus"sv]).value())};
+		const auto fileName{std::any_cast<path>(std::get<flag_t>(*writeArguments["fileName"sv]).value())};
+		const auto report{reportOptions(writeArguments)};
+		const auto *const manifestArg{writeArguments["manifest"sv]};
+		const auto manifestFile
+		{
+			[&]() -> std::optional<path>
+			{
+				if (!manifestArg)
+					return std::nullopt;
+				return std::any_cast<path>(std::get<flag_t>(*manifestArg).value());
+			}()
+		};
+		if (writeArguments["nand"sv])
+		{
+			if (manifestFile)
+				console.warn("Manifests are not supported for SPI NAND, ignoring --manifest"sv);
+			auto probe{beginComms(device, spiBus)};
+			if (!probe || !writeNand(*probe, fileName, report))
+				return false;
+			return probe->end();
+		}
+		// Get the input file open and decoding in the background while we bring up the probe
+		writeInput_t input{};
+		const auto sdCard{writeArguments["sdcard"sv] != nullptr};
+		if (sdCard && manifestFile)
+			console.warn("Manifests are not supported for SD cards, ignoring --manifest"sv);
+		if (!input.open(fileName, sdCard ? std::nullopt : manifestFile))
+			return false;
+		if (sdCard)
+		{
+			auto probe{beginSDCardComms(device, spiBus)};
+			if (!probe || !writeSDCard(*probe, input, report))
+				return false;
+			return probe->end();
+		}
+
+		// Grab the serial number of the probe before we start talking to it for tagging the manifest
+		const auto serialNumber{readSerialNumber(device)};
+		// Try to begin communications with the BMP
+		auto probe{beginComms(device, spiBus)};
+		if (!probe)
+			return false;
+		// If we got good comms, then try and identify the Flash
+		auto target{discoverFlash(*probe, spiBus)};
+		if (!target)
+			return false;
+
+		if (!writeFlash(*probe, *target, serialNumber, input, report))
+			return false;
+
+		// Finish up by cleaning up the session
 		return probe->end();
 	}
 } // namespace bmpflash
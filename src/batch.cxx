@@ -0,0 +1,415 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// SPDX-FileCopyrightText: 2023 1BitSquared <info@1bitsquared.com>
+#include <string_view>
+#include <chrono>
+#if defined(_MSC_VER)
+#pragma warning(push)
+#pragma warning(disable: 4061 4365)
+#elif defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wswitch-enum"
+#pragma GCC diagnostic ignored "-Wsign-conversion"
+#endif
+#include <fmt/format.h>
+#if defined(_MSC_VER)
+#pragma warning(pop)
+#elif defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+#include <substrate/fd>
+#include <substrate/console>
+#include <substrate/conversions>
+#include "batch.hxx"
+#include "actions.hxx"
+#include "sfdp.hxx"
+#include "capture.hxx"
+#include "profileCache.hxx"
+
+using namespace std::literals::string_view_literals;
+using substrate::fd_t;
+using substrate::console;
+using substrate::toInt_t;
+
+namespace bmpflash::batch
+{
+	// Split a line from a job file into its arguments, dropping any comment on the end
+	[[nodiscard]] static std::optional<std::vector<std::string>> tokenise(const std::string_view &line)
+	{
+		std::vector<std::string> tokens{};
+		std::optional<std::string> token{};
+		bool quoted{false};
+		for (const auto character : line)
+		{
+			if (!quoted && (character == ' ' || character == '\t' || character == '\r' || character == '#'))
+			{
+				if (token)
+					tokens.emplace_back(std::move(*token));
+				token.reset();
+				if (character == '#')
+					break;
+				continue;
+			}
+			if (!token)
+				token.emplace();
+			// Quotes can appear anywhere in an argument, and protect any spaces and '#'s between them
+			if (character == '"')
+				quoted = !quoted;
+			else
+				token->push_back(character);
+		}
+		if (quoted)
+			return std::nullopt;
+		if (token)
+			tokens.emplace_back(std::move(*token));
+		return tokens;
+	}
+
+	[[nodiscard]] static std::optional<spiBus_t> parseBus(const std::string_view &value) noexcept
+	{
+		if (value == "int"sv || value == "internal"sv)
+			return spiBus_t::internal;
+		if (value == "ext"sv || value == "external"sv)
+			return spiBus_t::external;
+		return std::nullopt;
+	}
+
+	[[nodiscard]] static std::optional<size_t> parseNumber(const std::string_view &value) noexcept
+	{
+		if (value.substr(0, 2) == "0x"sv)
+		{
+			const auto digits{value.substr(2U)};
+			const toInt_t<uint64_t> number{digits.data(), digits.size()};
+			if (digits.empty() || digits.size() > 16U || !number.isHex())
+				return std::nullopt;
+			return static_cast<size_t>(number.fromHex());
+		}
+		const toInt_t<uint64_t> number{value.data(), value.size()};
+		if (value.empty() || !number.isDec())
+			return std::nullopt;
+		return static_cast<size_t>(number.fromDec());
+	}
+
+	[[nodiscard]] static std::optional<elf::imageSpec_t> parseImageSpec(const std::string_view &value) noexcept
+	{
+		// Only treat what follows the last '@' as an offset if it's a number, so file names containing
+		// an '@' can still be given without one
+		const auto separator{value.rfind('@')};
+		if (separator == std::string_view::npos)
+			return elf::imageSpec_t{path{value}, std::nullopt};
+		const auto offset{parseNumber(value.substr(separator + 1U))};
+		if (!offset)
+			return elf::imageSpec_t{path{value}, std::nullopt};
+		if (*offset > UINT32_MAX)
+			return std::nullopt;
+		return elf::imageSpec_t{path{value.substr(0, separator)}, static_cast<uint32_t>(*offset)};
+	}
+
+	// Handle the 'key=value' style options that can follow an operation's positional arguments
+	template<typename handler_t> [[nodiscard]] static bool parseOptions(const std::vector<std::string> &tokens,
+		const size_t first, handler_t &&handler)
+	{
+		for (size_t index{first}; index < tokens.size(); ++index)
+		{
+			const std::string_view token{tokens[index]};
+			const auto separator{token.find('=')};
+			const auto key{token.substr(0, separator)};
+			const auto value{separator == std::string_view::npos ? std::string_view{} : token.substr(separator + 1U)};
+			if (!handler(key, value))
+				return false;
+		}
+		return true;
+	}
+
+	[[nodiscard]] static std::optional<job_t> parseTokens(const std::vector<std::string> &tokens, job_t job)
+	{
+		const std::string_view operation{tokens[0]};
+		if (operation == "provision"sv)
+		{
+			job.operation = operation_t::provision;
+			job.bus = spiBus_t::internal;
+			for (size_t index{1U}; index < tokens.size(); ++index)
+			{
+				const auto spec{parseImageSpec(tokens[index])};
+				if (!spec)
+					return std::nullopt;
+				job.images.push_back(*spec);
+			}
+			if (job.images.empty())
+				return std::nullopt;
+			return job;
+		}
+
+		// Everything else starts with the bus to use
+		if (tokens.size() < 2U)
+			return std::nullopt;
+		const auto bus{parseBus(tokens[1])};
+		if (!bus)
+			return std::nullopt;
+		job.bus = *bus;
+
+		if (operation == "sfdp"sv)
+		{
+			job.operation = operation_t::sfdp;
+			const auto result
+			{
+				parseOptions(tokens, 2U, [&](const std::string_view &key, const std::string_view &value)
+				{
+					if (key == "raw"sv && value.empty())
+						job.displayRaw = true;
+					else if (key == "save"sv && !value.empty())
+						job.saveFile = path{value};
+					else
+						return false;
+					return true;
+				})
+			};
+			return result ? std::optional{job} : std::nullopt;
+		}
+
+		// read and write both take a file name next
+		if (tokens.size() < 3U)
+			return std::nullopt;
+		job.fileName = path{tokens[2]};
+		if (operation == "read"sv)
+		{
+			job.operation = operation_t::read;
+			const auto result
+			{
+				parseOptions(tokens, 3U, [&](const std::string_view &key, const std::string_view &value)
+				{
+					const auto number{parseNumber(value)};
+					if (!number)
+						return false;
+					if (key == "address"sv)
+						job.address = *number;
+					else if (key == "length"sv)
+						job.length = *number;
+					else
+						return false;
+					return true;
+				})
+			};
+			return result ? std::optional{job} : std::nullopt;
+		}
+		if (operation == "write"sv)
+		{
+			job.operation = operation_t::write;
+			const auto result
+			{
+				parseOptions(tokens, 3U, [&](const std::string_view &key, const std::string_view &value)
+				{
+					if (key != "manifest"sv || value.empty())
+						return false;
+					job.manifestFile = path{value};
+					return true;
+				})
+			};
+			return result ? std::optional{job} : std::nullopt;
+		}
+		return std::nullopt;
+	}
+
+	[[nodiscard]] static std::optional<job_t> jobFrom(const std::vector<std::string> &tokens, const size_t lineNumber)
+	{
+		auto job{parseTokens(tokens, {lineNumber})};
+		if (!job)
+			return std::nullopt;
+		// Rebuild the operation from its arguments to describe it in reports
+		for (const auto &token : tokens)
+		{
+			if (!job->description.empty())
+				job->description += ' ';
+			job->description += token;
+		}
+		return job;
+	}
+
+	std::optional<job_t> parseJob(const std::string_view line, const size_t lineNumber)
+	{
+		const auto tokens{tokenise(line)};
+		if (!tokens || tokens->empty())
+			return std::nullopt;
+		return jobFrom(*tokens, lineNumber);
+	}
+
+	std::optional<std::vector<job_t>> parseJobFile(const path &fileName)
+	{
+		const fd_t file{fileName, O_RDONLY | O_NOCTTY};
+		if (!file.valid() || file.length() < 0)
+		{
+			console.error("Failed to open job file "sv, fileName.string());
+			return std::nullopt;
+		}
+		std::string data(static_cast<size_t>(file.length()), '\0');
+		if (!file.read(data.data(), data.size()))
+		{
+			console.error("Failed to read job file "sv, fileName.string());
+			return std::nullopt;
+		}
+
+		std::vector<job_t> jobs{};
+		size_t lineNumber{0U};
+		for (size_t offset{0U}; offset < data.size();)
+		{
+			const auto end{std::min(data.find('\n', offset), data.size())};
+			const std::string_view line{data.data() + offset, end - offset};
+			offset = end + 1U;
+			++lineNumber;
+
+			const auto tokens{tokenise(line)};
+			if (tokens && tokens->empty())
+				continue;
+			auto job{tokens ? jobFrom(*tokens, lineNumber) : std::nullopt};
+			if (!job)
+			{
+				console.error("Invalid operation on line "sv, lineNumber, " of job file: "sv, line);
+				return std::nullopt;
+			}
+			jobs.emplace_back(std::move(*job));
+		}
+		return jobs;
+	}
+
+	bool runJob(flashSession_t &session, const job_t &job)
+	{
+		// Start on a write's input before selecting the bus, as that may have to bring up the probe and find the Flash
+		writeInput_t input{};
+		if (job.operation == operation_t::write && !input.open(job.fileName, job.manifestFile))
+			return false;
+		auto *const target{session.select(job.bus)};
+		if (!target)
+			return false;
+		const auto &probe{session.probe()};
+		switch (job.operation)
+		{
+			case operation_t::sfdp:
+				return sfdp::readAndDisplay(probe, target->chipID, job.displayRaw, job.saveFile);
+			case operation_t::read:
+			{
+				const auto capacity{target->spiFlash.capacity()};
+				return readFlash(probe, *target, job.fileName, job.address,
+					job.length.value_or(capacity - std::min(job.address, capacity)));
+			}
+			case operation_t::write:
+				return writeFlash(probe, *target, session.serialNumber(), input);
+			case operation_t::provision:
+			{
+				const auto image{elf::packedImageFor(job.images, target->spiFlash)};
+				if (!image)
+				{
+					console.error("Failed to successfully repack ELF files"sv);
+					return false;
+				}
+				return elf::writeImage(probe, target->spiFlash, {image->data(), image->size()});
+			}
+		}
+		return false;
+	}
+} // namespace bmpflash::batch
+
+namespace bmpflash
+{
+	using bmpflash::batch::job_t;
+
+	// How a job from the job file fared, for the combined report at the end of the batch
+	struct jobResult_t final
+	{
+		bool ran{false};
+		bool succeeded{false};
+		std::chrono::duration<double> duration{};
+	};
+
+	// Run the jobs over the session, then summarise how each one went
+	[[nodiscard]] static bool runJobs(flashSession_t &session, const std::vector<job_t> &jobs, const bool keepGoing,
+		const path &jobFile)
+	{
+		std::vector<jobResult_t> results(jobs.size());
+		bool failed{false};
+		for (size_t index{0U}; index < jobs.size(); ++index)
+		{
+			const auto &job{jobs[index]};
+			auto &result{results[index]};
+			if (failed && !keepGoing)
+				break;
+			console.info("Running job "sv, index + 1U, " of "sv, jobs.size(), ": "sv, job.description);
+			const auto start{std::chrono::steady_clock::now()};
+			result.ran = true;
+			result.succeeded = batch::runJob(session, job);
+			result.duration = std::chrono::steady_clock::now() - start;
+			if (!result.succeeded)
+				failed = true;
+		}
+		const auto sessionEnded{session.end()};
+
+		// Now summarise how everything went
+		size_t succeeded{0U};
+		console.info("Batch results for "sv, jobFile.string(), ':');
+		for (size_t index{0U}; index < jobs.size(); ++index)
+		{
+			const auto &job{jobs[index]};
+			const auto &result{results[index]};
+			const auto status
+			{
+				[&]()
+				{
+					if (!result.ran)
+						return "skipped"sv;
+					return result.succeeded ? "ok"sv : "FAILED"sv;
+				}()
+			};
+			if (result.succeeded)
+				++succeeded;
+			console.info(fmt::format("  line {:>4}: {:<7} {:>8.2f}s  {}", job.lineNumber, status,
+				result.duration.count(), job.description));
+		}
+		console.info(succeeded, " of "sv, jobs.size(), " operations completed successfully"sv);
+		return !failed && sessionEnded;
+	}
+
+	bool runBatch(const usbDevice_t &device, const arguments_t &batchArguments)
+	{
+		const auto jobFile{std::any_cast<path>(std::get<flag_t>(*batchArguments["jobFile"sv]).value())};
+		const auto jobs{batch::parseJobFile(jobFile)};
+		if (!jobs)
+			return false;
+
+		// The whole batch runs over a single session with the probe
+		flashSession_t session{device};
+		return runJobs(session, *jobs, batchArguments["keep-going"sv] != nullptr, jobFile);
+	}
+
+	bool runReplay(const arguments_t &replayArguments)
+	{
+		const auto captureFile{std::any_cast<path>(std::get<flag_t>(*replayArguments["captureFile"sv]).value())};
+		const auto jobFile{std::any_cast<path>(std::get<flag_t>(*replayArguments["jobFile"sv]).value())};
+		const auto jobs{batch::parseJobFile(jobFile)};
+		if (!jobs)
+			return false;
+		// The replay has to make exactly the same requests as were captured, so discovery can't come from the cache
+		profileCache::bypassDiscoveryCache();
+		const auto replay{capture::load(captureFile, replayArguments["real-time"sv] != nullptr)};
+		if (!replay)
+			return false;
+
+		flashSession_t session{"replay"sv, *replay};
+		const auto start{std::chrono::steady_clock::now()};
+		try
+		{
+			if (!runJobs(session, *jobs, false, jobFile))
+				return false;
+		}
+		catch (const bmpCommsError_t &)
+		{
+			console.error("Replay of "sv, captureFile.string(), " failed"sv);
+			return false;
+		}
+		const std::chrono::duration<double> duration{std::chrono::steady_clock::now() - start};
+		console.info(fmt::format("Replay completed in {:.3f}s", duration.count()));
+		if (!replay->complete())
+		{
+			console.error("Replay finished before the end of the capture"sv);
+			return false;
+		}
+		return true;
+	}
+} // namespace bmpflash
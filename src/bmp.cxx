@@ -3,6 +3,14 @@
 // SPDX-FileContributor: Written by Rachel Mant <git@dragonmux.network>
 #include "bmp.hxx"
 
+// How long the probe gets to respond to anything, plus how much longer it gets per KiB of data in the transfer.
+// Transfers of even the largest packets take only a few milliseconds, so a probe that blows through these is wedged
+constexpr static milliseconds_t baseTransferTimeout{250ms};
+constexpr static milliseconds_t transferTimeoutPerKiB{16ms};
+
+[[nodiscard]] static milliseconds_t transferTimeout(const size_t length) noexcept
+	{ return baseTransferTimeout + transferTimeoutPerKiB * static_cast<int64_t>((length + 1023U) / 1024U); }
+
 bmp_t::bmp_t(const usbDevice_t &usbDevice) : device{usbDevice} { }
 
 bmp_t::~bmp_t() noexcept
@@ -14,8 +22,25 @@ bmp_t::~bmp_t() noexcept
 void bmp_t::swap(bmp_t &probe) noexcept
 {
 	device.swap(probe.device);
+	replay.swap(probe.replay);
 	std::swap(_spiBus, probe._spiBus);
 	std::swap(_spiDevice, probe._spiDevice);
+	std::swap(_cancellation, probe._cancellation);
+}
+
+void bmp_t::writePacket(const std::string_view &packet) const
+{
+	if (replay.valid())
+		replay.writePacket(packet);
+	else
+		device.writePacket(packet, transferTimeout(packet.length()));
+}
+
+std::string bmp_t::readPacket(const size_t expectedLength) const
+{
+	if (replay.valid())
+		return replay.readPacket();
+	return device.readPacket(transferTimeout(expectedLength));
 }
 
 const char *bmpCommsError_t::what() const noexcept
@@ -11,6 +11,11 @@
 #include "bmp.hxx"
 #include "options.hxx"
 #include "actions.hxx"
+#include "daemon.hxx"
+#include "trace.hxx"
+#include "capture.hxx"
+#include "profileCache.hxx"
+#include "cancellation.hxx"
 #include "version.hxx"
 
 using namespace std::literals::string_view_literals;
@@ -23,18 +28,19 @@ using substrate::commandLine::parseArguments;
 arguments_t args{};
 uint64_t verbosity{0U};
 
-[[nodiscard]] auto findBMPs(const usbContext_t &context)
+// Run an action that works with a probe such that an interrupt (Ctrl+C) stops it between SPI transactions,
+// unwinding back out through the action so the session with the probe gets ended cleanly on the way
+template<typename function_t> [[nodiscard]] static int runInterruptible(const function_t &action)
 {
-	std::vector<usbDevice_t> devices{};
-	for (auto device : context.deviceList())
+	bmpflash::installInterruptHandler();
+	try
+		{ return action() ? 0 : 1; }
+	catch (const bmpflash::operationCancelled_t &)
 	{
-		if (device.vid() == bmp_t::vid && device.pid() == bmp_t::pid)
-		{
-			console.info("Found BMP at USB address "sv, device.busNumber(), '-', device.portNumber());
-			devices.emplace_back(std::move(device));
-		}
+		console.warn("Interrupted, stopped talking to the probe"sv);
+		// Exit the same way as if the interrupt had killed us
+		return 130;
 	}
-	return devices;
 }
 
 int main(const int argCount, const char *const *const argList)
@@ -75,6 +81,25 @@ int main(const int argCount, const char *const *const argList)
 		return 0;
 	}
 
+	// If asked to, record a trace of everything that follows for as long as we run
+	std::optional<bmpflash::trace::recording_t> trace{};
+	if (const auto *const traceArg{args["trace"sv]}; traceArg)
+	{
+		trace.emplace(std::any_cast<std::filesystem::path>(std::get<flag_t>(*traceArg).value()));
+		if (!trace->valid())
+			return 1;
+	}
+	// Likewise for capturing the session with the probe
+	std::optional<bmpflash::capture::recording_t> capture{};
+	if (const auto *const recordArg{args["record"sv]}; recordArg)
+	{
+		// The capture has to be replayable, so its traffic can't depend on what's in the profile cache
+		bmpflash::profileCache::bypassDiscoveryCache();
+		capture.emplace(std::any_cast<std::filesystem::path>(std::get<flag_t>(*recordArg).value()));
+		if (!capture->valid())
+			return 1;
+	}
+
 	// Try and discover what action the user's requested
 	const auto *const actionArg{args["action"sv]};
 	if (!actionArg)
@@ -93,13 +118,28 @@ int main(const int argCount, const char *const *const argList)
 		return 0;
 	}
 
+	// SFDP data being displayed from a file doesn't need a probe, so handle that before looking for any
+	if (action.value() == "sfdp"sv && action.arguments()["from-file"sv])
+		return bmpflash::displaySFDPFromFile(action.arguments()) ? 0 : 1;
+	// Likewise for packing a provisioning image into a file
+	if (action.value() == "provision"sv && action.arguments()["output"sv])
+		return bmpflash::provisionToFile(action.arguments()) ? 0 : 1;
+	// Replaying a captured session doesn't need a probe either
+	if (action.value() == "replay"sv)
+		return runInterruptible([&]() { return bmpflash::runReplay(action.arguments()); });
+	// Requests to be handed off to a running daemon and daemon control don't touch the probes themselves either
+	if (action.arguments()["daemon"sv])
+		return bmpflash::daemon::request(action.value(), action.arguments()) ? 0 : 1;
+	if (action.value() == "serve"sv && (action.arguments()["status"sv] || action.arguments()["stop"sv]))
+		return bmpflash::daemon::control(action.arguments()) ? 0 : 1;
+
 	// Get a libusb context to perform everything in
 	const usbContext_t context{};
 	if (!context.valid())
 		return 2;
 
 	// Find all BMPs attached to the system
-	const auto devices{findBMPs(context)};
+	const auto devices{bmpflash::findBMPs(context)};
 	if (devices.empty())
 	{
 		console.error("Could not find any Black Magic Probes"sv);
@@ -109,6 +149,9 @@ int main(const int argCount, const char *const *const argList)
 	// if the user's asked us to dump the info on the attached devices, step into that and exit
 	if (action.value() == "info"sv)
 		return bmpflash::displayInfo(devices, action.arguments());
+	// Likewise if we're to become a daemon serving requests for all of them
+	if (action.value() == "serve"sv)
+		return bmpflash::daemon::serve(devices, action.arguments()) ? 0 : 1;
 
 	const auto serialNumber
 	{
@@ -124,24 +167,20 @@ int main(const int argCount, const char *const *const argList)
 	if (!device)
 		return 1;
 
-	// Grab the result of trying to run the requested action
-	const auto result
+	// Run the requested action and translate the boolean result into a success/fail value to finish up
+	return runInterruptible([&]()
 	{
-		[&]()
-		{
-			// Dispatch based on the requested action (info's already handled)
-			if (action.value() == "sfdp"sv)
-				return bmpflash::displaySFDP(*device, action.arguments());
-			if (action.value() == "provision"sv)
-				return bmpflash::provision(*device, action.arguments());
-			if (action.value() == "read"sv)
-				return bmpflash::read(*device, action.arguments());
-			if (action.value() == "write"sv)
-				return bmpflash::write(*device, action.arguments());
-			return false;
-		}()
-	};
-
-	// Translate the boolean result into a success/fail value and finish up
-	return result ? 0 : 1;
+		// Dispatch based on the requested action (info's already handled)
+		if (action.value() == "sfdp"sv)
+			return bmpflash::displaySFDP(*device, action.arguments());
+		if (action.value() == "provision"sv)
+			return bmpflash::provision(*device, action.arguments());
+		if (action.value() == "read"sv)
+			return bmpflash::read(*device, action.arguments());
+		if (action.value() == "write"sv)
+			return bmpflash::write(*device, action.arguments());
+		if (action.value() == "batch"sv)
+			return bmpflash::runBatch(*device, action.arguments());
+		return false;
+	});
 }
@@ -0,0 +1,34 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// SPDX-FileCopyrightText: 2023 1BitSquared <info@1bitsquared.com>
+#include <csignal>
+#include "cancellation.hxx"
+
+namespace bmpflash
+{
+	static_assert(std::atomic<bool>::is_always_lock_free, "Cancellation must be safe to request from a signal handler");
+
+	const char *operationCancelled_t::what() const noexcept
+	{
+		return "Operation cancelled";
+	}
+
+	const cancellationToken_t &interruptToken() noexcept
+	{
+		static const cancellationToken_t token{};
+		return token;
+	}
+
+	static void handleInterrupt(const int signal) noexcept
+	{
+		interruptToken().cancel();
+		// Put the default handling back so that if we're stuck, a second interrupt still gets us out
+		static_cast<void>(std::signal(signal, SIG_DFL));
+	}
+
+	void installInterruptHandler() noexcept
+	{
+		// Make sure the token exists before the handler can ever need it
+		static_cast<void>(interruptToken());
+		static_cast<void>(std::signal(SIGINT, handleInterrupt));
+	}
+} // namespace bmpflash
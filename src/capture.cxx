@@ -0,0 +1,253 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// SPDX-FileCopyrightText: 2023 1BitSquared <info@1bitsquared.com>
+#include <mutex>
+#include <thread>
+#if defined(_MSC_VER)
+#pragma warning(push)
+#pragma warning(disable: 4061 4365)
+#elif defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wswitch-enum"
+#pragma GCC diagnostic ignored "-Wsign-conversion"
+#endif
+#include <fmt/format.h>
+#if defined(_MSC_VER)
+#pragma warning(pop)
+#elif defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+#include <substrate/fd>
+#include <substrate/console>
+#include <substrate/conversions>
+#include <substrate/units>
+#include "capture.hxx"
+#include "bmp.hxx"
+
+using namespace std::literals::string_literals;
+using namespace std::literals::string_view_literals;
+using substrate::fd_t;
+using substrate::normalMode;
+using substrate::console;
+using substrate::toInt_t;
+using substrate::operator ""_KiB;
+using substrate::operator ""_MiB;
+using std::chrono::duration_cast;
+
+namespace bmpflash::capture
+{
+	using steadyClock_t = std::chrono::steady_clock;
+
+	constexpr static size_t flushThreshold{64_KiB};
+	// Captures of even very long sessions come nowhere near this, so anything bigger is not a capture
+	constexpr static size_t maxCaptureLength{1024_MiB};
+	constexpr static auto captureHeader{"# bmpflash remote protocol capture v1\n"sv};
+
+	// The capture file and the state needed to time each packet going into it
+	struct captureFile_t final
+	{
+		std::mutex lock{};
+		fd_t file{};
+		std::string buffer{};
+		steadyClock_t::time_point lastResponse{};
+		steadyClock_t::time_point lastRequest{};
+	};
+
+	static captureFile_t captureFile{};
+
+	[[nodiscard]] static uint64_t microsecondsBetween(const steadyClock_t::time_point begin,
+		const steadyClock_t::time_point end)
+		{ return static_cast<uint64_t>(duration_cast<microseconds>(end - begin).count()); }
+
+	static void writeLine(const char direction, const uint64_t delay, const std::string_view &data)
+	{
+		captureFile.buffer += fmt::format("{} {}", direction, delay);
+		if (!data.empty())
+		{
+			captureFile.buffer += ' ';
+			captureFile.buffer += data;
+		}
+		captureFile.buffer += '\n';
+		if (captureFile.buffer.size() >= flushThreshold)
+		{
+			if (!captureFile.file.write(captureFile.buffer.data(), captureFile.buffer.size()))
+				console.warn("Failed to write capture data"sv);
+			captureFile.buffer.clear();
+		}
+	}
+
+	bool start(const path &fileName)
+	{
+		const std::lock_guard lock{captureFile.lock};
+		captureFile.file = fd_t{fileName, O_WRONLY | O_CREAT | O_TRUNC | O_NOCTTY, normalMode};
+		if (!captureFile.file.valid())
+		{
+			console.error("Failed to open capture file "sv, fileName.string());
+			return false;
+		}
+		captureFile.buffer = captureHeader;
+		captureFile.lastResponse = steadyClock_t::now();
+		recording = true;
+		return true;
+	}
+
+	void stop() noexcept
+	{
+		recording = false;
+		const std::lock_guard lock{captureFile.lock};
+		if (!captureFile.file.write(captureFile.buffer.data(), captureFile.buffer.size()))
+			console.warn("Failed to write capture data"sv);
+		captureFile.buffer.clear();
+		captureFile.file = fd_t{};
+	}
+
+	void recordRequest(const std::string_view request) noexcept
+	{
+		const auto now{steadyClock_t::now()};
+		try
+		{
+			const std::lock_guard lock{captureFile.lock};
+			if (!captureFile.file.valid())
+				return;
+			writeLine('>', microsecondsBetween(captureFile.lastResponse, now), request);
+			captureFile.lastRequest = now;
+		}
+		catch (const std::exception &)
+			{ return; }
+	}
+
+	void recordResponse(const std::string_view response, const bool succeeded) noexcept
+	{
+		const auto now{steadyClock_t::now()};
+		try
+		{
+			const std::lock_guard lock{captureFile.lock};
+			if (!captureFile.file.valid())
+				return;
+			writeLine(succeeded ? '<' : '!', microsecondsBetween(captureFile.lastRequest, now),
+				succeeded ? response : std::string_view{});
+			captureFile.lastResponse = now;
+		}
+		catch (const std::exception &)
+			{ return; }
+	}
+
+	[[nodiscard]] static std::optional<packet_t> parsePacket(const std::string_view &line)
+	{
+		if (line.size() < 3U || line[1] != ' ')
+			return std::nullopt;
+		packet_t packet{};
+		switch (line[0])
+		{
+			case '>':
+				packet.direction = direction_t::request;
+				break;
+			case '<':
+				packet.direction = direction_t::response;
+				break;
+			case '!':
+				packet.direction = direction_t::failure;
+				break;
+			default:
+				return std::nullopt;
+		}
+		const auto delayEnd{std::min(line.find(' ', 2U), line.size())};
+		const toInt_t<uint64_t> delay{line.data() + 2U, delayEnd - 2U};
+		if (!delay.isDec())
+			return std::nullopt;
+		packet.delay = microseconds{delay.fromDec()};
+		if (delayEnd != line.size())
+			packet.data = line.substr(delayEnd + 1U);
+		return packet;
+	}
+
+	std::optional<replayInterface_t> load(const path &fileName, const bool realTime)
+	{
+		const fd_t file{fileName, O_RDONLY | O_NOCTTY};
+		if (!file.valid() || file.length() < 0 || static_cast<size_t>(file.length()) > maxCaptureLength)
+		{
+			console.error("Failed to open capture file "sv, fileName.string());
+			return std::nullopt;
+		}
+		std::string data(static_cast<size_t>(file.length()), '\0');
+		if (!file.read(data.data(), data.size()))
+		{
+			console.error("Failed to read capture file "sv, fileName.string());
+			return std::nullopt;
+		}
+
+		std::vector<packet_t> packets{};
+		size_t lineNumber{0U};
+		for (size_t begin{0U}; begin < data.size();)
+		{
+			const auto end{std::min(data.find('\n', begin), data.size())};
+			const auto line{std::string_view{data}.substr(begin, end - begin)};
+			begin = end + 1U;
+			++lineNumber;
+			if (line.empty() || line[0] == '#')
+				continue;
+			auto packet{parsePacket(line)};
+			if (!packet)
+			{
+				console.error("Invalid packet on line "sv, lineNumber, " of capture file"sv);
+				return std::nullopt;
+			}
+			packets.emplace_back(std::move(*packet));
+		}
+		if (packets.empty())
+		{
+			console.error("Capture file contains no packets"sv);
+			return std::nullopt;
+		}
+		return replayInterface_t{std::move(packets), realTime};
+	}
+
+	replayInterface_t::replayInterface_t(std::vector<packet_t> &&packets, const bool realTime) :
+		_state{std::make_shared<replayState_t>(replayState_t{std::move(packets), 0U, realTime, false})} { }
+
+	void replayInterface_t::writePacket(const std::string_view &packet) const
+	{
+		console.debug("Replay write: "sv, packet);
+		auto &[packets, position, realTime, diverged] = *_state;
+		// Once the replay's diverged there's nothing more to check, requests just get error responses from here on
+		if (diverged)
+			return;
+		if (position == packets.size() || packets[position].direction != direction_t::request)
+		{
+			console.error("Replay diverged from the capture at packet "sv, position + 1U,
+				": the capture has no request here, got '"sv, packet, '\'');
+			diverged = true;
+			throw bmpCommsError_t{};
+		}
+		const auto &expected{packets[position]};
+		if (expected.data != packet)
+		{
+			console.error("Replay diverged from the capture at packet "sv, position + 1U, ": expected '"sv,
+				expected.data, "', got '"sv, packet, '\'');
+			diverged = true;
+			throw bmpCommsError_t{};
+		}
+		++position;
+	}
+
+	std::string replayInterface_t::readPacket() const
+	{
+		auto &[packets, position, realTime, diverged] = *_state;
+		if (diverged)
+			return "E"s;
+		if (position == packets.size() || packets[position].direction == direction_t::request)
+		{
+			console.error("Replay diverged from the capture at packet "sv, position + 1U,
+				": the capture has no response to read here"sv);
+			diverged = true;
+			throw bmpCommsError_t{};
+		}
+		const auto &response{packets[position++]};
+		// Reproduce how long the probe took to respond if asked to
+		if (realTime)
+			std::this_thread::sleep_for(response.delay);
+		if (response.direction == direction_t::failure)
+			throw bmpCommsError_t{};
+		console.debug("Replay read: "sv, response.data);
+		return response.data;
+	}
+} // namespace bmpflash::capture
@@ -1,8 +1,40 @@
 // SPDX-License-Identifier: BSD-3-Clause
 // SPDX-FileCopyrightText: 2023 1BitSquared <info@1bitsquared.com>
 // SPDX-FileContributor: Written by Rachel Mant <git@dragonmux.network>
+#include <cstring>
 #include "crc32.hxx"
 
+#if defined(__x86_64__) || defined(_M_X64)
+#define CRC32_PCLMUL 1
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#include <emmintrin.h>
+#include <smmintrin.h>
+#include <wmmintrin.h>
+#elif defined(__aarch64__) && !defined(__ARM_BIG_ENDIAN) && (defined(__linux__) || defined(__APPLE__))
+#define CRC32_ARMV8 1
+#include <arm_acle.h>
+#if defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+#if defined(__GNUC__) && defined(CRC32_PCLMUL)
+#define CRC32_TARGET_PCLMUL __attribute__((target("pclmul,sse4.1")))
+#else
+#define CRC32_TARGET_PCLMUL
+#endif
+
+#if defined(__clang__) && defined(CRC32_ARMV8)
+#define CRC32_TARGET_ARMV8 __attribute__((target("crc")))
+#elif defined(__GNUC__) && defined(CRC32_ARMV8)
+#define CRC32_TARGET_ARMV8 __attribute__((target("+crc")))
+#else
+#define CRC32_TARGET_ARMV8
+#endif
+
 namespace bmpflash
 {
 	// Iterate till we have calculated the CRC
@@ -13,17 +45,219 @@ namespace bmpflash
 	constexpr uint32_t calcTableC(const uint32_t poly, const size_t byte) noexcept
 		{ return calcTableC(poly, static_cast<uint32_t>(byte), 8); }
 
-	template<size_t N, uint32_t poly, uint32_t... table> struct calcTable
+	using crcTables_t = std::array<std::array<uint32_t, 256U>, 16U>;
+
+	/*
+	 * Table 0 is the usual byte-at-a-time CRC table. Each table after that gives the CRC contribution of
+	 * a byte followed by one more zero byte than the last, which is what lets slice-by-16 look up all
+	 * 16 bytes of a block independently and XOR the results together.
+	 */
+	constexpr static crcTables_t calcTables(const uint32_t poly) noexcept
+	{
+		crcTables_t tables{};
+		for (size_t byte{0U}; byte < 256U; ++byte)
+			tables[0U][byte] = calcTableC(poly, byte);
+		for (size_t table{1U}; table < tables.size(); ++table)
+		{
+			for (size_t byte{0U}; byte < 256U; ++byte)
+			{
+				const auto previous{tables[table - 1U][byte]};
+				tables[table][byte] = (previous >> 8U) ^ tables[0U][previous & 0xffU];
+			}
+		}
+		return tables;
+	}
+
+	constexpr static auto crcTables{calcTables(crc32_t::poly)};
+
+	// Multiply two polynomials modulo the CRC polynomial, working in the CRC's reflected bit order
+	constexpr static uint32_t multiplyModP(const uint32_t a, uint32_t b) noexcept
+	{
+		uint32_t product{0U};
+		for (uint32_t bit{UINT32_C(1) << 31U}; bit; bit >>= 1U)
+		{
+			if (a & bit)
+				product ^= b;
+			b = (b & 1U) ? (b >> 1U) ^ crc32_t::poly : b >> 1U;
+		}
+		return product;
+	}
+
+	// Entry n is x^(2^n) modulo the CRC polynomial
+	constexpr static std::array<uint32_t, 32U> calcPowerTable() noexcept
+	{
+		std::array<uint32_t, 32U> powers{};
+		powers[0U] = UINT32_C(1) << 30U;
+		for (size_t power{1U}; power < powers.size(); ++power)
+			powers[power] = multiplyModP(powers[power - 1U], powers[power - 1U]);
+		return powers;
+	}
+
+	constexpr static auto powerTable{calcPowerTable()};
+
+	// Compute x^(n * 2^k) modulo the CRC polynomial
+	[[nodiscard]] static uint32_t powerModP(uint64_t n, size_t k) noexcept
+	{
+		uint32_t result{UINT32_C(1) << 31U};
+		for (; n; n >>= 1U, ++k)
+		{
+			if (n & 1U)
+				result = multiplyModP(powerTable[k & 31U], result);
+		}
+		return result;
+	}
+
+	// All the engines work on the CRC's internal state, which is the inverted CRC value
+	using crcEngine_t = uint32_t (*)(uint32_t state, const uint8_t *data, size_t length) noexcept;
+
+	[[nodiscard]] static uint32_t crcSlice16(uint32_t state, const uint8_t *data, size_t length) noexcept
+	{
+		for (; length >= 16U; data += 16U, length -= 16U)
+		{
+			state ^= uint32_t{data[0]} | (uint32_t{data[1]} << 8U) | (uint32_t{data[2]} << 16U) |
+				(uint32_t{data[3]} << 24U);
+			state =
+				crcTables[15U][state & 0xffU] ^ crcTables[14U][(state >> 8U) & 0xffU] ^
+				crcTables[13U][(state >> 16U) & 0xffU] ^ crcTables[12U][state >> 24U] ^
+				crcTables[11U][data[4]] ^ crcTables[10U][data[5]] ^ crcTables[9U][data[6]] ^ crcTables[8U][data[7]] ^
+				crcTables[7U][data[8]] ^ crcTables[6U][data[9]] ^ crcTables[5U][data[10]] ^ crcTables[4U][data[11]] ^
+				crcTables[3U][data[12]] ^ crcTables[2U][data[13]] ^ crcTables[1U][data[14]] ^ crcTables[0U][data[15]];
+		}
+		for (; length; ++data, --length)
+			state = crcTables[0U][(state ^ *data) & 0xffU] ^ (state >> 8U);
+		return state;
+	}
+
+#ifdef CRC32_PCLMUL
+#if defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-align"
+#endif
+	[[nodiscard]] CRC32_TARGET_PCLMUL static inline __m128i load128(const uint8_t *const data) noexcept
+		{ return _mm_loadu_si128(reinterpret_cast<const __m128i *>(data)); }
+#if defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+
+	[[nodiscard]] CRC32_TARGET_PCLMUL static inline __m128i fold128(const __m128i value, const __m128i constants,
+		const __m128i next) noexcept
+	{
+		return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(value, constants, 0x00),
+			_mm_clmulepi64_si128(value, constants, 0x11)), next);
+	}
+
+	/*
+	 * Carry-less multiply folding, per Intel's "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ
+	 * Instruction", using the bit-reflected constants for this polynomial. Four 128-bit lanes are folded
+	 * forward 64 bytes at a time, then merged down to one lane, folded over any remaining 16 byte blocks,
+	 * and finally Barrett reduced down to 32 bits. Anything short of a whole 16 byte block is left to
+	 * slice-by-16, as is any input too small to be worth setting up the lanes for.
+	 */
+	[[nodiscard]] CRC32_TARGET_PCLMUL static uint32_t crcPCLMUL(uint32_t state, const uint8_t *data, size_t length)
+		noexcept
+	{
+		if (length < 64U)
+			return crcSlice16(state, data, length);
+
+		const auto foldBy4{_mm_set_epi64x(INT64_C(0x01c6e41596), INT64_C(0x0154442bd4))};
+		const auto foldBy1{_mm_set_epi64x(INT64_C(0x00ccaa009e), INT64_C(0x01751997d0))};
+		const auto reduce64{_mm_set_epi64x(INT64_C(0), INT64_C(0x0163cd6124))};
+		const auto barrett{_mm_set_epi64x(INT64_C(0x01f7011641), INT64_C(0x01db710641))};
+		const auto lowMask{_mm_setr_epi32(~0, 0, ~0, 0)};
+
+		auto lane0{_mm_xor_si128(load128(data), _mm_cvtsi32_si128(static_cast<int>(state)))};
+		auto lane1{load128(data + 16U)};
+		auto lane2{load128(data + 32U)};
+		auto lane3{load128(data + 48U)};
+		data += 64U;
+		length -= 64U;
+
+		for (; length >= 64U; data += 64U, length -= 64U)
+		{
+			lane0 = fold128(lane0, foldBy4, load128(data));
+			lane1 = fold128(lane1, foldBy4, load128(data + 16U));
+			lane2 = fold128(lane2, foldBy4, load128(data + 32U));
+			lane3 = fold128(lane3, foldBy4, load128(data + 48U));
+		}
+
+		auto value{fold128(lane0, foldBy1, lane1)};
+		value = fold128(value, foldBy1, lane2);
+		value = fold128(value, foldBy1, lane3);
+		for (; length >= 16U; data += 16U, length -= 16U)
+			value = fold128(value, foldBy1, load128(data));
+
+		// Fold the 128 bits down to 64
+		value = _mm_xor_si128(_mm_srli_si128(value, 8), _mm_clmulepi64_si128(value, foldBy1, 0x10));
+		value = _mm_xor_si128(_mm_srli_si128(value, 4),
+			_mm_clmulepi64_si128(_mm_and_si128(value, lowMask), reduce64, 0x00));
+
+		// Barrett reduce that down to the 32-bit result
+		auto quotient{_mm_clmulepi64_si128(_mm_and_si128(value, lowMask), barrett, 0x10)};
+		quotient = _mm_clmulepi64_si128(_mm_and_si128(quotient, lowMask), barrett, 0x00);
+		state = static_cast<uint32_t>(_mm_extract_epi32(_mm_xor_si128(value, quotient), 1));
+		return crcSlice16(state, data, length);
+	}
+
+	[[nodiscard]] static bool hasPCLMUL() noexcept
+	{
+#if defined(_MSC_VER) && !defined(__clang__)
+		std::array<int, 4U> registers{};
+		__cpuid(registers.data(), 1);
+		// ECX bit 1 is PCLMULQDQ, bit 19 is SSE4.1
+		return (registers[2] & (1 << 1)) && (registers[2] & (1 << 19));
+#else
+		return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#endif
+	}
+#endif
+
+#ifdef CRC32_ARMV8
+	// Run the ARMv8 CRC32 instructions over the data 8 bytes at a time, picking up any stragglers bytewise
+	[[nodiscard]] CRC32_TARGET_ARMV8 static uint32_t crcARMv8(uint32_t state, const uint8_t *data, size_t length)
+		noexcept
+	{
+		for (; length >= 8U; data += 8U, length -= 8U)
+		{
+			uint64_t value{};
+			std::memcpy(&value, data, sizeof(value));
+			state = __crc32d(state, value);
+		}
+		for (; length; ++data, --length)
+			state = __crc32b(state, *data);
+		return state;
+	}
+
+	[[nodiscard]] static bool hasARMv8CRC() noexcept
+	{
+#if defined(__APPLE__)
+		// Every 64-bit Apple CPU implements the CRC32 instructions
+		return true;
+#else
+		return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0U;
+#endif
+	}
+#endif
+
+	[[nodiscard]] static crcEngine_t selectEngine() noexcept
 	{
-		constexpr static std::array<const uint32_t, sizeof...(table) + N + 1> value
-			{calcTable<N - 1, poly, calcTableC(poly, N), table...>::value};
-	};
+#ifdef CRC32_PCLMUL
+		if (hasPCLMUL())
+			return crcPCLMUL;
+#endif
+#ifdef CRC32_ARMV8
+		if (hasARMv8CRC())
+			return crcARMv8;
+#endif
+		return crcSlice16;
+	}
 
-	template<uint32_t poly, uint32_t... table> struct calcTable<0, poly, table...>
+	void crc32_t::crc(uint32_t &crc, const substrate::span<const uint8_t> data) noexcept
 	{
-		constexpr static std::array<const uint32_t, sizeof...(table) + 1> value
-			{{calcTableC(poly, 0), table...}};
-	};
+		static const auto engine{selectEngine()};
+		crc = engine(crc ^ UINT32_C(0xffffffff), data.data(), data.size()) ^ UINT32_C(0xffffffff);
+	}
 
-	std::array<const uint32_t, 256> crc32_t::crcTable = calcTable<255, poly>::value;
+	uint32_t crc32_t::combine(const uint32_t crcA, const uint32_t crcB, const uint64_t lengthB) noexcept
+		// Shift crcA along by lengthB bytes (x^(8 * lengthB)) and then fold in crcB
+		{ return multiplyModP(powerModP(lengthB, 3U), crcA) ^ crcB; }
 } // namespace bmpflash
@@ -0,0 +1,542 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// SPDX-FileCopyrightText: 2023 1BitSquared <info@1bitsquared.com>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <map>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#ifndef _WIN32
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#endif
+#if defined(_MSC_VER)
+#pragma warning(push)
+#pragma warning(disable: 4061 4365)
+#elif defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wswitch-enum"
+#pragma GCC diagnostic ignored "-Wsign-conversion"
+#endif
+#include <fmt/format.h>
+#if defined(_MSC_VER)
+#pragma warning(pop)
+#elif defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+#include <substrate/fd>
+#include <substrate/console>
+#include "daemon.hxx"
+#include "batch.hxx"
+#include "session.hxx"
+
+using namespace std::literals::string_literals;
+using namespace std::literals::string_view_literals;
+using substrate::fd_t;
+using substrate::console;
+using substrate::commandLine::flag_t;
+using bmpflash::flashSession_t;
+
+/*
+ * The daemon speaks a simple line based protocol over its socket. Each connection carries one request,
+ * which is a single line consisting of the serial number (or part of it) of the probe to use, or '*' if only
+ * one probe is attached, followed by either an operation in the job file syntax, 'status' or 'shutdown'.
+ * The daemon responds with any number of informational lines, finishing with a line that is one of
+ * 'ok', 'failed', or 'error' followed by a description of what went wrong.
+ */
+namespace bmpflash::daemon
+{
+	constexpr static size_t maxRequestLength{4096U};
+	// How many connections may be handled at once - any more wait in the listen backlog till one finishes
+	constexpr static size_t maxConnections{16U};
+	// How long a client may leave the daemon waiting on it before the connection is dropped
+	constexpr static time_t clientTimeout{30};
+
+#ifndef _WIN32
+	// Without a runtime directory the socket goes in a directory in /tmp that only we can get into
+	[[nodiscard]] static path fallbackSocketDirectory()
+		{ return path{"/tmp"} / fmt::format("bmpflash-{}", getuid()); }
+#endif
+
+	std::optional<path> defaultSocketPath()
+	{
+#ifndef _WIN32
+		// NOLINTNEXTLINE(concurrency-mt-unsafe)
+		if (const auto *const runtimeDir{std::getenv("XDG_RUNTIME_DIR")}; runtimeDir && *runtimeDir == '/')
+			return path{runtimeDir} / "bmpflash.sock";
+		return fallbackSocketDirectory() / "bmpflash.sock";
+#else
+		return std::nullopt;
+#endif
+	}
+
+	[[nodiscard]] static std::optional<path> socketPathFrom(const arguments_t &arguments)
+	{
+		if (const auto *const socketArg{arguments["socket"sv]}; socketArg)
+			return std::any_cast<path>(std::get<flag_t>(*socketArg).value());
+		const auto socketPath{defaultSocketPath()};
+		if (!socketPath)
+			console.error("Could not work out where the daemon's socket should be, please specify it with --socket"sv);
+		return socketPath;
+	}
+
+#ifndef _WIN32
+	[[nodiscard]] static std::optional<sockaddr_un> socketAddress(const path &socketPath)
+	{
+		sockaddr_un address{};
+		address.sun_family = AF_UNIX;
+		const auto &pathString{socketPath.native()};
+		if (pathString.size() >= sizeof(address.sun_path))
+		{
+			console.error("Socket path "sv, pathString, " is too long"sv);
+			return std::nullopt;
+		}
+		std::memcpy(address.sun_path, pathString.c_str(), pathString.size() + 1U);
+		return address;
+	}
+
+	// Make sure the fallback socket directory exists, belongs to us and is private, so nobody else can get at
+	// (or swap out) the socket in it
+	[[nodiscard]] static bool prepareSocketDirectory(const path &directory)
+	{
+		if (mkdir(directory.c_str(), S_IRWXU) != 0 && errno != EEXIST)
+		{
+			console.error("Failed to create socket directory "sv, directory.string(), ": "sv, std::strerror(errno));
+			return false;
+		}
+		struct stat directoryStat{};
+		if (lstat(directory.c_str(), &directoryStat) != 0 || !S_ISDIR(directoryStat.st_mode) ||
+			directoryStat.st_uid != getuid() || (directoryStat.st_mode & (S_IRWXG | S_IRWXO)))
+		{
+			console.error("Socket directory "sv, directory.string(), " is not a private directory belonging to us"sv);
+			return false;
+		}
+		return true;
+	}
+
+	// Stop a client that goes quiet (or stops reading) from holding its connection open forever
+	[[nodiscard]] static bool setClientTimeouts(const fd_t &client) noexcept
+	{
+		const timeval timeout{clientTimeout, 0};
+		return setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == 0 &&
+			setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) == 0;
+	}
+
+	/*
+	 * A connection being handled on its own thread. The thread flags when it's done so the connection
+	 * can be reaped while the daemon keeps running, rather than piling up till shutdown
+	 */
+	struct connection_t final
+	{
+		std::atomic<bool> finished{false};
+		std::thread thread{};
+	};
+
+	[[nodiscard]] static std::optional<std::string> readLine(const fd_t &socket)
+	{
+		std::string line{};
+		while (line.size() < maxRequestLength)
+		{
+			char character{};
+			size_t amount{0U};
+			if (!socket.read(&character, 1U, &amount) || amount == 0U)
+				return line.empty() ? std::nullopt : std::optional{line};
+			if (character == '\n')
+				return line;
+			line.push_back(character);
+		}
+		return std::nullopt;
+	}
+
+	[[nodiscard]] static bool writeLine(const fd_t &socket, const std::string_view &line)
+		{ return socket.write(line.data(), line.size()) && socket.write('\n'); }
+
+	/*
+	 * Owns the session with a single probe, running the tasks queued against it one at a time
+	 * and in order on a thread dedicated to the probe
+	 */
+	struct probeWorker_t final
+	{
+	private:
+		using task_t = std::function<bool (flashSession_t &)>;
+
+		flashSession_t _session;
+		std::mutex _lock{};
+		std::condition_variable _taskAvailable{};
+		std::deque<std::pair<task_t, std::promise<bool>>> _tasks{};
+		bool _stopping{false};
+		std::thread _thread{};
+
+		void run()
+		{
+			while (true)
+			{
+				std::unique_lock lock{_lock};
+				_taskAvailable.wait(lock, [this]() { return _stopping || !_tasks.empty(); });
+				if (_tasks.empty())
+					break;
+				auto [task, result] = std::move(_tasks.front());
+				_tasks.pop_front();
+				lock.unlock();
+
+				try
+					{ result.set_value(task(_session)); }
+				catch (const std::exception &error)
+				{
+					console.error("Request failed: "sv, error.what());
+					// A communications failure leaves the session in an unknown state, so start
+					// over with a fresh one on the next request
+					static_cast<void>(_session.end());
+					result.set_value(false);
+				}
+			}
+			static_cast<void>(_session.end());
+		}
+
+	public:
+		probeWorker_t(const usbDevice_t &device) : _session{device}, _thread{[this]() { run(); }} { }
+		probeWorker_t(const probeWorker_t &) = delete;
+		probeWorker_t(probeWorker_t &&) = delete;
+		probeWorker_t &operator =(const probeWorker_t &) = delete;
+		probeWorker_t &operator =(probeWorker_t &&) = delete;
+
+		~probeWorker_t() noexcept
+		{
+			{
+				const std::lock_guard lock{_lock};
+				_stopping = true;
+			}
+			_taskAvailable.notify_all();
+			if (_thread.joinable())
+				_thread.join();
+		}
+
+		[[nodiscard]] auto &serialNumber() const noexcept { return _session.serialNumber(); }
+
+		[[nodiscard]] std::future<bool> submit(task_t task)
+		{
+			std::unique_lock lock{_lock};
+			auto &[_, result] = _tasks.emplace_back(std::move(task), std::promise<bool>{});
+			auto future{result.get_future()};
+			lock.unlock();
+			_taskAvailable.notify_one();
+			return future;
+		}
+	};
+
+	using workers_t = std::vector<std::unique_ptr<probeWorker_t>>;
+
+	[[nodiscard]] static std::string_view busName(const spiBus_t bus) noexcept
+		{ return bus == spiBus_t::internal ? "int"sv : "ext"sv; }
+
+	[[nodiscard]] static std::string describe(const flashSession_t &session)
+	{
+		auto description{fmt::format("probe {} session={}", session.serialNumber(),
+			session.active() ? "open"sv : "closed"sv)};
+		for (const auto &[bus, target] : session.targets())
+			description += fmt::format("\n  bus={} chip={:02x}{:02x}{:02x} capacity={} sectorSize={}", busName(bus),
+				target.chipID.manufacturer, target.chipID.type, target.chipID.capacity, target.spiFlash.capacity(),
+				target.spiFlash.sectorSize());
+		return description;
+	}
+
+	[[nodiscard]] static probeWorker_t *findWorker(const workers_t &workers, const std::string_view &selector)
+	{
+		if (selector == "*"sv)
+			return workers.size() == 1U ? workers[0].get() : nullptr;
+		// Match serial numbers the same way as --serial, allowing a partial match
+		probeWorker_t *match{nullptr};
+		for (const auto &worker : workers)
+		{
+			if (worker->serialNumber().find(selector) == std::string::npos)
+				continue;
+			if (match)
+				return nullptr;
+			match = worker.get();
+		}
+		return match;
+	}
+
+	static void handleConnection(const fd_t &client, const workers_t &workers, std::atomic<bool> &running)
+	{
+		const auto line{readLine(client)};
+		if (!line)
+			return;
+		const auto separator{line->find(' ')};
+		const std::string_view selector{line->data(), std::min(separator, line->size())};
+		const auto operation{separator == std::string::npos ? std::string_view{} :
+			std::string_view{*line}.substr(separator + 1U)};
+		console.info("Request: "sv, *line);
+
+		if (operation == "shutdown"sv)
+		{
+			running = false;
+			static_cast<void>(writeLine(client, "ok"sv));
+			return;
+		}
+		if (operation == "status"sv)
+		{
+			// Ask every probe's worker to describe its session, so the answer reflects any queued work
+			for (const auto &worker : workers)
+			{
+				std::string description{};
+				auto result{worker->submit([&](flashSession_t &session)
+				{
+					description = describe(session);
+					return true;
+				})};
+				result.wait();
+				if (!writeLine(client, description))
+					return;
+			}
+			static_cast<void>(writeLine(client, "ok"sv));
+			return;
+		}
+
+		auto *const worker{findWorker(workers, selector)};
+		if (!worker)
+		{
+			static_cast<void>(writeLine(client, fmt::format("error no single probe matches '{}'", selector)));
+			return;
+		}
+		const auto job{batch::parseJob(operation)};
+		if (!job)
+		{
+			static_cast<void>(writeLine(client, "error invalid operation"sv));
+			return;
+		}
+		auto result{worker->submit([&](flashSession_t &session) { return batch::runJob(session, *job); })};
+		static_cast<void>(writeLine(client, result.get() ? "ok"sv : "failed"sv));
+	}
+#endif
+
+	bool serve([[maybe_unused]] const std::vector<usbDevice_t> &devices,
+		[[maybe_unused]] const arguments_t &serveArguments)
+	{
+#ifndef _WIN32
+		const auto socketPath{socketPathFrom(serveArguments)};
+		if (!socketPath)
+			return false;
+		const auto address{socketAddress(*socketPath)};
+		if (!address)
+			return false;
+
+		const auto socketDirectory{socketPath->parent_path()};
+		if (socketDirectory == fallbackSocketDirectory() && !prepareSocketDirectory(socketDirectory))
+			return false;
+
+		// If there's a socket left behind by a daemon that didn't shut down cleanly, get rid of it -
+		// but only after checking there isn't actually still a daemon listening on it
+		struct stat socketStat{};
+		if (lstat(socketPath->c_str(), &socketStat) == 0 && S_ISSOCK(socketStat.st_mode))
+		{
+			const fd_t probe{socket(AF_UNIX, SOCK_STREAM, 0)};
+			// NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+			if (connect(probe, reinterpret_cast<const sockaddr *>(&*address), sizeof(*address)) == 0)
+			{
+				console.error("A daemon is already listening on "sv, socketPath->string());
+				return false;
+			}
+			unlink(socketPath->c_str());
+		}
+
+		const fd_t listener{socket(AF_UNIX, SOCK_STREAM, 0)};
+		// Create the socket with only our permissions from the start so there's no window where others can connect
+		const auto oldMask{umask(S_IXUSR | S_IRWXG | S_IRWXO)};
+		const auto bound
+		{
+			// NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+			listener.valid() && !bind(listener, reinterpret_cast<const sockaddr *>(&*address), sizeof(*address))
+		};
+		umask(oldMask);
+		if (!bound || listen(listener, 8))
+		{
+			console.error("Failed to listen on "sv, socketPath->string(), ": "sv, std::strerror(errno));
+			return false;
+		}
+
+		workers_t workers{};
+		for (const auto &device : devices)
+		{
+			auto &worker{workers.emplace_back(std::make_unique<probeWorker_t>(device))};
+			console.info("Serving requests for probe "sv, worker->serialNumber());
+		}
+		console.info("Listening for requests on "sv, socketPath->string());
+
+		std::atomic<bool> running{true};
+		std::vector<std::unique_ptr<connection_t>> connections{};
+		const auto reapConnections
+		{
+			[&]()
+			{
+				for (auto connection{connections.begin()}; connection != connections.end();)
+				{
+					if ((*connection)->finished)
+					{
+						(*connection)->thread.join();
+						connection = connections.erase(connection);
+					}
+					else
+						++connection;
+				}
+			}
+		};
+		while (running)
+		{
+			reapConnections();
+			if (connections.size() >= maxConnections)
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds{250});
+				continue;
+			}
+			// Wake up periodically so a shutdown request gets noticed and finished connections get reaped
+			pollfd pollFD{listener, POLLIN, 0};
+			if (poll(&pollFD, 1U, 250) <= 0 || !(pollFD.revents & POLLIN))
+				continue;
+			fd_t client{accept(listener, nullptr, nullptr)};
+			if (!client.valid() || !setClientTimeouts(client))
+				continue;
+			auto &connection{connections.emplace_back(std::make_unique<connection_t>())};
+			connection->thread = std::thread
+			{
+				[&, &finished = connection->finished](const fd_t &socket)
+				{
+					handleConnection(socket, workers, running);
+					finished = true;
+				},
+				std::move(client)
+			};
+		}
+
+		for (auto &connection : connections)
+			connection->thread.join();
+		// Destroying the workers finishes off any queued work and cleans up the sessions
+		workers.clear();
+		unlink(socketPath->c_str());
+		console.info("Daemon shut down"sv);
+		return true;
+#else
+		console.error("The daemon is not supported on Windows"sv);
+		return false;
+#endif
+	}
+
+	// Send a request to the daemon, relaying what it says back and returning whether it succeeded
+	[[nodiscard]] static bool sendRequest([[maybe_unused]] const std::optional<path> &socketPath,
+		[[maybe_unused]] const std::string &request)
+	{
+#ifndef _WIN32
+		if (!socketPath)
+			return false;
+		const auto address{socketAddress(*socketPath)};
+		if (!address)
+			return false;
+		const fd_t server{socket(AF_UNIX, SOCK_STREAM, 0)};
+		// NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+		if (!server.valid() || connect(server, reinterpret_cast<const sockaddr *>(&*address), sizeof(*address)))
+		{
+			console.error("Could not connect to a daemon on "sv, socketPath->string(),
+				", is `bmpflash serve` running?"sv);
+			return false;
+		}
+		if (!writeLine(server, request))
+		{
+			console.error("Failed to send request to the daemon"sv);
+			return false;
+		}
+
+		while (const auto line{readLine(server)})
+		{
+			if (*line == "ok"sv)
+				return true;
+			if (*line == "failed"sv)
+			{
+				console.error("The daemon failed to complete the request, see its output for details"sv);
+				return false;
+			}
+			if (line->rfind("error "sv, 0U) == 0U)
+			{
+				console.error("The daemon rejected the request: "sv, line->substr(6U));
+				return false;
+			}
+			console.info(*line);
+		}
+		console.error("Lost connection to the daemon"sv);
+		return false;
+#else
+		console.error("The daemon is not supported on Windows"sv);
+		return false;
+#endif
+	}
+
+	bool control(const arguments_t &serveArguments)
+	{
+		const auto socketPath{socketPathFrom(serveArguments)};
+		if (serveArguments["stop"sv])
+			return sendRequest(socketPath, "* shutdown"s);
+		return sendRequest(socketPath, "* status"s);
+	}
+
+	// Quote a path for use in a request, making it absolute as the daemon won't share our working directory
+	[[nodiscard]] static std::string quote(const path &fileName)
+		{ return fmt::format("\"{}\"", std::filesystem::absolute(fileName).string()); }
+
+	bool request(const std::string_view action, const arguments_t &actionArguments)
+	{
+		// The daemon's sessions only know how to drive NOR Flash
+		if (actionArguments["nand"sv])
+		{
+			console.error("SPI NAND operations can't be handed to the daemon"sv);
+			return false;
+		}
+		if (actionArguments["sdcard"sv])
+		{
+			console.error("SD card operations can't be handed to the daemon"sv);
+			return false;
+		}
+		// Nor does it report anything beyond whether a request succeeded
+		if (actionArguments["digest"sv] || actionArguments["stats-json"sv])
+		{
+			console.error("Digests and statistics are not available for operations handed to the daemon"sv);
+			return false;
+		}
+		const auto *const serialArg{actionArguments["serial"sv]};
+		auto request
+		{
+			serialArg ? std::string{std::any_cast<std::string_view>(std::get<flag_t>(*serialArg).value())} : "*"s
+		};
+		const auto fileArgs{actionArguments.findAll("fileName"sv)};
+
+		if (action == "provision"sv)
+		{
+			request += " provision"sv;
+			for (const auto *const fileArg : fileArgs)
+			{
+				const auto spec{std::any_cast<elf::imageSpec_t>(std::get<flag_t>(*fileArg).value())};
+				request += ' ' + quote(spec.fileName);
+				if (spec.offset)
+					request += fmt::format("@0x{:x}", *spec.offset);
+			}
+		}
+		else
+		{
+			const auto bus{std::any_cast<spiBus_t>(std::get<flag_t>(*actionArguments["bus"sv]).value())};
+			const auto fileName{std::any_cast<path>(std::get<flag_t>(*fileArgs[0]).value())};
+			request += fmt::format(" {} {} {}", action, busName(bus), quote(fileName));
+			if (const auto *const manifestArg{actionArguments["manifest"sv]}; manifestArg)
+				request += " manifest="s + quote(std::any_cast<path>(std::get<flag_t>(*manifestArg).value()));
+		}
+		return sendRequest(socketPathFrom(actionArguments), request);
+	}
+} // namespace bmpflash::daemon
@@ -0,0 +1,323 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// SPDX-FileCopyrightText: 2023 1BitSquared <info@1bitsquared.com>
+#include <string>
+#include <algorithm>
+#include <iterator>
+#if defined(_MSC_VER)
+#pragma warning(push)
+#pragma warning(disable: 4061 4365)
+#elif defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wswitch-enum"
+#pragma GCC diagnostic ignored "-Wsign-conversion"
+#endif
+#include <fmt/format.h>
+#if defined(_MSC_VER)
+#pragma warning(pop)
+#elif defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+#include <substrate/fd>
+#include <substrate/console>
+#include <substrate/index_sequence>
+#include <substrate/indexed_iterator>
+#include "digest.hxx"
+#include "crc32.hxx"
+#include "trace.hxx"
+
+using namespace std::literals::string_view_literals;
+using substrate::fd_t;
+using substrate::normalMode;
+using substrate::console;
+using substrate::indexSequence_t;
+using substrate::span;
+
+namespace bmpflash::digest
+{
+	constexpr static size_t chunkQueueDepth{8U};
+
+	constexpr static std::array<uint32_t, 8U> sha256Initial
+	{{
+		0x6a09e667U, 0xbb67ae85U, 0x3c6ef372U, 0xa54ff53aU, 0x510e527fU, 0x9b05688cU, 0x1f83d9abU, 0x5be0cd19U,
+	}};
+
+	constexpr static std::array<uint32_t, 64U> sha256Constants
+	{{
+		0x428a2f98U, 0x71374491U, 0xb5c0fbcfU, 0xe9b5dba5U, 0x3956c25bU, 0x59f111f1U, 0x923f82a4U, 0xab1c5ed5U,
+		0xd807aa98U, 0x12835b01U, 0x243185beU, 0x550c7dc3U, 0x72be5d74U, 0x80deb1feU, 0x9bdc06a7U, 0xc19bf174U,
+		0xe49b69c1U, 0xefbe4786U, 0x0fc19dc6U, 0x240ca1ccU, 0x2de92c6fU, 0x4a7484aaU, 0x5cb0a9dcU, 0x76f988daU,
+		0x983e5152U, 0xa831c66dU, 0xb00327c8U, 0xbf597fc7U, 0xc6e00bf3U, 0xd5a79147U, 0x06ca6351U, 0x14292967U,
+		0x27b70a85U, 0x2e1b2138U, 0x4d2c6dfcU, 0x53380d13U, 0x650a7354U, 0x766a0abbU, 0x81c2c92eU, 0x92722c85U,
+		0xa2bfe8a1U, 0xa81a664bU, 0xc24b8b70U, 0xc76c51a3U, 0xd192e819U, 0xd6990624U, 0xf40e3585U, 0x106aa070U,
+		0x19a4c116U, 0x1e376c08U, 0x2748774cU, 0x34b0bcb5U, 0x391c0cb3U, 0x4ed8aa4aU, 0x5b9cca4fU, 0x682e6ff3U,
+		0x748f82eeU, 0x78a5636fU, 0x84c87814U, 0x8cc70208U, 0x90befffaU, 0xa4506cebU, 0xbef9a3f7U, 0xc67178f2U,
+	}};
+
+	[[nodiscard]] constexpr static uint32_t rotateRight(const uint32_t value, const uint32_t amount) noexcept
+		{ return (value >> amount) | (value << (32U - amount)); }
+
+	[[nodiscard]] static std::string toHexString(const span<const uint8_t> &data)
+	{
+		std::string result{};
+		result.reserve(data.size() * 2U);
+		for (const auto byte : data)
+			fmt::format_to(std::back_inserter(result), "{:02x}", byte);
+		return result;
+	}
+
+	sha256_t::sha256_t() noexcept : _state{sha256Initial} { }
+
+	void sha256_t::processBlock(const uint8_t *const block) noexcept
+	{
+		std::array<uint32_t, 64U> schedule{};
+		for (const auto index : indexSequence_t{16U})
+		{
+			const auto *const word{block + (index * 4U)};
+			schedule[index] = (uint32_t{word[0]} << 24U) | (uint32_t{word[1]} << 16U) |
+				(uint32_t{word[2]} << 8U) | uint32_t{word[3]};
+		}
+		for (const auto index : indexSequence_t{16U, 64U})
+		{
+			const auto &early{schedule[index - 15U]};
+			const auto &late{schedule[index - 2U]};
+			const auto sigma0{rotateRight(early, 7U) ^ rotateRight(early, 18U) ^ (early >> 3U)};
+			const auto sigma1{rotateRight(late, 17U) ^ rotateRight(late, 19U) ^ (late >> 10U)};
+			schedule[index] = schedule[index - 16U] + sigma0 + schedule[index - 7U] + sigma1;
+		}
+
+		auto [a, b, c, d, e, f, g, h] = _state;
+		for (const auto index : indexSequence_t{64U})
+		{
+			const auto sum1{rotateRight(e, 6U) ^ rotateRight(e, 11U) ^ rotateRight(e, 25U)};
+			const auto choice{(e & f) ^ (~e & g)};
+			const auto temp1{h + sum1 + choice + sha256Constants[index] + schedule[index]};
+			const auto sum0{rotateRight(a, 2U) ^ rotateRight(a, 13U) ^ rotateRight(a, 22U)};
+			const auto majority{(a & b) ^ (a & c) ^ (b & c)};
+			h = g;
+			g = f;
+			f = e;
+			e = d + temp1;
+			d = c;
+			c = b;
+			b = a;
+			a = temp1 + sum0 + majority;
+		}
+		_state[0] += a;
+		_state[1] += b;
+		_state[2] += c;
+		_state[3] += d;
+		_state[4] += e;
+		_state[5] += f;
+		_state[6] += g;
+		_state[7] += h;
+	}
+
+	void sha256_t::update(const span<const uint8_t> data) noexcept
+	{
+		_length += data.size();
+		size_t offset{0U};
+		// Top up any partial block left over from last time first
+		if (_blockUsed)
+		{
+			offset = std::min(_block.size() - _blockUsed, data.size());
+			std::copy_n(data.data(), offset, _block.data() + _blockUsed);
+			_blockUsed += offset;
+			if (_blockUsed < _block.size())
+				return;
+			processBlock(_block.data());
+			_blockUsed = 0U;
+		}
+		// Then work straight from the data for as many whole blocks as it holds, keeping what's left over
+		for (; data.size() - offset >= _block.size(); offset += _block.size())
+			processBlock(data.data() + offset);
+		_blockUsed = data.size() - offset;
+		std::copy_n(data.data() + offset, _blockUsed, _block.data());
+	}
+
+	std::array<uint8_t, 32U> sha256_t::finish() noexcept
+	{
+		// Pad the message out with a 1 bit, then zeros up to the 64-bit big endian length in bits
+		const auto bitLength{_length * 8U};
+		_block[_blockUsed++] = 0x80U;
+		if (_blockUsed > 56U)
+		{
+			std::fill_n(_block.data() + _blockUsed, _block.size() - _blockUsed, uint8_t{0U});
+			processBlock(_block.data());
+			_blockUsed = 0U;
+		}
+		std::fill_n(_block.data() + _blockUsed, 56U - _blockUsed, uint8_t{0U});
+		for (const auto index : indexSequence_t{8U})
+			_block[56U + index] = static_cast<uint8_t>(bitLength >> (56U - (index * 8U)));
+		processBlock(_block.data());
+
+		std::array<uint8_t, 32U> result{};
+		for (const auto index : indexSequence_t{result.size()})
+			result[index] = static_cast<uint8_t>(_state[index / 4U] >> (24U - ((index % 4U) * 8U)));
+		return result;
+	}
+
+	digestWorker_t::digestWorker_t(const size_t sectorSize) :
+		_sectorSize{sectorSize}, _thread{[this]() { run(); }} { }
+
+	digestWorker_t::~digestWorker_t() noexcept
+	{
+		{
+			const std::lock_guard lock{_lock};
+			_finished = true;
+		}
+		_chunkAvailable.notify_all();
+		if (_thread.joinable())
+			_thread.join();
+	}
+
+	void digestWorker_t::push(const uint64_t address, const span<const uint8_t> data)
+	{
+		chunk_t chunk{address, {data.begin(), data.end()}};
+		std::unique_lock lock{_lock};
+		_spaceAvailable.wait(lock, [this]() { return _chunks.size() < chunkQueueDepth; });
+		_chunks.emplace_back(std::move(chunk));
+		lock.unlock();
+		_chunkAvailable.notify_one();
+	}
+
+	void digestWorker_t::run()
+	{
+		const trace::span_t span{"digest"sv, "hash data"sv};
+		while (true)
+		{
+			std::unique_lock lock{_lock};
+			_chunkAvailable.wait(lock, [this]() { return _finished || !_chunks.empty(); });
+			if (_chunks.empty())
+				return;
+			const auto chunk{std::move(_chunks.front())};
+			_chunks.pop_front();
+			lock.unlock();
+			_spaceAvailable.notify_one();
+			// Once hashing has failed, keep draining the queue so the transfers aren't held up
+			if (_failure)
+				continue;
+			try
+				{ hash(chunk); }
+			catch (const std::exception &error)
+				{ _failure = error.what(); }
+			catch (...)
+				{ _failure = "unknown error"; }
+		}
+	}
+
+	void digestWorker_t::hash(const chunk_t &chunk)
+	{
+		const span<const uint8_t> data{chunk.data.data(), chunk.data.size()};
+		_sha256.update(data);
+		_digest.length += data.size();
+
+		// Split the chunk up along sector boundaries and CRC each piece once, combining the result into
+		// both its sector's CRC and the CRC of all the data
+		auto address{chunk.address};
+		for (auto remaining{data}; !remaining.empty();)
+		{
+			const auto sectorAddress{address - (address % _sectorSize)};
+			const auto amount{static_cast<size_t>(std::min<uint64_t>(remaining.size(),
+				sectorAddress + _sectorSize - address))};
+			if (_digest.sectors.empty() || _digest.sectors.back().address != sectorAddress)
+				_digest.sectors.push_back({sectorAddress, 0U});
+			uint32_t crc{0U};
+			crc32_t::crc(crc, remaining.subspan(0U, amount));
+			auto &sectorCRC{_digest.sectors.back().crc};
+			sectorCRC = crc32_t::combine(sectorCRC, crc, amount);
+			_digest.crc32 = crc32_t::combine(_digest.crc32, crc, amount);
+			remaining = remaining.subspan(amount);
+			address += amount;
+		}
+	}
+
+	std::optional<digest_t> digestWorker_t::finish()
+	{
+		{
+			const std::lock_guard lock{_lock};
+			_finished = true;
+		}
+		_chunkAvailable.notify_all();
+		if (_thread.joinable())
+			_thread.join();
+		if (_failure)
+		{
+			console.error("Failed to hash the data: "sv, *_failure);
+			return std::nullopt;
+		}
+		_digest.sha256 = _sha256.finish();
+		_digest.sectorSize = _sectorSize;
+		return std::move(_digest);
+	}
+
+	[[nodiscard]] static bool writeFile(const path &fileName, const std::string &content)
+	{
+		const fd_t file{fileName, O_WRONLY | O_CREAT | O_TRUNC | O_NOCTTY, normalMode};
+		if (!file.valid() || !file.write(content.data(), content.size()))
+		{
+			console.error("Failed to write "sv, fileName.string());
+			return false;
+		}
+		return true;
+	}
+
+	bool writeSidecar(const path &fileName, const digest_t &digest)
+	{
+		const path sidecarName{fileName.string() + ".digest"};
+		auto content
+		{
+			fmt::format("# bmpflash digest of {}\nlength {}\ncrc32 {:08x}\nsha256 {}\nsector-size {}\n",
+				fileName.filename().string(), digest.length, digest.crc32, toHexString(digest.sha256),
+				digest.sectorSize)
+		};
+		for (const auto &sector : digest.sectors)
+			content += fmt::format("0x{:08x} {:08x}\n", sector.address, sector.crc);
+		if (!writeFile(sidecarName, content))
+			return false;
+		console.info("Wrote digests to "sv, sidecarName.string());
+		return true;
+	}
+
+	// Escape a string for use in a JSON document
+	[[nodiscard]] static std::string jsonString(const std::string_view &value)
+	{
+		std::string result{};
+		result.reserve(value.size());
+		for (const auto character : value)
+		{
+			if (character == '"' || character == '\\')
+				result += '\\';
+			if (static_cast<uint8_t>(character) < 0x20U)
+				fmt::format_to(std::back_inserter(result), "\\u{:04x}", static_cast<uint8_t>(character));
+			else
+				result += character;
+		}
+		return result;
+	}
+
+	bool writeStats(const path &statsFile, const std::string_view operation, const path &fileName,
+		const progress::stats_t &stats, const digest_t *const digest)
+	{
+		const auto averageRate{stats.elapsed > 0.0 ? static_cast<double>(stats.bytesTransferred) / stats.elapsed : 0.0};
+		auto content
+		{
+			fmt::format(R"({{"operation":"{}","file":"{}","bytes":{},"bytesTransferred":{},"elapsedSeconds":{:.3f},)"
+				R"("readSeconds":{:.3f},"eraseSeconds":{:.3f},"programSeconds":{:.3f},"averageRate":{:.1f})",
+				jsonString(operation), jsonString(fileName.string()), stats.bytesDone, stats.bytesTransferred,
+				stats.elapsed, stats.readTime, stats.eraseTime, stats.programTime, averageRate)
+		};
+		if (digest)
+		{
+			content += fmt::format(R"(,"digest":{{"length":{},"crc32":"{:08x}","sha256":"{}","sectorSize":{},)"
+				R"("sectors":[)", digest->length, digest->crc32, toHexString(digest->sha256), digest->sectorSize);
+			for (const auto &[index, sector] : substrate::indexedIterator_t{digest->sectors})
+			{
+				content += fmt::format(R"({}{{"address":{},"crc32":"{:08x}"}})", index ? ","sv : ""sv,
+					sector.address, sector.crc);
+			}
+			content += "]}"sv;
+		}
+		content += "}\n"sv;
+		return writeFile(statsFile, content);
+	}
+} // namespace bmpflash::digest
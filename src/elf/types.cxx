@@ -45,6 +45,18 @@ uint16_t elfHeader_t::sectionHeaderCount() const noexcept
 uint16_t elfHeader_t::sectionNamesIndex() const noexcept
 	{ return std::visit([](const auto &header) { return header.sectionNamesIndex(); }, _header); }
 
+programHeader_t programHeader_t::from(const memory_t &storage, const class_t elfClass, const endian_t endian) noexcept
+{
+	if (elfClass == class_t::elf64Bit)
+		return elf64::programHeader_t{storage, endian};
+	if (endian == endian_t::little)
+		return elf32::programHeaderLE_t{storage};
+	return elf32::programHeader_t{storage, endian};
+}
+
+size_t programHeader_t::size(const class_t elfClass) noexcept
+	{ return elfClass == class_t::elf64Bit ? elf64::programHeader_t::size() : elf32::programHeader_t::size(); }
+
 programHeaderType_t programHeader_t::type() const noexcept
 	{ return std::visit([](const auto &header) { return header.type(); }, _header); }
 uint32_t programHeader_t::flags() const noexcept
@@ -62,6 +74,18 @@ uint64_t programHeader_t::memoryLength() const noexcept
 uint64_t programHeader_t::alignment() const noexcept
 	{ return std::visit([](const auto &header) -> uint64_t { return header.alignment(); }, _header); }
 
+sectionHeader_t sectionHeader_t::from(const memory_t &storage, const class_t elfClass, const endian_t endian) noexcept
+{
+	if (elfClass == class_t::elf64Bit)
+		return elf64::sectionHeader_t{storage, endian};
+	if (endian == endian_t::little)
+		return elf32::sectionHeaderLE_t{storage};
+	return elf32::sectionHeader_t{storage, endian};
+}
+
+size_t sectionHeader_t::size(const class_t elfClass) noexcept
+	{ return elfClass == class_t::elf64Bit ? elf64::sectionHeader_t::size() : elf32::sectionHeader_t::size(); }
+
 uint32_t sectionHeader_t::nameOffset() const noexcept
 	{ return std::visit([](const auto &header) { return header.nameOffset(); }, _header); }
 sectionHeaderType_t sectionHeader_t::type() const noexcept
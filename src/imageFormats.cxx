@@ -0,0 +1,489 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// SPDX-FileCopyrightText: 2023 1BitSquared <info@1bitsquared.com>
+#include <cctype>
+#include <array>
+#include <string>
+#include <algorithm>
+#include <numeric>
+#include <substrate/span>
+#include <substrate/console>
+#include <substrate/conversions>
+#include <substrate/buffer_utils>
+#include <substrate/units>
+#include "imageFormats.hxx"
+#include "trace.hxx"
+
+using namespace std::literals::string_view_literals;
+using substrate::fd_t;
+using substrate::span;
+using substrate::console;
+using substrate::toInt_t;
+using substrate::buffer_utils::readLE;
+using substrate::operator ""_KiB;
+
+namespace bmpflash::imageFormats
+{
+	constexpr static size_t maxExtentLength{64_KiB};
+	constexpr static size_t readChunkLength{64_KiB};
+	// How many extents the background parser may get ahead of the consumer by
+	constexpr static size_t extentQueueDepth{8U};
+
+	/*
+	 * UF2 files are made of 512 byte blocks laid out as follows, with all values stored little endian:
+	 *
+	 *   0   1   2   3   4   5   6   7   8   9   A   B   C   D   E   F
+	 * +---------------+---------------+---------------+---------------+
+	 * |    magic 0    |    magic 1    |     flags     |  target addr  | +0x000
+	 * +---------------+---------------+---------------+---------------+
+	 * | payload size  |   block no.   |  block count  |   family ID   | +0x010
+	 * +---------------+---------------+---------------+---------------+
+	 * | data (476 bytes, of which payload size are valid) ....        | +0x020
+	 * +-----------------------------------------------+---------------+
+	 * | .... data                                     |  end magic    | +0x1f0
+	 * +-----------------------------------------------+---------------+
+	 */
+	constexpr static size_t uf2BlockLength{512U};
+	constexpr static size_t uf2DataOffset{32U};
+	constexpr static size_t uf2MaxPayloadLength{476U};
+	constexpr static uint32_t uf2Magic0{0x0a324655U};
+	constexpr static uint32_t uf2Magic1{0x9e5d5157U};
+	constexpr static uint32_t uf2MagicEnd{0x0ab16f30U};
+	// Blocks with this flag set are for something other than the main Flash and must be ignored
+	constexpr static uint32_t uf2FlagNotMainFlash{0x00000001U};
+
+	std::string_view formatName(const format_t format) noexcept
+	{
+		switch (format)
+		{
+			case format_t::binary:
+				return "raw binary"sv;
+			case format_t::intelHex:
+				return "Intel HEX"sv;
+			case format_t::srec:
+				return "Motorola S-record"sv;
+			case format_t::uf2:
+				return "UF2"sv;
+		}
+		return "unknown"sv;
+	}
+
+	format_t detectFormat(const path &fileName, const fd_t &file)
+	{
+		auto extension{fileName.extension().string()};
+		std::transform(extension.begin(), extension.end(), extension.begin(),
+			[](const char value) { return static_cast<char>(std::tolower(value)); });
+		if (extension == ".hex"sv || extension == ".ihex"sv || extension == ".ihx"sv)
+			return format_t::intelHex;
+		if (extension == ".srec"sv || extension == ".s19"sv || extension == ".s28"sv ||
+			extension == ".s37"sv || extension == ".mot"sv)
+			return format_t::srec;
+		if (extension == ".uf2"sv)
+			return format_t::uf2;
+		if (extension == ".bin"sv)
+			return format_t::binary;
+
+		// The extension didn't tell us anything, so take a look at the start of the file instead
+		std::array<uint8_t, 4> magic{};
+		const auto haveMagic{file.read(magic.data(), magic.size())};
+		static_cast<void>(file.head());
+		if (!haveMagic)
+			return format_t::binary;
+		if (readLE<uint32_t>(span<const uint8_t>{magic.data(), magic.size()}) == uf2Magic0)
+			return format_t::uf2;
+		if (magic[0] == ':' && std::all_of(magic.begin() + 1, magic.end(),
+			[](const uint8_t value) { return std::isxdigit(value) != 0; }))
+			return format_t::intelHex;
+		if (magic[0] == 'S' && magic[1] >= '0' && magic[1] <= '3')
+			return format_t::srec;
+		return format_t::binary;
+	}
+
+	size_t estimateDataLength(const format_t format, const size_t fileLength) noexcept
+	{
+		switch (format)
+		{
+			case format_t::binary:
+				return fileLength;
+			// A typical 16 byte data record is 44 characters including the line ending for
+			// Intel HEX, and 46 for a S3 record, the difference being lost in the noise
+			case format_t::intelHex:
+			case format_t::srec:
+				return (fileLength * 16U) / 45U;
+			// UF2 files are almost always made with 256 byte payloads
+			case format_t::uf2:
+				return (fileLength / uf2BlockLength) * 256U;
+		}
+		return fileLength;
+	}
+
+	// Gathers adjacent records together, handing the resulting extents off to the sink
+	struct extentBuilder_t final
+	{
+	private:
+		const extentSink_t &_sink;
+		extent_t _extent{};
+
+	public:
+		extentBuilder_t(const extentSink_t &sink) noexcept : _sink{sink} { }
+
+		[[nodiscard]] bool append(const uint32_t address, const span<const uint8_t> &data)
+		{
+			if (!_extent.data.empty() &&
+				(address != _extent.end() || _extent.data.size() + data.size() > maxExtentLength) && !flush())
+				return false;
+			if (_extent.data.empty())
+				_extent.address = address;
+			_extent.data.insert(_extent.data.end(), data.begin(), data.end());
+			return true;
+		}
+
+		[[nodiscard]] bool flush()
+		{
+			if (_extent.data.empty())
+				return true;
+			auto extent{std::move(_extent)};
+			_extent = {};
+			return _sink(std::move(extent));
+		}
+	};
+
+	[[nodiscard]] static std::optional<std::vector<uint8_t>> decodeHex(const std::string_view &digits)
+	{
+		if (digits.size() % 2U)
+			return std::nullopt;
+		std::vector<uint8_t> result(digits.size() / 2U);
+		for (size_t offset{0U}; offset < result.size(); ++offset)
+		{
+			const toInt_t<uint8_t> value{digits.data() + (offset * 2U), 2U};
+			if (!value.isHex())
+				return std::nullopt;
+			result[offset] = value.fromHex();
+		}
+		return result;
+	}
+
+	[[nodiscard]] static uint8_t byteSum(const std::vector<uint8_t> &data) noexcept
+	{
+		return std::accumulate(data.begin(), data.end(), uint8_t{0U},
+			[](const uint8_t sum, const uint8_t value) { return static_cast<uint8_t>(sum + value); });
+	}
+
+	enum class lineResult_t : uint8_t
+	{
+		next,
+		done,
+		error,
+	};
+
+	// Read the file a chunk at a time, handing each non-empty line in it to the handler
+	template<typename handler_t> [[nodiscard]] static bool forEachLine(const fd_t &file, handler_t &&handler)
+	{
+		std::vector<char> chunk(readChunkLength);
+		std::string line{};
+		size_t lineNumber{0U};
+		const auto processLine
+		{
+			[&]() -> lineResult_t
+			{
+				++lineNumber;
+				// Strip any trailing whitespace, including the '\r' from CRLF line endings
+				const auto end{line.find_last_not_of(" \t\r")};
+				const std::string_view content{line.data(), end == std::string::npos ? 0U : end + 1U};
+				if (content.empty())
+					return lineResult_t::next;
+				const auto result{handler(content)};
+				if (result == lineResult_t::error)
+					console.error("Invalid record on line "sv, lineNumber, " of input file"sv);
+				return result;
+			}
+		};
+
+		while (true)
+		{
+			size_t amount{0U};
+			if (!file.read(chunk.data(), chunk.size(), &amount))
+			{
+				console.error("Failed to read data from input file"sv);
+				return false;
+			}
+			if (amount == 0U)
+				break;
+			for (const auto value : span<const char>{chunk.data(), amount})
+			{
+				if (value != '\n')
+				{
+					line.push_back(value);
+					continue;
+				}
+				const auto result{processLine()};
+				if (result != lineResult_t::next)
+					return result == lineResult_t::done;
+				line.clear();
+			}
+		}
+		// Deal with the file not ending in a newline
+		return processLine() != lineResult_t::error;
+	}
+
+	[[nodiscard]] static bool parseIntelHex(const fd_t &file, extentBuilder_t &builder)
+	{
+		uint32_t baseAddress{0U};
+		// Whether the base address came from an extended segment address record rather than a linear one
+		bool segmentAddressing{false};
+		const auto result
+		{
+			forEachLine(file, [&](const std::string_view &line) -> lineResult_t
+			{
+				if (line[0] != ':')
+					return lineResult_t::error;
+				// A record is a length byte, 16-bit address, record type, the data and a checksum
+				const auto record{decodeHex(line.substr(1U))};
+				if (!record || record->size() < 5U || record->size() != (*record)[0] + 5U || byteSum(*record) != 0U)
+					return lineResult_t::error;
+				const span<const uint8_t> data{record->data() + 4U, (*record)[0]};
+				switch ((*record)[3])
+				{
+					// Data
+					case 0x00U:
+					{
+						const auto offset{static_cast<uint32_t>(((*record)[1] << 8U) | (*record)[2])};
+						// With a segment address, data running off the end of the 64KiB segment wraps back
+						// around to its start rather than carrying on into the next one
+						const auto leading
+							{segmentAddressing ? std::min<size_t>(data.size(), 0x10000U - offset) : data.size()};
+						if (!builder.append(baseAddress + offset, data.subspan(0U, leading)) ||
+							(leading != data.size() && !builder.append(baseAddress, data.subspan(leading))))
+							return lineResult_t::error;
+						return lineResult_t::next;
+					}
+					// End of file
+					case 0x01U:
+						return lineResult_t::done;
+					// Extended segment address and extended linear address
+					case 0x02U:
+					case 0x04U:
+					{
+						if (data.size() != 2U)
+							return lineResult_t::error;
+						segmentAddressing = (*record)[3] == 0x02U;
+						const auto shift{segmentAddressing ? 4U : 16U};
+						baseAddress = static_cast<uint32_t>((data[0] << 8U) | data[1]) << shift;
+						return lineResult_t::next;
+					}
+					// Start segment address and start linear address, which don't matter for Flash contents
+					case 0x03U:
+					case 0x05U:
+						return lineResult_t::next;
+					default:
+						return lineResult_t::error;
+				}
+			})
+		};
+		return result && builder.flush();
+	}
+
+	[[nodiscard]] static bool parseSRecord(const fd_t &file, extentBuilder_t &builder)
+	{
+		const auto result
+		{
+			forEachLine(file, [&](const std::string_view &line) -> lineResult_t
+			{
+				if (line.size() < 2U || line[0] != 'S' || line[1] < '0' || line[1] > '9')
+					return lineResult_t::error;
+				const auto type{static_cast<uint8_t>(line[1] - '0')};
+				// A record is a count byte, the address, the data and a checksum that is the ones'
+				// complement of the sum of everything before it
+				const auto record{decodeHex(line.substr(2U))};
+				if (!record || record->size() < 3U || record->size() != (*record)[0] + 1U || byteSum(*record) != 0xffU)
+					return lineResult_t::error;
+
+				switch (type)
+				{
+					// Data records with 16, 24 and 32-bit addresses
+					case 1U:
+					case 2U:
+					case 3U:
+					{
+						const size_t addressLength{type + 1U};
+						if (record->size() < addressLength + 2U)
+							return lineResult_t::error;
+						uint32_t address{0U};
+						for (const auto &byte : span<const uint8_t>{record->data() + 1U, addressLength})
+							address = (address << 8U) | byte;
+						const span<const uint8_t> data{record->data() + 1U + addressLength,
+							record->size() - addressLength - 2U};
+						return builder.append(address, data) ? lineResult_t::next : lineResult_t::error;
+					}
+					// Termination records with 32, 24 and 16-bit start addresses
+					case 7U:
+					case 8U:
+					case 9U:
+						return lineResult_t::done;
+					// Header and record count records carry nothing we need
+					default:
+						return lineResult_t::next;
+				}
+			})
+		};
+		return result && builder.flush();
+	}
+
+	[[nodiscard]] static bool parseUF2(const fd_t &file, extentBuilder_t &builder)
+	{
+		std::array<uint8_t, uf2BlockLength> block{};
+		const span<const uint8_t> blockData{block.data(), block.size()};
+		for (size_t blockNumber{0U};; ++blockNumber)
+		{
+			size_t amount{0U};
+			if (!file.read(block.data(), block.size(), &amount))
+			{
+				console.error("Failed to read data from input file"sv);
+				return false;
+			}
+			if (amount == 0U)
+				break;
+			if (amount != block.size() ||
+				readLE<uint32_t>(blockData.subspan(0, 4)) != uf2Magic0 ||
+				readLE<uint32_t>(blockData.subspan(4, 4)) != uf2Magic1 ||
+				readLE<uint32_t>(blockData.subspan(uf2BlockLength - 4U, 4)) != uf2MagicEnd)
+			{
+				console.error("Invalid UF2 block "sv, blockNumber, " in input file"sv);
+				return false;
+			}
+
+			const auto flags{readLE<uint32_t>(blockData.subspan(8, 4))};
+			const auto address{readLE<uint32_t>(blockData.subspan(12, 4))};
+			const auto payloadLength{readLE<uint32_t>(blockData.subspan(16, 4))};
+			if (payloadLength > uf2MaxPayloadLength)
+			{
+				console.error("Invalid payload length in UF2 block "sv, blockNumber, " in input file"sv);
+				return false;
+			}
+			if (flags & uf2FlagNotMainFlash)
+				continue;
+			if (!builder.append(address, blockData.subspan(uf2DataOffset, payloadLength)))
+				return false;
+		}
+		return builder.flush();
+	}
+
+	[[nodiscard]] static bool parseBinary(const fd_t &file, const extentSink_t &sink)
+	{
+		// Raw images can be far bigger than SPI Flash, such as when they're of SD cards, so this can't stop at 4GiB
+		for (uint64_t address{0U};;)
+		{
+			extent_t extent{address, std::vector<uint8_t>(maxExtentLength)};
+			size_t amount{0U};
+			if (!file.read(extent.data.data(), extent.data.size(), &amount))
+			{
+				console.error("Failed to read data block from input file"sv);
+				return false;
+			}
+			if (amount == 0U)
+				return true;
+			extent.data.resize(amount);
+			address += amount;
+			if (!sink(std::move(extent)))
+				return false;
+		}
+	}
+
+	bool parse(const format_t format, const fd_t &file, const extentSink_t &sink)
+	{
+		extentBuilder_t builder{sink};
+		switch (format)
+		{
+			case format_t::binary:
+				return parseBinary(file, sink);
+			case format_t::intelHex:
+				return parseIntelHex(file, builder);
+			case format_t::srec:
+				return parseSRecord(file, builder);
+			case format_t::uf2:
+				return parseUF2(file, builder);
+		}
+		return false;
+	}
+
+	extentReader_t::~extentReader_t() noexcept
+	{
+		// Make sure the parser thread isn't left blocked on a full queue before waiting for it
+		{
+			const std::lock_guard lock{_lock};
+			_stopping = true;
+		}
+		_spaceAvailable.notify_all();
+		if (_thread.joinable())
+			_thread.join();
+	}
+
+	bool extentReader_t::open(const path &fileName)
+	{
+		fd_t file{fileName, O_RDONLY | O_NOCTTY};
+		if (!file.valid() || file.length() < 0)
+		{
+			console.error("Failed to open input file"sv);
+			return false;
+		}
+		_fileLength = static_cast<size_t>(file.length());
+		_format = detectFormat(fileName, file);
+		_thread = std::thread
+		{
+			[this](const fd_t inputFile)
+			{
+				const trace::span_t span{"file"sv, "parse input"sv};
+				finish(parse(_format, inputFile, [this](extent_t &&extent) { return push(std::move(extent)); }));
+			},
+			std::move(file)
+		};
+		return true;
+	}
+
+	bool extentReader_t::push(extent_t &&extent)
+	{
+		std::unique_lock lock{_lock};
+		_spaceAvailable.wait(lock, [this]() { return _stopping || _extents.size() < extentQueueDepth; });
+		if (_stopping)
+			return false;
+		_dataLength += extent.data.size();
+		_extents.emplace_back(std::move(extent));
+		lock.unlock();
+		_extentAvailable.notify_one();
+		return true;
+	}
+
+	void extentReader_t::finish(const bool succeeded)
+	{
+		{
+			const std::lock_guard lock{_lock};
+			_finished = true;
+			_succeeded = succeeded;
+		}
+		_extentAvailable.notify_all();
+	}
+
+	std::optional<extent_t> extentReader_t::next()
+	{
+		std::unique_lock lock{_lock};
+		_extentAvailable.wait(lock, [this]() { return _finished || !_extents.empty(); });
+		if (_extents.empty())
+			return std::nullopt;
+		auto extent{std::move(_extents.front())};
+		_extents.pop_front();
+		lock.unlock();
+		_spaceAvailable.notify_one();
+		return extent;
+	}
+
+	bool extentReader_t::succeeded() noexcept
+	{
+		const std::lock_guard lock{_lock};
+		return _finished && _succeeded;
+	}
+
+	size_t extentReader_t::dataLength() noexcept
+	{
+		const std::lock_guard lock{_lock};
+		return _dataLength;
+	}
+} // namespace bmpflash::imageFormats
@@ -7,25 +7,70 @@
 #include <cstdint>
 #include <vector>
 #include <optional>
+#include <string>
 #include <string_view>
+#include <future>
+#include <filesystem>
 #include <substrate/command_line/arguments>
 #include "usbDevice.hxx"
 #include "bmp.hxx"
+#include "spiFlash.hxx"
+#include "session.hxx"
+#include "imageFormats.hxx"
+#include "manifest.hxx"
 
 namespace bmpflash
 {
 	using substrate::commandLine::arguments_t;
 	using substrate::commandLine::flag_t;
 	using substrate::commandLine::choice_t;
+	using std::filesystem::path;
+
+	// What to report about a read or write once it's done, beyond what goes to the console
+	struct reportOptions_t final
+	{
+		// Write digests of the data to a sidecar file next to the file read into or written from
+		bool digest{false};
+		// Write statistics about the operation, including the data's digests, to this file as JSON
+		std::optional<path> statsFile{};
+
+		[[nodiscard]] bool wanted() const noexcept { return digest || statsFile; }
+	};
+
+	// Read length bytes from address in the target Flash into the given file
+	[[nodiscard]] bool readFlash(const bmp_t &probe, flashTarget_t &target, const path &fileName, size_t address,
+		size_t length, const reportOptions_t &report = {});
+	/*
+	 * The input to a write. Opening it starts the file being decoded and any previous manifest being loaded
+	 * in the background, so doing this before bringing up the probe overlaps that work with the probe handshake
+	 * and Flash discovery rather than leaving it all to happen afterwards.
+	 */
+	struct writeInput_t final
+	{
+		imageFormats::extentReader_t reader{};
+		path fileName{};
+		std::optional<path> manifestFile{};
+		std::future<std::optional<manifest::manifest_t>> previousManifest{};
+
+		[[nodiscard]] bool open(const path &inputFile, const std::optional<path> &manifestFileName);
+	};
+
+	// Write the contents of the opened input into the target Flash, optionally using and updating a sector manifest
+	[[nodiscard]] bool writeFlash(const bmp_t &probe, flashTarget_t &target, std::string_view serialNumber,
+		writeInput_t &input, const reportOptions_t &report = {});
 
 	[[nodiscard]] std::optional<usbDevice_t> filterDevices(const std::vector<usbDevice_t> &devices,
 		std::optional<std::string_view> deviceSerialNumber) noexcept;
 	[[nodiscard]] int32_t displayInfo(const std::vector<usbDevice_t> &devices, const arguments_t &infoArguments);
 
 	[[nodiscard]] bool displaySFDP(const usbDevice_t &device, const arguments_t &sfdpArguments);
+	[[nodiscard]] bool displaySFDPFromFile(const arguments_t &sfdpArguments);
 	[[nodiscard]] bool provision(const usbDevice_t &device, const arguments_t &provisionArguments);
+	[[nodiscard]] bool provisionToFile(const arguments_t &provisionArguments);
 	[[nodiscard]] bool read(const usbDevice_t &device, const arguments_t &readArguments);
 	[[nodiscard]] bool write(const usbDevice_t &device, const arguments_t &writeArguments);
+	[[nodiscard]] bool runBatch(const usbDevice_t &device, const arguments_t &batchArguments);
+	[[nodiscard]] bool runReplay(const arguments_t &replayArguments);
 } // namespace bmpflash
 
 #endif /*ACTIONS_HXX*/
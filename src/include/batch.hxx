@@ -0,0 +1,66 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// SPDX-FileCopyrightText: 2023 1BitSquared <info@1bitsquared.com>
+#ifndef BATCH_HXX
+#define BATCH_HXX
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <optional>
+#include <vector>
+#include <filesystem>
+#include "usbDevice.hxx"
+#include "bmp.hxx"
+#include "session.hxx"
+#include "provisionELF.hxx"
+
+namespace bmpflash::batch
+{
+	using std::filesystem::path;
+
+	enum class operation_t : uint8_t
+	{
+		sfdp,
+		read,
+		write,
+		provision,
+	};
+
+	// A single operation from a job file, along with everything needed to run it
+	struct job_t final
+	{
+		size_t lineNumber{};
+		std::string description{};
+		operation_t operation{operation_t::sfdp};
+		spiBus_t bus{spiBus_t::none};
+		path fileName{};
+		size_t address{0U};
+		std::optional<size_t> length{};
+		std::optional<path> manifestFile{};
+		std::optional<path> saveFile{};
+		bool displayRaw{false};
+		std::vector<elf::imageSpec_t> images{};
+	};
+
+	/*
+	 * Job files hold one operation per line, with the same meaning as the equivalent action:
+	 *
+	 *   sfdp <bus> [raw] [save=<file>]
+	 *   read <bus> <file> [address=<offset>] [length=<length>]
+	 *   write <bus> <file> [manifest=<file>]
+	 *   provision <file>[@<offset>] [<file>[@<offset>] ...]
+	 *
+	 * Where <bus> is one of 'int'/'internal' or 'ext'/'external', and numbers are either decimal or
+	 * hexadecimal with a '0x' prefix. Arguments containing spaces may be wrapped in double quotes.
+	 * Blank lines are ignored, as is anything after a '#'.
+	 */
+	[[nodiscard]] std::optional<std::vector<job_t>> parseJobFile(const path &fileName);
+	// Parse a single operation in the job file syntax
+	[[nodiscard]] std::optional<job_t> parseJob(std::string_view line, size_t lineNumber = 0U);
+
+	// Run the given job using the session, switching to the bus it needs
+	[[nodiscard]] bool runJob(flashSession_t &session, const job_t &job);
+} // namespace bmpflash::batch
+
+#endif /*BATCH_HXX*/
@@ -7,8 +7,11 @@
 #include <string>
 #include <string_view>
 #include <exception>
+#include <substrate/span>
 #include "usbDevice.hxx"
 #include "spiFlash.hxx"
+#include "capture.hxx"
+#include "cancellation.hxx"
 #ifdef _WIN32
 #include "windows/serialInterface.hxx"
 #else
@@ -45,17 +48,27 @@ struct bmp_t final
 {
 private:
 	serialInterface_t device{};
+	bmpflash::capture::replayInterface_t replay{};
 	spiBus_t _spiBus{spiBus_t::none};
 	spiDevice_t _spiDevice{spiDevice_t::none};
+	bmpflash::cancellationToken_t _cancellation{bmpflash::interruptToken()};
 
 	bmp_t() noexcept = default;
 
+	void writePacket(const std::string_view &packet) const;
+	// Read back a response, allowing extra time for how much data we expect the probe to send us
+	[[nodiscard]] std::string readPacket(size_t expectedLength = 0U) const;
+
 public:
 	constexpr static uint16_t vid{0x1d50U};
 	constexpr static uint16_t pid{0x6018U};
 	constexpr static size_t maxPacketSize{1024U};
+	// The most a block transfer can move, with the data hex encoded in both the request and the response
+	constexpr static size_t maxTransferLength{(maxPacketSize - 10U) / 2U};
 
 	bmp_t(const usbDevice_t &usbDevice);
+	// Talk to a replayed capture of a session with a probe rather than a real one
+	bmp_t(const bmpflash::capture::replayInterface_t &replayInterface) noexcept : replay{replayInterface} { }
 	bmp_t(const bmp_t &) noexcept = delete;
 	bmp_t(bmp_t &&probe) noexcept : bmp_t{} { swap(probe); }
 	~bmp_t() noexcept;
@@ -67,8 +80,10 @@ public:
 		return *this;
 	}
 
-	[[nodiscard]] bool valid() const noexcept { return device.valid(); }
+	[[nodiscard]] bool valid() const noexcept { return device.valid() || replay.valid(); }
 	void swap(bmp_t &probe) noexcept;
+	// Have SPI transactions with the probe stop with operationCancelled_t once the token is cancelled
+	void cancellation(const bmpflash::cancellationToken_t &token) noexcept { _cancellation = token; }
 
 	[[nodiscard]] std::string init() const;
 	[[nodiscard]] uint64_t readProtocolVersion() const;
@@ -78,6 +93,15 @@ public:
 	[[nodiscard]] bool read(spiFlashCommand_t command, uint32_t address, void *data, size_t dataLength) const;
 	[[nodiscard]] bool write(spiFlashCommand_t command, uint32_t address, const void *data, size_t dataLength) const;
 	[[nodiscard]] bool runCommand(spiFlashCommand_t command, uint32_t address) const;
+	// Drive the current device's chip select directly, so it can be held across several requests
+	[[nodiscard]] bool select(bool selected) const;
+	// Clock a single byte out to the current device, returning the byte clocked back in from it
+	[[nodiscard]] uint8_t transfer(uint8_t value) const;
+	// Clock a block of bytes out to the current device without touching its chip select, storing the bytes
+	// clocked back in from it. Returns false if the probe's firmware predates block transfers
+	[[nodiscard]] bool transfer(substrate::span<const uint8_t> dataOut, substrate::span<uint8_t> dataIn) const;
+	// Get communications with the probe back into a known state after a protocol error
+	[[nodiscard]] bool recover() const noexcept;
 };
 
 #endif /*BMP_HXX*/
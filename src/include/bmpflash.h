@@ -0,0 +1,102 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/* SPDX-FileCopyrightText: 2023 1BitSquared <info@1bitsquared.com> */
+#ifndef BMPFLASH_H
+#define BMPFLASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32)
+#	ifdef BMPFLASH_BUILD_LIBRARY
+#		define BMPFLASH_API __declspec(dllexport)
+#	else
+#		define BMPFLASH_API __declspec(dllimport)
+#	endif
+#else
+#	define BMPFLASH_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+typedef enum bmpflash_status
+{
+	BMPFLASH_OK = 0,
+	BMPFLASH_ERROR_INVALID_ARGUMENT = -1,
+	BMPFLASH_ERROR_NO_PROBE = -2,
+	BMPFLASH_ERROR_COMMS = -3,
+	BMPFLASH_ERROR_NO_FLASH = -4,
+	BMPFLASH_ERROR_OUT_OF_RANGE = -5,
+	BMPFLASH_ERROR_FLASH = -6,
+	BMPFLASH_ERROR_CANCELLED = -7,
+	BMPFLASH_ERROR_INTERNAL = -8,
+} bmpflash_status_t;
+
+typedef enum bmpflash_bus
+{
+	BMPFLASH_BUS_EXTERNAL = 0,
+	BMPFLASH_BUS_INTERNAL = 1,
+} bmpflash_bus_t;
+
+/* The geometry of the Flash chip found on one of a probe's busses */
+typedef struct bmpflash_geometry
+{
+	uint8_t manufacturer;
+	uint8_t type;
+	uint8_t capacity_id;
+	uint64_t capacity;
+	uint32_t page_size;
+	uint32_t sector_size;
+} bmpflash_geometry_t;
+
+/*
+ * Called as an operation progresses with how many of the total bytes are done so far.
+ * Returning non-zero cancels the operation, which then fails with BMPFLASH_ERROR_CANCELLED.
+ */
+typedef int (*bmpflash_progress_t)(void *context, size_t done, size_t total);
+
+/*
+ * An open session with a probe. A session stays open across calls, so the probe is only set up and the
+ * Flash on each bus only discovered once, however calls on any one session must not be made concurrently.
+ */
+typedef struct bmpflash_session bmpflash_session_t;
+
+/* Turn the library's console logging (off by default) on or off */
+BMPFLASH_API void bmpflash_set_logging(int enabled);
+BMPFLASH_API const char *bmpflash_status_string(bmpflash_status_t status);
+
+/*
+ * Open a session with the probe whose serial number contains the given string, or the only attached
+ * probe if serial_number is NULL
+ */
+BMPFLASH_API bmpflash_status_t bmpflash_open(const char *serial_number, bmpflash_session_t **session);
+BMPFLASH_API void bmpflash_close(bmpflash_session_t *session);
+BMPFLASH_API const char *bmpflash_serial_number(const bmpflash_session_t *session);
+
+BMPFLASH_API bmpflash_status_t bmpflash_get_geometry(bmpflash_session_t *session, bmpflash_bus_t bus,
+	bmpflash_geometry_t *geometry);
+/* Read length bytes starting at address into the caller's buffer */
+BMPFLASH_API bmpflash_status_t bmpflash_read(bmpflash_session_t *session, bmpflash_bus_t bus, uint32_t address,
+	void *buffer, size_t length, bmpflash_progress_t progress, void *context);
+/*
+ * Write length bytes from the caller's buffer starting at address, erasing as needed. Any data sharing
+ * an erase block with the range but outside of it is read back first and preserved.
+ */
+BMPFLASH_API bmpflash_status_t bmpflash_write(bmpflash_session_t *session, bmpflash_bus_t bus, uint32_t address,
+	const void *buffer, size_t length, bmpflash_progress_t progress, void *context);
+/* Erase a range, which must start and end on erase block boundaries */
+BMPFLASH_API bmpflash_status_t bmpflash_erase(bmpflash_session_t *session, bmpflash_bus_t bus, uint32_t address,
+	size_t length, bmpflash_progress_t progress, void *context);
+/*
+ * Cancel the read, write or erase running on the session, which then fails with BMPFLASH_ERROR_CANCELLED.
+ * Safe to call from any thread. If nothing is running, the next operation on the session is cancelled instead.
+ */
+BMPFLASH_API void bmpflash_cancel(bmpflash_session_t *session);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*BMPFLASH_H*/
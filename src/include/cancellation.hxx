@@ -0,0 +1,46 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// SPDX-FileCopyrightText: 2023 1BitSquared <info@1bitsquared.com>
+#ifndef CANCELLATION_HXX
+#define CANCELLATION_HXX
+
+#include <atomic>
+#include <memory>
+#include <exception>
+
+namespace bmpflash
+{
+	struct operationCancelled_t final : std::exception
+	{
+		[[nodiscard]] const char *what() const noexcept final;
+	};
+
+	/*
+	 * A request to stop whatever's being done with a probe, which may be made from any thread (or a signal handler).
+	 * Copies share the one request, so a copy can be handed to a probe while another is kept to cancel it with.
+	 * Cancellation is checked before each SPI transaction is sent to the probe, so the remote protocol is never
+	 * left part way through a packet and the probe can always be cleanly ended afterwards.
+	 */
+	struct cancellationToken_t final
+	{
+	private:
+		std::shared_ptr<std::atomic<bool>> _cancelled{std::make_shared<std::atomic<bool>>(false)};
+
+	public:
+		void cancel() const noexcept { _cancelled->store(true); }
+		void reset() const noexcept { _cancelled->store(false); }
+		[[nodiscard]] bool cancelled() const noexcept { return _cancelled->load(std::memory_order_relaxed); }
+
+		void throwIfCancelled() const
+		{
+			if (cancelled())
+				throw operationCancelled_t{};
+		}
+	};
+
+	// The token cancelled by the user interrupting bmpflash, which probes use unless handed another
+	[[nodiscard]] const cancellationToken_t &interruptToken() noexcept;
+	// Have the first SIGINT cancel interruptToken() rather than kill bmpflash outright - a second still does
+	void installInterruptHandler() noexcept;
+} // namespace bmpflash
+
+#endif /*CANCELLATION_HXX*/
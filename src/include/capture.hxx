@@ -0,0 +1,132 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// SPDX-FileCopyrightText: 2023 1BitSquared <info@1bitsquared.com>
+#ifndef CAPTURE_HXX
+#define CAPTURE_HXX
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <optional>
+#include <filesystem>
+
+/*
+ * Captures of remote protocol sessions with a probe, and replaying them back to bmp_t in place of a real probe.
+ *
+ * A capture file is a text file holding one packet per line, with lines starting '#' being comments:
+ *
+ *   > <microseconds since the previous response> <request>
+ *   < <microseconds since the request> <response>
+ *   ! <microseconds since the request>
+ *
+ * Where '!' marks a request the probe failed to respond to. As the capture is a single stream of packets,
+ * only sessions with a single probe can be meaningfully captured.
+ */
+namespace bmpflash::capture
+{
+	using std::filesystem::path;
+	using std::chrono::microseconds;
+
+	inline std::atomic<bool> recording{false};
+
+	[[nodiscard]] inline bool enabled() noexcept { return recording.load(std::memory_order_relaxed); }
+
+	// Begin capturing all traffic with the probe into the given file, returning false if it could not be opened
+	[[nodiscard]] bool start(const path &fileName);
+	void stop() noexcept;
+
+	void recordRequest(std::string_view request) noexcept;
+	void recordResponse(std::string_view response, bool succeeded) noexcept;
+
+	// Called by the serial interface as each packet goes out to the probe
+	inline void requestSent(const std::string_view request) noexcept
+	{
+		if (enabled())
+			recordRequest(request);
+	}
+
+	// Called by the serial interface as each response comes back
+	inline void responseReceived(const std::string_view response, const bool succeeded = true) noexcept
+	{
+		if (enabled())
+			recordResponse(response, succeeded);
+	}
+
+	// Keeps a capture going for as long as it lives, stopping it when it goes out of scope
+	struct recording_t final
+	{
+	private:
+		bool _valid;
+
+	public:
+		recording_t(const path &fileName) : _valid{start(fileName)} { }
+		recording_t(const recording_t &) = delete;
+		recording_t(recording_t &&) = delete;
+		recording_t &operator =(const recording_t &) = delete;
+		recording_t &operator =(recording_t &&) = delete;
+
+		~recording_t() noexcept
+		{
+			if (_valid)
+				stop();
+		}
+
+		[[nodiscard]] bool valid() const noexcept { return _valid; }
+	};
+
+	enum class direction_t : uint8_t
+	{
+		request,
+		response,
+		failure,
+	};
+
+	struct packet_t final
+	{
+		direction_t direction{direction_t::request};
+		microseconds delay{};
+		std::string data{};
+	};
+
+	// A loaded capture and how far through replaying it we are
+	struct replayState_t final
+	{
+		std::vector<packet_t> packets{};
+		size_t position{0U};
+		bool realTime{false};
+		bool diverged{false};
+	};
+
+	/*
+	 * Stands in for the serial interface to a probe, checking each request made matches the next one
+	 * in the capture and serving back the response the probe gave to it. Optionally, the time the probe
+	 * took to respond to each request is reproduced too, so timing-sensitive changes can be benchmarked.
+	 * Copies share their place in the capture, so a session that ends and begins again carries on from
+	 * where it left off, just as the capture did.
+	 */
+	struct replayInterface_t final
+	{
+	private:
+		std::shared_ptr<replayState_t> _state{};
+
+	public:
+		replayInterface_t() noexcept = default;
+		replayInterface_t(std::vector<packet_t> &&packets, bool realTime);
+
+		[[nodiscard]] bool valid() const noexcept { return _state != nullptr; }
+		void swap(replayInterface_t &interface) noexcept { _state.swap(interface._state); }
+		// Whether every packet in the capture has been replayed
+		[[nodiscard]] bool complete() const noexcept { return !_state || _state->position == _state->packets.size(); }
+
+		void writePacket(const std::string_view &packet) const;
+		[[nodiscard]] std::string readPacket() const;
+	};
+
+	[[nodiscard]] std::optional<replayInterface_t> load(const path &fileName, bool realTime);
+} // namespace bmpflash::capture
+
+#endif /*CAPTURE_HXX*/
@@ -16,21 +16,22 @@ namespace bmpflash
 	template<typename T, typename... U> constexpr std::enable_if_t<sizeof...(U) != 0, uint32_t>
 		calcPolynomial(T bit, U ...bits) noexcept { return calcPolynomial(bit) | calcPolynomial(bits...); }
 
+	/*
+	 * CRC-32 (as used by zlib, Ethernet, etc) over data in memory. The work is done by the fastest engine
+	 * the host CPU supports, picked on first use: carry-less multiply folding on x86 CPUs with PCLMULQDQ,
+	 * the CRC32 instructions on ARMv8 CPUs that have them, and slice-by-16 tables everywhere else. All give
+	 * results identical to the plain byte-at-a-time table algorithm.
+	 */
 	struct crc32_t final
 	{
-	private:
 		constexpr static uint32_t poly = calcPolynomial(0U, 1U, 2U, 4U, 5U, 7U, 8U, 10U, 11U, 12U, 16U, 22U, 23U, 26U);
 		static_assert(poly == UINT32_C(0xedb88320), "Polynomial calculation failure");
-		static std::array<const uint32_t, 256> crcTable;
 
-	public:
-		static void crc(uint32_t &crc, const substrate::span<const uint8_t> data) noexcept
-		{
-			crc ^= UINT32_C(0xffffffff);
-			for (const auto &item : data)
-				crc = crcTable[uint8_t(crc ^ item)] ^ (crc >> 8U);
-			crc ^= UINT32_C(0xffffffff);
-		}
+		// Update crc (starting from 0 for a fresh CRC) with the given data
+		static void crc(uint32_t &crc, substrate::span<const uint8_t> data) noexcept;
+		// Given the CRCs of two consecutive blocks of data, and the length of the second, compute the CRC
+		// of both blocks together. This lets pieces of a larger block be CRC'd independently and then merged
+		[[nodiscard]] static uint32_t combine(uint32_t crcA, uint32_t crcB, uint64_t lengthB) noexcept;
 
 		crc32_t() = delete;
 	};
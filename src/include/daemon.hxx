@@ -0,0 +1,29 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// SPDX-FileCopyrightText: 2023 1BitSquared <info@1bitsquared.com>
+#ifndef DAEMON_HXX
+#define DAEMON_HXX
+
+#include <optional>
+#include <vector>
+#include <string_view>
+#include <filesystem>
+#include <substrate/command_line/arguments>
+#include "usbDevice.hxx"
+
+namespace bmpflash::daemon
+{
+	using std::filesystem::path;
+	using substrate::commandLine::arguments_t;
+
+	// The socket the daemon listens on unless told otherwise - $XDG_RUNTIME_DIR/bmpflash.sock,
+	// or a per-user socket in /tmp
+	[[nodiscard]] std::optional<path> defaultSocketPath();
+	// Keep sessions to the given probes open, serving requests for them until asked to shut down
+	[[nodiscard]] bool serve(const std::vector<usbDevice_t> &devices, const arguments_t &serveArguments);
+	// Handle `serve --status` and `serve --stop`, which talk to an already running daemon
+	[[nodiscard]] bool control(const arguments_t &serveArguments);
+	// Hand the read, write or provision action described by the arguments to a running daemon to perform
+	[[nodiscard]] bool request(std::string_view action, const arguments_t &actionArguments);
+} // namespace bmpflash::daemon
+
+#endif /*DAEMON_HXX*/
@@ -0,0 +1,110 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// SPDX-FileCopyrightText: 2023 1BitSquared <info@1bitsquared.com>
+#ifndef DIGEST_HXX
+#define DIGEST_HXX
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <vector>
+#include <deque>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <filesystem>
+#include <substrate/span>
+#include "progress.hxx"
+
+namespace bmpflash::digest
+{
+	using std::filesystem::path;
+
+	// An incremental SHA-256 implementation for hashing data as it streams past
+	struct sha256_t final
+	{
+	private:
+		std::array<uint32_t, 8U> _state;
+		std::array<uint8_t, 64U> _block{};
+		size_t _blockUsed{0U};
+		uint64_t _length{0U};
+
+		void processBlock(const uint8_t *block) noexcept;
+
+	public:
+		sha256_t() noexcept;
+
+		void update(substrate::span<const uint8_t> data) noexcept;
+		[[nodiscard]] std::array<uint8_t, 32U> finish() noexcept;
+	};
+
+	struct sectorCRC_t final
+	{
+		uint64_t address{};
+		uint32_t crc{};
+	};
+
+	// Everything computed over the data that went through a read or write
+	struct digest_t final
+	{
+		uint64_t length{0U};
+		uint32_t crc32{0U};
+		std::array<uint8_t, 32U> sha256{};
+		size_t sectorSize{0U};
+		std::vector<sectorCRC_t> sectors{};
+	};
+
+	/*
+	 * Hashes data on a background thread as a read or write streams it through, so the digests are ready as
+	 * soon as the USB transfers are done rather than the data having to be read back from disk afterwards.
+	 * Chunks are copied into a small bounded queue, so hashing falling behind holds up the transfers rather
+	 * than building up memory use. Per-sector CRCs cover whatever bytes of each sector the data touched.
+	 * The data must be pushed in address order, which is why sparse inputs can't be digested.
+	 */
+	struct digestWorker_t final
+	{
+	private:
+		struct chunk_t final
+		{
+			uint64_t address{};
+			std::vector<uint8_t> data{};
+		};
+
+		size_t _sectorSize;
+		std::mutex _lock{};
+		std::condition_variable _spaceAvailable{};
+		std::condition_variable _chunkAvailable{};
+		std::deque<chunk_t> _chunks{};
+		bool _finished{false};
+		std::optional<std::string> _failure{};
+		digest_t _digest{};
+		sha256_t _sha256{};
+		std::thread _thread;
+
+		void run();
+		void hash(const chunk_t &chunk);
+
+	public:
+		digestWorker_t(size_t sectorSize);
+		digestWorker_t(const digestWorker_t &) = delete;
+		digestWorker_t(digestWorker_t &&) = delete;
+		~digestWorker_t() noexcept;
+		digestWorker_t &operator =(const digestWorker_t &) = delete;
+		digestWorker_t &operator =(digestWorker_t &&) = delete;
+
+		// Queue a copy of the data that lives at the given address for hashing
+		void push(uint64_t address, substrate::span<const uint8_t> data);
+		// Wait for everything queued to be hashed, and hand back the results if hashing succeeded
+		[[nodiscard]] std::optional<digest_t> finish();
+	};
+
+	// Write the digest to a sidecar file next to the one the data came from or went to
+	[[nodiscard]] bool writeSidecar(const path &fileName, const digest_t &digest);
+	// Write the operation's statistics, along with the digest of the data if there is one, out as a JSON document
+	[[nodiscard]] bool writeStats(const path &statsFile, std::string_view operation, const path &fileName,
+		const progress::stats_t &stats, const digest_t *digest);
+} // namespace bmpflash::digest
+
+#endif /*DIGEST_HXX*/
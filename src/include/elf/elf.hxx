@@ -4,9 +4,11 @@
 #ifndef ELF_HXX
 #define ELF_HXX
 
+#include <cstddef>
 #include <variant>
 #include <vector>
 #include <memory>
+#include <iterator>
 #include <substrate/fd>
 #include <substrate/mmap>
 #include <substrate/span>
@@ -30,13 +32,82 @@ namespace bmpflash::elf
 			{ return {map.address<uint8_t>(), map.length()}; }
 	} // namespace internal
 
+	/*
+	 * A view over one of the header tables in an ELF file. The headers are only decoded from the
+	 * backing storage as they are accessed, so opening a file with tens of thousands of sections
+	 * costs nothing up front, and walking them involves no copying.
+	 */
+	template<typename header_t> struct headerTable_t final
+	{
+	private:
+		span<uint8_t> _table{};
+		size_t _entrySize{0U};
+		class_t _elfClass{class_t::elf32Bit};
+		endian_t _endian{endian_t::little};
+
+	public:
+		struct iterator_t final
+		{
+		private:
+			const headerTable_t *_table;
+			size_t _index;
+
+		public:
+			using iterator_category = std::forward_iterator_tag;
+			using value_type = header_t;
+			using difference_type = std::ptrdiff_t;
+			using pointer = void;
+			using reference = header_t;
+
+			constexpr iterator_t(const headerTable_t &table, const size_t index) noexcept :
+				_table{&table}, _index{index} { }
+
+			[[nodiscard]] header_t operator *() const noexcept { return (*_table)[_index]; }
+			constexpr iterator_t &operator ++() noexcept
+			{
+				++_index;
+				return *this;
+			}
+
+			[[nodiscard]] constexpr bool operator ==(const iterator_t &other) const noexcept
+				{ return _table == other._table && _index == other._index; }
+			[[nodiscard]] constexpr bool operator !=(const iterator_t &other) const noexcept
+				{ return !(*this == other); }
+		};
+
+		constexpr headerTable_t() noexcept = default;
+
+		// If the table described doesn't fit in the file, or its entries are too short, this results in an empty table
+		headerTable_t(const span<uint8_t> &data, const uint64_t offset, const size_t entrySize, const size_t count,
+			const class_t elfClass, const endian_t endian) noexcept : _entrySize{entrySize}, _elfClass{elfClass},
+			_endian{endian}
+		{
+			if (count == 0U || entrySize < header_t::size(elfClass) || offset > data.size() ||
+				count > (data.size() - offset) / entrySize)
+				return;
+			_table = {data.data() + offset, count * entrySize};
+		}
+
+		[[nodiscard]] size_t size() const noexcept { return _entrySize ? _table.size() / _entrySize : 0U; }
+		[[nodiscard]] bool empty() const noexcept { return _table.empty(); }
+
+		[[nodiscard]] header_t operator [](const size_t index) const noexcept
+		{
+			return header_t::from(span<uint8_t>{_table.data() + (index * _entrySize), _entrySize},
+				_elfClass, _endian);
+		}
+
+		[[nodiscard]] iterator_t begin() const noexcept { return {*this, 0U}; }
+		[[nodiscard]] iterator_t end() const noexcept { return {*this, size()}; }
+	};
+
 	struct elf_t final
 	{
 	private:
 		std::variant<mmap_t, fragmentStorage_t> _backingStorage;
 		elfHeader_t _header;
-		std::vector<programHeader_t> _programHeaders{};
-		std::vector<sectionHeader_t> _sectionHeaders{};
+		headerTable_t<programHeader_t> _programHeaders{};
+		headerTable_t<sectionHeader_t> _sectionHeaders{};
 		stringTable_t _sectionNames{};
 
 		template<typename T> T allocate()
@@ -54,9 +125,7 @@ namespace bmpflash::elf
 
 		[[nodiscard]] auto &header() noexcept { return _header; }
 		[[nodiscard]] const auto &header() const noexcept { return _header; }
-		[[nodiscard]] auto &programHeaders() noexcept { return _programHeaders; }
 		[[nodiscard]] const auto &programHeaders() const noexcept { return _programHeaders; }
-		[[nodiscard]] auto &sectionHeaders() noexcept { return _sectionHeaders; }
 		[[nodiscard]] const auto &sectionHeaders() const noexcept { return _sectionHeaders; }
 		[[nodiscard]] auto &sectionNames() noexcept { return _sectionNames; }
 		[[nodiscard]] const auto &sectionNames() const noexcept { return _sectionNames; }
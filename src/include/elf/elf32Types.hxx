@@ -88,6 +88,52 @@ namespace bmpflash::elf::types::elf32
 		[[nodiscard]] constexpr static size_t size() noexcept { return 40U; }
 	};
 
+	/*
+	 * Little endian 32-bit ELF files are by far the most common thing we get handed, so these provide
+	 * a fast path for reading their headers that skips the endian dispatch on every field access
+	 */
+	struct programHeaderLE_t final
+	{
+	private:
+		memory_t _storage;
+
+	public:
+		programHeaderLE_t(const memory_t &storage) : _storage{storage} { }
+
+		[[nodiscard]] auto type() const noexcept { return _storage.readLE<programHeaderType_t>(0); }
+		[[nodiscard]] auto offset() const noexcept { return _storage.readLE<uint32_t>(4); }
+		[[nodiscard]] auto virtualAddress() const noexcept { return _storage.readLE<uint32_t>(8); }
+		[[nodiscard]] auto physicalAddress() const noexcept { return _storage.readLE<uint32_t>(12); }
+		[[nodiscard]] auto fileLength() const noexcept { return _storage.readLE<uint32_t>(16); }
+		[[nodiscard]] auto memoryLength() const noexcept { return _storage.readLE<uint32_t>(20); }
+		[[nodiscard]] auto flags() const noexcept { return _storage.readLE<uint32_t>(24); }
+		[[nodiscard]] auto alignment() const noexcept { return _storage.readLE<uint32_t>(28); }
+
+		[[nodiscard]] constexpr static size_t size() noexcept { return programHeader_t::size(); }
+	};
+
+	struct sectionHeaderLE_t final
+	{
+	private:
+		memory_t _storage;
+
+	public:
+		sectionHeaderLE_t(const memory_t &storage) : _storage{storage} { }
+
+		[[nodiscard]] auto nameOffset() const noexcept { return _storage.readLE<uint32_t>(0); }
+		[[nodiscard]] auto type() const noexcept { return _storage.readLE<sectionHeaderType_t>(4); }
+		[[nodiscard]] flags_t<sectionFlag_t> flags() const noexcept { return {_storage.readLE<uint32_t>(8)}; }
+		[[nodiscard]] auto address() const noexcept { return _storage.readLE<uint32_t>(12); }
+		[[nodiscard]] auto fileOffset() const noexcept { return _storage.readLE<uint32_t>(16); }
+		[[nodiscard]] auto fileLength() const noexcept { return _storage.readLE<uint32_t>(20); }
+		[[nodiscard]] auto link() const noexcept { return _storage.readLE<uint32_t>(24); }
+		[[nodiscard]] auto info() const noexcept { return _storage.readLE<uint32_t>(28); }
+		[[nodiscard]] auto alignment() const noexcept { return _storage.readLE<uint32_t>(32); }
+		[[nodiscard]] auto entityLength() const noexcept { return _storage.readLE<uint32_t>(36); }
+
+		[[nodiscard]] constexpr static size_t size() noexcept { return sectionHeader_t::size(); }
+	};
+
 	struct elfSymbol_t final
 	{
 	private:
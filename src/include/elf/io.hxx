@@ -211,6 +211,9 @@ namespace bmpflash::elf::io
 
 		template<typename T> [[nodiscard]] auto read(const size_t offset, const endian_t endian) const noexcept
 			{ return reader_t<T>{_data.subspan(offset)}.read(endian); }
+
+		template<typename T> [[nodiscard]] auto readLE(const size_t offset) const noexcept
+			{ return reader_t<T>{_data.subspan(offset)}.readLE(); }
 	};
 
 	/** Helper type for std::visit(), allowing match block semantics for interaction with std::variant<>s */
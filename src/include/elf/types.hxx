@@ -51,11 +51,14 @@ namespace bmpflash::elf::types
 	struct programHeader_t final
 	{
 	private:
-		std::variant<elf32::programHeader_t, elf64::programHeader_t> _header;
+		std::variant<elf32::programHeader_t, elf32::programHeaderLE_t, elf64::programHeader_t> _header;
 
 	public:
 		template<typename T> programHeader_t(T header) noexcept : _header{header} { }
 
+		[[nodiscard]] static programHeader_t from(const memory_t &storage, class_t elfClass, endian_t endian) noexcept;
+		[[nodiscard]] static size_t size(class_t elfClass) noexcept;
+
 		[[nodiscard]] programHeaderType_t type() const noexcept;
 		[[nodiscard]] uint32_t flags() const noexcept;
 		[[nodiscard]] uint64_t offset() const noexcept;
@@ -69,11 +72,14 @@ namespace bmpflash::elf::types
 	struct sectionHeader_t final
 	{
 	private:
-		std::variant<elf32::sectionHeader_t, elf64::sectionHeader_t> _header;
+		std::variant<elf32::sectionHeader_t, elf32::sectionHeaderLE_t, elf64::sectionHeader_t> _header;
 
 	public:
 		template<typename T> sectionHeader_t(T header) noexcept : _header{header} { }
 
+		[[nodiscard]] static sectionHeader_t from(const memory_t &storage, class_t elfClass, endian_t endian) noexcept;
+		[[nodiscard]] static size_t size(class_t elfClass) noexcept;
+
 		[[nodiscard]] uint32_t nameOffset() const noexcept;
 		[[nodiscard]] sectionHeaderType_t type() const noexcept;
 		[[nodiscard]] flags_t<sectionFlag_t> flags() const noexcept;
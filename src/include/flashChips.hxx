@@ -0,0 +1,217 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// SPDX-FileCopyrightText: 2023 1BitSquared <info@1bitsquared.com>
+#ifndef FLASH_CHIPS_HXX
+#define FLASH_CHIPS_HXX
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <chrono>
+#include <string_view>
+#include "spiFlash.hxx"
+
+namespace bmpflash::flashChips
+{
+	using namespace std::literals::string_view_literals;
+	using namespace std::literals::chrono_literals;
+	using bmpflash::spiFlash::jedecID_t;
+	using bmpflash::spiFlash::spiFlash_t;
+	using bmpflash::spiFlash::eraseType_t;
+	using bmpflash::spiFlash::timing_t;
+	using bmpflash::spiFlash::opcode_t;
+	using bmpflash::spiFlash::maxEraseTypes;
+
+	// Describes a Flash chip that may not have (usable) SFDP data, so its parameters must be known in advance
+	struct flashChip_t final
+	{
+		uint32_t jedecID{};
+		std::string_view name{};
+		spiFlash_t spiFlash{};
+	};
+
+	constexpr inline uint32_t toJEDECID(const uint8_t manufacturer, const uint8_t type,
+		const uint8_t capacity) noexcept
+		{ return (uint32_t{manufacturer} << 16U) | (uint32_t{type} << 8U) | capacity; }
+
+	constexpr inline uint32_t toJEDECID(const jedecID_t &chipID) noexcept
+		{ return toJEDECID(chipID.manufacturer, chipID.type, chipID.capacity); }
+
+	// NB: For the table, all the parts use 256 byte pages and 1-1-1 fast read (0x0b) with 1 dummy byte
+	constexpr inline flashChip_t flashChip(const uint32_t jedecID, const std::string_view name, const size_t capacity,
+		const std::array<eraseType_t, maxEraseTypes> &eraseTypes, const timing_t &pageProgram,
+		const timing_t &chipErase) noexcept
+	{
+		// The first erase type is always the smallest, so use it as the sector erase
+		spiFlash_t spiFlash{256U, eraseTypes[0].size, eraseTypes[0].opcode, capacity};
+		spiFlash.eraseTypes(eraseTypes);
+		spiFlash.timings({pageProgram, {30us, 50us}, {3us, 12us}, chipErase});
+		spiFlash.readInstruction(uint8_t(opcode_t::fastRead), 1U);
+		return {jedecID, name, spiFlash};
+	}
+
+	// Erase types and timings shared by the families of parts in the table
+	constexpr inline std::array<eraseType_t, maxEraseTypes> winbondEraseTypes
+	{{
+		{4096U, 0x20U, {45ms, 400ms}},
+		{32768U, 0x52U, {120ms, 800ms}},
+		{65536U, 0xd8U, {150ms, 1000ms}},
+	}};
+	constexpr inline timing_t winbondPageProgram{700us, 3ms};
+
+	constexpr inline std::array<eraseType_t, maxEraseTypes> macronixEraseTypes
+	{{
+		{4096U, 0x20U, {60ms, 300ms}},
+		{65536U, 0xd8U, {1s, 2s}},
+	}};
+	constexpr inline timing_t macronixPageProgram{1400us, 5ms};
+
+	constexpr inline std::array<eraseType_t, maxEraseTypes> micronEraseTypes
+		{{{65536U, 0xd8U, {600ms, 3s}}}};
+	constexpr inline std::array<eraseType_t, maxEraseTypes> micronLargeEraseTypes
+		{{{262144U, 0xd8U, {1600ms, 6s}}}};
+	constexpr inline timing_t micronPageProgram{1400us, 5ms};
+
+	constexpr inline std::array<eraseType_t, maxEraseTypes> gigaDeviceEraseTypes
+	{{
+		{4096U, 0x20U, {50ms, 400ms}},
+		{32768U, 0x52U, {160ms, 800ms}},
+		{65536U, 0xd8U, {250ms, 1200ms}},
+	}};
+	constexpr inline timing_t gigaDevicePageProgram{600us, 2400us};
+
+	constexpr inline std::array<eraseType_t, maxEraseTypes> adestoEraseTypes
+	{{
+		{4096U, 0x20U, {50ms, 200ms}},
+		{32768U, 0x52U, {250ms, 600ms}},
+		{65536U, 0xd8U, {400ms, 950ms}},
+	}};
+	constexpr inline timing_t adestoPageProgram{1ms, 5ms};
+
+	constexpr inline std::array<flashChip_t, 35U> flashChips
+	{{
+		// Winbond W25X (pre-SFDP) and early W25Q parts
+		flashChip(0xef3011U, "W25X10"sv, 128U * 1024U, winbondEraseTypes, winbondPageProgram, {1s, 2s}),
+		flashChip(0xef3012U, "W25X20"sv, 256U * 1024U, winbondEraseTypes, winbondPageProgram, {2s, 4s}),
+		flashChip(0xef3013U, "W25X40"sv, 512U * 1024U, winbondEraseTypes, winbondPageProgram, {4s, 8s}),
+		flashChip(0xef3014U, "W25X80"sv, 1024U * 1024U, winbondEraseTypes, winbondPageProgram, {6s, 12s}),
+		flashChip(0xef3015U, "W25X16"sv, 2048U * 1024U, winbondEraseTypes, winbondPageProgram, {10s, 20s}),
+		flashChip(0xef3016U, "W25X32"sv, 4096U * 1024U, winbondEraseTypes, winbondPageProgram, {20s, 40s}),
+		flashChip(0xef3017U, "W25X64"sv, 8192U * 1024U, winbondEraseTypes, winbondPageProgram, {40s, 80s}),
+		flashChip(0xef4014U, "W25Q80"sv, 1024U * 1024U, winbondEraseTypes, winbondPageProgram, {3s, 6s}),
+		flashChip(0xef4015U, "W25Q16"sv, 2048U * 1024U, winbondEraseTypes, winbondPageProgram, {5s, 25s}),
+		flashChip(0xef4016U, "W25Q32"sv, 4096U * 1024U, winbondEraseTypes, winbondPageProgram, {10s, 50s}),
+		flashChip(0xef4017U, "W25Q64"sv, 8192U * 1024U, winbondEraseTypes, winbondPageProgram, {20s, 100s}),
+		flashChip(0xef4018U, "W25Q128"sv, 16384U * 1024U, winbondEraseTypes, winbondPageProgram, {40s, 200s}),
+		// Macronix MX25Lxx05 parts (pre-SFDP)
+		flashChip(0xc22011U, "MX25L1005"sv, 128U * 1024U, macronixEraseTypes, macronixPageProgram, {1s, 2s}),
+		flashChip(0xc22012U, "MX25L2005"sv, 256U * 1024U, macronixEraseTypes, macronixPageProgram, {2s, 4s}),
+		flashChip(0xc22013U, "MX25L4005"sv, 512U * 1024U, macronixEraseTypes, macronixPageProgram, {4s, 8s}),
+		flashChip(0xc22014U, "MX25L8005"sv, 1024U * 1024U, macronixEraseTypes, macronixPageProgram, {8s, 16s}),
+		flashChip(0xc22015U, "MX25L1605"sv, 2048U * 1024U, macronixEraseTypes, macronixPageProgram, {14s, 30s}),
+		flashChip(0xc22016U, "MX25L3205"sv, 4096U * 1024U, macronixEraseTypes, macronixPageProgram, {25s, 50s}),
+		flashChip(0xc22017U, "MX25L6405"sv, 8192U * 1024U, macronixEraseTypes, macronixPageProgram, {50s, 80s}),
+		// Numonyx/Micron M25P parts, which have no 4KiB sector erase
+		flashChip(0x202013U, "M25P40"sv, 512U * 1024U, micronEraseTypes, micronPageProgram, {4500ms, 10s}),
+		flashChip(0x202014U, "M25P80"sv, 1024U * 1024U, micronEraseTypes, micronPageProgram, {8s, 20s}),
+		flashChip(0x202015U, "M25P16"sv, 2048U * 1024U, micronEraseTypes, micronPageProgram, {13s, 40s}),
+		flashChip(0x202016U, "M25P32"sv, 4096U * 1024U, micronEraseTypes, micronPageProgram, {23s, 80s}),
+		flashChip(0x202017U, "M25P64"sv, 8192U * 1024U, micronEraseTypes, micronPageProgram, {68s, 160s}),
+		flashChip(0x202018U, "M25P128"sv, 16384U * 1024U, micronLargeEraseTypes, micronPageProgram, {105s, 250s}),
+		// GigaDevice GD25Q parts
+		flashChip(0xc84013U, "GD25Q40"sv, 512U * 1024U, gigaDeviceEraseTypes, gigaDevicePageProgram, {3s, 10s}),
+		flashChip(0xc84014U, "GD25Q80"sv, 1024U * 1024U, gigaDeviceEraseTypes, gigaDevicePageProgram, {6s, 20s}),
+		flashChip(0xc84015U, "GD25Q16"sv, 2048U * 1024U, gigaDeviceEraseTypes, gigaDevicePageProgram, {12s, 40s}),
+		flashChip(0xc84016U, "GD25Q32"sv, 4096U * 1024U, gigaDeviceEraseTypes, gigaDevicePageProgram, {20s, 80s}),
+		flashChip(0xc84017U, "GD25Q64"sv, 8192U * 1024U, gigaDeviceEraseTypes, gigaDevicePageProgram, {40s, 160s}),
+		// Atmel/Adesto AT25DF parts, where the third ID byte is not the capacity
+		flashChip(0x1f4401U, "AT25DF041A"sv, 512U * 1024U, adestoEraseTypes, adestoPageProgram, {4s, 7s}),
+		flashChip(0x1f4502U, "AT25DF081"sv, 1024U * 1024U, adestoEraseTypes, adestoPageProgram, {8s, 14s}),
+		flashChip(0x1f4602U, "AT25DF161"sv, 2048U * 1024U, adestoEraseTypes, adestoPageProgram, {16s, 28s}),
+		flashChip(0x1f4700U, "AT25DF321"sv, 4096U * 1024U, adestoEraseTypes, adestoPageProgram, {36s, 56s}),
+		flashChip(0x1f4800U, "AT25DF641"sv, 8192U * 1024U, adestoEraseTypes, adestoPageProgram, {64s, 112s}),
+	}};
+
+	// The hash table is the next power of 2 at least twice the size of the chip table
+	constexpr inline size_t chipTableSize
+	{
+		[]() noexcept
+		{
+			size_t size{1U};
+			while (size < flashChips.size() * 2U)
+				size <<= 1U;
+			return size;
+		}()
+	};
+	constexpr inline uint8_t emptySlot{0xffU};
+	static_assert(flashChips.size() < emptySlot, "Flash chip table too large for the hash table index type");
+
+	// FNV-1a over the bytes of the JEDEC ID, with the seed mixed into the offset basis
+	constexpr inline size_t chipHash(const uint32_t jedecID, const uint32_t seed) noexcept
+	{
+		uint32_t hash{UINT32_C(0x811c9dc5) ^ seed};
+		for (size_t shift{0U}; shift < 24U; shift += 8U)
+		{
+			hash ^= (jedecID >> shift) & 0xffU;
+			hash *= UINT32_C(0x01000193);
+		}
+		return hash & (chipTableSize - 1U);
+	}
+
+	// Search for a seed for the hash that maps every chip in the table to a unique slot, making it perfect
+	constexpr inline uint32_t chipHashSeed
+	{
+		[]() noexcept
+		{
+			for (uint32_t seed{0U}; seed < 65536U; ++seed)
+			{
+				std::array<bool, chipTableSize> used{};
+				bool collision{false};
+				for (const auto &chip : flashChips)
+				{
+					const auto slot{chipHash(chip.jedecID, seed)};
+					if (used[slot])
+					{
+						collision = true;
+						break;
+					}
+					used[slot] = true;
+				}
+				if (!collision)
+					return seed;
+			}
+			return UINT32_MAX;
+		}()
+	};
+	static_assert(chipHashSeed != UINT32_MAX, "Failed to find a perfect hash seed for the Flash chip table");
+
+	constexpr inline std::array<uint8_t, chipTableSize> chipTable
+	{
+		[]() noexcept
+		{
+			std::array<uint8_t, chipTableSize> table{};
+			for (auto &slot : table)
+				slot = emptySlot;
+			for (size_t index{0U}; index < flashChips.size(); ++index)
+				table[chipHash(flashChips[index].jedecID, chipHashSeed)] = static_cast<uint8_t>(index);
+			return table;
+		}()
+	};
+
+	constexpr inline const flashChip_t *findFlashChip(const uint32_t jedecID) noexcept
+	{
+		const auto index{chipTable[chipHash(jedecID, chipHashSeed)]};
+		if (index == emptySlot || flashChips[index].jedecID != jedecID)
+			return nullptr;
+		return &flashChips[index];
+	}
+
+	constexpr inline const flashChip_t *findFlashChip(const jedecID_t &chipID) noexcept
+		{ return findFlashChip(toJEDECID(chipID)); }
+
+	// Check the lookup works, noting that a failed lookup dereferencing nullptr is a compile error here
+	static_assert(findFlashChip(0xef4018U)->name == "W25Q128"sv);
+	static_assert(findFlashChip(0x1f4800U)->spiFlash.capacity() == 8U * 1024U * 1024U);
+	static_assert(findFlashChip(0x000000U) == nullptr);
+} // namespace bmpflash::flashChips
+
+#endif /*FLASH_CHIPS_HXX*/
@@ -0,0 +1,99 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// SPDX-FileCopyrightText: 2023 1BitSquared <info@1bitsquared.com>
+#ifndef IMAGE_FORMATS_HXX
+#define IMAGE_FORMATS_HXX
+
+#include <cstdint>
+#include <cstddef>
+#include <string_view>
+#include <optional>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <filesystem>
+#include <substrate/fd>
+
+namespace bmpflash::imageFormats
+{
+	using std::filesystem::path;
+
+	enum class format_t : uint8_t
+	{
+		binary,
+		intelHex,
+		srec,
+		uf2,
+	};
+
+	// A run of contiguous data from an input file, tagged with the Flash address it belongs at
+	struct extent_t final
+	{
+		uint64_t address{};
+		std::vector<uint8_t> data{};
+
+		[[nodiscard]] uint64_t end() const noexcept { return address + data.size(); }
+	};
+
+	using extentSink_t = std::function<bool (extent_t &&)>;
+
+	[[nodiscard]] std::string_view formatName(format_t format) noexcept;
+	// Work out what format a file is in from its extension, falling back on sniffing its first few bytes
+	[[nodiscard]] format_t detectFormat(const path &fileName, const substrate::fd_t &file);
+	// Raw binary covers every byte from 0 to its length, the other formats only describe the data they contain
+	[[nodiscard]] constexpr inline bool isSparse(const format_t format) noexcept
+		{ return format != format_t::binary; }
+	// Guess how many bytes of data a file of the given format and length holds, for progress reporting
+	[[nodiscard]] size_t estimateDataLength(format_t format, size_t fileLength) noexcept;
+	/*
+	 * Parse the file from its current position through to the end, handing each extent found to
+	 * the sink in file order. Adjacent records are merged into extents of up to 64KiB as they go past.
+	 * Parsing stops early with a failure if the sink returns false.
+	 */
+	[[nodiscard]] bool parse(format_t format, const substrate::fd_t &file, const extentSink_t &sink);
+
+	/*
+	 * Runs the parser for a file on a background thread so the input is decoded ahead of and in
+	 * parallel with the USB transfers that consume it. Extents are handed over through a small bounded
+	 * queue so a slow Flash chip doesn't result in the whole file being held in memory.
+	 */
+	struct extentReader_t final
+	{
+	private:
+		format_t _format{format_t::binary};
+		size_t _fileLength{0U};
+		std::mutex _lock{};
+		std::condition_variable _spaceAvailable{};
+		std::condition_variable _extentAvailable{};
+		std::deque<extent_t> _extents{};
+		size_t _dataLength{0U};
+		bool _finished{false};
+		bool _succeeded{false};
+		bool _stopping{false};
+		std::thread _thread{};
+
+		[[nodiscard]] bool push(extent_t &&extent);
+		void finish(bool succeeded);
+
+	public:
+		extentReader_t() noexcept = default;
+		extentReader_t(const extentReader_t &) = delete;
+		extentReader_t(extentReader_t &&) = delete;
+		~extentReader_t() noexcept;
+		extentReader_t &operator =(const extentReader_t &) = delete;
+		extentReader_t &operator =(extentReader_t &&) = delete;
+
+		[[nodiscard]] bool open(const path &fileName);
+		[[nodiscard]] auto format() const noexcept { return _format; }
+		[[nodiscard]] auto fileLength() const noexcept { return _fileLength; }
+		// Get the next extent from the file, or std::nullopt once the file is exhausted or parsing failed
+		[[nodiscard]] std::optional<extent_t> next();
+		// Once next() has returned std::nullopt, these tell if that was due to an error, and how much data there was
+		[[nodiscard]] bool succeeded() noexcept;
+		[[nodiscard]] size_t dataLength() noexcept;
+	};
+} // namespace bmpflash::imageFormats
+
+#endif /*IMAGE_FORMATS_HXX*/
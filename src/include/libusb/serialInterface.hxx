@@ -32,8 +32,9 @@ public:
 	[[nodiscard]] bool valid() const noexcept { return device.valid() && txEndpoint && rxEndpoint; }
 	void swap(serialInterface_t &interface) noexcept;
 
-	void writePacket(const std::string_view &packet) const;
-	[[nodiscard]] std::string readPacket() const;
+	void writePacket(const std::string_view &packet, milliseconds_t timeout) const;
+	[[nodiscard]] std::string readPacket(milliseconds_t timeout) const;
+	void resync() const noexcept;
 };
 
 #endif /*SERIAL_INTERFACE_HXX*/
@@ -0,0 +1,61 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// SPDX-FileCopyrightText: 2023 1BitSquared <info@1bitsquared.com>
+#ifndef MANIFEST_HXX
+#define MANIFEST_HXX
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <map>
+#include <optional>
+#include <filesystem>
+#include "bmp.hxx"
+
+namespace bmpflash::manifest
+{
+	using std::filesystem::path;
+
+	// The length and CRC32 of the contents of a single sector recorded in a manifest
+	struct sectorEntry_t final
+	{
+		uint32_t length{};
+		uint32_t crc{};
+	};
+
+	/*
+	 * A sector manifest records the CRC32 of every Flash sector written by a `write` action,
+	 * tagged with the probe, bus and Flash chip it was written to. Feeding the manifest back in on
+	 * a later write allows sectors whose contents are unchanged to be skipped without having to read
+	 * the chip back first. As the erase granularity can vary across a chip, each sector's length is
+	 * recorded alongside its CRC, and a sector only matches if both agree.
+	 */
+	struct manifest_t final
+	{
+	private:
+		std::string _serialNumber{};
+		spiBus_t _spiBus{spiBus_t::none};
+		spiFlashID_t _chipID{};
+		uint32_t _sectorSize{};
+		std::map<uint32_t, sectorEntry_t> _sectors{};
+
+		[[nodiscard]] bool overlapsSector(uint32_t address, uint32_t length) const noexcept;
+
+	public:
+		manifest_t() noexcept = default;
+		manifest_t(std::string serialNumber, spiBus_t spiBus, spiFlashID_t chipID, uint32_t sectorSize) noexcept;
+
+		[[nodiscard]] static std::optional<manifest_t> load(const path &fileName);
+		[[nodiscard]] bool store(const path &fileName) const;
+
+		[[nodiscard]] auto &serialNumber() const noexcept { return _serialNumber; }
+		[[nodiscard]] auto sectorSize() const noexcept { return _sectorSize; }
+		[[nodiscard]] auto sectors() const noexcept { return _sectors.size(); }
+
+		[[nodiscard]] bool describesSameTarget(const manifest_t &other) const noexcept;
+		[[nodiscard]] bool sectorMatches(uint32_t address, uint32_t length, uint32_t crc) const noexcept;
+		void sector(uint32_t address, uint32_t length, uint32_t crc);
+		void merge(const manifest_t &other);
+	};
+} // namespace bmpflash::manifest
+
+#endif /*MANIFEST_HXX*/
@@ -6,7 +6,9 @@
 
 #include <substrate/console>
 #include <substrate/command_line/options>
+#include <substrate/conversions>
 #include "bmp.hxx"
+#include "provisionELF.hxx"
 
 namespace bmpflash
 {
@@ -25,6 +27,36 @@ namespace bmpflash
 		return std::nullopt;
 	}
 
+	static inline std::optional<std::any> chipIDParser(const std::string_view &value) noexcept
+	{
+		const substrate::toInt_t<uint32_t> jedecID{value.data(), value.size()};
+		if (value.size() != 6U || !jedecID.isHex())
+		{
+			console.error("Invalid value for --chip given, got '"sv, value, "', expecting a 6 digit hexadecimal "
+				"JEDEC ID such as 'ef4018'"sv);
+			return std::nullopt;
+		}
+		const auto chipID{jedecID.fromHex()};
+		return spiFlashID_t{uint8_t(chipID >> 16U), uint8_t(chipID >> 8U), uint8_t(chipID)};
+	}
+
+	static inline std::optional<std::any> imageSpecParser(const std::string_view &value) noexcept
+	{
+		// Images can be given a fixed Flash offset by following the file name with '@' and the offset in hex
+		const auto separator{value.rfind('@')};
+		if (separator == std::string_view::npos || value.substr(separator + 1U, 2U) != "0x"sv)
+			return elf::imageSpec_t{elf::path{value}, std::nullopt};
+		const auto offsetString{value.substr(separator + 3U)};
+		const substrate::toInt_t<uint32_t> offset{offsetString.data(), offsetString.size()};
+		if (offsetString.empty() || offsetString.size() > 8U || !offset.isHex())
+		{
+			console.error("Invalid Flash offset given for image '"sv, value, "', expecting a hexadecimal "
+				"offset such as 'firmware.elf@0x100000'"sv);
+			return std::nullopt;
+		}
+		return elf::imageSpec_t{elf::path{value.substr(0, separator)}, offset.fromHex()};
+	}
+
 	constexpr static auto serialOption
 	{
 		option_t
@@ -43,37 +75,217 @@ namespace bmpflash
 		}.takesParameter(optionValueType_t::path).required()
 	};
 
+	constexpr static auto imageFileOption
+	{
+		option_t
+		{
+			optionValue_t{"fileName"sv},
+			"Use the given ELF file (including path relative to your working directory) for the operation.\n"
+			"This may be given multiple times to provision several images, and each may be followed by '@'\n"
+			"and a Flash offset (eg, 'firmware.elf@0x100000') to place that image at a fixed location"sv
+		}.takesParameter(optionValueType_t::userDefined, imageSpecParser).required().repeatable()
+	};
+
+	constexpr static auto manifestOption
+	{
+		option_t
+		{
+			optionFlagPair_t{"-m"sv, "--manifest"sv},
+			"Use the given sector manifest file to skip writing sectors that are unchanged since the\n"
+			"manifest was made, updating it once the write completes"sv
+		}.takesParameter(optionValueType_t::path)
+	};
+
+	constexpr static auto digestOption
+	{
+		option_t
+		{
+			"--digest"sv,
+			"Hash the data as it's transferred, writing its CRC32, SHA-256 and per-sector CRCs to a\n"
+			"sidecar file named after the file being read or written, with .digest appended.\n"
+			"Not supported when writing Intel HEX, S-record or UF2 files"sv
+		}
+	};
+
+	constexpr static auto statsJSONOption
+	{
+		option_t
+		{
+			"--stats-json"sv,
+			"Write statistics about the operation, including digests of the data, to the given file\n"
+			"as JSON once it completes. Digests are left out when writing Intel HEX, S-record or UF2 files"sv
+		}.takesParameter(optionValueType_t::path)
+	};
+
+	constexpr static auto nandOption
+	{
+		option_t
+		{
+			"--nand"sv,
+			"Treat the Flash as SPI NAND, skipping over any bad blocks. Files are raw binary images\n"
+			"of the device's good blocks, starting from its first block"sv
+		}
+	};
+
+	constexpr static auto sdCardOption
+	{
+		option_t
+		{
+			"--sdcard"sv,
+			"Access an SD card on the external bus as raw blocks rather than SPI Flash. Files are raw\n"
+			"images of the card, or sparse images in any of the formats write otherwise accepts. Data goes\n"
+			"over in block transfers where the probe firmware supports them, and otherwise a byte at a time,\n"
+			"which is much slower"sv
+		}
+	};
+
+	constexpr static auto socketOption
+	{
+		option_t
+		{
+			"--socket"sv,
+			"Use the given UNIX socket to talk to the daemon rather than the default\n"
+			"($XDG_RUNTIME_DIR/bmpflash.sock, or /tmp/bmpflash-<uid>/bmpflash.sock)"sv
+		}.takesParameter(optionValueType_t::path)
+	};
+
+	constexpr static auto daemonOption
+	{
+		option_t
+		{
+			"--daemon"sv,
+			"Hand the operation to a running `bmpflash serve` daemon rather than talking to the BMP directly"sv
+		}
+	};
+
 	constexpr static auto probeOptions{options(serialOption)};
 
-	constexpr static auto deviceOptions
+	constexpr static auto busOption
+	{
+		option_t
+		{
+			optionFlagPair_t{"-b"sv, "--bus"sv},
+			"Which of the internal (on-board) or external (debug connector attached)\n"
+			"busses to use. Specified by giving either 'int' or 'ext'"sv,
+		}.takesParameter(optionValueType_t::userDefined, busSelectionParser)
+	};
+
+	constexpr static auto deviceOptions{options(serialOption, option_t{busOption}.required())};
+
+	constexpr static auto sfdpOptions
 	{
 		options
 		(
 			serialOption,
+			busOption,
+			option_t
+			{
+				optionFlagPair_t{"-r"sv, "--display-raw"sv},
+				"Dispaly the raw SFDP data read from the device as it's read"sv
+			},
 			option_t
 			{
-				optionFlagPair_t{"-b"sv, "--bus"sv},
-				"Which of the internal (on-board) or external (debug connector attached)\n"
-				"busses to use. Specified by giving either 'int' or 'ext'"sv,
-			}.takesParameter(optionValueType_t::userDefined, busSelectionParser).required()
+				"--save"sv,
+				"Save the raw SFDP data read from the device to the given file"sv
+			}.takesParameter(optionValueType_t::path),
+			option_t
+			{
+				"--from-file"sv,
+				"Display the SFDP data from the given file (as made by --save) rather than reading\n"
+				"it from a device. When this is used, --bus is not required"sv
+			}.takesParameter(optionValueType_t::path)
 		)
 	};
 
-	constexpr static auto sfdpOptions
+	constexpr static auto provisioningOptions
 	{
 		options
 		(
-			deviceOptions,
+			probeOptions,
+			imageFileOption,
 			option_t
 			{
-				optionFlagPair_t{"-r"sv, "--display-raw"sv},
-				"Dispaly the raw SFDP data read from the device as it's read"sv
+				optionFlagPair_t{"-o"sv, "--output"sv},
+				"Write the packed Flash image to the given file rather than provisioning a BMP. This needs\n"
+				"the Flash chip to be described using either --sfdp or --chip"sv
+			}.takesParameter(optionValueType_t::path),
+			option_t
+			{
+				"--sfdp"sv,
+				"Use the SFDP data in the given file (as made by sfdp --save) to describe the Flash chip\n"
+				"the image is being packed for"sv
+			}.takesParameter(optionValueType_t::path),
+			option_t
+			{
+				"--chip"sv,
+				"Use the known parameters for the Flash chip with the given JEDEC ID (eg, 'ef4018') to\n"
+				"describe the Flash chip the image is being packed for"sv
+			}.takesParameter(optionValueType_t::userDefined, chipIDParser)
+		)
+	};
+	constexpr static auto batchOptions
+	{
+		options
+		(
+			serialOption,
+			option_t
+			{
+				optionValue_t{"jobFile"sv},
+				"Run the operations listed in the given job file, one per line, over a single probe session"sv
+			}.takesParameter(optionValueType_t::path).required(),
+			option_t
+			{
+				"--keep-going"sv,
+				"Carry on with the rest of the job file after an operation fails"sv
 			}
 		)
 	};
-
-	constexpr static auto provisioningOptions{options(probeOptions, fileOption)};
+	constexpr static auto replayOptions
+	{
+		options
+		(
+			option_t
+			{
+				optionValue_t{"captureFile"sv},
+				"Replay the probe's side of the session captured in the given file (as made by --record)"sv
+			}.takesParameter(optionValueType_t::path).required(),
+			option_t
+			{
+				optionValue_t{"jobFile"sv},
+				"Run the operations in the given job file against the replayed session. These must be\n"
+				"the same operations that were run when the session was captured"sv
+			}.takesParameter(optionValueType_t::path).required(),
+			option_t
+			{
+				"--real-time"sv,
+				"Take as long to respond to each request as the probe did when the session was captured"sv
+			}
+		)
+	};
+	constexpr static auto serveOptions
+	{
+		options
+		(
+			socketOption,
+			option_t
+			{
+				"--status"sv,
+				"Display the probes a running daemon is serving and the Flash it knows about on each, then exit"sv
+			},
+			option_t{"--stop"sv, "Ask a running daemon to finish any queued requests and shut down"sv}
+		)
+	};
 	constexpr static auto generalFlashOptions{options(deviceOptions, fileOption)};
+	constexpr static auto readOptions
+	{
+		options(generalFlashOptions, nandOption, sdCardOption, digestOption, statsJSONOption, daemonOption,
+			socketOption)
+	};
+	constexpr static auto writeOptions
+	{
+		options(generalFlashOptions, manifestOption, nandOption, sdCardOption, digestOption, statsJSONOption,
+			daemonOption, socketOption)
+	};
 
 	constexpr static auto actions
 	{
@@ -97,12 +309,27 @@ namespace bmpflash
 			{
 				"read"sv,
 				"Read the contents of a Flash chip into the file specified"sv,
-				generalFlashOptions,
+				readOptions,
 			},
 			{
 				"write"sv,
-				"Write the contents of the file specified into a Flash chip"sv,
-				generalFlashOptions,
+				"Write the contents of the file specified (raw binary, Intel HEX, S-record or UF2) into a Flash chip"sv,
+				writeOptions,
+			},
+			{
+				"batch"sv,
+				"Run a job file of sfdp, read, write and provision operations in one session with a BMP"sv,
+				batchOptions,
+			},
+			{
+				"replay"sv,
+				"Replay a captured session with a BMP, running a job file against it to benchmark or test changes"sv,
+				replayOptions,
+			},
+			{
+				"serve"sv,
+				"Run as a daemon holding sessions with all attached BMPs open to serve --daemon requests"sv,
+				serveOptions,
 			},
 		})
 	};
@@ -118,6 +345,18 @@ namespace bmpflash
 				option_t{"--version"sv, "Display the program version information and exit"sv}.exclusive(),
 				option_t{optionFlagPair_t{"-v"sv, "--verbosity"sv}, "Set the program output verbosity"sv}
 					.takesParameter(optionValueType_t::unsignedInt).valueRange(0U, 1U),
+				option_t
+				{
+					"--trace"sv,
+					"Record a timeline of every transaction with the probe to the given file in the\n"
+					"Chrome trace-event format, for viewing in Perfetto"sv
+				}.takesParameter(optionValueType_t::path),
+				option_t
+				{
+					"--record"sv,
+					"Capture the session with the probe to the given file so it can be replayed with the\n"
+					"replay action. The profile cache is not used while capturing"sv
+				}.takesParameter(optionValueType_t::path),
 				optionSet_t{"action"sv, actions}
 			)
 		}
@@ -0,0 +1,67 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// SPDX-FileCopyrightText: 2023 1BitSquared <info@1bitsquared.com>
+#ifndef PROFILE_CACHE_HXX
+#define PROFILE_CACHE_HXX
+
+#include <cstdint>
+#include <string_view>
+#include <optional>
+#include <vector>
+#include <filesystem>
+#include <substrate/span>
+#include "spiFlash.hxx"
+#include "bmp.hxx"
+
+namespace bmpflash::profileCache
+{
+	using std::filesystem::path;
+	using bmpflash::spiFlash::spiFlash_t;
+
+	struct chipProfile_t final
+	{
+		uint32_t sfdpHeaderCRC{};
+		spiFlash_t spiFlash{};
+	};
+
+	struct probeCapabilities_t final
+	{
+		uint64_t protocolVersion{};
+	};
+
+	struct imageKey_t final
+	{
+		uint32_t elfCRC{};
+		uint64_t elfLength{};
+		uint32_t geometryCRC{};
+	};
+
+	/*
+	 * The profile cache lives in the user's cache directory and remembers the results of the
+	 * discovery done at the start of each session so later runs can skip it:
+	 * - Flash chip geometry parsed from SFDP, keyed by JEDEC ID and tagged with a CRC32 of the
+	 *   SFDP header and parameter headers it was parsed from
+	 * - Probe capabilities, keyed by probe serial number and firmware version string
+	 * - Packed provisioning images, keyed by the CRC32 and length of the ELF file they were built
+	 *   from and a CRC32 of the geometry of the Flash they were laid out for
+	 * Failing to read or write the cache is never fatal, it just means discovery gets redone.
+	 */
+	[[nodiscard]] std::optional<path> cacheDirectory();
+	// Stop using the chip and probe profiles for the rest of the run, so the traffic with the probe
+	// doesn't depend on what happens to be cached (used when capturing or replaying sessions)
+	void bypassDiscoveryCache() noexcept;
+
+	[[nodiscard]] std::optional<chipProfile_t> loadChipProfile(const spiFlashID_t &chipID);
+	void storeChipProfile(const spiFlashID_t &chipID, const chipProfile_t &profile);
+
+	[[nodiscard]] std::optional<probeCapabilities_t> loadProbeCapabilities(std::string_view serialNumber,
+		std::string_view firmwareVersion);
+	void storeProbeCapabilities(std::string_view serialNumber, std::string_view firmwareVersion,
+		const probeCapabilities_t &capabilities);
+
+	// Fingerprint the parts of a Flash chip's geometry that affect how a provisioning image is laid out
+	[[nodiscard]] uint32_t geometryCRC(const spiFlash_t &spiFlash) noexcept;
+	[[nodiscard]] std::optional<std::vector<uint8_t>> loadPackedImage(const imageKey_t &key);
+	void storePackedImage(const imageKey_t &key, const substrate::span<const uint8_t> &image);
+} // namespace bmpflash::profileCache
+
+#endif /*PROFILE_CACHE_HXX*/
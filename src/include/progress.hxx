@@ -0,0 +1,84 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// SPDX-FileCopyrightText: 2023 1BitSquared <info@1bitsquared.com>
+#ifndef PROGRESS_HXX
+#define PROGRESS_HXX
+
+#include <cstdint>
+#include <cstddef>
+#include <chrono>
+#include <string_view>
+
+namespace bmpflash::progress
+{
+	enum class phase_t : uint8_t
+	{
+		idle,
+		read,
+		erase,
+		program,
+	};
+
+	// A summary of how an operation went, for reporting once it's done
+	struct stats_t final
+	{
+		size_t bytesDone{0U};
+		size_t bytesTransferred{0U};
+		double elapsed{0.0};
+		double readTime{0.0};
+		double eraseTime{0.0};
+		double programTime{0.0};
+	};
+
+	/*
+	 * Tracks how far through an operation on a Flash chip we are, and periodically reports
+	 * this along with the achieved throughput and an estimated time to completion.
+	 * When the console is a TTY this is displayed as a progress bar, otherwise a machine
+	 * readable progress line is emitted once a second.
+	 */
+	struct progress_t final
+	{
+	private:
+		using clock_t = std::chrono::steady_clock;
+		using seconds_t = std::chrono::duration<double>;
+
+		std::string_view _operation;
+		size_t _totalBytes;
+		size_t _bytesDone{0U};
+		size_t _bytesTransferred{0U};
+		bool _isTTY;
+		bool _displayed{false};
+		clock_t::time_point _startTime{clock_t::now()};
+		clock_t::time_point _lastReport{_startTime};
+		size_t _lastReportBytes{0U};
+		double _currentRate{0.0};
+		phase_t _phase{phase_t::idle};
+		clock_t::time_point _phaseStart{};
+		clock_t::duration _readTime{};
+		clock_t::duration _eraseTime{};
+		clock_t::duration _programTime{};
+		seconds_t _expectedTime{};
+
+		void report(bool final);
+
+	public:
+		progress_t(std::string_view operation, size_t totalBytes) noexcept;
+		progress_t(const progress_t &) = delete;
+		progress_t(progress_t &&) = delete;
+		~progress_t() noexcept;
+		progress_t &operator =(const progress_t &) = delete;
+		progress_t &operator =(progress_t &&) = delete;
+
+		// Provide an estimate of how long the whole operation should take, used for the ETA until there's
+		// enough real throughput data to go on
+		void expectedTime(const std::chrono::microseconds time) noexcept { _expectedTime = time; }
+		// Correct the total size of the operation once it's known, for when it could only be estimated up front
+		void totalBytes(const size_t totalBytes) noexcept { _totalBytes = totalBytes; }
+		void begin(phase_t phase) noexcept;
+		void end(size_t bytes = 0U);
+		void skip(size_t bytes);
+		void finish();
+		[[nodiscard]] stats_t stats() const noexcept;
+	};
+} // namespace bmpflash::progress
+
+#endif /*PROGRESS_HXX*/
@@ -4,13 +4,46 @@
 #ifndef PROVISION_ELF_HXX
 #define PROVISION_ELF_HXX
 
+#include <cstdint>
+#include <vector>
+#include <optional>
+#include <future>
 #include <filesystem>
+#include <substrate/span>
 #include "bmp.hxx"
+#include "spiFlash.hxx"
 #include "elf/elf.hxx"
 
 namespace bmpflash::elf
 {
 	using std::filesystem::path;
+	using bmpflash::spiFlash::spiFlash_t;
+
+	// An ELF file to provision, and if it has to go somewhere specific, the Flash offset to place it at
+	struct imageSpec_t final
+	{
+		path fileName{};
+		std::optional<uint32_t> offset{};
+	};
+
+	// A set of sections from the same loadable segment that sit back to back in the target's address space
+	struct sectionRun_t final
+	{
+		uint64_t address{};
+		uint64_t flashAddr{};
+		std::vector<uint8_t> data{};
+
+		[[nodiscard]] uint64_t end() const noexcept { return address + data.size(); }
+	};
+
+	// An ELF file that has been read in and had its sections gathered into runs, ready to be laid out
+	struct elfImage_t final
+	{
+		imageSpec_t spec{};
+		uint32_t crc{};
+		uint64_t length{};
+		std::vector<sectionRun_t> runs{};
+	};
 
 	struct provision_t final
 	{
@@ -21,8 +54,26 @@ namespace bmpflash::elf
 		provision_t(const path &fileName) noexcept;
 
 		[[nodiscard]] bool valid() const noexcept;
-		[[nodiscard]] bool repack(const bmp_t &probe) const;
+		[[nodiscard]] std::optional<std::vector<sectionRun_t>> sectionRuns() const;
 	};
+
+	[[nodiscard]] std::optional<elfImage_t> loadImage(const imageSpec_t &spec);
+	// Load a set of images in the background on a bounded pool of threads. Anything the loaders have to say
+	// is held back and printed by the thread that waits on the result
+	[[nodiscard]] std::future<std::optional<std::vector<elfImage_t>>> loadImages(std::vector<imageSpec_t> specs);
+	// Lay a set of images out for a Flash of the given geometry, returning the resulting packed image
+	[[nodiscard]] std::optional<std::vector<uint8_t>> repack(const std::vector<elfImage_t> &images,
+		const spiFlash_t &spiFlash);
+
+	// Get the packed image for a set of ELF files, either from the cache of previously packed images or by
+	// repacking them. The image spec form avoids loading the files at all when the result is in the cache
+	[[nodiscard]] std::optional<std::vector<uint8_t>> packedImageFor(const std::vector<elfImage_t> &images,
+		const spiFlash_t &spiFlash);
+	[[nodiscard]] std::optional<std::vector<uint8_t>> packedImageFor(const std::vector<imageSpec_t> &specs,
+		const spiFlash_t &spiFlash);
+	// Write a packed image to a probe's on-board Flash, skipping any sections already present and unchanged
+	[[nodiscard]] bool writeImage(const bmp_t &probe, spiFlash_t &spiFlash,
+		const substrate::span<const uint8_t> &image);
 } // namespace bmpflash::elf
 
 #endif /*PROVISION_ELF_HXX*/
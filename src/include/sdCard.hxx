@@ -0,0 +1,85 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// SPDX-FileCopyrightText: 2023 1BitSquared <info@1bitsquared.com>
+#ifndef SD_CARD_HXX
+#define SD_CARD_HXX
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <optional>
+#include <substrate/span>
+
+struct bmp_t;
+
+namespace bmpflash::sdCard
+{
+	// SD cards in SPI mode always transfer data in blocks of this size (SDSC cards get set up to match)
+	constexpr inline size_t blockSize{512U};
+
+	enum class sdCommand_t : uint8_t
+	{
+		goIdleState = 0U,
+		sendIfCond = 8U,
+		sendCSD = 9U,
+		sendCID = 10U,
+		stopTransmission = 12U,
+		setBlockLength = 16U,
+		readMultipleBlock = 18U,
+		writeMultipleBlock = 25U,
+		sdSendOpCond = 41U,
+		appCommand = 55U,
+		readOCR = 58U,
+	};
+
+	/*
+	 * Drives an SD card in SPI mode through the probe, giving raw access to its blocks. The card requires
+	 * its chip select be held asserted for the whole of a transaction, from the command frame through to the
+	 * end of any data, but the probe's read and write requests release chip select around themselves. So the
+	 * card is explicitly selected at the start of each transaction and released at the end, with everything in
+	 * between going through the probe's transfer requests. Command frames and data blocks go over as block
+	 * transfers of several hundred bytes at a time, while polling for responses and tokens is done a byte at a
+	 * time. Probes whose firmware predates block transfers get everything a byte at a time, which is sound
+	 * but slow. Every data block is checked against its CRC.
+	 */
+	struct sdCard_t final
+	{
+	private:
+		bool blockAddressed_{false};
+		bool blockTransfers_{true};
+		uint64_t blockCount_{0U};
+		std::string name_{};
+
+		[[nodiscard]] std::optional<uint8_t> command(const bmp_t &probe, sdCommand_t command, uint32_t argument) const;
+		[[nodiscard]] std::optional<uint8_t> appCommand(const bmp_t &probe, sdCommand_t command,
+			uint32_t argument) const;
+		void endTransaction(const bmp_t &probe) const;
+		[[nodiscard]] bool waitToken(const bmp_t &probe, uint8_t &token) const;
+		[[nodiscard]] bool waitIdle(const bmp_t &probe) const;
+		[[nodiscard]] bool readRegister(const bmp_t &probe, sdCommand_t command, substrate::span<uint8_t> data) const;
+		[[nodiscard]] bool receiveBlock(const bmp_t &probe, substrate::span<uint8_t> block) const;
+		[[nodiscard]] bool sendBlock(const bmp_t &probe, substrate::span<const uint8_t> block) const;
+		void exchange(const bmp_t &probe, substrate::span<const uint8_t> dataOut,
+			substrate::span<uint8_t> dataIn) const;
+		[[nodiscard]] bool sendBytes(const bmp_t &probe, substrate::span<const uint8_t> data) const;
+		void receiveBytes(const bmp_t &probe, substrate::span<uint8_t> data) const;
+		[[nodiscard]] uint32_t address(uint64_t block) const noexcept
+			{ return static_cast<uint32_t>(blockAddressed_ ? block : block * blockSize); }
+
+	public:
+		sdCard_t() noexcept = default;
+
+		// Bring the card up from power-on into SPI mode and read out how big it is and what it is
+		[[nodiscard]] static std::optional<sdCard_t> initialise(const bmp_t &probe);
+
+		[[nodiscard]] auto &name() const noexcept { return name_; }
+		[[nodiscard]] uint64_t blockCount() const noexcept { return blockCount_; }
+		[[nodiscard]] uint64_t capacity() const noexcept { return blockCount_ * blockSize; }
+
+		// Read whole blocks starting from the given block, using a single multi-block read
+		[[nodiscard]] bool readBlocks(const bmp_t &probe, uint64_t block, substrate::span<uint8_t> data);
+		// Write whole blocks starting from the given block, using a single multi-block write
+		[[nodiscard]] bool writeBlocks(const bmp_t &probe, uint64_t block, substrate::span<const uint8_t> data);
+	};
+} // namespace bmpflash::sdCard
+
+#endif /*SD_CARD_HXX*/
@@ -0,0 +1,80 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// SPDX-FileCopyrightText: 2023 1BitSquared <info@1bitsquared.com>
+#ifndef SESSION_HXX
+#define SESSION_HXX
+
+#include <optional>
+#include <string>
+#include <vector>
+#include <map>
+#include <functional>
+#include <string_view>
+#include "usbContext.hxx"
+#include "usbDevice.hxx"
+#include "bmp.hxx"
+#include "cancellation.hxx"
+#include "spiFlash.hxx"
+
+namespace bmpflash
+{
+	using bmpflash::spiFlash::spiFlash_t;
+
+	// A Flash chip that's been identified on one of the probe's busses, along with its discovered geometry
+	struct flashTarget_t final
+	{
+		spiBus_t bus{spiBus_t::none};
+		spiFlashID_t chipID{};
+		spiFlash_t spiFlash{};
+	};
+
+	[[nodiscard]] std::vector<usbDevice_t> findBMPs(const usbContext_t &context);
+	[[nodiscard]] std::string readSerialNumber(const usbDevice_t &device);
+	[[nodiscard]] spiDevice_t busToDevice(const spiBus_t &bus);
+	[[nodiscard]] std::optional<bmp_t> beginComms(const usbDevice_t &device, const spiBus_t &spiBus);
+	// Begin communications with a specific device on the bus, rather than the Flash on it
+	[[nodiscard]] std::optional<bmp_t> beginComms(const usbDevice_t &device, const spiBus_t &spiBus,
+		spiDevice_t spiDevice);
+	[[nodiscard]] std::optional<bmp_t> beginComms(bmp_t &&probe, std::string_view serialNumber, const spiBus_t &spiBus);
+	[[nodiscard]] std::optional<bmp_t> beginComms(bmp_t &&probe, std::string_view serialNumber, const spiBus_t &spiBus,
+		spiDevice_t spiDevice);
+	[[nodiscard]] std::optional<spiFlashID_t> identifyFlash(const bmp_t &probe) noexcept;
+	[[nodiscard]] std::optional<flashTarget_t> discoverFlash(const bmp_t &probe, spiBus_t spiBus);
+
+	/*
+	 * A session with a probe that can be used for any number of operations, only switching busses when
+	 * an operation needs a different one to the last and only discovering the Flash on each bus the first
+	 * time it's used
+	 */
+	struct flashSession_t final
+	{
+	private:
+		using connect_t = std::function<std::optional<bmp_t> (spiBus_t)>;
+
+		std::string _serialNumber;
+		connect_t _connect;
+		std::optional<bmp_t> _probe{};
+		spiBus_t _activeBus{spiBus_t::none};
+		std::map<spiBus_t, flashTarget_t> _targets{};
+		cancellationToken_t _cancellation{interruptToken()};
+
+	public:
+		flashSession_t(const usbDevice_t &device);
+		// Run the session against a replayed capture of a session with a probe
+		flashSession_t(std::string_view serialNumber, const capture::replayInterface_t &replay);
+
+		[[nodiscard]] auto &serialNumber() const noexcept { return _serialNumber; }
+		[[nodiscard]] auto &targets() const noexcept { return _targets; }
+		[[nodiscard]] bool active() const noexcept { return _probe.has_value(); }
+		// Only valid after a successful call to select()
+		[[nodiscard]] auto &probe() const noexcept { return *_probe; }
+		// Replace the token that cancels work done with the probe, which otherwise is the interrupt token
+		void cancellation(const cancellationToken_t &token) noexcept;
+
+		// Switch to the given bus, beginning the session if necessary, and return the Flash found on it
+		[[nodiscard]] flashTarget_t *select(spiBus_t bus);
+		// Close the session with the probe, keeping what was learnt about the Flash on each bus
+		[[nodiscard]] bool end() noexcept;
+	};
+} // namespace bmpflash
+
+#endif /*SESSION_HXX*/
@@ -2,16 +2,40 @@
 #ifndef SFDP_HXX
 #define SFDP_HXX
 
+#include <cstdint>
 #include <optional>
+#include <vector>
+#include <filesystem>
+#include <substrate/span>
 #include "spiFlash.hxx"
 #include "bmp.hxx"
 
 namespace bmpflash::sfdp
 {
+	using std::filesystem::path;
 	using bmpflash::spiFlash::spiFlash_t;
 
-	bool readAndDisplay(const bmp_t &probe, bool displayRaw);
-	std::optional<spiFlash_t> read(const bmp_t &probe);
+	// Fetch the whole SFDP region from the device in as few reads as possible
+	[[nodiscard]] std::optional<std::vector<uint8_t>> fetch(const bmp_t &probe);
+	// Fetch just the SFDP header and parameter headers, enough for headerCRC() to identify the SFDP data
+	[[nodiscard]] std::optional<std::vector<uint8_t>> fetchHeaders(const bmp_t &probe);
+	[[nodiscard]] bool save(const substrate::span<const uint8_t> &sfdpData, const path &fileName);
+	[[nodiscard]] std::optional<std::vector<uint8_t>> load(const path &fileName);
+
+	// These operate on SFDP data already fetched from a device or loaded from a file
+	[[nodiscard]] bool valid(const substrate::span<const uint8_t> &sfdpData) noexcept;
+	[[nodiscard]] uint32_t headerCRC(const substrate::span<const uint8_t> &sfdpData) noexcept;
+	bool display(const substrate::span<const uint8_t> &sfdpData, bool displayRaw);
+	// If the device has a sector map that needs configuration detection, a probe must be provided to run it.
+	// configurationDetected, if given, is set when the sector map used depended on the results of that detection
+	[[nodiscard]] std::optional<spiFlash_t> parse(const substrate::span<const uint8_t> &sfdpData,
+		const bmp_t *probe = nullptr, bool *configurationDetected = nullptr);
+
+	// Build the best description of the device we can with nothing more than its JEDEC ID
+	[[nodiscard]] std::optional<spiFlash_t> spiFlashFromID(const spiFlashID_t &chipID);
+	bool readAndDisplay(const bmp_t &probe, const spiFlashID_t &chipID, bool displayRaw,
+		const std::optional<path> &saveFile);
+	std::optional<spiFlash_t> read(const bmp_t &probe, const spiFlashID_t &chipID);
 } // namespace bmpflash::sfdp
 
 #endif /*SFDP_HXX*/
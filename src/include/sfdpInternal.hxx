@@ -5,10 +5,15 @@
 #include <cstdint>
 #include <cstddef>
 #include <array>
+#include <chrono>
 #include "defs.hxx"
+#include "spiFlash.hxx"
 
 namespace bmpflash::sfdp
 {
+	using bmpflash::spiFlash::timing_t;
+	using namespace std::literals::chrono_literals;
+
 	enum struct accessProtocol_t : uint8_t
 	{
 		xspiNANDClass1 = 0xF0U,
@@ -154,11 +159,64 @@ BEGIN_PACKED(1)
 	};
 END_PACKED()
 
+	struct eraseTimings_t
+	{
+	private:
+		uint32_t data{};
+
+	public:
+		[[nodiscard]] uint32_t maximumMultiplier() const noexcept { return 2U * ((data & 0x0fU) + 1U); }
+
+		[[nodiscard]] timing_t eraseTime(const size_t eraseType) const noexcept
+		{
+			// Each erase type's typical time is 5 bits of count followed by 2 bits of units, starting at bit 4
+			const auto shift{4U + (eraseType * 7U)};
+			const auto count{((data >> shift) & 0x1fU) + 1U};
+			constexpr std::array<std::chrono::microseconds, 4> units{{1ms, 16ms, 128ms, 1s}};
+			const auto typical{count * units[(data >> (shift + 5U)) & 0x03U]};
+			return {typical, typical * maximumMultiplier()};
+		}
+	};
+
 	struct programmingAndChipEraseTiming_t
 	{
 		uint8_t programmingTimingRatioAndPageSize{};
 		std::array<uint8_t, 3> eraseTimings;
 
+	private:
+		[[nodiscard]] uint32_t value() const noexcept
+		{
+			return (uint32_t{eraseTimings[2]} << 24U) | (uint32_t{eraseTimings[1]} << 16U) |
+				(uint32_t{eraseTimings[0]} << 8U) | programmingTimingRatioAndPageSize;
+		}
+		[[nodiscard]] uint32_t maximumMultiplier() const noexcept { return 2U * ((value() & 0x0fU) + 1U); }
+
+		[[nodiscard]] timing_t programTime(const size_t shift, const size_t countBits,
+			const std::chrono::microseconds smallUnits, const std::chrono::microseconds largeUnits) const noexcept
+		{
+			const auto data{value()};
+			const auto count{((data >> shift) & ((1U << countBits) - 1U)) + 1U};
+			// The units bit immediately follows the count
+			const auto typical{count * (((data >> (shift + countBits)) & 1U) ? largeUnits : smallUnits)};
+			return {typical, typical * maximumMultiplier()};
+		}
+
+	public:
+		[[nodiscard]] timing_t pageProgramTime() const noexcept { return programTime(8U, 5U, 8us, 64us); }
+		[[nodiscard]] timing_t byteProgramTime() const noexcept { return programTime(14U, 4U, 1us, 8us); }
+		[[nodiscard]] timing_t additionalByteProgramTime() const noexcept
+			{ return programTime(19U, 4U, 1us, 8us); }
+
+		// The chip erase time's maximum is found using the erase timings multiplier, so that must be passed in
+		[[nodiscard]] timing_t chipEraseTime(const uint32_t eraseMultiplier) const noexcept
+		{
+			const auto data{value()};
+			const auto count{((data >> 24U) & 0x1fU) + 1U};
+			constexpr std::array<std::chrono::microseconds, 4> units{{16ms, 256ms, 4s, 64s}};
+			const auto typical{count * units[(data >> 29U) & 0x03U]};
+			return {typical, typical * eraseMultiplier};
+		}
+
 		[[nodiscard]] uint32_t pageSize() const noexcept
 		{
 			// Extract the exponent, which by definition must be a value between 0 and 15
@@ -205,7 +263,7 @@ END_PACKED()
 		std::array<uint8_t, 2> reserved3{};
 		timingsAndOpcode_t fastQuadQPI{};
 		std::array<eraseParameters_t, 4> eraseTypes{};
-		uint32_t eraseTiming{};
+		eraseTimings_t eraseTimings{};
 		programmingAndChipEraseTiming_t programmingAndChipEraseTiming{};
 		uint8_t operationalProhibitions{};
 		std::array<uint8_t, 3> suspendLatencySpecs{};
@@ -221,11 +279,64 @@ END_PACKED()
 	};
 // NOLINTEND(misc-non-private-member-variables-in-classes)
 
+	enum struct detectionAddressLength_t : uint8_t
+	{
+		none = 0U,
+		threeByte = 1U,
+		fourByte = 2U,
+		variable = 3U,
+	};
+
+	// Represents the first DWORD of a sector map table descriptor, which is either a
+	// configuration detection command descriptor or a configuration map descriptor
+	struct sectorMapDescriptor_t
+	{
+	private:
+		uint32_t data{};
+
+	public:
+		constexpr sectorMapDescriptor_t(const uint32_t value) noexcept : data{value} { }
+
+		[[nodiscard]] bool isLastDescriptor() const noexcept { return data & 0x01U; }
+		[[nodiscard]] bool isMapDescriptor() const noexcept { return data & 0x02U; }
+
+		// Configuration detection command descriptor fields
+		[[nodiscard]] uint8_t opcode() const noexcept { return static_cast<uint8_t>(data >> 8U); }
+		[[nodiscard]] uint8_t readLatency() const noexcept
+		{
+			const auto latency{static_cast<uint8_t>((data >> 16U) & 0x0fU)};
+			// 0xf means the latency is variable, so assume the usual 8 cycles
+			return latency == 0x0fU ? 8U : latency;
+		}
+		[[nodiscard]] detectionAddressLength_t addressLength() const noexcept
+			{ return static_cast<detectionAddressLength_t>((data >> 22U) & 0x03U); }
+		[[nodiscard]] uint8_t readDataMask() const noexcept { return static_cast<uint8_t>(data >> 24U); }
+
+		// Configuration map descriptor fields
+		[[nodiscard]] uint8_t configurationID() const noexcept { return static_cast<uint8_t>(data >> 8U); }
+		[[nodiscard]] size_t regionCount() const noexcept { return ((data >> 16U) & 0xffU) + 1U; }
+	};
+
+	struct sectorMapRegion_t
+	{
+	private:
+		uint32_t data{};
+
+	public:
+		constexpr sectorMapRegion_t(const uint32_t value) noexcept : data{value} { }
+
+		// Bit 0 means erase type 1 is supported in the region, bit 1 erase type 2, and so on
+		[[nodiscard]] uint8_t eraseTypes() const noexcept { return static_cast<uint8_t>(data & 0x0fU); }
+		// The region size is stored in units of 256 bytes, less one
+		[[nodiscard]] uint32_t regionSize() const noexcept { return ((data >> 8U) + 1U) * 256U; }
+	};
+
 	static_assert(sizeof(uint24_t) == 3);
 	static_assert(sizeof(sfdpHeader_t) == 8);
 	static_assert(sizeof(parameterTableHeader_t) == 8);
 	static_assert(sizeof(memoryDensity_t) == 4);
 	static_assert(sizeof(timingsAndOpcode_t) == 2);
+	static_assert(sizeof(eraseTimings_t) == 4);
 	static_assert(sizeof(programmingAndChipEraseTiming_t) == 4);
 	static_assert(sizeof(basicParameterTable_t) == 64);
 } // namespace bmpflash::sfdp
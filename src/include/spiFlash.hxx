@@ -6,6 +6,10 @@
 
 #include <cstdint>
 #include <cstddef>
+#include <array>
+#include <vector>
+#include <optional>
+#include <chrono>
 #include <substrate/span>
 
 struct bmp_t;
@@ -27,6 +31,7 @@ namespace bmpflash::spiFlash
 		blockErase = 0xd8U,
 		sectorErase = 0x20U,
 		pageRead = 0x03U,
+		fastRead = 0x0bU,
 		pageAddressRead = 0x13U,
 		pageWrite = 0x02U,
 		pageAddressWrite = 0x10U,
@@ -37,6 +42,12 @@ namespace bmpflash::spiFlash
 		readSFDP = 0x5aU,
 		wakeUp = 0xabU,
 		reset = 0xffU,
+		// SPI NAND specific opcodes
+		getFeature = 0x0fU,
+		setFeature = 0x1fU,
+		randomProgramLoad = 0x84U,
+		pageCacheSequentialRead = 0x31U,
+		pageCacheLastRead = 0x3fU,
 	};
 
 	enum class opcodeMode_t : uint16_t
@@ -88,6 +99,76 @@ namespace bmpflash::spiFlash
 	constexpr inline uint8_t spiStatusBusy{1};
 	constexpr inline uint8_t spiStatusWriteEnabled{2};
 
+	using std::chrono::microseconds;
+	using namespace std::literals::chrono_literals;
+
+	// The typical and maximum times an operation on a Flash chip takes to complete
+	struct timing_t final
+	{
+		microseconds typical{};
+		microseconds maximum{};
+	};
+
+	// Conservative defaults for when the device doesn't tell us its timings via SFDP
+	constexpr inline timing_t defaultPageProgramTime{700us, 5000us};
+	constexpr inline timing_t defaultByteProgramTime{30us, 100us};
+	constexpr inline timing_t defaultAdditionalByteProgramTime{3us, 15us};
+	constexpr inline timing_t defaultSectorEraseTime{50ms, 500ms};
+	constexpr inline timing_t defaultChipEraseTime{30s, 400s};
+
+	// Scale the default erase time with the erase size, as larger erases take proportionally longer
+	constexpr inline timing_t defaultEraseTime(const uint32_t eraseSize) noexcept
+	{
+		if (eraseSize <= 4096U)
+			return defaultSectorEraseTime;
+		if (eraseSize <= 32768U)
+			return {120ms, 1600ms};
+		const auto blocks{eraseSize / 65536U};
+		return {150ms * blocks, 2000ms * blocks};
+	}
+
+	// Describes one of the (up to 4) erase instructions a Flash chip supports, as listed in its SFDP data
+	struct eraseType_t final
+	{
+		uint32_t size{0U};
+		uint8_t opcode{0U};
+		timing_t eraseTime{defaultSectorEraseTime};
+
+		[[nodiscard]] constexpr bool valid() const noexcept { return size != 0U; }
+	};
+
+	// Describes a region of a Flash chip and which erase types (as a bitmask, bit 0 being erase type 1) are
+	// valid to use within it
+	struct eraseRegion_t final
+	{
+		uint32_t start{0U};
+		uint32_t length{0U};
+		uint8_t eraseTypes{0U};
+
+		[[nodiscard]] constexpr uint64_t end() const noexcept { return uint64_t{start} + length; }
+		[[nodiscard]] constexpr bool contains(const size_t address) const noexcept
+			{ return address >= start && address < end(); }
+	};
+
+	// A single erase instruction to run, as produced by planning an erase against the region map
+	struct eraseOperation_t final
+	{
+		uint32_t address{0U};
+		eraseType_t type{};
+	};
+
+	// Timings for the programming and whole-chip operations of a Flash chip
+	struct flashTimings_t final
+	{
+		timing_t pageProgram{defaultPageProgramTime};
+		timing_t byteProgram{defaultByteProgramTime};
+		timing_t additionalByteProgram{defaultAdditionalByteProgramTime};
+		timing_t chipErase{defaultChipEraseTime};
+	};
+
+	constexpr inline size_t maxEraseTypes{4U};
+	constexpr inline size_t maxEraseRegions{16U};
+
 	struct spiFlash_t final
 	{
 	private:
@@ -95,6 +176,17 @@ namespace bmpflash::spiFlash
 		uint32_t sectorSize_{4096};
 		size_t capacity_{};
 		uint8_t sectorEraseOpcode_{uint8_t(opcode_t::sectorErase)};
+		std::array<eraseType_t, maxEraseTypes> eraseTypes_{};
+		std::array<eraseRegion_t, maxEraseRegions> eraseRegions_{};
+		uint8_t eraseRegionCount_{0U};
+		flashTimings_t timings_{};
+		uint8_t readOpcode_{uint8_t(opcode_t::pageRead)};
+		uint8_t readDummyBytes_{0U};
+
+		[[nodiscard]] std::array<eraseType_t, maxEraseTypes> effectiveEraseTypes() const noexcept;
+		[[nodiscard]] uint8_t eraseTypesAt(size_t address, uint64_t &regionEnd) const noexcept;
+		// Poll the Flash until it's no longer busy, giving up if it stays busy well past maximumTime
+		[[nodiscard]] bool pollFlashIdle(const bmp_t &probe, microseconds maximumTime) const;
 
 	public:
 		constexpr spiFlash_t() noexcept = default;
@@ -109,9 +201,36 @@ namespace bmpflash::spiFlash
 		[[nodiscard]] constexpr auto sectorSize() const noexcept { return sectorSize_; }
 		[[nodiscard]] constexpr auto capacity() const noexcept { return capacity_; }
 		[[nodiscard]] constexpr auto sectorEraseOpcode() const noexcept { return sectorEraseOpcode_; }
+		[[nodiscard]] constexpr auto &eraseTypes() const noexcept { return eraseTypes_; }
+		[[nodiscard]] substrate::span<const eraseRegion_t> eraseRegions() const noexcept
+			{ return {eraseRegions_.data(), eraseRegionCount_}; }
+		[[nodiscard]] constexpr auto &timings() const noexcept { return timings_; }
+		[[nodiscard]] constexpr auto readOpcode() const noexcept { return readOpcode_; }
+		[[nodiscard]] constexpr auto readDummyBytes() const noexcept { return readDummyBytes_; }
+
+		constexpr void eraseTypes(const std::array<eraseType_t, maxEraseTypes> &eraseTypes) noexcept
+			{ eraseTypes_ = eraseTypes; }
+		constexpr void timings(const flashTimings_t &timings) noexcept { timings_ = timings; }
+		// Sets the read instruction (eg, fast read, 0x0b, with 1 dummy byte) used by readBlock()
+		constexpr void readInstruction(const uint8_t opcode, const uint8_t dummyBytes) noexcept
+		{
+			readOpcode_ = opcode;
+			readDummyBytes_ = dummyBytes;
+		}
+		[[nodiscard]] bool addEraseRegion(uint32_t length, uint8_t eraseTypes) noexcept;
+		void clearEraseRegions() noexcept { eraseRegionCount_ = 0U; }
+
+		[[nodiscard]] uint32_t eraseGranularity(size_t address) const noexcept;
+		[[nodiscard]] std::optional<std::vector<eraseOperation_t>> planErase(size_t address, size_t length) const;
+		[[nodiscard]] timing_t programTime(size_t length) const noexcept;
+		[[nodiscard]] std::optional<timing_t> writeTime(size_t address, size_t length) const;
 
 		[[nodiscard]] bool waitFlashIdle(const bmp_t &probe);
-		[[nodiscard]] bool writeBlock(const bmp_t &probe, size_t address, const substrate::span<uint8_t> &block);
+		[[nodiscard]] bool waitFlashIdle(const bmp_t &probe, const timing_t &expectedTime);
+		[[nodiscard]] bool erase(const bmp_t &probe, const eraseOperation_t &operation);
+		[[nodiscard]] bool eraseSector(const bmp_t &probe, size_t address);
+		[[nodiscard]] bool programBlock(const bmp_t &probe, size_t address, const substrate::span<const uint8_t> &block);
+		[[nodiscard]] bool writeBlock(const bmp_t &probe, size_t address, const substrate::span<const uint8_t> &block);
 		[[nodiscard]] bool readBlock(const bmp_t &probe, size_t address, substrate::span<uint8_t> block);
 	};
 } // namespace bmpflash::spiFlash
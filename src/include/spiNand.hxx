@@ -0,0 +1,145 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// SPDX-FileCopyrightText: 2023 1BitSquared <info@1bitsquared.com>
+#ifndef SPI_NAND_HXX
+#define SPI_NAND_HXX
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <optional>
+#include <substrate/span>
+#include "spiFlash.hxx"
+
+struct bmp_t;
+
+namespace bmpflash::spiNand
+{
+	using namespace std::literals::string_view_literals;
+	using namespace std::literals::chrono_literals;
+	using bmpflash::spiFlash::timing_t;
+
+	// The feature registers accessed with the get and set feature instructions
+	enum class feature_t : uint8_t
+	{
+		blockLock = 0xa0U,
+		config = 0xb0U,
+		status = 0xc0U,
+	};
+
+	constexpr inline uint8_t statusBusy{0x01U};
+	constexpr inline uint8_t statusEraseFailed{0x04U};
+	constexpr inline uint8_t statusProgramFailed{0x08U};
+	constexpr inline uint8_t statusECCMask{0x30U};
+	constexpr inline uint8_t statusECCUncorrectable{0x20U};
+	constexpr inline uint8_t configOTPEnable{0x40U};
+	constexpr inline uint8_t configECCEnable{0x10U};
+
+	// Conservative timings for the array operations, which vary little between parts
+	constexpr inline timing_t pageReadTime{25us, 100us};
+	constexpr inline timing_t pageProgramTime{300us, 900us};
+	constexpr inline timing_t blockEraseTime{2ms, 10ms};
+
+	// The layout of a NAND device's array
+	struct nandGeometry_t final
+	{
+		uint32_t pageSize{2048U};
+		uint32_t spareSize{64U};
+		uint32_t pagesPerBlock{64U};
+		uint32_t blockCount{0U};
+		// Whether the device has two planes, selected by a bit in the column address from the block address
+		bool multiPlane{false};
+		// Whether the device supports the page read cache sequential/last instructions
+		bool sequentialCacheRead{false};
+
+		[[nodiscard]] constexpr size_t blockSize() const noexcept { return size_t{pageSize} * pagesPerBlock; }
+		[[nodiscard]] constexpr size_t capacity() const noexcept { return blockSize() * blockCount; }
+	};
+
+	// Describes a SPI NAND part by its ID, which is either 2 or 3 bytes long depending on the manufacturer
+	struct nandChip_t final
+	{
+		std::array<uint8_t, 3U> id{};
+		uint8_t idLength{2U};
+		std::string_view name{};
+		nandGeometry_t geometry{};
+	};
+
+	constexpr inline std::array<nandChip_t, 14U> nandChips
+	{{
+		nandChip_t{{{0xefU, 0xaaU, 0x21U}}, 3U, "W25N01GV"sv, {2048U, 64U, 64U, 1024U}},
+		nandChip_t{{{0xefU, 0xaaU, 0x22U}}, 3U, "W25N02KV"sv, {2048U, 128U, 64U, 2048U}},
+		nandChip_t{{{0xefU, 0xaaU, 0x23U}}, 3U, "W25N04KV"sv, {2048U, 128U, 64U, 4096U}},
+		nandChip_t{{{0x2cU, 0x14U}}, 2U, "MT29F1G01ABAFD"sv, {2048U, 128U, 64U, 1024U, false, true}},
+		nandChip_t{{{0x2cU, 0x24U}}, 2U, "MT29F2G01ABAGD"sv, {2048U, 128U, 64U, 2048U, true, true}},
+		nandChip_t{{{0x2cU, 0x34U}}, 2U, "MT29F4G01ABAFD"sv, {4096U, 256U, 64U, 2048U, false, true}},
+		nandChip_t{{{0xc8U, 0xd1U}}, 2U, "GD5F1GQ4UB"sv, {2048U, 128U, 64U, 1024U}},
+		nandChip_t{{{0xc8U, 0xd2U}}, 2U, "GD5F2GQ4UB"sv, {2048U, 128U, 64U, 2048U}},
+		nandChip_t{{{0xc8U, 0xd4U}}, 2U, "GD5F4GQ4UB"sv, {4096U, 256U, 64U, 2048U}},
+		nandChip_t{{{0xc2U, 0x12U}}, 2U, "MX35LF1GE4AB"sv, {2048U, 64U, 64U, 1024U}},
+		nandChip_t{{{0xc2U, 0x22U}}, 2U, "MX35LF2GE4AB"sv, {2048U, 64U, 64U, 2048U, true}},
+		nandChip_t{{{0x98U, 0xc2U}}, 2U, "TC58CVG0S3HRAIG"sv, {2048U, 128U, 64U, 1024U}},
+		nandChip_t{{{0x98U, 0xcbU}}, 2U, "TC58CVG1S3HRAIG"sv, {2048U, 128U, 64U, 2048U}},
+		nandChip_t{{{0x98U, 0xcdU}}, 2U, "TC58CVG2S0HRAIG"sv, {4096U, 256U, 64U, 2048U}},
+	}};
+
+	/*
+	 * Drives a SPI NAND device through the probe. Unlike NOR Flash, the array is only accessed a page at a time
+	 * through the device's cache: reads load a page into the cache and then read it out, and writes load the
+	 * cache then program it into a page. Blocks can go bad, so every block is checked for the factory bad block
+	 * marker before use and any that fail to erase or program are marked bad too. Block numbers here are
+	 * physical, and it's up to the caller to skip the bad ones.
+	 */
+	struct spiNand_t final
+	{
+	private:
+		std::array<uint8_t, 3U> id_{};
+		std::string name_{};
+		nandGeometry_t geometry_{};
+		std::vector<bool> badBlocks_{};
+
+		[[nodiscard]] std::optional<uint8_t> getFeature(const bmp_t &probe, feature_t feature) const;
+		[[nodiscard]] bool setFeature(const bmp_t &probe, feature_t feature, uint8_t value) const;
+		[[nodiscard]] std::optional<uint8_t> waitReady(const bmp_t &probe, const timing_t &expectedTime) const;
+		[[nodiscard]] uint32_t planeSelect(uint32_t page) const noexcept;
+		[[nodiscard]] bool loadPage(const bmp_t &probe, uint32_t page) const;
+		[[nodiscard]] bool readCache(const bmp_t &probe, uint32_t page, uint32_t column,
+			substrate::span<uint8_t> data) const;
+		[[nodiscard]] bool loadCache(const bmp_t &probe, uint32_t page, uint32_t column,
+			substrate::span<const uint8_t> data) const;
+		[[nodiscard]] bool programPage(const bmp_t &probe, uint32_t page, substrate::span<const uint8_t> data) const;
+		[[nodiscard]] bool readParameterPage(const bmp_t &probe);
+
+	public:
+		spiNand_t() noexcept = default;
+
+		// Read the device's ID and work out its geometry, either from the table of known parts or its parameter page
+		[[nodiscard]] static std::optional<spiNand_t> identify(const bmp_t &probe);
+
+		[[nodiscard]] auto &name() const noexcept { return name_; }
+		[[nodiscard]] auto &geometry() const noexcept { return geometry_; }
+		[[nodiscard]] size_t blockSize() const noexcept { return geometry_.blockSize(); }
+		[[nodiscard]] uint32_t blockCount() const noexcept { return geometry_.blockCount; }
+		[[nodiscard]] bool isBad(const uint32_t block) const noexcept { return badBlocks_[block]; }
+		[[nodiscard]] size_t badBlockCount() const noexcept;
+		// How much data the device can hold once its bad blocks are skipped
+		[[nodiscard]] size_t usableCapacity() const noexcept { return (blockCount() - badBlockCount()) * blockSize(); }
+
+		// Make sure the device is ready to go, with its blocks unlocked and ECC enabled
+		[[nodiscard]] bool prepare(const bmp_t &probe) const;
+		// Check the first page of every block for the factory bad block marker, building the bad block table
+		[[nodiscard]] bool scanBadBlocks(const bmp_t &probe);
+		// Record the block as bad, and try to mark it on the device so it stays that way
+		void markBad(const bmp_t &probe, uint32_t block);
+
+		[[nodiscard]] bool readBlock(const bmp_t &probe, uint32_t block, substrate::span<uint8_t> data) const;
+		// Erase the block, returning false if the device reports the erase failed
+		[[nodiscard]] bool eraseBlock(const bmp_t &probe, uint32_t block) const;
+		// Program the (erased) block with up to a block of data, leaving any pages that'd be all 0xff untouched
+		[[nodiscard]] bool programBlock(const bmp_t &probe, uint32_t block, substrate::span<const uint8_t> data) const;
+	};
+} // namespace bmpflash::spiNand
+
+#endif /*SPI_NAND_HXX*/
@@ -0,0 +1,107 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// SPDX-FileCopyrightText: 2023 1BitSquared <info@1bitsquared.com>
+#ifndef TRACE_HXX
+#define TRACE_HXX
+
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <filesystem>
+
+/*
+ * Records a timeline of everything bmpflash does with a probe in the Chrome trace-event format,
+ * so it can be loaded into Perfetto (or chrome://tracing) to see where the time goes.
+ * When no trace is being recorded, every entry point here costs a single relaxed atomic load.
+ */
+namespace bmpflash::trace
+{
+	using std::filesystem::path;
+	using steadyClock_t = std::chrono::steady_clock;
+
+	inline std::atomic<bool> recording{false};
+
+	[[nodiscard]] inline bool enabled() noexcept { return recording.load(std::memory_order_relaxed); }
+
+	// Begin recording a trace into the given file, returning false if it could not be opened
+	[[nodiscard]] bool start(const path &fileName);
+	// Finish the trace off and close the file
+	void stop() noexcept;
+
+	void recordRequest(std::string_view request) noexcept;
+	void recordResponse(std::string_view response, bool succeeded) noexcept;
+	void recordSpan(std::string_view category, std::string_view name, steadyClock_t::time_point begin,
+		std::string_view args) noexcept;
+	[[nodiscard]] std::string regionArgs(uint64_t address, uint64_t length);
+
+	// Called by the serial interface as each packet goes out to the probe
+	inline void requestSent(const std::string_view request) noexcept
+	{
+		if (enabled())
+			recordRequest(request);
+	}
+
+	// Called by the serial interface as each response comes back, completing the transaction for the request
+	inline void responseReceived(const std::string_view response, const bool succeeded = true) noexcept
+	{
+		if (enabled())
+			recordResponse(response, succeeded);
+	}
+
+	// Records the time from its construction to its destruction as a named span on the timeline
+	struct span_t final
+	{
+	private:
+		std::string_view _category;
+		std::string_view _name;
+		bool _enabled{enabled()};
+		steadyClock_t::time_point _begin{_enabled ? steadyClock_t::now() : steadyClock_t::time_point{}};
+		std::string _args{};
+
+	public:
+		span_t(const std::string_view category, const std::string_view name) noexcept :
+			_category{category}, _name{name} { }
+		span_t(const span_t &) = delete;
+		span_t(span_t &&) = delete;
+		span_t &operator =(const span_t &) = delete;
+		span_t &operator =(span_t &&) = delete;
+
+		~span_t() noexcept
+		{
+			if (_enabled)
+				recordSpan(_category, _name, _begin, _args);
+		}
+
+		// Attach an address and length to the span, shown in the span's details in the trace viewer
+		void region(const uint64_t address, const uint64_t length)
+		{
+			if (_enabled)
+				_args = regionArgs(address, length);
+		}
+	};
+
+	// Keeps a trace recording for as long as it lives, stopping it when it goes out of scope
+	struct recording_t final
+	{
+	private:
+		bool _valid;
+
+	public:
+		recording_t(const path &fileName) : _valid{start(fileName)} { }
+		recording_t(const recording_t &) = delete;
+		recording_t(recording_t &&) = delete;
+		recording_t &operator =(const recording_t &) = delete;
+		recording_t &operator =(recording_t &&) = delete;
+
+		~recording_t() noexcept
+		{
+			if (_valid)
+				stop();
+		}
+
+		[[nodiscard]] bool valid() const noexcept { return _valid; }
+	};
+} // namespace bmpflash::trace
+
+#endif /*TRACE_HXX*/
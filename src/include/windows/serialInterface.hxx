@@ -16,7 +16,7 @@ private:
 	HANDLE device{INVALID_HANDLE_VALUE};
 
 	void handleDeviceError(std::string_view operation) noexcept;
-	void refillBuffer() const;
+	void refillBuffer(milliseconds_t timeout) const;
 
 public:
 	serialInterface_t() noexcept = default;
@@ -35,8 +35,9 @@ public:
 	[[nodiscard]] bool valid() const noexcept { return device != INVALID_HANDLE_VALUE; }
 	void swap(serialInterface_t &interface) noexcept;
 
-	void writePacket(const std::string_view &packet) const;
-	[[nodiscard]] std::string readPacket() const;
+	void writePacket(const std::string_view &packet, milliseconds_t timeout) const;
+	[[nodiscard]] std::string readPacket(milliseconds_t timeout) const;
+	void resync() const noexcept;
 };
 
 #endif /*SERIAL_INTERFACE_HXX*/
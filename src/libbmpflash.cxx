@@ -0,0 +1,311 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// SPDX-FileCopyrightText: 2023 1BitSquared <info@1bitsquared.com>
+#include <cstdio>
+#include <exception>
+#include <new>
+#include <optional>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <substrate/span>
+#include <substrate/console>
+#include "bmpflash.h"
+#include "session.hxx"
+
+using namespace std::literals::string_view_literals;
+using substrate::span;
+using substrate::console;
+using substrate::console_t;
+using bmpflash::flashSession_t;
+using bmpflash::flashTarget_t;
+using bmpflash::cancellationToken_t;
+using bmpflash::operationCancelled_t;
+
+struct bmpflash_session final
+{
+	// The libusb context has to outlive all the devices and handles made from it, so it lives here with them
+	usbContext_t context;
+	flashSession_t session;
+	// Each session gets its own token so cancelling one session's work leaves the others alone
+	cancellationToken_t cancellation{};
+
+	bmpflash_session(usbContext_t &&usbContext, const usbDevice_t &device) :
+		context{std::move(usbContext)}, session{device} { session.cancellation(cancellation); }
+};
+
+namespace bmpflash::library
+{
+	// Run an API call, turning any exceptions that escape it into a status code as they can't cross into C
+	template<typename function_t> [[nodiscard]] bmpflash_status_t guarded(const function_t &function) noexcept
+	{
+		try
+			{ return function(); }
+		catch (const bmpCommsError_t &)
+			{ return BMPFLASH_ERROR_COMMS; }
+		catch (const operationCancelled_t &)
+			{ return BMPFLASH_ERROR_CANCELLED; }
+		catch (const std::bad_alloc &)
+			{ return BMPFLASH_ERROR_INTERNAL; }
+		catch (const std::exception &error)
+		{
+			console.error("Unexpected error: "sv, error.what());
+			return BMPFLASH_ERROR_INTERNAL;
+		}
+	}
+
+	// Run an API call that works with the probe. If it gets cancelled, the probe is ended so it's left in a clean
+	// state, and any cancellation requested during the call is cleared so it doesn't spill over into the next one
+	template<typename function_t> [[nodiscard]] bmpflash_status_t cancellable(bmpflash_session_t *const session,
+		const function_t &function) noexcept
+	{
+		const auto status{guarded(function)};
+		if (session)
+		{
+			if (status == BMPFLASH_ERROR_CANCELLED)
+				static_cast<void>(session->session.end());
+			session->cancellation.reset();
+		}
+		return status;
+	}
+
+	[[nodiscard]] static std::optional<spiBus_t> busFrom(const bmpflash_bus_t bus) noexcept
+	{
+		switch (bus)
+		{
+			case BMPFLASH_BUS_EXTERNAL:
+				return spiBus_t::external;
+			case BMPFLASH_BUS_INTERNAL:
+				return spiBus_t::internal;
+		}
+		return std::nullopt;
+	}
+
+	// Get the session on to the requested bus, checking the range given is entirely within the Flash there
+	[[nodiscard]] static bmpflash_status_t select(bmpflash_session_t *const session, const bmpflash_bus_t bus,
+		const uint32_t address, const size_t length, flashTarget_t *&target)
+	{
+		const auto spiBus{busFrom(bus)};
+		if (!session || !spiBus)
+			return BMPFLASH_ERROR_INVALID_ARGUMENT;
+		target = session->session.select(*spiBus);
+		if (!target)
+			return session->session.active() ? BMPFLASH_ERROR_NO_FLASH : BMPFLASH_ERROR_COMMS;
+		const auto capacity{target->spiFlash.capacity()};
+		if (address > capacity || length > capacity - address)
+			return BMPFLASH_ERROR_OUT_OF_RANGE;
+		return BMPFLASH_OK;
+	}
+
+	[[nodiscard]] static bool cancelled(const bmpflash_progress_t progress, void *const context, const size_t done,
+		const size_t total)
+		{ return progress && progress(context, done, total) != 0; }
+} // namespace bmpflash::library
+
+using namespace bmpflash::library;
+
+void bmpflash_set_logging(const int enabled)
+{
+	if (enabled)
+		console = {stdout, stderr};
+	else
+		console = console_t{};
+}
+
+const char *bmpflash_status_string(const bmpflash_status_t status)
+{
+	switch (status)
+	{
+		case BMPFLASH_OK:
+			return "success";
+		case BMPFLASH_ERROR_INVALID_ARGUMENT:
+			return "invalid argument";
+		case BMPFLASH_ERROR_NO_PROBE:
+			return "no matching Black Magic Probe found";
+		case BMPFLASH_ERROR_COMMS:
+			return "communications with the probe failed";
+		case BMPFLASH_ERROR_NO_FLASH:
+			return "no valid Flash found on the requested bus";
+		case BMPFLASH_ERROR_OUT_OF_RANGE:
+			return "range is outside the Flash or not suitably aligned";
+		case BMPFLASH_ERROR_FLASH:
+			return "Flash operation failed";
+		case BMPFLASH_ERROR_CANCELLED:
+			return "operation cancelled";
+		case BMPFLASH_ERROR_INTERNAL:
+			return "internal error";
+	}
+	return "unknown status";
+}
+
+bmpflash_status_t bmpflash_open(const char *const serialNumber, bmpflash_session_t **const session)
+{
+	if (!session)
+		return BMPFLASH_ERROR_INVALID_ARGUMENT;
+	*session = nullptr;
+	return guarded([&]()
+	{
+		usbContext_t context{};
+		if (!context.valid())
+			return BMPFLASH_ERROR_INTERNAL;
+
+		// Pick the probe the same way as --serial does, falling back to the only one attached if not given one
+		const auto devices{bmpflash::findBMPs(context)};
+		std::optional<usbDevice_t> match{};
+		if (serialNumber)
+		{
+			const std::string_view targetSerialNumber{serialNumber};
+			for (const auto &device : devices)
+			{
+				if (device.serialNumberIndex() == 0U ||
+					bmpflash::readSerialNumber(device).find(targetSerialNumber) == std::string_view::npos)
+					continue;
+				match = device;
+				break;
+			}
+		}
+		else if (devices.size() == 1U)
+			match = devices[0];
+		if (!match)
+			return BMPFLASH_ERROR_NO_PROBE;
+
+		*session = new bmpflash_session_t{std::move(context), *match};
+		return BMPFLASH_OK;
+	});
+}
+
+void bmpflash_close(bmpflash_session_t *const session)
+{
+	if (!session)
+		return;
+	static_cast<void>(session->session.end());
+	delete session;
+}
+
+const char *bmpflash_serial_number(const bmpflash_session_t *const session)
+	{ return session ? session->session.serialNumber().c_str() : nullptr; }
+
+bmpflash_status_t bmpflash_get_geometry(bmpflash_session_t *const session, const bmpflash_bus_t bus,
+	bmpflash_geometry_t *const geometry)
+{
+	if (!geometry)
+		return BMPFLASH_ERROR_INVALID_ARGUMENT;
+	return cancellable(session, [&]()
+	{
+		flashTarget_t *target{nullptr};
+		if (const auto status{select(session, bus, 0U, 0U, target)}; status != BMPFLASH_OK)
+			return status;
+		const auto &spiFlash{target->spiFlash};
+		*geometry =
+		{
+			target->chipID.manufacturer, target->chipID.type, target->chipID.capacity,
+			spiFlash.capacity(), spiFlash.pageSize(), spiFlash.eraseGranularity(0U),
+		};
+		return BMPFLASH_OK;
+	});
+}
+
+bmpflash_status_t bmpflash_read(bmpflash_session_t *const session, const bmpflash_bus_t bus, const uint32_t address,
+	void *const buffer, const size_t length, const bmpflash_progress_t progress, void *const context)
+{
+	if (!buffer && length)
+		return BMPFLASH_ERROR_INVALID_ARGUMENT;
+	return cancellable(session, [&]()
+	{
+		flashTarget_t *target{nullptr};
+		if (const auto status{select(session, bus, address, length, target)}; status != BMPFLASH_OK)
+			return status;
+		const auto &probe{session->session.probe()};
+		// Read in chunks of a sector's worth so progress gets reported at a sensible rate
+		const auto chunkLength{target->spiFlash.sectorSize()};
+		span<uint8_t> data{static_cast<uint8_t *>(buffer), length};
+		for (size_t offset{0U}; offset < length; offset += chunkLength)
+		{
+			const auto amount{std::min<size_t>(chunkLength, length - offset)};
+			if (!target->spiFlash.readBlock(probe, address + offset, data.subspan(offset, amount)))
+				return BMPFLASH_ERROR_FLASH;
+			if (cancelled(progress, context, offset + amount, length))
+				return BMPFLASH_ERROR_CANCELLED;
+		}
+		return BMPFLASH_OK;
+	});
+}
+
+bmpflash_status_t bmpflash_write(bmpflash_session_t *const session, const bmpflash_bus_t bus, const uint32_t address,
+	const void *const buffer, const size_t length, const bmpflash_progress_t progress, void *const context)
+{
+	if (!buffer && length)
+		return BMPFLASH_ERROR_INVALID_ARGUMENT;
+	return cancellable(session, [&]()
+	{
+		flashTarget_t *target{nullptr};
+		if (const auto status{select(session, bus, address, length, target)}; status != BMPFLASH_OK)
+			return status;
+		const auto &probe{session->session.probe()};
+		auto &spiFlash{target->spiFlash};
+		const span<const uint8_t> data{static_cast<const uint8_t *>(buffer), length};
+		const auto end{size_t{address} + length};
+		std::vector<uint8_t> block{};
+
+		// Work through the range an erase block at a time, merging in what's already in the Flash for any
+		// erase block the range only partially covers
+		for (size_t position{address}; position < end;)
+		{
+			const auto blockLength{spiFlash.eraseGranularity(position)};
+			const auto blockStart{position - (position % blockLength)};
+			const auto blockEnd{blockStart + blockLength};
+			const auto amount{std::min(blockEnd, end) - position};
+			block.resize(blockLength);
+			if (blockStart < address || blockEnd > end)
+			{
+				if (!spiFlash.readBlock(probe, blockStart, {block.data(), block.size()}))
+					return BMPFLASH_ERROR_FLASH;
+			}
+			std::copy_n(data.data() + (position - address), amount, block.data() + (position - blockStart));
+			if (!spiFlash.writeBlock(probe, blockStart, {block.data(), block.size()}))
+				return BMPFLASH_ERROR_FLASH;
+			position += amount;
+			if (cancelled(progress, context, position - address, length))
+				return BMPFLASH_ERROR_CANCELLED;
+		}
+		return BMPFLASH_OK;
+	});
+}
+
+bmpflash_status_t bmpflash_erase(bmpflash_session_t *const session, const bmpflash_bus_t bus, const uint32_t address,
+	const size_t length, const bmpflash_progress_t progress, void *const context)
+{
+	return cancellable(session, [&]()
+	{
+		flashTarget_t *target{nullptr};
+		if (const auto status{select(session, bus, address, length, target)}; status != BMPFLASH_OK)
+			return status;
+		if (!length)
+			return BMPFLASH_OK;
+		const auto &probe{session->session.probe()};
+		auto &spiFlash{target->spiFlash};
+		// Erasing has to be done in whole erase blocks, so refuse ranges that'd take out anything else
+		const auto end{size_t{address} + length};
+		if (address % spiFlash.eraseGranularity(address) != 0U || end % spiFlash.eraseGranularity(end - 1U) != 0U)
+			return BMPFLASH_ERROR_OUT_OF_RANGE;
+
+		const auto plan{spiFlash.planErase(address, length)};
+		if (!plan)
+			return BMPFLASH_ERROR_FLASH;
+		size_t erased{0U};
+		for (const auto &operation : *plan)
+		{
+			if (!spiFlash.erase(probe, operation))
+				return BMPFLASH_ERROR_FLASH;
+			erased += operation.type.size;
+			if (cancelled(progress, context, erased, length))
+				return BMPFLASH_ERROR_CANCELLED;
+		}
+		return BMPFLASH_OK;
+	});
+}
+
+void bmpflash_cancel(bmpflash_session_t *const session)
+{
+	if (session)
+		session->cancellation.cancel();
+}
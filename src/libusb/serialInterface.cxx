@@ -8,6 +8,8 @@
 #include <substrate/span>
 #include "libusb/serialInterface.hxx"
 #include "bmp.hxx"
+#include "trace.hxx"
+#include "capture.hxx"
 
 using substrate::console;
 using usb::descriptors::usbClass_t;
@@ -195,24 +197,46 @@ void serialInterface_t::swap(serialInterface_t &interface) noexcept
 	std::swap(rxEndpoint, interface.rxEndpoint);
 }
 
-void serialInterface_t::writePacket(const std::string_view &packet) const
+void serialInterface_t::writePacket(const std::string_view &packet, const milliseconds_t timeout) const
 {
 	console.debug("Remote write: "sv, packet);
-	if (!device.writeBulk(txEndpoint, packet.data(), static_cast<int32_t>(packet.length())))
+	bmpflash::trace::requestSent(packet);
+	bmpflash::capture::requestSent(packet);
+	if (!device.writeBulk(txEndpoint, packet.data(), static_cast<int32_t>(packet.length()), timeout))
 		throw bmpCommsError_t{};
 }
 
-std::string serialInterface_t::readPacket() const
+std::string serialInterface_t::readPacket(const milliseconds_t timeout) const
 {
 	std::array<char, bmp_t::maxPacketSize + 1U> packet{};
 	// Read back what we can and check we got a valid response packet
-	if (!device.readBulk(rxEndpoint, packet.data(), bmp_t::maxPacketSize) || packet[0] != '&')
+	if (!device.readBulk(rxEndpoint, packet.data(), bmp_t::maxPacketSize, timeout) || packet[0] != '&')
+	{
+		bmpflash::trace::responseReceived({}, false);
+		bmpflash::capture::responseReceived({}, false);
 		throw bmpCommsError_t{};
+	}
 	// Figure out how long that is (minus the beginning '&' and ending '#')
 	const auto length{std::strlen(packet.data() + 1U)};
 	packet[length] = '\0';
 	// Make a new std::string of an appropriate length, copying the data in to return it
 	std::string result{packet.data() + 1U, length};
 	console.debug("Remote read: "sv, result);
+	bmpflash::trace::responseReceived(result);
+	bmpflash::capture::responseReceived(result);
 	return result;
 }
+
+void serialInterface_t::resync() const noexcept
+{
+	// Throw away anything the probe still has queued for us (the rest of a mangled or late response, typically)
+	// so the next read starts on a packet boundary again. This stops at the first read to time out, or after
+	// enough reads that the probe is clearly not going to stop sending.
+	std::array<char, bmp_t::maxPacketSize> discard{};
+	for (const auto attempt : substrate::indexSequence_t{16U})
+	{
+		if (!device.readBulk(rxEndpoint, discard.data(), bmp_t::maxPacketSize, 10ms))
+			break;
+		console.debug("Discarded pending probe data during resynchronisation ("sv, attempt + 1U, ')');
+	}
+}
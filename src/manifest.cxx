@@ -0,0 +1,196 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// SPDX-FileCopyrightText: 2023 1BitSquared <info@1bitsquared.com>
+#include <cstring>
+#include <string_view>
+#include <vector>
+#include <array>
+#include <substrate/fd>
+#include <substrate/console>
+#include <substrate/span>
+#include <substrate/buffer_utils>
+#include "manifest.hxx"
+#include "crc32.hxx"
+
+using namespace std::literals::string_view_literals;
+using substrate::fd_t;
+using substrate::span;
+using substrate::console;
+using substrate::normalMode;
+using substrate::buffer_utils::writeLE;
+using substrate::buffer_utils::readLE;
+
+namespace bmpflash::manifest
+{
+	constexpr static std::array<char, 4> manifestMagic{{'B', 'M', 'P', 'M'}};
+	constexpr static uint16_t manifestVersion{2U};
+
+	/*
+	 * The manifest file is laid out as follows, with all values stored little endian:
+	 *
+	 *   0   1   2   3   4   5   6   7   8   9   A   B   C   D   E   F
+	 * +---+---+---+---+-------+---+---+-----------+---+---------------+
+	 * | B | M | P | M |  ver  |bus|len| JEDEC ID  |   |  sector size  | +0x00
+	 * +---+---+---+---+-------+---+---+-----------+---+---------------+
+	 * | sector count  | serial number (len bytes) ....                | +0x10
+	 * +---------------+-----------------------------------------------+
+	 *
+	 * The serial number is followed by `sector count` triples of uint32_t's giving the address of
+	 * each sector, its length and the CRC32 of its contents. The sector size in the header is the chip's
+	 * nominal sector size, used only to identify the chip. The file ends with a CRC32 covering every byte
+	 * before it.
+	 */
+	constexpr static size_t headerLength{20U};
+	constexpr static size_t sectorEntryLength{12U};
+
+	manifest_t::manifest_t(std::string serialNumber, const spiBus_t spiBus, const spiFlashID_t chipID,
+		const uint32_t sectorSize) noexcept : _serialNumber{std::move(serialNumber)}, _spiBus{spiBus},
+			_chipID{chipID}, _sectorSize{sectorSize} { }
+
+	std::optional<manifest_t> manifest_t::load(const path &fileName)
+	{
+		const fd_t file{fileName, O_RDONLY | O_NOCTTY};
+		if (!file.valid())
+			return std::nullopt;
+		const auto fileLength{file.length()};
+		if (fileLength < 0 || static_cast<size_t>(fileLength) < headerLength + 4U)
+		{
+			console.error("Manifest file is truncated"sv);
+			return std::nullopt;
+		}
+
+		std::vector<uint8_t> data(static_cast<size_t>(fileLength));
+		if (!file.read(data.data(), data.size()))
+		{
+			console.error("Failed to read manifest file"sv);
+			return std::nullopt;
+		}
+		const span<const uint8_t> manifestData{data.data(), data.size()};
+
+		// Check the magic and the version number before trusting anything else in the file
+		if (std::memcmp(manifestData.data(), manifestMagic.data(), manifestMagic.size()) != 0)
+		{
+			console.error("Manifest file is not a valid sector manifest"sv);
+			return std::nullopt;
+		}
+		if (readLE<uint16_t>(manifestData.subspan(4, 2)) != manifestVersion)
+		{
+			console.error("Manifest file was written by an incompatible version of bmpflash"sv);
+			return std::nullopt;
+		}
+
+		// Validate the file's CRC
+		const auto contentLength{data.size() - 4U};
+		uint32_t crc{0U};
+		crc32_t::crc(crc, manifestData.subspan(0, contentLength));
+		if (crc != readLE<uint32_t>(manifestData.subspan(contentLength, 4)))
+		{
+			console.error("Manifest file is corrupt (CRC mismatch)"sv);
+			return std::nullopt;
+		}
+
+		manifest_t manifest{};
+		manifest._spiBus = static_cast<spiBus_t>(manifestData[6]);
+		manifest._chipID = {manifestData[8], manifestData[9], manifestData[10]};
+		manifest._sectorSize = readLE<uint32_t>(manifestData.subspan(12, 4));
+		const auto sectorCount{readLE<uint32_t>(manifestData.subspan(16, 4))};
+		const size_t serialLength{manifestData[7]};
+		if (headerLength + serialLength + (sectorCount * sectorEntryLength) != contentLength)
+		{
+			console.error("Manifest file has an inconsistent length"sv);
+			return std::nullopt;
+		}
+		const auto serialNumber{manifestData.subspan(headerLength, serialLength)};
+		// NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+		manifest._serialNumber = {reinterpret_cast<const char *>(serialNumber.data()), serialNumber.size()};
+
+		for (size_t offset{headerLength + serialLength}; offset < contentLength; offset += sectorEntryLength)
+		{
+			const auto address{readLE<uint32_t>(manifestData.subspan(offset, 4))};
+			const auto length{readLE<uint32_t>(manifestData.subspan(offset + 4U, 4))};
+			const auto sectorCRC{readLE<uint32_t>(manifestData.subspan(offset + 8U, 4))};
+			manifest._sectors.emplace(address, sectorEntry_t{length, sectorCRC});
+		}
+		return manifest;
+	}
+
+	bool manifest_t::store(const path &fileName) const
+	{
+		const auto serialLength{std::min<size_t>(_serialNumber.size(), UINT8_MAX)};
+		std::vector<uint8_t> data(headerLength + serialLength + (_sectors.size() * sectorEntryLength) + 4U);
+		const span<uint8_t> manifestData{data.data(), data.size()};
+
+		std::memcpy(manifestData.data(), manifestMagic.data(), manifestMagic.size());
+		writeLE(manifestVersion, manifestData.subspan(4, 2));
+		manifestData[6] = static_cast<uint8_t>(_spiBus);
+		manifestData[7] = static_cast<uint8_t>(serialLength);
+		manifestData[8] = _chipID.manufacturer;
+		manifestData[9] = _chipID.type;
+		manifestData[10] = _chipID.capacity;
+		manifestData[11] = 0U;
+		writeLE(_sectorSize, manifestData.subspan(12, 4));
+		writeLE(static_cast<uint32_t>(_sectors.size()), manifestData.subspan(16, 4));
+		std::memcpy(manifestData.data() + headerLength, _serialNumber.data(), serialLength);
+
+		size_t offset{headerLength + serialLength};
+		for (const auto &[address, entry] : _sectors)
+		{
+			writeLE(address, manifestData.subspan(offset, 4));
+			writeLE(entry.length, manifestData.subspan(offset + 4U, 4));
+			writeLE(entry.crc, manifestData.subspan(offset + 8U, 4));
+			offset += sectorEntryLength;
+		}
+
+		uint32_t crc{0U};
+		crc32_t::crc(crc, manifestData.subspan(0, offset));
+		writeLE(crc, manifestData.subspan(offset, 4));
+
+		const fd_t file{fileName, O_WRONLY | O_CREAT | O_TRUNC | O_NOCTTY, normalMode};
+		if (!file.valid() || !file.write(data.data(), data.size()))
+		{
+			console.error("Failed to write manifest file"sv);
+			return false;
+		}
+		return true;
+	}
+
+	bool manifest_t::describesSameTarget(const manifest_t &other) const noexcept
+	{
+		return _serialNumber == other._serialNumber && _spiBus == other._spiBus &&
+			_chipID.manufacturer == other._chipID.manufacturer && _chipID.type == other._chipID.type &&
+			_chipID.capacity == other._chipID.capacity && _sectorSize == other._sectorSize;
+	}
+
+	bool manifest_t::sectorMatches(const uint32_t address, const uint32_t length, const uint32_t crc) const noexcept
+	{
+		const auto sector{_sectors.find(address)};
+		return sector != _sectors.end() && sector->second.length == length && sector->second.crc == crc;
+	}
+
+	void manifest_t::sector(const uint32_t address, const uint32_t length, const uint32_t crc)
+		{ _sectors.insert_or_assign(address, sectorEntry_t{length, crc}); }
+
+	bool manifest_t::overlapsSector(const uint32_t address, const uint32_t length) const noexcept
+	{
+		const auto end{uint64_t{address} + length};
+		// Find the first sector starting at or after the address, and check both it and the one before it
+		auto sector{_sectors.lower_bound(address)};
+		if (sector != _sectors.end() && sector->first < end)
+			return true;
+		if (sector == _sectors.begin())
+			return false;
+		--sector;
+		return uint64_t{sector->first} + sector->second.length > address;
+	}
+
+	void manifest_t::merge(const manifest_t &other)
+	{
+		// Sectors we already have an entry for were (re)written and so take precedence, anything
+		// else was left alone on the Flash and so the entry from the other manifest still holds.
+		// Entries that only partly overlap a (re)written sector no longer describe the Flash, so are dropped
+		for (const auto &[address, entry] : other._sectors)
+		{
+			if (!overlapsSector(address, entry.length))
+				_sectors.emplace(address, entry);
+		}
+	}
+} // namespace bmpflash::manifest
@@ -0,0 +1,467 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// SPDX-FileCopyrightText: 2023 1BitSquared <info@1bitsquared.com>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <array>
+#include <system_error>
+#if defined(_MSC_VER)
+#pragma warning(push)
+#pragma warning(disable: 4061 4365)
+#elif defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wswitch-enum"
+#pragma GCC diagnostic ignored "-Wsign-conversion"
+#endif
+#include <fmt/format.h>
+#if defined(_MSC_VER)
+#pragma warning(pop)
+#elif defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+#include <substrate/fd>
+#include <substrate/console>
+#include <substrate/span>
+#include <substrate/buffer_utils>
+#include <substrate/index_sequence>
+#include <substrate/indexed_iterator>
+#include "profileCache.hxx"
+#include "crc32.hxx"
+
+using namespace std::literals::string_view_literals;
+using substrate::fd_t;
+using substrate::span;
+using substrate::console;
+using substrate::normalMode;
+using substrate::buffer_utils::writeLE;
+using substrate::buffer_utils::readLE;
+using substrate::indexSequence_t;
+using substrate::indexedIterator_t;
+using bmpflash::spiFlash::eraseType_t;
+using bmpflash::spiFlash::maxEraseTypes;
+using bmpflash::spiFlash::maxEraseRegions;
+using bmpflash::spiFlash::timing_t;
+using bmpflash::spiFlash::microseconds;
+
+namespace bmpflash::profileCache
+{
+	constexpr static std::array<char, 4> chipProfileMagic{{'B', 'M', 'P', 'C'}};
+	constexpr static std::array<char, 4> probeProfileMagic{{'B', 'M', 'P', 'P'}};
+	constexpr static std::array<char, 4> packedImageMagic{{'B', 'M', 'P', 'I'}};
+	constexpr static uint16_t profileVersion{4U};
+	// This must be bumped any time the way provisioning lays out images changes
+	constexpr static uint16_t packedImageVersion{1U};
+
+	/*
+	 * Chip profiles are laid out as follows, with all values stored little endian:
+	 *
+	 *   0   1   2   3   4   5   6   7   8   9   A   B   C   D   E   F
+	 * +---+---+---+---+-------+-------+-----------+---+---------------+
+	 * | B | M | P | C |  ver  |  rsvd | JEDEC ID  |ers| SFDP hdr CRC  | +0x00
+	 * +---+---+---+---+-------+-------+-----------+---+---------------+
+	 * |   page size   |  sector size  |           capacity            | +0x10
+	 * +---+---+---+---+---------------+---------------+---------------+
+	 * |erase opcodes  | erase 1 size  | erase 2 size  | erase 3 size  | +0x20
+	 * +---+---+---+---+---+-----------+---------------+---------------+
+	 * | erase 4 size  |cnt|   rsvd    | timings ....                  | +0x30
+	 * +---------------+---+-----------+-------------------------------+
+	 *
+	 * The timings are stored as pairs of uint64_t's giving the typical and maximum times in microseconds,
+	 * for page program, first byte program, additional byte program and chip erase followed by erase
+	 * types 1 through 4. Each of the `cnt` erase regions follows, stored as a uint32_t length followed by
+	 * the erase types bitmask for the region and 3 reserved bytes. The file ends with a CRC32 covering
+	 * every byte before it.
+	 *
+	 * Probe profiles start with the magic and version, followed by the length of the serial number
+	 * and firmware version strings as a byte each and then the protocol version as a uint64_t. The
+	 * two strings follow that, and the file ends with a CRC32 covering every byte before it.
+	 *
+	 * Packed images start with the magic and image layout version, followed by 2 reserved bytes, the ELF
+	 * file CRC32, Flash geometry CRC32 and the ELF file length as a uint64_t. The image itself follows
+	 * that, and the file ends with a CRC32 covering every byte before it.
+	 */
+	constexpr static size_t chipProfileTimingsOffset{0x38U};
+	constexpr static size_t chipProfileTimingLength{16U};
+	constexpr static size_t chipProfileHeaderLength{chipProfileTimingsOffset + (chipProfileTimingLength * 8U)};
+	constexpr static size_t chipProfileRegionLength{8U};
+	constexpr static size_t probeProfileHeaderLength{16U};
+	constexpr static size_t maxProfileLength{4096U};
+	constexpr static size_t packedImageHeaderLength{24U};
+	// Images are addressed with uint32_t offsets, so can't be any larger than this
+	constexpr static size_t maxPackedImageLength{packedImageHeaderLength + UINT32_MAX + 4U};
+
+	[[nodiscard]] static std::optional<path> environmentPath(const char *const variable)
+	{
+		// NOLINTNEXTLINE(concurrency-mt-unsafe)
+		const auto *const value{std::getenv(variable)};
+		if (!value || !*value)
+			return std::nullopt;
+		path result{value};
+		// Relative paths in these variables are invalid and must be ignored
+		if (!result.is_absolute())
+			return std::nullopt;
+		return result;
+	}
+
+	std::optional<path> cacheDirectory()
+	{
+#if defined(_WIN32)
+		const auto localAppData{environmentPath("LOCALAPPDATA")};
+		if (!localAppData)
+			return std::nullopt;
+		return *localAppData / "bmpflash";
+#elif defined(__APPLE__)
+		const auto home{environmentPath("HOME")};
+		if (!home)
+			return std::nullopt;
+		return *home / "Library" / "Caches" / "bmpflash";
+#else
+		if (const auto cacheHome{environmentPath("XDG_CACHE_HOME")}; cacheHome)
+			return *cacheHome / "bmpflash";
+		const auto home{environmentPath("HOME")};
+		if (!home)
+			return std::nullopt;
+		return *home / ".cache" / "bmpflash";
+#endif
+	}
+
+	[[nodiscard]] static std::optional<std::vector<uint8_t>> readProfile(const path &fileName,
+		const size_t maxLength = maxProfileLength)
+	{
+		const fd_t file{fileName, O_RDONLY | O_NOCTTY};
+		if (!file.valid())
+			return std::nullopt;
+		const auto fileLength{file.length()};
+		// Anything larger than the entry could ever be is not something we wrote
+		if (fileLength < 4 || static_cast<size_t>(fileLength) > maxLength)
+			return std::nullopt;
+		std::vector<uint8_t> data(static_cast<size_t>(fileLength));
+		if (!file.read(data.data(), data.size()))
+			return std::nullopt;
+
+		// Check the trailing CRC to make sure the profile is intact before anything looks at it
+		const span<const uint8_t> profileData{data.data(), data.size()};
+		const auto contentLength{data.size() - 4U};
+		uint32_t crc{0U};
+		crc32_t::crc(crc, profileData.subspan(0, contentLength));
+		if (crc != readLE<uint32_t>(profileData.subspan(contentLength, 4)))
+		{
+			console.debug("Ignoring corrupt cache entry "sv, fileName.string());
+			return std::nullopt;
+		}
+		data.resize(contentLength);
+		return data;
+	}
+
+	static void writeProfile(const path &fileName, std::vector<uint8_t> &data)
+	{
+		// Tack the CRC on the end, then write the profile to a temporary file and move it into place
+		// so a concurrent run never sees a partially written profile
+		const auto contentLength{data.size()};
+		data.resize(contentLength + 4U);
+		const span<uint8_t> profileData{data.data(), data.size()};
+		uint32_t crc{0U};
+		crc32_t::crc(crc, profileData.subspan(0, contentLength));
+		writeLE(crc, profileData.subspan(contentLength, 4));
+
+		std::error_code error{};
+		std::filesystem::create_directories(fileName.parent_path(), error);
+		if (error)
+		{
+			console.debug("Failed to create cache directory: "sv, error.message());
+			return;
+		}
+		auto tempFileName{fileName};
+		tempFileName += ".tmp";
+		{
+			const fd_t file{tempFileName, O_WRONLY | O_CREAT | O_TRUNC | O_NOCTTY, normalMode};
+			if (!file.valid() || !file.write(data.data(), data.size()))
+			{
+				console.debug("Failed to write cache entry "sv, tempFileName.string());
+				return;
+			}
+		}
+		std::filesystem::rename(tempFileName, fileName, error);
+		if (error)
+		{
+			console.debug("Failed to update cache entry "sv, fileName.string(), ": "sv, error.message());
+			std::filesystem::remove(tempFileName, error);
+		}
+	}
+
+	[[nodiscard]] static timing_t readTiming(const span<const uint8_t> &profileData, const size_t index)
+	{
+		const auto timing{profileData.subspan(chipProfileTimingsOffset + (index * chipProfileTimingLength),
+			chipProfileTimingLength)};
+		return
+		{
+			microseconds{readLE<uint64_t>(timing.subspan(0, 8))},
+			microseconds{readLE<uint64_t>(timing.subspan(8, 8))},
+		};
+	}
+
+	static void writeTiming(const span<uint8_t> &profileData, const size_t index, const timing_t &value)
+	{
+		const auto timing{profileData.subspan(chipProfileTimingsOffset + (index * chipProfileTimingLength),
+			chipProfileTimingLength)};
+		writeLE(static_cast<uint64_t>(value.typical.count()), timing.subspan(0, 8));
+		writeLE(static_cast<uint64_t>(value.maximum.count()), timing.subspan(8, 8));
+	}
+
+	static bool discoveryCacheBypassed{false};
+
+	void bypassDiscoveryCache() noexcept { discoveryCacheBypassed = true; }
+
+	[[nodiscard]] static std::optional<path> chipProfilePath(const spiFlashID_t &chipID)
+	{
+		const auto directory{cacheDirectory()};
+		if (!directory || discoveryCacheBypassed)
+			return std::nullopt;
+		return *directory / fmt::format("chip-{:02x}{:02x}{:02x}.profile", chipID.manufacturer, chipID.type,
+			chipID.capacity);
+	}
+
+	[[nodiscard]] static std::optional<path> probeProfilePath(const std::string_view serialNumber,
+		const std::string_view firmwareVersion)
+	{
+		const auto directory{cacheDirectory()};
+		if (!directory || discoveryCacheBypassed)
+			return std::nullopt;
+		// Name the profile by a hash of the serial number and firmware version, which are checked on load
+		uint32_t crc{0U};
+		// NOLINTBEGIN(cppcoreguidelines-pro-type-reinterpret-cast)
+		crc32_t::crc(crc, {reinterpret_cast<const uint8_t *>(serialNumber.data()), serialNumber.size()});
+		crc32_t::crc(crc, {reinterpret_cast<const uint8_t *>(firmwareVersion.data()), firmwareVersion.size()});
+		// NOLINTEND(cppcoreguidelines-pro-type-reinterpret-cast)
+		return *directory / fmt::format("probe-{:08x}.profile", crc);
+	}
+
+	std::optional<chipProfile_t> loadChipProfile(const spiFlashID_t &chipID)
+	{
+		const auto fileName{chipProfilePath(chipID)};
+		if (!fileName)
+			return std::nullopt;
+		const auto data{readProfile(*fileName)};
+		if (!data || data->size() < chipProfileHeaderLength)
+			return std::nullopt;
+		const span<const uint8_t> profileData{data->data(), data->size()};
+
+		if (std::memcmp(profileData.data(), chipProfileMagic.data(), chipProfileMagic.size()) != 0 ||
+			readLE<uint16_t>(profileData.subspan(4, 2)) != profileVersion ||
+			profileData[8] != chipID.manufacturer || profileData[9] != chipID.type ||
+			profileData[10] != chipID.capacity)
+			return std::nullopt;
+		const size_t regionCount{profileData[0x34]};
+		if (chipProfileHeaderLength + (regionCount * chipProfileRegionLength) != profileData.size())
+			return std::nullopt;
+
+		spiFlash_t spiFlash
+		{
+			readLE<uint32_t>(profileData.subspan(0x10, 4)),
+			readLE<uint32_t>(profileData.subspan(0x14, 4)),
+			profileData[11],
+			readLE<uint64_t>(profileData.subspan(0x18, 8)),
+		};
+		if (!spiFlash.valid())
+			return std::nullopt;
+
+		spiFlash.timings({readTiming(profileData, 0U), readTiming(profileData, 1U), readTiming(profileData, 2U),
+			readTiming(profileData, 3U)});
+		std::array<eraseType_t, maxEraseTypes> eraseTypes{};
+		for (const auto idx : indexSequence_t{maxEraseTypes})
+		{
+			eraseTypes[idx] =
+			{
+				readLE<uint32_t>(profileData.subspan(0x24U + (idx * 4U), 4)),
+				profileData[0x20U + idx],
+				readTiming(profileData, 4U + idx),
+			};
+		}
+		spiFlash.eraseTypes(eraseTypes);
+		for (const auto idx : indexSequence_t{regionCount})
+		{
+			const auto region{profileData.subspan(chipProfileHeaderLength + (idx * chipProfileRegionLength),
+				chipProfileRegionLength)};
+			if (!spiFlash.addEraseRegion(readLE<uint32_t>(region.subspan(0, 4)), region[4]))
+				return std::nullopt;
+		}
+		return chipProfile_t{readLE<uint32_t>(profileData.subspan(12, 4)), spiFlash};
+	}
+
+	void storeChipProfile(const spiFlashID_t &chipID, const chipProfile_t &profile)
+	{
+		const auto fileName{chipProfilePath(chipID)};
+		if (!fileName)
+			return;
+		const auto &spiFlash{profile.spiFlash};
+		const auto regions{spiFlash.eraseRegions()};
+		std::vector<uint8_t> data(chipProfileHeaderLength + (regions.size() * chipProfileRegionLength));
+		const span<uint8_t> profileData{data.data(), data.size()};
+
+		std::memcpy(profileData.data(), chipProfileMagic.data(), chipProfileMagic.size());
+		writeLE(profileVersion, profileData.subspan(4, 2));
+		writeLE(uint16_t{0U}, profileData.subspan(6, 2));
+		profileData[8] = chipID.manufacturer;
+		profileData[9] = chipID.type;
+		profileData[10] = chipID.capacity;
+		profileData[11] = spiFlash.sectorEraseOpcode();
+		writeLE(profile.sfdpHeaderCRC, profileData.subspan(12, 4));
+		writeLE(spiFlash.pageSize(), profileData.subspan(0x10, 4));
+		writeLE(spiFlash.sectorSize(), profileData.subspan(0x14, 4));
+		writeLE(uint64_t{spiFlash.capacity()}, profileData.subspan(0x18, 8));
+		const auto &timings{spiFlash.timings()};
+		writeTiming(profileData, 0U, timings.pageProgram);
+		writeTiming(profileData, 1U, timings.byteProgram);
+		writeTiming(profileData, 2U, timings.additionalByteProgram);
+		writeTiming(profileData, 3U, timings.chipErase);
+		for (const auto &[idx, eraseType] : indexedIterator_t{spiFlash.eraseTypes()})
+		{
+			profileData[0x20U + idx] = eraseType.opcode;
+			writeLE(eraseType.size, profileData.subspan(0x24U + (idx * 4U), 4));
+			writeTiming(profileData, 4U + idx, eraseType.eraseTime);
+		}
+		profileData[0x34] = static_cast<uint8_t>(regions.size());
+		for (const auto &[idx, region] : indexedIterator_t{regions})
+		{
+			const auto regionData{profileData.subspan(chipProfileHeaderLength + (idx * chipProfileRegionLength),
+				chipProfileRegionLength)};
+			writeLE(region.length, regionData.subspan(0, 4));
+			regionData[4] = region.eraseTypes;
+		}
+		writeProfile(*fileName, data);
+	}
+
+	std::optional<probeCapabilities_t> loadProbeCapabilities(const std::string_view serialNumber,
+		const std::string_view firmwareVersion)
+	{
+		const auto fileName{probeProfilePath(serialNumber, firmwareVersion)};
+		if (!fileName)
+			return std::nullopt;
+		const auto data{readProfile(*fileName)};
+		if (!data || data->size() < probeProfileHeaderLength)
+			return std::nullopt;
+		const span<const uint8_t> profileData{data->data(), data->size()};
+
+		if (std::memcmp(profileData.data(), probeProfileMagic.data(), probeProfileMagic.size()) != 0 ||
+			readLE<uint16_t>(profileData.subspan(4, 2)) != profileVersion)
+			return std::nullopt;
+		const size_t serialLength{profileData[6]};
+		const size_t versionLength{profileData[7]};
+		if (probeProfileHeaderLength + serialLength + versionLength != profileData.size())
+			return std::nullopt;
+
+		// Check this profile really is for the probe and firmware asked about, and not a hash collision
+		// NOLINTBEGIN(cppcoreguidelines-pro-type-reinterpret-cast)
+		const std::string_view profileSerialNumber
+		{
+			reinterpret_cast<const char *>(profileData.data() + probeProfileHeaderLength),
+			serialLength
+		};
+		const std::string_view profileFirmwareVersion
+		{
+			reinterpret_cast<const char *>(profileData.data() + probeProfileHeaderLength + serialLength),
+			versionLength
+		};
+		// NOLINTEND(cppcoreguidelines-pro-type-reinterpret-cast)
+		if (profileSerialNumber != serialNumber || profileFirmwareVersion != firmwareVersion)
+			return std::nullopt;
+		return probeCapabilities_t{readLE<uint64_t>(profileData.subspan(8, 8))};
+	}
+
+	void storeProbeCapabilities(const std::string_view serialNumber, const std::string_view firmwareVersion,
+		const probeCapabilities_t &capabilities)
+	{
+		// Probes without a serial number can't be told apart, so don't cache anything about them
+		if (serialNumber.empty() || serialNumber.size() > UINT8_MAX || firmwareVersion.size() > UINT8_MAX)
+			return;
+		const auto fileName{probeProfilePath(serialNumber, firmwareVersion)};
+		if (!fileName)
+			return;
+		std::vector<uint8_t> data(probeProfileHeaderLength + serialNumber.size() + firmwareVersion.size());
+		const span<uint8_t> profileData{data.data(), data.size()};
+
+		std::memcpy(profileData.data(), probeProfileMagic.data(), probeProfileMagic.size());
+		writeLE(profileVersion, profileData.subspan(4, 2));
+		profileData[6] = static_cast<uint8_t>(serialNumber.size());
+		profileData[7] = static_cast<uint8_t>(firmwareVersion.size());
+		writeLE(capabilities.protocolVersion, profileData.subspan(8, 8));
+		std::memcpy(profileData.data() + probeProfileHeaderLength, serialNumber.data(), serialNumber.size());
+		std::memcpy(profileData.data() + probeProfileHeaderLength + serialNumber.size(), firmwareVersion.data(),
+			firmwareVersion.size());
+		writeProfile(*fileName, data);
+	}
+
+	uint32_t geometryCRC(const spiFlash_t &spiFlash) noexcept
+	{
+		// The layout depends on the capacity, and on the erase granularity everywhere on the device
+		std::array<uint8_t, 12U + (maxEraseTypes * 5U) + (maxEraseRegions * 5U)> geometry{};
+		const span<uint8_t> geometryData{geometry.data(), geometry.size()};
+		writeLE(uint64_t{spiFlash.capacity()}, geometryData.subspan(0, 8));
+		writeLE(spiFlash.sectorSize(), geometryData.subspan(8, 4));
+		size_t offset{12U};
+		for (const auto &eraseType : spiFlash.eraseTypes())
+		{
+			writeLE(eraseType.size, geometryData.subspan(offset, 4));
+			geometryData[offset + 4U] = eraseType.opcode;
+			offset += 5U;
+		}
+		for (const auto &region : spiFlash.eraseRegions())
+		{
+			writeLE(region.length, geometryData.subspan(offset, 4));
+			geometryData[offset + 4U] = region.eraseTypes;
+			offset += 5U;
+		}
+		uint32_t crc{0U};
+		crc32_t::crc(crc, geometryData.subspan(0, offset));
+		return crc;
+	}
+
+	[[nodiscard]] static std::optional<path> packedImagePath(const imageKey_t &key)
+	{
+		const auto directory{cacheDirectory()};
+		if (!directory)
+			return std::nullopt;
+		return *directory / "images" / fmt::format("image-{:08x}-{:x}-{:08x}.bin", key.elfCRC, key.elfLength,
+			key.geometryCRC);
+	}
+
+	std::optional<std::vector<uint8_t>> loadPackedImage(const imageKey_t &key)
+	{
+		const auto fileName{packedImagePath(key)};
+		if (!fileName)
+			return std::nullopt;
+		auto data{readProfile(*fileName, maxPackedImageLength)};
+		if (!data || data->size() < packedImageHeaderLength)
+			return std::nullopt;
+		const span<const uint8_t> imageData{data->data(), data->size()};
+
+		// Check this image really was built from the same ELF file for the same geometry
+		if (std::memcmp(imageData.data(), packedImageMagic.data(), packedImageMagic.size()) != 0 ||
+			readLE<uint16_t>(imageData.subspan(4, 2)) != packedImageVersion ||
+			readLE<uint32_t>(imageData.subspan(8, 4)) != key.elfCRC ||
+			readLE<uint32_t>(imageData.subspan(12, 4)) != key.geometryCRC ||
+			readLE<uint64_t>(imageData.subspan(16, 8)) != key.elfLength)
+			return std::nullopt;
+		data->erase(data->begin(), data->begin() + packedImageHeaderLength);
+		return data;
+	}
+
+	void storePackedImage(const imageKey_t &key, const span<const uint8_t> &image)
+	{
+		const auto fileName{packedImagePath(key)};
+		if (!fileName || image.size() > UINT32_MAX)
+			return;
+		std::vector<uint8_t> data(packedImageHeaderLength + image.size());
+		const span<uint8_t> imageData{data.data(), data.size()};
+
+		std::memcpy(imageData.data(), packedImageMagic.data(), packedImageMagic.size());
+		writeLE(packedImageVersion, imageData.subspan(4, 2));
+		writeLE(uint16_t{0U}, imageData.subspan(6, 2));
+		writeLE(key.elfCRC, imageData.subspan(8, 4));
+		writeLE(key.geometryCRC, imageData.subspan(12, 4));
+		writeLE(key.elfLength, imageData.subspan(16, 8));
+		std::memcpy(imageData.data() + packedImageHeaderLength, image.data(), image.size());
+		writeProfile(*fileName, data);
+	}
+} // namespace bmpflash::profileCache
@@ -0,0 +1,191 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// SPDX-FileCopyrightText: 2023 1BitSquared <info@1bitsquared.com>
+#include <cstdio>
+#include <string>
+#include <algorithm>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#if defined(_MSC_VER)
+#pragma warning(push)
+#pragma warning(disable: 4061 4365)
+#elif defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wswitch-enum"
+#pragma GCC diagnostic ignored "-Wsign-conversion"
+#endif
+#include <fmt/format.h>
+#if defined(_MSC_VER)
+#pragma warning(pop)
+#elif defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+#include <substrate/console>
+#include "progress.hxx"
+#include "units.hxx"
+
+using namespace std::literals::chrono_literals;
+using substrate::console;
+using bmpflash::utils::humanReadableSize;
+
+namespace bmpflash::progress
+{
+	constexpr static auto ttyReportInterval{100ms};
+	constexpr static auto lineReportInterval{1s};
+	constexpr static size_t progressBarWidth{30U};
+	// How long to measure the throughput for before trusting it over any expected time for the operation
+	constexpr static std::chrono::duration<double> minimumRateTime{2s};
+
+	[[nodiscard]] static bool stdoutIsTTY() noexcept
+	{
+#ifdef _WIN32
+		return _isatty(_fileno(stdout));
+#else
+		return isatty(fileno(stdout));
+#endif
+	}
+
+	[[nodiscard]] static std::string formatETA(const double seconds)
+	{
+		if (seconds < 0.0)
+			return "--:--";
+		const auto wholeSeconds{static_cast<uint64_t>(seconds)};
+		return fmt::format("{}:{:02}", wholeSeconds / 60U, wholeSeconds % 60U);
+	}
+
+	progress_t::progress_t(const std::string_view operation, const size_t totalBytes) noexcept :
+		_operation{operation}, _totalBytes{totalBytes}, _isTTY{stdoutIsTTY() && !console.showDebug()} { }
+
+	progress_t::~progress_t() noexcept
+	{
+		// If we were displaying a progress bar and never finished, terminate the line so
+		// any further output doesn't get appended to the bar
+		if (_isTTY && _displayed)
+			console.writeln();
+	}
+
+	void progress_t::begin(const phase_t phase) noexcept
+	{
+		_phase = phase;
+		_phaseStart = clock_t::now();
+	}
+
+	void progress_t::end(const size_t bytes)
+	{
+		const auto phaseTime{clock_t::now() - _phaseStart};
+		switch (_phase)
+		{
+			case phase_t::read:
+				_readTime += phaseTime;
+				break;
+			case phase_t::erase:
+				_eraseTime += phaseTime;
+				break;
+			case phase_t::program:
+				_programTime += phaseTime;
+				break;
+			case phase_t::idle:
+				break;
+		}
+		_phase = phase_t::idle;
+		_bytesDone += bytes;
+		_bytesTransferred += bytes;
+		report(false);
+	}
+
+	void progress_t::skip(const size_t bytes)
+	{
+		// Skipped data counts towards completion, but not towards the transfer rate
+		_bytesDone += bytes;
+		report(false);
+	}
+
+	void progress_t::finish()
+	{
+		report(true);
+		if (_isTTY)
+			console.writeln();
+		_displayed = false;
+	}
+
+	stats_t progress_t::stats() const noexcept
+	{
+		return
+		{
+			_bytesDone,
+			_bytesTransferred,
+			seconds_t{clock_t::now() - _startTime}.count(),
+			seconds_t{_readTime}.count(),
+			seconds_t{_eraseTime}.count(),
+			seconds_t{_programTime}.count(),
+		};
+	}
+
+	void progress_t::report(const bool final)
+	{
+		const auto now{clock_t::now()};
+		const auto sinceLastReport{now - _lastReport};
+		const auto reportInterval
+			{_isTTY ? clock_t::duration{ttyReportInterval} : clock_t::duration{lineReportInterval}};
+		if (!final && sinceLastReport < reportInterval)
+			return;
+
+		// Work out the throughput since the last report, and over the whole operation
+		const seconds_t sinceLastReportSeconds{sinceLastReport};
+		if (sinceLastReportSeconds.count() > 0.0)
+		{
+			_currentRate =
+				static_cast<double>(_bytesTransferred - _lastReportBytes) / sinceLastReportSeconds.count();
+		}
+		_lastReport = now;
+		_lastReportBytes = _bytesTransferred;
+		const seconds_t elapsed{now - _startTime};
+		const auto averageRate
+			{elapsed.count() > 0.0 ? static_cast<double>(_bytesTransferred) / elapsed.count() : 0.0};
+
+		// Estimate how long the remaining data will take at the average rate seen so far, or if we don't have
+		// enough of a measurement to go on yet, from the expected time for the operation if we have one
+		const auto bytesDone{std::min(_bytesDone, _totalBytes)};
+		const auto bytesRemaining{_totalBytes - bytesDone};
+		const auto eta
+		{
+			[&]()
+			{
+				if (_expectedTime.count() > 0.0 && _totalBytes && (averageRate <= 0.0 || elapsed < minimumRateTime))
+				{
+					const auto fractionRemaining
+						{static_cast<double>(bytesRemaining) / static_cast<double>(_totalBytes)};
+					return _expectedTime.count() * fractionRemaining;
+				}
+				return averageRate > 0.0 ? static_cast<double>(bytesRemaining) / averageRate : -1.0;
+			}()
+		};
+		const auto percentage{_totalBytes ? (bytesDone * 100U) / _totalBytes : 100U};
+
+		const auto eraseTime{seconds_t{_eraseTime}.count()};
+		const auto programTime{seconds_t{_programTime}.count()};
+		const auto readTime{seconds_t{_readTime}.count()};
+
+		if (_isTTY)
+		{
+			const auto filled{_totalBytes ? (bytesDone * progressBarWidth) / _totalBytes : progressBarWidth};
+			const auto [doneValue, doneUnits] = humanReadableSize(bytesDone);
+			const auto [totalValue, totalUnits] = humanReadableSize(_totalBytes);
+			console.writeln(fmt::format("\r\x1b[K{} [{}{}] {:3}% {}{}/{}{} {:.1f}KiB/s (avg {:.1f}KiB/s) ETA {}",
+				_operation, std::string(filled, '#'), std::string(progressBarWidth - filled, '.'), percentage,
+				doneValue, doneUnits, totalValue, totalUnits, _currentRate / 1024.0, averageRate / 1024.0,
+				formatETA(final ? 0.0 : eta)), nullptr);
+			// For writes, also show the split between time spent erasing and time spent programming
+			if (eraseTime > 0.0 || programTime > 0.0)
+				console.writeln(fmt::format(" [erase {:.1f}s, program {:.1f}s]", eraseTime, programTime), nullptr);
+			_displayed = true;
+		}
+		else
+			console.writeln(fmt::format("progress operation={} bytes={} total={} rate={:.1f} average={:.1f} "
+				"read={:.3f} erase={:.3f} program={:.3f} eta={}", _operation, bytesDone, _totalBytes,
+				_currentRate / 1024.0, averageRate / 1024.0, readTime, eraseTime, programTime,
+				final ? 0 : static_cast<int64_t>(eta)));
+	}
+} // namespace bmpflash::progress
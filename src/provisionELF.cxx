@@ -2,9 +2,27 @@
 // SPDX-FileCopyrightText: 2023 1BitSquared <info@1bitsquared.com>
 // SPDX-FileContributor: Written by Rachel Mant <git@dragonmux.network>
 #include <cstddef>
+#include <cstring>
+#include <algorithm>
 #include <string_view>
-#include <map>
 #include <optional>
+#include <future>
+#include <atomic>
+#include <thread>
+#if defined(_MSC_VER)
+#pragma warning(push)
+#pragma warning(disable: 4061 4365)
+#elif defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wswitch-enum"
+#pragma GCC diagnostic ignored "-Wsign-conversion"
+#endif
+#include <fmt/format.h>
+#if defined(_MSC_VER)
+#pragma warning(pop)
+#elif defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
 #include <substrate/fd>
 #include <substrate/console>
 #include <substrate/index_sequence>
@@ -13,7 +31,8 @@
 #include <substrate/buffer_utils>
 #include "provisionELF.hxx"
 #include "crc32.hxx"
-#include "sfdp.hxx"
+#include "profileCache.hxx"
+#include "progress.hxx"
 
 using namespace std::literals::string_view_literals;
 using substrate::asHex_t;
@@ -21,7 +40,11 @@ using substrate::indexSequence_t;
 using substrate::indexedIterator_t;
 using substrate::operator ""_KiB;
 using substrate::buffer_utils::writeLE;
+using substrate::buffer_utils::readLE;
 using bmpflash::spiFlash::spiFlash_t;
+using bmpflash::spiFlash::eraseOperation_t;
+using bmpflash::progress::progress_t;
+using bmpflash::progress::phase_t;
 
 namespace bmpflash::elf
 {
@@ -34,6 +57,16 @@ namespace bmpflash::elf
 		uint64_t flashAddr{};
 	};
 
+	struct imageSlot_t final
+	{
+		uint16_t firstSection{};
+		uint16_t sectionCount{};
+		uint32_t flags{};
+	};
+
+	// The slot's image must be placed at the Flash offset of its first section
+	constexpr static uint32_t slotFixedOffset{1U};
+
 	/*
 	 * The Flash header is laid out as follows:
 	 *
@@ -44,19 +77,89 @@ namespace bmpflash::elf
 	 *
 	 * Where '....' at the end signals the start of the packed flashSection_t headers.
 	 *
+	 * The section headers are followed by the magic 'BMPC' and then a CRC32 per section of the
+	 * section's data, which allows a later provisioning run to tell which sections are unchanged.
+	 *
+	 * When more than one image is provisioned, or an image is placed at a fixed offset, the CRCs are
+	 * followed by the magic 'BMPS', a uint32_t slot count and then an imageSlot_t for each image giving
+	 * the range of sections that belong to it. The sections of every slot are listed in the header in
+	 * slot order, so firmware that knows nothing of slots simply programs all the images in turn.
+	 *
 	 * The CRC32 value covers all bytes in the page and is calculated assuming the
 	 * CRC32 is value 0xfffffffFU.
 	 */
 	struct flashHeader_t final
 	{
-		// NOLINTNEXTLINE(misc-non-private-member-variables-in-classes)
+		// NOLINTBEGIN(misc-non-private-member-variables-in-classes)
 		std::vector<flashSection_t> sections{};
+		std::vector<uint32_t> sectionCRCs{};
+		std::vector<imageSlot_t> slots{};
+		// NOLINTEND(misc-non-private-member-variables-in-classes)
+
 		[[nodiscard]] bool toPage(span<uint8_t> pageBuffer) const noexcept;
+		[[nodiscard]] static std::optional<flashHeader_t> fromPage(span<const uint8_t> pageBuffer) noexcept;
+	};
+
+	constexpr static std::array<char, 4> sectionCRCMagic{{'B', 'M', 'P', 'C'}};
+	constexpr static std::array<char, 4> slotTableMagic{{'B', 'M', 'P', 'S'}};
+	constexpr static size_t flashSectionLength{16U};
+	constexpr static size_t imageSlotLength{8U};
+
+	// A PT_LOAD segment, covering the virtual addresses [begin, end)
+	struct segment_t final
+	{
+		uint64_t begin;
+		uint64_t end;
+		programHeader_t header;
 	};
 
-	using segmentMap_t = std::map<uint64_t, const programHeader_t &>;
+	// PT_LOAD segments sorted by virtual address, so the one holding a section can be found by bisection
+	using segmentMap_t = std::vector<segment_t>;
 	using block_t = std::array<uint8_t, 4_KiB>;
 
+	enum class severity_t : uint8_t
+	{
+		debug,
+		info,
+		error,
+	};
+
+	// A message from loading an image, held back so it can be printed from the thread waiting on the load
+	struct diagnostic_t final
+	{
+		severity_t severity{};
+		std::string message{};
+	};
+
+	// Set while an image is being loaded on a worker thread, so the loader's messages don't interleave
+	thread_local static std::vector<diagnostic_t> *loaderDiagnostics{nullptr};
+
+	static void display(const diagnostic_t &diagnostic)
+	{
+		const std::string_view message{diagnostic.message};
+		switch (diagnostic.severity)
+		{
+			case severity_t::debug:
+				console.debug(message);
+				break;
+			case severity_t::info:
+				console.info(message);
+				break;
+			case severity_t::error:
+				console.error(message);
+				break;
+		}
+	}
+
+	static void diagnose(const severity_t severity, std::string message)
+	{
+		diagnostic_t diagnostic{severity, std::move(message)};
+		if (loaderDiagnostics)
+			loaderDiagnostics->push_back(std::move(diagnostic));
+		else
+			display(diagnostic);
+	}
+
 	provision_t::provision_t(const path &fileName) noexcept : file{fd_t{fileName, O_RDONLY | O_NOCTTY}} { }
 
 	bool provision_t::valid() const noexcept
@@ -64,7 +167,7 @@ namespace bmpflash::elf
 		const auto &elfHeader{file.header()};
 		if (elfHeader.magic() != elfMagic)
 		{
-			console.error("File is not a valid ELF file"sv);
+			diagnose(severity_t::error, "File is not a valid ELF file");
 			return false;
 		}
 
@@ -85,136 +188,690 @@ namespace bmpflash::elf
 			if (progHeader.fileLength() >= UINT32_C(0xffffffff) ||
 				progHeader.offset() >= UINT32_C(0xffffffff))
 			{
-				console.error("Reading program header for chunk "sv, headerIndex, " failed"sv);
+				diagnose(severity_t::error, fmt::format("Reading program header for chunk {} failed", headerIndex));
 				return std::nullopt;
 			}
 
 			if (progHeader.type() == programHeaderType_t::load && progHeader.fileLength() != 0)
-				segmentMap.emplace(progHeader.virtualAddress(), progHeader);
+			{
+				const auto address{progHeader.virtualAddress()};
+				segmentMap.push_back({address, address + progHeader.memoryLength(), progHeader});
+			}
 		}
+		// The ELF spec requires loadable segments be sorted by address already, but don't rely on that
+		std::stable_sort(segmentMap.begin(), segmentMap.end(),
+			[](const segment_t &lhs, const segment_t &rhs) { return lhs.begin < rhs.begin; });
 		return segmentMap;
 	}
 
 	[[nodiscard]] auto map(const segmentMap_t &segmentMap, const sectionHeader_t &sectHeader)
 	{
-		for (auto begin{segmentMap.begin()}; begin != segmentMap.end(); ++begin)
+		// Loadable segments may not overlap, so the only segment that can hold the section is
+		// the last one starting at or before the section's address
+		const auto sectHdrBegin{sectHeader.address()};
+		const auto sectHdrEnd{sectHdrBegin + sectHeader.fileLength()};
+		auto segment
 		{
-			const auto &[_, progHeader] = *begin;
-			const auto progHdrEnd{progHeader.virtualAddress() + progHeader.memoryLength()};
-			const auto sectHdrEnd{sectHeader.address() + sectHeader.fileLength()};
-			if (sectHeader.address() >= progHeader.virtualAddress() && sectHdrEnd <= progHdrEnd)
-				return begin;
-		}
+			std::upper_bound(segmentMap.begin(), segmentMap.end(), sectHdrBegin,
+				[](const uint64_t address, const segment_t &candidate) { return address < candidate.begin; })
+		};
+		if (segment == segmentMap.begin())
+			return segmentMap.end();
+		--segment;
+		if (sectHdrEnd <= segment->end)
+			return segment;
 		return segmentMap.end();
 	}
 
-	[[nodiscard]] uint32_t currentOffsetFrom(const flashHeader_t &flashHeader) noexcept
+	[[nodiscard]] bool extendsRun(const sectionRun_t &run, const segmentMap_t::const_iterator runSegment,
+		const segmentMap_t::const_iterator segment, const sectionHeader_t &sectHeader) noexcept
 	{
-		// If there are no sections stored yet, the offset of the first is at the start of the second erase block
-		if (flashHeader.sections.empty())
-			return static_cast<uint32_t>(4_KiB);
-		// Otherwise, grab the last and compute the next offset
-		const auto &last{flashHeader.sections.back()};
-		const auto offset{last.offset + last.length};
-		// Adjust the resulting value to the start of the next erase block
-		return static_cast<uint32_t>((offset + (4_KiB - 1U)) & ~(4_KiB - 1U));
+		// Sections can only be merged if they come from the same segment and follow on from the run,
+		// allowing for any padding the linker inserted to satisfy the new section's alignment
+		if (segment != runSegment || sectHeader.address() < run.end())
+			return false;
+		const auto padding{sectHeader.address() - run.end()};
+		return padding < std::max<uint64_t>(sectHeader.alignment(), 1U);
 	}
 
-	bool packSection(const elf_t &file, const bmp_t &probe, spiFlash_t &spiFlash, flashHeader_t &flashHeader,
-		const size_t sectionIndex, const segmentMap_t &segmentMap)
+	[[nodiscard]] std::optional<std::vector<sectionRun_t>> collectRuns(const elf_t &file,
+		const segmentMap_t &segmentMap)
 	{
-		const auto &sectHeader{file.sectionHeaders()[sectionIndex]};
-		const auto sectName{file.sectionNames().stringFromOffset(sectHeader.nameOffset())};
-		console.debug("Looking for section "sv, sectionIndex, " ("sv, sectName,
-			") in segment map. Section has address 0x"sv, asHex_t<8, '0'>{sectHeader.address()});
-		auto segment{map(segmentMap, sectHeader)};
-		if (segment == segmentMap.end() || !sectHeader.fileOffset())
-			return true;
-		const auto &progHeader{segment->second};
+		std::vector<sectionRun_t> runs{};
+		auto runSegment{segmentMap.end()};
+		for (const auto &[sectionIndex, sectHeader] : indexedIterator_t{file.sectionHeaders()})
+		{
+			const auto sectName{file.sectionNames().stringFromOffset(sectHeader.nameOffset())};
+			diagnose(severity_t::debug, fmt::format("Looking for section {} ({}) in segment map. "
+				"Section has address 0x{:08x}", sectionIndex, sectName, sectHeader.address()));
+			const auto segment{map(segmentMap, sectHeader)};
+			if (segment == segmentMap.end() || !sectHeader.fileOffset())
+				continue;
+
+			if (sectHeader.fileLength() == 0)
+			{
+				diagnose(severity_t::debug, "Section is empty, skipping");
+				continue;
+			}
+
+			diagnose(severity_t::debug, "Found section in segment map, attempting to get underlying data for it");
+			const auto sectionData{file.dataFor(sectHeader)};
+			if (sectionData.empty())
+			{
+				diagnose(severity_t::error, fmt::format("Cannot get any underlying data for section {} ({}) "
+					"at address {:x}", sectionIndex, sectName, sectHeader.address()));
+				return std::nullopt;
+			}
+
+			const auto &progHeader{segment->header};
+			if (runs.empty() || !extendsRun(runs.back(), runSegment, segment, sectHeader))
+			{
+				const auto address{sectHeader.address()};
+				runs.push_back({address, progHeader.physicalAddress() + (address - progHeader.virtualAddress())});
+				runSegment = segment;
+			}
+			else
+			{
+				// Fill any alignment padding between the run and this section from the segment's own data
+				auto &run{runs.back()};
+				const auto segmentData{file.dataFor(progHeader)};
+				const auto paddingOffset{run.end() - progHeader.virtualAddress()};
+				const auto padding{static_cast<size_t>(sectHeader.address() - run.end())};
+				for (const auto &idx : indexSequence_t{padding})
+				{
+					const auto offset{paddingOffset + idx};
+					run.data.push_back(offset < segmentData.size() ? segmentData[offset] : 0xffU);
+				}
+				diagnose(severity_t::debug, fmt::format("Merging section into the run at 0x{:08x}", run.address));
+			}
+			auto &run{runs.back()};
+			run.data.insert(run.data.end(), sectionData.begin(), sectionData.end());
+		}
+		return runs;
+	}
+
+	/*
+	 * A Flash run is a run of sections as stored on the Flash, which has either just been built from an
+	 * ELF file or has been recovered from the header of a packed image
+	 */
+	struct flashRun_t final
+	{
+		// NOLINTBEGIN(misc-non-private-member-variables-in-classes)
+		uint64_t flashAddr;
+		span<const uint8_t> data;
+		uint32_t crc;
+		std::optional<uint32_t> fixedOffset{};
+		std::optional<uint32_t> offset{};
+		bool unchanged{false};
+		// NOLINTEND(misc-non-private-member-variables-in-classes)
+
+		[[nodiscard]] bool matches(const flashSection_t &section, const uint32_t sectionCRC) const noexcept
+			{ return section.flashAddr == flashAddr && section.length == data.size() && sectionCRC == crc; }
+	};
+
+	[[nodiscard]] size_t nextEraseBoundary(const spiFlash_t &spiFlash, size_t offset) noexcept
+	{
+		// Adjust the offset to the start of the next erase block, taking into account that the
+		// erase block size can change as we cross into a new region of the Flash
+		for (auto granularity{spiFlash.eraseGranularity(offset)}; offset % granularity;
+			granularity = spiFlash.eraseGranularity(offset))
+			offset += granularity - (offset % granularity);
+		return offset;
+	}
+
+	// Tracks which erase blocks of the Flash have been given over to the header and to runs
+	struct flashAllocator_t final
+	{
+	private:
+		const spiFlash_t &_spiFlash;
+		std::vector<std::pair<size_t, size_t>> _allocations{};
+
+		[[nodiscard]] std::pair<size_t, size_t> extent(const size_t offset, const size_t length) const noexcept
+			{ return {offset, nextEraseBoundary(_spiFlash, offset + length)}; }
+
+		[[nodiscard]] bool available(const std::pair<size_t, size_t> &allocation) const noexcept
+		{
+			const auto &[begin, end] = allocation;
+			return std::none_of(_allocations.begin(), _allocations.end(),
+				[&](const auto &other) { return begin < other.second && other.first < end; });
+		}
+
+	public:
+		// The header always owns the first erase block of the Flash
+		flashAllocator_t(const spiFlash_t &spiFlash) : _spiFlash{spiFlash}
+			{ _allocations.emplace_back(0U, spiFlash.eraseGranularity(0U)); }
 
-		if (sectHeader.fileLength() == 0)
+		// Try to claim a specific region, as used by a run that is already on the Flash
+		[[nodiscard]] bool claim(const size_t offset, const size_t length)
 		{
-			console.debug("Section is empty, skipping"sv);
+			const auto allocation{extent(offset, length)};
+			if (allocation.second > _spiFlash.capacity() || !available(allocation))
+				return false;
+			_allocations.push_back(allocation);
 			return true;
 		}
 
-		flashSection_t flashSection{};
-		flashSection.offset = currentOffsetFrom(flashHeader);
-		flashSection.flashAddr = progHeader.physicalAddress() + (sectHeader.address() - progHeader.virtualAddress());
+		// Find the first erase-aligned region big enough to hold a run, and claim it
+		[[nodiscard]] std::optional<uint32_t> allocate(const size_t length)
+		{
+			auto allocation{extent(0U, length)};
+			for (bool moved{true}; moved;)
+			{
+				moved = false;
+				for (const auto &[begin, end] : _allocations)
+				{
+					if (allocation.first < end && begin < allocation.second)
+					{
+						allocation = extent(nextEraseBoundary(_spiFlash, end), length);
+						moved = true;
+					}
+				}
+			}
+			if (allocation.second > _spiFlash.capacity())
+				return std::nullopt;
+			_allocations.push_back(allocation);
+			return static_cast<uint32_t>(allocation.first);
+		}
+	};
+
+	[[nodiscard]] std::optional<flashHeader_t> readFlashHeader(const bmp_t &probe, spiFlash_t &spiFlash)
+	{
+		block_t headerBuffer{};
+		if (!spiFlash.readBlock(probe, 0U, headerBuffer))
+			return std::nullopt;
+		auto flashHeader{flashHeader_t::fromPage(headerBuffer)};
+		if (!flashHeader)
+			console.info("No valid Flash header found on the on-board Flash, writing all sections"sv);
+		else if (flashHeader->sectionCRCs.empty())
+			console.info("Existing Flash header does not carry section CRCs, writing all sections"sv);
+		return flashHeader;
+	}
 
-		console.debug("Found section in segment map, attempting to get underlying data for it"sv);
-		const auto sectionData{file.dataFor(sectHeader)};
-		if (sectionData.empty())
+	[[nodiscard]] bool layoutRuns(std::vector<flashRun_t> &runs, const std::optional<flashHeader_t> &existingHeader,
+		const spiFlash_t &spiFlash)
+	{
+		flashAllocator_t allocator{spiFlash};
+		const auto alreadyPresent
 		{
-			console.error("Cannot get any underlying data for section "sv, sectionIndex, " ("sv, sectName,
-				") at address "sv, asHex_t{sectHeader.address()});
-			return false;
+			[&](const flashRun_t &run, const uint32_t offset)
+			{
+				if (!existingHeader)
+					return false;
+				const auto &sections{existingHeader->sections};
+				for (const auto &[index, crc] : indexedIterator_t{existingHeader->sectionCRCs})
+				{
+					if (sections[index].offset == offset && run.matches(sections[index], crc))
+						return true;
+				}
+				return false;
+			}
+		};
+
+		// Runs from images that have to live at a specific offset go down first
+		for (auto &run : runs)
+		{
+			if (!run.fixedOffset)
+				continue;
+			const auto offset{*run.fixedOffset};
+			if (offset % spiFlash.eraseGranularity(offset) || !allocator.claim(offset, run.data.size()))
+			{
+				console.error("Cannot place image data at fixed offset +0x"sv, asHex_t{offset},
+					", it is not erase block aligned, overlaps other data or does not fit in the Flash"sv);
+				return false;
+			}
+			run.offset = offset;
+			run.unchanged = alreadyPresent(run, offset);
+		}
+
+		// Then find all the runs that are already on the Flash, leaving them where they are
+		if (existingHeader)
+		{
+			const auto &sections{existingHeader->sections};
+			for (auto &run : runs)
+			{
+				if (run.offset)
+					continue;
+				for (const auto &[index, crc] : indexedIterator_t{existingHeader->sectionCRCs})
+				{
+					const auto &section{sections[index]};
+					if (!run.matches(section, crc) || !allocator.claim(section.offset, section.length))
+						continue;
+					run.offset = section.offset;
+					run.unchanged = true;
+					break;
+				}
+			}
+		}
+
+		// Now find space for everything that changed
+		for (auto &run : runs)
+		{
+			if (run.offset)
+				continue;
+			run.offset = allocator.allocate(run.data.size());
+			if (!run.offset)
+			{
+				console.error("Firmware image does not fit in the on-board Flash"sv);
+				return false;
+			}
+		}
+		return true;
+	}
+
+	[[nodiscard]] size_t imageLength(const std::vector<flashRun_t> &runs) noexcept
+	{
+		// Add up the length of all the runs that programRun() will end up writing to Flash
+		size_t length{0U};
+		for (const auto &run : runs)
+			length += run.data.size();
+		return length;
+	}
+
+	[[nodiscard]] std::optional<std::vector<eraseOperation_t>> planErase(const std::vector<flashRun_t> &runs,
+		const spiFlash_t &spiFlash)
+	{
+		// Work out which parts of the Flash need erasing for the runs being written, merging the
+		// ranges of neighbouring runs so that erases can span the boundaries between them
+		std::vector<std::pair<size_t, size_t>> ranges{};
+		for (const auto &run : runs)
+		{
+			if (!run.unchanged)
+				ranges.emplace_back(*run.offset, nextEraseBoundary(spiFlash, *run.offset + run.data.size()));
 		}
+		std::sort(ranges.begin(), ranges.end());
 
-		console.debug("Transfering "sv, sectionData.size(), " bytes of data to on-board Flash at offset +0x"sv,
-			asHex_t{flashSection.offset});
-		block_t segmentBuffer{};
-		for (const auto offset : indexSequence_t{sectionData.size()}.step(segmentBuffer.size()))
+		std::vector<eraseOperation_t> plan{};
+		for (auto range{ranges.begin()}; range != ranges.end();)
 		{
-			// Figure out how many bytes we can sling at the segment buffer
-			const size_t amount{std::min(segmentBuffer.size(), sectionData.size() - offset)};
-			// Request the appropriate subspan from the sectionData span
-			const auto subspan{sectionData.subspan(offset, amount)};
-			// Copy the data, and then fill any remaining space with the Flash blank constant
-			std::copy(subspan.begin(), subspan.end(), segmentBuffer.begin());
-			for (const auto &idx : substrate::indexSequence_t{subspan.size(), segmentBuffer.size()})
-				segmentBuffer[idx] = 0xffU;
+			const auto begin{range->first};
+			auto end{range->second};
+			for (++range; range != ranges.end() && range->first <= end; ++range)
+				end = std::max(end, range->second);
+			const auto rangePlan{spiFlash.planErase(begin, end - begin)};
+			if (!rangePlan)
+				return std::nullopt;
+			plan.insert(plan.end(), rangePlan->begin(), rangePlan->end());
+		}
+		return plan;
+	}
 
-			const auto blockOffset{flashSection.offset + offset};
-			if (!spiFlash.writeBlock(probe, blockOffset, segmentBuffer))
+	bool programRun(const bmp_t &probe, spiFlash_t &spiFlash, const flashRun_t &run, progress_t &progress)
+	{
+		const auto runOffset{*run.offset};
+		console.debug("Transfering "sv, run.data.size(), " bytes of data to on-board Flash at offset +0x"sv,
+			asHex_t{runOffset});
+		const auto &runData{run.data};
+		for (const auto offset : indexSequence_t{runData.size()}.step(4_KiB))
+		{
+			const size_t amount{std::min<size_t>(4_KiB, runData.size() - offset)};
+			const auto blockOffset{runOffset + offset};
+			progress.begin(phase_t::program);
+			if (!spiFlash.programBlock(probe, blockOffset, runData.subspan(offset, amount)))
 			{
-				console.error("Failed to write segment data for 0x"sv, asHex_t{sectHeader.address()}, "+0x"sv,
+				console.error("Failed to write segment data for 0x"sv, asHex_t{run.flashAddr}, "+0x"sv,
 					asHex_t{offset}, " to the on-board Flash at offset +"sv, asHex_t{blockOffset});
 				return false;
 			}
+			progress.end(amount);
 		}
-		flashSection.length = static_cast<uint32_t>(sectionData.size_bytes());
-		console.info("Adding section at "sv, asHex_t{flashSection.offset}, '(',
-			asHex_t{flashSection.length}, ") to flash header"sv);
-		flashHeader.sections.push_back(flashSection);
 		return true;
 	}
 
-	bool provision_t::repack(const bmp_t &probe) const
+	[[nodiscard]] flashHeader_t headerFor(const std::vector<flashRun_t> &runs, const std::vector<imageSlot_t> &slots)
+	{
+		flashHeader_t flashHeader{};
+		for (const auto &run : runs)
+		{
+			flashHeader.sections.push_back({*run.offset, static_cast<uint32_t>(run.data.size()), run.flashAddr});
+			flashHeader.sectionCRCs.push_back(run.crc);
+		}
+		flashHeader.slots = slots;
+		return flashHeader;
+	}
+
+	std::optional<std::vector<sectionRun_t>> provision_t::sectionRuns() const
 	{
 		const auto elfHeader{file.header()};
 		if (elfHeader.type() != type_t::executable || elfHeader.machine() != machine_t::arm ||
 			elfHeader.version() != version_t::current)
 		{
-			console.error("File does not contain a valid firmware image"sv);
-			return false;
+			diagnose(severity_t::error, "File does not contain a valid firmware image");
+			return std::nullopt;
 		}
 
-		auto spiFlash{sfdp::read(probe)};
-		if (!spiFlash)
+		const auto segmentMap{collectSegments(file)};
+		if (!segmentMap)
+			return std::nullopt;
+		diagnose(severity_t::debug, fmt::format("Found {} usable program headers and {} section headers",
+			segmentMap->size(), file.sectionHeaders().size()));
+		return collectRuns(file, *segmentMap);
+	}
+
+	[[nodiscard]] std::optional<elfImage_t> hashImage(const imageSpec_t &spec)
+	{
+		const fd_t file{spec.fileName, O_RDONLY | O_NOCTTY};
+		if (!file.valid())
+		{
+			diagnose(severity_t::error, "Failed to open " + spec.fileName.string());
+			return std::nullopt;
+		}
+		const auto fileLength{file.length()};
+		if (fileLength <= 0)
+		{
+			diagnose(severity_t::error, "Cannot read requested file as an ELF binary");
+			return std::nullopt;
+		}
+		std::vector<uint8_t> data(static_cast<size_t>(fileLength));
+		if (!file.read(data.data(), data.size()))
 		{
-			console.error("Could not setup SPI Flash control structures"sv);
+			diagnose(severity_t::error, "Failed to read " + spec.fileName.string());
+			return std::nullopt;
+		}
+		uint32_t crc{0U};
+		crc32_t::crc(crc, {data.data(), data.size()});
+		return elfImage_t{spec, crc, data.size(), {}};
+	}
+
+	std::optional<elfImage_t> loadImage(const imageSpec_t &spec)
+	{
+		auto image{hashImage(spec)};
+		if (!image)
+			return std::nullopt;
+
+		// Try and open the requested file, checking that it's a valid ELF file, and gather up its sections
+		const provision_t elf{spec.fileName};
+		if (!elf.valid())
+		{
+			diagnose(severity_t::error, "Cannot read requested file as an ELF binary");
+			return std::nullopt;
+		}
+		auto runs{elf.sectionRuns()};
+		if (!runs)
+			return std::nullopt;
+		image->runs = std::move(*runs);
+		return image;
+	}
+
+	// The outcome of loading a single image, along with anything the loader had to say about it
+	struct loadResult_t final
+	{
+		std::optional<elfImage_t> image{};
+		std::vector<diagnostic_t> diagnostics{};
+	};
+
+	std::future<std::optional<std::vector<elfImage_t>>> loadImages(std::vector<imageSpec_t> specs)
+	{
+		auto loading
+		{
+			std::async(std::launch::async, [](const std::vector<imageSpec_t> imageSpecs)
+			{
+				// Parse the ELF files on no more threads than the machine can run at once, with each
+				// worker taking the next file yet to be loaded until they're all done
+				std::vector<loadResult_t> results(imageSpecs.size());
+				std::atomic<size_t> nextImage{0U};
+				const auto worker
+				{
+					[&]()
+					{
+						for (auto index{nextImage++}; index < imageSpecs.size(); index = nextImage++)
+						{
+							auto &result{results[index]};
+							loaderDiagnostics = &result.diagnostics;
+							result.image = loadImage(imageSpecs[index]);
+							loaderDiagnostics = nullptr;
+						}
+					}
+				};
+				const auto workerCount
+					{std::min<size_t>(std::max(std::thread::hardware_concurrency(), 1U), imageSpecs.size())};
+				std::vector<std::future<void>> workers{};
+				for ([[maybe_unused]] const auto workerIndex : indexSequence_t{workerCount})
+					workers.push_back(std::async(std::launch::async, worker));
+				for (auto &loader : workers)
+					loader.get();
+				return results;
+			}, std::move(specs))
+		};
+
+		// Hand the images back through a deferred future so the loaders' messages get printed, in the
+		// order the images were given, by whichever thread waits on the result
+		return std::async(std::launch::deferred, [](std::future<std::vector<loadResult_t>> pending)
+		{
+			auto results{pending.get()};
+			std::vector<elfImage_t> images{};
+			bool success{true};
+			for (auto &result : results)
+			{
+				for (const auto &diagnostic : result.diagnostics)
+					display(diagnostic);
+				if (result.image)
+					images.push_back(std::move(*result.image));
+				else
+					success = false;
+			}
+			return success ? std::optional{std::move(images)} : std::nullopt;
+		}, std::move(loading));
+	}
+
+	std::optional<std::vector<uint8_t>> repack(const std::vector<elfImage_t> &images, const spiFlash_t &spiFlash)
+	{
+		// Gather the runs of every image together, noting which belong to which slot
+		std::vector<flashRun_t> runs{};
+		std::vector<imageSlot_t> slots{};
+		for (const auto &image : images)
+		{
+			imageSlot_t slot{static_cast<uint16_t>(runs.size()), static_cast<uint16_t>(image.runs.size()), 0U};
+			std::optional<size_t> fixedOffset{};
+			if (image.spec.offset)
+			{
+				slot.flags |= slotFixedOffset;
+				fixedOffset = *image.spec.offset;
+			}
+			for (const auto &sectionRun : image.runs)
+			{
+				if (sectionRun.data.size() >= UINT32_C(0xffffffff))
+				{
+					console.error("Run of sections at 0x"sv, asHex_t{sectionRun.address}, " in "sv,
+						image.spec.fileName.string(), " is too large to store"sv);
+					return std::nullopt;
+				}
+				uint32_t crc{0U};
+				crc32_t::crc(crc, {sectionRun.data.data(), sectionRun.data.size()});
+				auto &run{runs.emplace_back(flashRun_t{sectionRun.flashAddr,
+					{sectionRun.data.data(), sectionRun.data.size()}, crc})};
+				// Runs of an image at a fixed offset are placed one after the other from that offset
+				if (fixedOffset)
+				{
+					run.fixedOffset = static_cast<uint32_t>(*fixedOffset);
+					fixedOffset = nextEraseBoundary(spiFlash, *fixedOffset + sectionRun.data.size());
+				}
+			}
+			console.info("Packing "sv, image.spec.fileName.string(), " into slot "sv, slots.size(), " as "sv,
+				image.runs.size(), " runs"sv);
+			slots.push_back(slot);
+		}
+		if (runs.size() > UINT16_MAX)
+		{
+			console.error("Too many sections to fit in the Flash header"sv);
+			return std::nullopt;
+		}
+		// A single image that can go anywhere doesn't need the slot table
+		if (slots.size() == 1U && !(slots[0].flags & slotFixedOffset))
+			slots.clear();
+
+		// Lay the runs out as if onto a blank Flash, and then build the image that results
+		if (!layoutRuns(runs, std::nullopt, spiFlash))
+			return std::nullopt;
+		size_t totalLength{sizeof(block_t)};
+		for (const auto &run : runs)
+			totalLength = std::max<size_t>(totalLength, *run.offset + run.data.size());
+
+		std::vector<uint8_t> image(totalLength, static_cast<uint8_t>(0xffU));
+		for (const auto &run : runs)
+			std::copy(run.data.begin(), run.data.end(), image.begin() + static_cast<ptrdiff_t>(*run.offset));
+		if (!headerFor(runs, slots).toPage({image.data(), sizeof(block_t)}))
+		{
+			console.error("Too many sections to fit in the Flash header"sv);
+			return std::nullopt;
+		}
+		return image;
+	}
+
+	[[nodiscard]] profileCache::imageKey_t imageKey(const std::vector<elfImage_t> &images,
+		const spiFlash_t &spiFlash) noexcept
+	{
+		// Combine the hashes of all the images and where they've been asked to go into a single key
+		profileCache::imageKey_t key{0U, 0U, profileCache::geometryCRC(spiFlash)};
+		for (const auto &image : images)
+		{
+			std::array<uint8_t, 9> description{};
+			const span<uint8_t> descriptionData{description.data(), description.size()};
+			writeLE(image.crc, descriptionData.subspan(0, 4));
+			writeLE(image.spec.offset.value_or(0U), descriptionData.subspan(4, 4));
+			descriptionData[8] = image.spec.offset ? 1U : 0U;
+			crc32_t::crc(key.elfCRC, descriptionData);
+			key.elfLength += image.length;
+		}
+		return key;
+	}
+
+	std::optional<std::vector<uint8_t>> packedImageFor(const std::vector<elfImage_t> &images,
+		const spiFlash_t &spiFlash)
+	{
+		// If these ELF files have been packed for Flash of the same geometry before, reuse the result
+		const auto key{imageKey(images, spiFlash)};
+		if (auto image{profileCache::loadPackedImage(key)}; image)
+		{
+			console.info("Using cached packed image"sv);
+			return image;
+		}
+
+		auto image{repack(images, spiFlash)};
+		if (image)
+			profileCache::storePackedImage(key, {image->data(), image->size()});
+		return image;
+	}
+
+	std::optional<std::vector<uint8_t>> packedImageFor(const std::vector<imageSpec_t> &specs,
+		const spiFlash_t &spiFlash)
+	{
+		// Hash the files first so that if the result is already cached, none of them need parsing
+		std::vector<elfImage_t> images{};
+		for (const auto &spec : specs)
+		{
+			auto image{hashImage(spec)};
+			if (!image)
+				return std::nullopt;
+			images.push_back(std::move(*image));
+		}
+		const auto key{imageKey(images, spiFlash)};
+		if (auto image{profileCache::loadPackedImage(key)}; image)
+		{
+			console.info("Using cached packed image"sv);
+			return image;
+		}
+
+		const auto loadedImages{loadImages(specs).get()};
+		if (!loadedImages)
+			return std::nullopt;
+		auto image{repack(*loadedImages, spiFlash)};
+		if (image)
+			profileCache::storePackedImage(key, {image->data(), image->size()});
+		return image;
+	}
+
+	bool writeImage(const bmp_t &probe, spiFlash_t &spiFlash, const span<const uint8_t> &image)
+	{
+		// Recover the runs to write from the image's own header
+		const auto imageHeader
+		{
+			[&]() -> std::optional<flashHeader_t>
+			{
+				if (image.size() < sizeof(block_t))
+					return std::nullopt;
+				return flashHeader_t::fromPage({image.data(), sizeof(block_t)});
+			}()
+		};
+		if (!imageHeader || imageHeader->sectionCRCs.size() != imageHeader->sections.size())
+		{
+			console.error("Packed image is invalid"sv);
 			return false;
 		}
+		std::vector<flashRun_t> runs{};
+		for (const auto &[index, section] : indexedIterator_t{imageHeader->sections})
+		{
+			if (uint64_t{section.offset} + section.length > image.size())
+			{
+				console.error("Packed image is truncated"sv);
+				return false;
+			}
+			runs.push_back({section.flashAddr, {image.data() + section.offset, section.length},
+				imageHeader->sectionCRCs[index]});
+		}
+		// Images that were packed at a fixed offset have to stay where they were put
+		for (const auto &slot : imageHeader->slots)
+		{
+			if (!(slot.flags & slotFixedOffset))
+				continue;
+			const size_t firstSection{slot.firstSection};
+			for (const auto index : indexSequence_t{firstSection, firstSection + slot.sectionCount})
+				runs[index].fixedOffset = imageHeader->sections[index].offset;
+		}
 
-		const auto segmentMap{collectSegments(file)};
-		if (!segmentMap)
+		// Read back what's already on the Flash so any runs that have not changed can be left alone
+		const auto existingHeader{readFlashHeader(probe, spiFlash)};
+		if (!layoutRuns(runs, existingHeader, spiFlash))
 			return false;
-		console.info("Found "sv, segmentMap->size(), " usable program headers"sv);
 
-		flashHeader_t flashHeader{};
-		const auto sectHeaderCount{file.sectionHeaders().size()};
-		console.info("Found "sv, sectHeaderCount, " section headers"sv);
+		for (const auto &run : runs)
+			console.info("Adding section at "sv, asHex_t{*run.offset}, '(', asHex_t{run.data.size()},
+				run.unchanged ? ") to flash header (unchanged)"sv : ") to flash header"sv);
+		block_t headerBuffer{};
+		if (!headerFor(runs, imageHeader->slots).toPage(headerBuffer))
+		{
+			console.error("Too many sections to fit in the Flash header"sv);
+			return false;
+		}
+
+		const auto unchanged
+			{std::all_of(runs.begin(), runs.end(), [](const flashRun_t &run) { return run.unchanged; })};
+		block_t existingBuffer{};
+		if (unchanged && existingHeader && existingHeader->toPage(existingBuffer) && existingBuffer == headerBuffer)
+		{
+			console.info("Firmware image on the on-board Flash is already up to date"sv);
+			return true;
+		}
 
-		for (const auto &headerIndex : substrate::indexSequence_t{sectHeaderCount})
+		// Invalidate the old header before touching any section data so that if we're interrupted, the
+		// probe is not left with a header that describes data which has since been overwritten
+		if (existingHeader && !unchanged && !spiFlash.eraseSector(probe, 0U))
 		{
-			if (!packSection(file, probe, *spiFlash, flashHeader, headerIndex, *segmentMap))
+			console.error("Failed to invalidate the existing Flash header"sv);
+			return false;
+		}
+
+		// Erase everything that's about to be written in one go, then program each of the runs
+		const auto erasePlan{planErase(runs, spiFlash)};
+		if (!erasePlan)
+			return false;
+		progress_t progress{"provision"sv, imageLength(runs)};
+		for (const auto &operation : *erasePlan)
+		{
+			progress.begin(phase_t::erase);
+			if (!spiFlash.erase(probe, operation))
+				return false;
+			progress.end();
+		}
+		for (const auto &run : runs)
+		{
+			if (run.unchanged)
+				progress.skip(run.data.size());
+			else if (!programRun(probe, spiFlash, run, progress))
 				return false;
 		}
+		progress.finish();
 
-		block_t headerBuffer{};
-		if (!flashHeader.toPage(headerBuffer) ||
-			!spiFlash->writeBlock(probe, 0U, headerBuffer))
+		if (!spiFlash.writeBlock(probe, 0U, {headerBuffer.data(), headerBuffer.size()}))
 		{
 			console.error("Failed to write the Flash header to the on-board Flash"sv);
 			return false;
@@ -231,6 +888,17 @@ namespace bmpflash::elf
 	template<typename T, size_t N> void copyInto(span<uint8_t> destination, const std::array<T, N> &source) noexcept
 		{ return copyInto(destination, span<const T>{source.data(), source.size()}); }
 
+	[[nodiscard]] uint32_t headerCRC(const span<const uint8_t> &pageBuffer) noexcept
+	{
+		// The CRC is calculated with the CRC field itself left in the erased state
+		uint32_t crc32{0xffffffffU};
+		crc32_t::crc(crc32, pageBuffer.subspan(0, 4));
+		constexpr static std::array<uint8_t, 4> erasedCRC{{0xffU, 0xffU, 0xffU, 0xffU}};
+		crc32_t::crc(crc32, {erasedCRC.data(), erasedCRC.size()});
+		crc32_t::crc(crc32, pageBuffer.subspan(8));
+		return crc32;
+	}
+
 	bool flashHeader_t::toPage(span<uint8_t> pageBuffer) const noexcept try
 	{
 		std::fill(pageBuffer.begin(), pageBuffer.end(), static_cast<uint8_t>(0xffU));
@@ -240,7 +908,7 @@ namespace bmpflash::elf
 		size_t offset{12U};
 		for (const auto &section : sections)
 		{
-			static_assert(sizeof(section) == 16U);
+			static_assert(sizeof(section) == flashSectionLength);
 			const auto sectionSubspan{pageBuffer.subspan(offset, sizeof(section))};
 			if (sectionSubspan.size_bytes() > pageBuffer.size_bytes())
 				return false;
@@ -250,11 +918,103 @@ namespace bmpflash::elf
 			offset += sizeof(section);
 		}
 
-		uint32_t crc32{0xffffffffU};
-		crc32_t::crc(crc32, {pageBuffer.data(), pageBuffer.size()});
-		writeLE(crc32, pageBuffer.subspan(4, 4));
+		if (!sectionCRCs.empty())
+		{
+			if (sectionCRCs.size() != sections.size())
+				return false;
+			copyInto(pageBuffer.subspan(offset, 4), sectionCRCMagic);
+			offset += 4U;
+			for (const auto &crc : sectionCRCs)
+			{
+				writeLE(crc, pageBuffer.subspan(offset, 4));
+				offset += 4U;
+			}
+		}
+
+		// The slot table can only be used alongside the section CRCs
+		if (!slots.empty())
+		{
+			if (sectionCRCs.empty())
+				return false;
+			copyInto(pageBuffer.subspan(offset, 4), slotTableMagic);
+			writeLE(static_cast<uint32_t>(slots.size()), pageBuffer.subspan(offset + 4U, 4));
+			offset += 8U;
+			for (const auto &slot : slots)
+			{
+				const auto slotSubspan{pageBuffer.subspan(offset, imageSlotLength)};
+				writeLE(slot.firstSection, slotSubspan.subspan(0, 2));
+				writeLE(slot.sectionCount, slotSubspan.subspan(2, 2));
+				writeLE(slot.flags, slotSubspan.subspan(4, 4));
+				offset += imageSlotLength;
+			}
+		}
+
+		writeLE(headerCRC(pageBuffer), pageBuffer.subspan(4, 4));
 		return true;
 	}
 	catch (const std::out_of_range &)
 		{ return false; }
+
+	std::optional<flashHeader_t> flashHeader_t::fromPage(const span<const uint8_t> pageBuffer) noexcept try
+	{
+		if (std::memcmp(pageBuffer.data(), flashMagic.data(), flashMagic.size()) != 0 ||
+			readLE<uint32_t>(pageBuffer.subspan(4, 4)) != headerCRC(pageBuffer))
+			return std::nullopt;
+
+		const auto sectionCount{readLE<uint32_t>(pageBuffer.subspan(8, 4))};
+		if (sectionCount > (pageBuffer.size() - 12U) / flashSectionLength)
+			return std::nullopt;
+
+		flashHeader_t flashHeader{};
+		size_t offset{12U};
+		for ([[maybe_unused]] const auto index : indexSequence_t{sectionCount})
+		{
+			const auto sectionSubspan{pageBuffer.subspan(offset, flashSectionLength)};
+			flashHeader.sections.push_back(
+			{
+				readLE<uint32_t>(sectionSubspan.subspan(0, 4)),
+				readLE<uint32_t>(sectionSubspan.subspan(4, 4)),
+				readLE<uint64_t>(sectionSubspan.subspan(8, 8)),
+			});
+			offset += flashSectionLength;
+		}
+
+		// Headers written by older versions of bmpflash do not carry the section CRCs, which is fine
+		const auto crcsLength{4U + (sectionCount * 4U)};
+		if (offset + crcsLength > pageBuffer.size() ||
+			std::memcmp(pageBuffer.data() + offset, sectionCRCMagic.data(), sectionCRCMagic.size()) != 0)
+			return flashHeader;
+		offset += 4U;
+		for ([[maybe_unused]] const auto index : indexSequence_t{sectionCount})
+		{
+			flashHeader.sectionCRCs.push_back(readLE<uint32_t>(pageBuffer.subspan(offset, 4)));
+			offset += 4U;
+		}
+
+		// Likewise, the slot table is only present when there's something for it to say
+		if (offset + 8U > pageBuffer.size() ||
+			std::memcmp(pageBuffer.data() + offset, slotTableMagic.data(), slotTableMagic.size()) != 0)
+			return flashHeader;
+		const auto slotCount{readLE<uint32_t>(pageBuffer.subspan(offset + 4U, 4))};
+		offset += 8U;
+		if (slotCount > (pageBuffer.size() - offset) / imageSlotLength)
+			return std::nullopt;
+		for ([[maybe_unused]] const auto index : indexSequence_t{slotCount})
+		{
+			const auto slotSubspan{pageBuffer.subspan(offset, imageSlotLength)};
+			const imageSlot_t slot
+			{
+				readLE<uint16_t>(slotSubspan.subspan(0, 2)),
+				readLE<uint16_t>(slotSubspan.subspan(2, 2)),
+				readLE<uint32_t>(slotSubspan.subspan(4, 4)),
+			};
+			if (size_t{slot.firstSection} + slot.sectionCount > sectionCount)
+				return std::nullopt;
+			flashHeader.slots.push_back(slot);
+			offset += imageSlotLength;
+		}
+		return flashHeader;
+	}
+	catch (const std::out_of_range &)
+		{ return std::nullopt; }
 } // namespace bmpflash::elf
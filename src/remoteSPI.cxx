@@ -1,8 +1,10 @@
 // SPDX-License-Identifier: BSD-3-Clause
 // SPDX-FileCopyrightText: 2023 1BitSquared <info@1bitsquared.com>
 // SPDX-FileContributor: Written by Rachel Mant <git@dragonmux.network>
+#include <array>
 #include <string>
 #include <string_view>
+#include <stdexcept>
 #if defined(_MSC_VER)
 #pragma warning(push)
 #pragma warning(disable: 4061 4365)
@@ -30,7 +32,7 @@ using substrate::indexSequence_t;
 
 constexpr static auto remoteResponseOK{'K'};
 constexpr static auto remoteResponseParameterError{'P'};
-[[maybe_unused]] constexpr static auto remoteResponseError{'E'};
+constexpr static auto remoteResponseError{'E'};
 constexpr static auto remoteResponseNotSupported{'N'};
 
 #define REMOTE_UINT8  "{:02x}"
@@ -45,6 +47,12 @@ constexpr static auto remoteSPIChipID{"!sI" REMOTE_UINT8 REMOTE_UINT8 "#"sv};
 constexpr static auto remoteSPIRead{"!sr" REMOTE_UINT8 REMOTE_UINT8 REMOTE_UINT16 REMOTE_UINT24 REMOTE_UINT16 "#"sv};
 constexpr static auto remoteSPIWrite{"!sw" REMOTE_UINT8 REMOTE_UINT8 REMOTE_UINT16 REMOTE_UINT24 REMOTE_UINT16 ""sv};
 constexpr static auto remoteSPICommand{"!sc" REMOTE_UINT8 REMOTE_UINT8 REMOTE_UINT16 REMOTE_UINT24 "#"sv};
+constexpr static auto remoteSPIChipSelect{"!ss" REMOTE_UINT8 "#"sv};
+constexpr static auto remoteSPITransfer{"!sx" REMOTE_UINT8 REMOTE_UINT8 "#"sv};
+constexpr static auto remoteSPIBlockTransfer{"!sX" REMOTE_UINT8 REMOTE_UINT16 ""sv};
+
+// The top bit of the chip select request's device number says whether to select or release the device
+constexpr static uint8_t remoteSPISelect{0x80U};
 
 bool fromHexSpan(const substrate::span<const char> &dataIn, substrate::span<uint8_t> dataOut) noexcept
 {
@@ -91,8 +99,8 @@ size_t toHex(const void *const buffer, const size_t bufferLength, substrate::spa
 std::string bmp_t::init() const
 {
 	// Ask the firmware to initialise its half of remote communications
-	device.writePacket(remoteInit);
-	const auto response{device.readPacket()};
+	writePacket(remoteInit);
+	const auto response{readPacket()};
 	if (response[0] != remoteResponseOK)
 		throw bmpCommsError_t{};
 	// Return the firmware version string that pops out from that process
@@ -102,8 +110,8 @@ std::string bmp_t::init() const
 uint64_t bmp_t::readProtocolVersion() const
 {
 	// Send a protocol version request packet
-	device.writePacket(remoteProtocolVersion);
-	const auto response{device.readPacket()};
+	writePacket(remoteProtocolVersion);
+	const auto response{readPacket()};
 	if (response[0] == remoteResponseNotSupported)
 		return 0U;
 	if (response[0] != remoteResponseOK)
@@ -118,34 +126,46 @@ uint64_t bmp_t::readProtocolVersion() const
 bool bmp_t::begin(const spiBus_t spiBus, const spiDevice_t spiDevice) noexcept
 {
 	const auto request{fmt::format(remoteSPIBegin, uint8_t(spiBus))};
-	device.writePacket(request);
-	const auto response{device.readPacket()};
-	if (response[0] == remoteResponseOK)
+	try
 	{
-		_spiBus = spiBus;
-		_spiDevice = spiDevice;
+		writePacket(request);
+		const auto response{readPacket()};
+		if (response[0] == remoteResponseOK)
+		{
+			_spiBus = spiBus;
+			_spiDevice = spiDevice;
+		}
+		return response[0] == remoteResponseOK;
 	}
-	return response[0] == remoteResponseOK;
+	// A probe that's stopped responding can't have begun anything
+	catch (const bmpCommsError_t &)
+		{ return false; }
 }
 
 bool bmp_t::end() noexcept
 {
 	const auto request{fmt::format(remoteSPIEnd, uint8_t(_spiBus))};
-	device.writePacket(request);
-	const auto response{device.readPacket()};
-	if (response[0] == remoteResponseOK)
+	try
 	{
-		_spiBus = spiBus_t::none;
-		_spiDevice = spiDevice_t::none;
+		writePacket(request);
+		const auto response{readPacket()};
+		if (response[0] == remoteResponseOK)
+		{
+			_spiBus = spiBus_t::none;
+			_spiDevice = spiDevice_t::none;
+		}
+		return response[0] == remoteResponseOK;
 	}
-	return response[0] == remoteResponseOK;
+	// This gets run as we unwind out of failed and cancelled operations, so a timeout here has to stay in here
+	catch (const bmpCommsError_t &)
+		{ return false; }
 }
 
 spiFlashID_t bmp_t::identifyFlash() const
 {
 	const auto request{fmt::format(remoteSPIChipID, uint8_t(_spiBus), uint8_t(_spiDevice))};
-	device.writePacket(request);
-	const auto response{device.readPacket()};
+	writePacket(request);
+	const auto response{readPacket()};
 	if (response[0] != remoteResponseOK)
 		throw bmpCommsError_t{};
 	const auto chipID{std::string_view{response}.substr(1U)};
@@ -163,11 +183,13 @@ bool bmp_t::read(const spiFlashCommand_t command, const uint32_t address, void *
 	// XXX: Implement read chunking!
 	if (dataLength > UINT16_MAX)
 		return false;
+	_cancellation.throwIfCancelled();
 
 	const auto request{fmt::format(remoteSPIRead, uint8_t(_spiBus), uint8_t(_spiDevice), uint16_t(command),
 		address & 0x00ffffffU, dataLength)};
-	device.writePacket(request);
-	const auto response{device.readPacket()};
+	writePacket(request);
+	// The data comes back hex encoded, so two characters for every byte
+	const auto response{readPacket(dataLength * 2U)};
 	// Check if the probe told us we asked for too big a read
 	if (response[0] == remoteResponseParameterError)
 		return false;
@@ -175,8 +197,9 @@ bool bmp_t::read(const spiFlashCommand_t command, const uint32_t address, void *
 	if (response[0] != remoteResponseOK)
 		throw bmpCommsError_t{};
 	const auto resultData{std::string_view{response}.substr(1U)};
+	// Data that isn't hex got mangled on its way back from the probe, so treat it like any other comms error
 	if (!fromHex(resultData, data, dataLength))
-		throw std::domain_error{"SPI read data is not properly hex encoded"s};
+		throw bmpCommsError_t{};
 	return true;
 }
 
@@ -186,6 +209,7 @@ bool bmp_t::write(const spiFlashCommand_t command, const uint32_t address, const
 	// XXX: Implement write chunking!
 	if (dataLength > UINT16_MAX)
 		return false;
+	_cancellation.throwIfCancelled();
 
 	std::array<char, maxPacketSize + 1U> request{};
 	auto offset
@@ -198,8 +222,8 @@ bool bmp_t::write(const spiFlashCommand_t command, const uint32_t address, const
 	};
 	offset += toHex(data, dataLength, substrate::span{request}.subspan(offset, maxPacketSize - offset));
 	request[offset] = '#';
-	device.writePacket({request.data()});
-	const auto response{device.readPacket()};
+	writePacket({request.data()});
+	const auto response{readPacket()};
 	// Check if the probe told us we asked for too big a read
 	if (response[0] == remoteResponseParameterError)
 		return false;
@@ -211,12 +235,92 @@ bool bmp_t::write(const spiFlashCommand_t command, const uint32_t address, const
 
 bool bmp_t::runCommand(const spiFlashCommand_t command, const uint32_t address) const
 {
+	_cancellation.throwIfCancelled();
 	const auto request{fmt::format(remoteSPICommand, uint8_t(_spiBus), uint8_t(_spiDevice), uint16_t(command),
 		address & 0x00ffffffU)};
-	device.writePacket(request);
-	const auto response{device.readPacket()};
+	writePacket(request);
+	const auto response{readPacket()};
 	// Check if the probe returned any kind of error response
 	if (response[0] != remoteResponseOK)
 		throw bmpCommsError_t{};
 	return true;
 }
+
+bool bmp_t::select(const bool selected) const
+{
+	_cancellation.throwIfCancelled();
+	const auto spiDevice{uint8_t(_spiDevice)};
+	const auto request{fmt::format(remoteSPIChipSelect, uint8_t(selected ? spiDevice | remoteSPISelect : spiDevice))};
+	writePacket(request);
+	const auto response{readPacket()};
+	if (response[0] != remoteResponseOK)
+		throw bmpCommsError_t{};
+	return true;
+}
+
+uint8_t bmp_t::transfer(const uint8_t value) const
+{
+	_cancellation.throwIfCancelled();
+	const auto request{fmt::format(remoteSPITransfer, uint8_t(_spiBus), value)};
+	writePacket(request);
+	const auto response{readPacket()};
+	if (response[0] != remoteResponseOK)
+		throw bmpCommsError_t{};
+	// The byte comes back as a hex number with any leading zeros dropped
+	const auto valueString{std::string_view{response}.substr(1U)};
+	const toInt_t<uint8_t> result{valueString.data(), valueString.length() - 1U};
+	if (valueString.length() < 2U || valueString.length() > 3U || !result.isHex())
+		throw bmpCommsError_t{};
+	return result.fromHex();
+}
+
+bool bmp_t::transfer(const substrate::span<const uint8_t> dataOut, const substrate::span<uint8_t> dataIn) const
+{
+	if (dataOut.size() != dataIn.size() || dataOut.size() > maxTransferLength)
+		throw std::length_error{"block transfer is too long or its buffers differ in length"s};
+	_cancellation.throwIfCancelled();
+
+	std::array<char, maxPacketSize + 1U> request{};
+	auto offset
+	{
+		static_cast<size_t>
+		(
+			fmt::format_to_n(request.begin(), request.size(), remoteSPIBlockTransfer, uint8_t(_spiBus),
+				dataOut.size()).out - request.begin()
+		)
+	};
+	offset += toHex(dataOut.data(), dataOut.size(), substrate::span{request}.subspan(offset, maxPacketSize - offset));
+	request[offset] = '#';
+	writePacket({request.data()});
+	const auto response{readPacket(dataIn.size() * 2U)};
+	// Firmware that doesn't know about block transfers rejects the request outright
+	if (response[0] == remoteResponseNotSupported || response[0] == remoteResponseError)
+		return false;
+	if (response[0] != remoteResponseOK)
+		throw bmpCommsError_t{};
+	const auto resultData{std::string_view{response}.substr(1U)};
+	if (!fromHex(resultData, dataIn.data(), dataIn.size()))
+		throw bmpCommsError_t{};
+	return true;
+}
+
+bool bmp_t::recover() const noexcept
+{
+	if (!valid())
+		return false;
+	try
+	{
+		// Drain whatever's left of the response that went wrong so we're back in step with the probe's framing,
+		// then have the probe set its side of remote communications back up and put the SPI bus back how it was.
+		// When replaying a capture there's nothing to drain, but the requests still get checked against it
+		if (device.valid())
+			device.resync();
+		static_cast<void>(init());
+		if (_spiBus == spiBus_t::none)
+			return true;
+		writePacket(fmt::format(remoteSPIBegin, uint8_t(_spiBus)));
+		return readPacket()[0] == remoteResponseOK;
+	}
+	catch (const bmpCommsError_t &)
+		{ return false; }
+}
@@ -0,0 +1,453 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// SPDX-FileCopyrightText: 2023 1BitSquared <info@1bitsquared.com>
+#include <cstdint>
+#include <array>
+#include <algorithm>
+#include <chrono>
+#include <string_view>
+#include <substrate/console>
+#include <substrate/index_sequence>
+#include "bmp.hxx"
+#include "sdCard.hxx"
+#include "trace.hxx"
+#include "units.hxx"
+
+using namespace std::literals::string_view_literals;
+using namespace std::literals::chrono_literals;
+using substrate::console;
+using substrate::asHex_t;
+using substrate::indexSequence_t;
+using substrate::span;
+using bmpflash::utils::humanReadableSize;
+
+namespace bmpflash::sdCard
+{
+	using steadyClock_t = std::chrono::steady_clock;
+
+	constexpr static uint8_t fillByte{0xffU};
+	constexpr static uint8_t commandStart{0x40U};
+	constexpr static uint8_t responseInvalid{0x80U};
+	constexpr static uint8_t r1Idle{0x01U};
+	constexpr static uint8_t r1IllegalCommand{0x04U};
+	constexpr static uint8_t startBlockToken{0xfeU};
+	constexpr static uint8_t startMultiWriteToken{0xfcU};
+	constexpr static uint8_t stopTransferToken{0xfdU};
+	constexpr static uint8_t dataResponseMask{0x1fU};
+	constexpr static uint8_t dataAccepted{0x05U};
+	constexpr static uint32_t ifCondCheckPattern{0x1aaU};
+	constexpr static uint32_t ocrHighCapacity{0x40000000U};
+
+	// The card has 8 bytes in which to respond to a command
+	constexpr static size_t responseBytes{8U};
+	constexpr static auto initialiseTimeout{1s};
+	constexpr static auto readTimeout{250ms};
+	constexpr static auto writeTimeout{500ms};
+
+	// What gets clocked out to the card while reading data back from it
+	constexpr static auto fillBlock
+	{
+		[]()
+		{
+			std::array<uint8_t, bmp_t::maxTransferLength> block{};
+			for (auto &value : block)
+				value = fillByte;
+			return block;
+		}()
+	};
+
+	[[nodiscard]] static uint8_t crc7(const span<const uint8_t> &data) noexcept
+	{
+		uint8_t crc{0U};
+		for (const auto byte : data)
+		{
+			for (const auto bit : indexSequence_t{8U})
+			{
+				const auto dataBit{static_cast<uint8_t>((uint32_t{byte} >> (7U - bit)) & 1U)};
+				const auto crcBit{static_cast<uint8_t>((uint32_t{crc} >> 6U) & 1U)};
+				crc = static_cast<uint8_t>((uint32_t{crc} << 1U) & 0x7fU);
+				if (dataBit != crcBit)
+					crc ^= 0x09U;
+			}
+		}
+		return crc;
+	}
+
+	[[nodiscard]] static uint16_t crc16(const span<const uint8_t> &data) noexcept
+	{
+		uint16_t crc{0U};
+		for (const auto byte : data)
+		{
+			crc ^= static_cast<uint16_t>(uint32_t{byte} << 8U);
+			for ([[maybe_unused]] const auto bit : indexSequence_t{8U})
+			{
+				const auto shifted{uint32_t{crc} << 1U};
+				crc = static_cast<uint16_t>((crc & 0x8000U) ? shifted ^ 0x1021U : shifted);
+			}
+		}
+		return crc;
+	}
+
+	std::optional<sdCard_t> sdCard_t::initialise(const bmp_t &probe)
+	{
+		// The card needs at least 74 clocks with its chip select released to get going after power-on
+		if (!probe.select(false))
+			return std::nullopt;
+		sdCard_t card{};
+		// This is also our chance to find out if the probe can do block transfers, as it doesn't matter what
+		// state this leaves things in if it can't
+		std::array<uint8_t, 10U> clocks{};
+		card.blockTransfers_ = probe.transfer({fillBlock.data(), clocks.size()}, clocks);
+		if (!card.blockTransfers_)
+		{
+			console.warn("Probe firmware does not support block transfers, SD card access will be a byte at a time"sv);
+			for ([[maybe_unused]] const auto byte : indexSequence_t{clocks.size()})
+				static_cast<void>(probe.transfer(fillByte));
+		}
+
+		// Selecting the card while sending it GO_IDLE_STATE puts it into SPI mode
+		const auto idle
+		{
+			[&]()
+			{
+				for ([[maybe_unused]] const auto attempt : indexSequence_t{10U})
+				{
+					const auto response{card.command(probe, sdCommand_t::goIdleState, 0U)};
+					card.endTransaction(probe);
+					if (response == r1Idle)
+						return true;
+				}
+				return false;
+			}()
+		};
+		if (!idle)
+		{
+			console.error("Could not find an SD card on the requested SPI bus"sv);
+			return std::nullopt;
+		}
+
+		// Version 2 cards understand SEND_IF_COND, echoing back the check pattern and the voltages they work at
+		const auto ifCond{card.command(probe, sdCommand_t::sendIfCond, ifCondCheckPattern)};
+		if (!ifCond)
+		{
+			card.endTransaction(probe);
+			return std::nullopt;
+		}
+		const auto version2{!(*ifCond & r1IllegalCommand)};
+		if (version2)
+		{
+			std::array<uint8_t, 4U> echo{};
+			card.receiveBytes(probe, echo);
+			if ((echo[2] & 0x0fU) != (ifCondCheckPattern >> 8U) || echo[3] != uint8_t(ifCondCheckPattern))
+			{
+				card.endTransaction(probe);
+				console.error("SD card does not support being run at 3.3V"sv);
+				return std::nullopt;
+			}
+		}
+		card.endTransaction(probe);
+
+		// Now wait for the card to finish its own initialisation, letting it know we handle high capacity cards
+		const auto deadline{steadyClock_t::now() + initialiseTimeout};
+		while (true)
+		{
+			const auto response{card.appCommand(probe, sdCommand_t::sdSendOpCond, version2 ? ocrHighCapacity : 0U)};
+			card.endTransaction(probe);
+			if (response == 0U)
+				break;
+			if (response != r1Idle || steadyClock_t::now() > deadline)
+			{
+				console.error("SD card failed to initialise"sv);
+				return std::nullopt;
+			}
+		}
+
+		// High capacity cards are addressed in blocks rather than bytes, which the OCR tells us about
+		if (version2)
+		{
+			const auto response{card.command(probe, sdCommand_t::readOCR, 0U)};
+			std::array<uint8_t, 4U> ocr{};
+			if (response == 0U)
+				card.receiveBytes(probe, ocr);
+			card.endTransaction(probe);
+			if (response != 0U)
+			{
+				console.error("Failed to read SD card OCR"sv);
+				return std::nullopt;
+			}
+			card.blockAddressed_ = (ocr[0] & uint8_t(ocrHighCapacity >> 24U)) != 0U;
+		}
+		// Standard capacity cards might not default to 512 byte blocks, so make sure that's what they use
+		if (!card.blockAddressed_)
+		{
+			const auto response{card.command(probe, sdCommand_t::setBlockLength, blockSize)};
+			card.endTransaction(probe);
+			if (response != 0U)
+			{
+				console.error("Failed to set SD card block length"sv);
+				return std::nullopt;
+			}
+		}
+
+		std::array<uint8_t, 16U> csd{};
+		std::array<uint8_t, 16U> cid{};
+		if (!card.readRegister(probe, sdCommand_t::sendCSD, csd) ||
+			!card.readRegister(probe, sdCommand_t::sendCID, cid))
+		{
+			console.error("Failed to read SD card CSD and CID registers"sv);
+			return std::nullopt;
+		}
+
+		// Version 2 CSDs give the size in units of 512KiB, version 1 ones as a size, multiplier and block length
+		if ((csd[0] >> 6U) == 1U)
+		{
+			const auto size{(uint32_t{csd[7] & 0x3fU} << 16U) | (uint32_t{csd[8]} << 8U) | csd[9]};
+			card.blockCount_ = (uint64_t{size} + 1U) * 1024U;
+		}
+		else
+		{
+			const auto readBlockLength{uint32_t{csd[5] & 0x0fU}};
+			const auto size{(uint32_t{csd[6] & 0x03U} << 10U) | (uint32_t{csd[7]} << 2U) | (uint32_t{csd[8]} >> 6U)};
+			const auto multiplier{(uint32_t{csd[9] & 0x03U} << 1U) | (uint32_t{csd[10]} >> 7U)};
+			card.blockCount_ = ((uint64_t{size} + 1U) << (multiplier + 2U + readBlockLength)) / blockSize;
+		}
+		card.name_ = std::string{reinterpret_cast<const char *>(cid.data() + 3U), 5U};
+
+		const auto [capacityValue, capacityUnits] = humanReadableSize(card.capacity());
+		console.info("SD card is a "sv, capacityValue, capacityUnits, ' ', card.name_,
+			card.blockAddressed_ ? " high"sv : " standard"sv, " capacity card from manufacturer "sv,
+			asHex_t<2, '0'>{cid[0]});
+		return card;
+	}
+
+	void sdCard_t::exchange(const bmp_t &probe, const span<const uint8_t> dataOut, const span<uint8_t> dataIn) const
+	{
+		if (blockTransfers_ && probe.transfer(dataOut, dataIn))
+			return;
+		for (const auto offset : indexSequence_t{dataOut.size()})
+			dataIn[offset] = probe.transfer(dataOut[offset]);
+	}
+
+	bool sdCard_t::sendBytes(const bmp_t &probe, const span<const uint8_t> data) const
+	{
+		if (!probe.select(true))
+			return false;
+		std::array<uint8_t, bmp_t::maxTransferLength> discard{};
+		for (size_t offset{0U}; offset < data.size(); offset += discard.size())
+		{
+			const auto length{std::min(data.size() - offset, discard.size())};
+			exchange(probe, data.subspan(offset, length), {discard.data(), length});
+		}
+		return true;
+	}
+
+	void sdCard_t::receiveBytes(const bmp_t &probe, const span<uint8_t> data) const
+	{
+		for (size_t offset{0U}; offset < data.size(); offset += fillBlock.size())
+		{
+			const auto length{std::min(data.size() - offset, fillBlock.size())};
+			exchange(probe, {fillBlock.data(), length}, data.subspan(offset, length));
+		}
+	}
+
+	std::optional<uint8_t> sdCard_t::command(const bmp_t &probe, const sdCommand_t command,
+		const uint32_t argument) const
+	{
+		std::array<uint8_t, 6U> frame
+		{{
+			uint8_t(commandStart | uint8_t(command)),
+			uint8_t(argument >> 24U),
+			uint8_t(argument >> 16U),
+			uint8_t(argument >> 8U),
+			uint8_t(argument),
+		}};
+		frame[5] = static_cast<uint8_t>((uint32_t{crc7({frame.data(), 5U})} << 1U) | 1U);
+		if (!sendBytes(probe, frame))
+			return std::nullopt;
+		// STOP_TRANSMISSION is followed by a stuff byte that has to be skipped before the response starts
+		if (command == sdCommand_t::stopTransmission)
+			static_cast<void>(probe.transfer(fillByte));
+		// The response is the first byte to come back with its top bit clear
+		for ([[maybe_unused]] const auto byte : indexSequence_t{responseBytes})
+		{
+			const auto response{probe.transfer(fillByte)};
+			if (!(response & responseInvalid))
+				return response;
+		}
+		console.error("SD card did not respond to CMD"sv, uint16_t(command));
+		return std::nullopt;
+	}
+
+	std::optional<uint8_t> sdCard_t::appCommand(const bmp_t &probe, const sdCommand_t command,
+		const uint32_t argument) const
+	{
+		const auto response{this->command(probe, sdCommand_t::appCommand, 0U)};
+		endTransaction(probe);
+		if (!response || (*response & ~r1Idle))
+			return std::nullopt;
+		return this->command(probe, command, argument);
+	}
+
+	void sdCard_t::endTransaction(const bmp_t &probe) const
+	{
+		// Give the card another 8 clocks after releasing it so it lets go of its data out line
+		static_cast<void>(probe.select(false));
+		static_cast<void>(probe.transfer(fillByte));
+	}
+
+	bool sdCard_t::waitToken(const bmp_t &probe, uint8_t &token) const
+	{
+		const auto deadline{steadyClock_t::now() + readTimeout};
+		while (steadyClock_t::now() < deadline)
+		{
+			token = probe.transfer(fillByte);
+			if (token != fillByte)
+				return true;
+		}
+		console.error("Timed out waiting for data from the SD card"sv);
+		return false;
+	}
+
+	bool sdCard_t::waitIdle(const bmp_t &probe) const
+	{
+		// The card holds its data out line low for as long as it's busy
+		const trace::span_t span{"card"sv, "busy poll"sv};
+		const auto deadline{steadyClock_t::now() + writeTimeout};
+		while (steadyClock_t::now() < deadline)
+		{
+			if (probe.transfer(fillByte) == fillByte)
+				return true;
+		}
+		console.error("SD card still busy after "sv, std::chrono::milliseconds{writeTimeout}.count(), "ms"sv);
+		return false;
+	}
+
+	bool sdCard_t::readRegister(const bmp_t &probe, const sdCommand_t command, const span<uint8_t> data) const
+	{
+		// The CSD and CID come back as a short data block
+		const auto response{this->command(probe, command, 0U)};
+		uint8_t token{};
+		if (response != 0U || !waitToken(probe, token) || token != startBlockToken)
+		{
+			endTransaction(probe);
+			return false;
+		}
+		std::array<uint8_t, 2U> crc{};
+		receiveBytes(probe, data);
+		receiveBytes(probe, crc);
+		endTransaction(probe);
+		return ((uint32_t{crc[0]} << 8U) | crc[1]) == crc16(data);
+	}
+
+	bool sdCard_t::receiveBlock(const bmp_t &probe, const span<uint8_t> block) const
+	{
+		uint8_t token{};
+		if (!waitToken(probe, token))
+			return false;
+		if (token != startBlockToken)
+		{
+			console.error("SD card read failed with error token "sv, asHex_t<2, '0'>{token});
+			return false;
+		}
+
+		// Take the data and its CRC together so they go over in as few transfers as possible
+		std::array<uint8_t, blockSize + 2U> frame{};
+		receiveBytes(probe, frame);
+		std::copy(frame.begin(), frame.begin() + blockSize, block.begin());
+		if (((uint32_t{frame[blockSize]} << 8U) | frame[blockSize + 1U]) != crc16(block))
+		{
+			console.error("SD card block failed its CRC check"sv);
+			return false;
+		}
+		return true;
+	}
+
+	bool sdCard_t::sendBlock(const bmp_t &probe, const span<const uint8_t> block) const
+	{
+		// Each block gets a byte of gap, the start token, then the data and its CRC
+		std::array<uint8_t, blockSize + 4U> frame{};
+		frame[0] = fillByte;
+		frame[1] = startMultiWriteToken;
+		std::copy(block.begin(), block.end(), frame.begin() + 2);
+		const auto crc{crc16(block)};
+		frame[blockSize + 2U] = uint8_t(crc >> 8U);
+		frame[blockSize + 3U] = uint8_t(crc);
+		if (!sendBytes(probe, frame))
+			return false;
+
+		// The card then answers with a data response token saying whether it accepted the block
+		for ([[maybe_unused]] const auto byte : indexSequence_t{responseBytes})
+		{
+			const auto response{probe.transfer(fillByte)};
+			if ((response & 0x11U) != 0x01U)
+				continue;
+			if ((response & dataResponseMask) != dataAccepted)
+			{
+				console.error("SD card rejected block with response "sv, asHex_t<2, '0'>{response});
+				return false;
+			}
+			return waitIdle(probe);
+		}
+		console.error("SD card did not acknowledge block"sv);
+		return false;
+	}
+
+	bool sdCard_t::readBlocks(const bmp_t &probe, const uint64_t block, const span<uint8_t> data)
+	{
+		trace::span_t span{"card"sv, "read"sv};
+		span.region(block * blockSize, data.size());
+		const auto response{command(probe, sdCommand_t::readMultipleBlock, address(block))};
+		if (response != 0U)
+		{
+			endTransaction(probe);
+			console.error("SD card rejected read from block "sv, block);
+			return false;
+		}
+		const auto received
+		{
+			[&]()
+			{
+				for (const auto offset : indexSequence_t{data.size()}.step(blockSize))
+				{
+					if (!receiveBlock(probe, data.subspan(offset, blockSize)))
+						return false;
+				}
+				return true;
+			}()
+		};
+		// Stop the card sending more blocks, and wait for it to settle
+		const auto stopped{command(probe, sdCommand_t::stopTransmission, 0U) && waitIdle(probe)};
+		endTransaction(probe);
+		return received && stopped;
+	}
+
+	bool sdCard_t::writeBlocks(const bmp_t &probe, const uint64_t block, const span<const uint8_t> data)
+	{
+		trace::span_t span{"card"sv, "write"sv};
+		span.region(block * blockSize, data.size());
+		const auto response{command(probe, sdCommand_t::writeMultipleBlock, address(block))};
+		if (response != 0U)
+		{
+			endTransaction(probe);
+			console.error("SD card rejected write to block "sv, block);
+			return false;
+		}
+		const auto sent
+		{
+			[&]()
+			{
+				for (const auto offset : indexSequence_t{data.size()}.step(blockSize))
+				{
+					if (!sendBlock(probe, data.subspan(offset, blockSize)))
+						return false;
+				}
+				return true;
+			}()
+		};
+		// End the transfer, and wait for the card to finish programming the last of the data
+		static_cast<void>(probe.transfer(stopTransferToken));
+		static_cast<void>(probe.transfer(fillByte));
+		const auto idle{waitIdle(probe)};
+		endTransaction(probe);
+		return sent && idle;
+	}
+} // namespace bmpflash::sdCard
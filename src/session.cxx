@@ -0,0 +1,209 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// SPDX-FileCopyrightText: 2023 1BitSquared <info@1bitsquared.com>
+#include <stdexcept>
+#include <substrate/console>
+#include "session.hxx"
+#include "flashVendors.hxx"
+#include "flashChips.hxx"
+#include "sfdp.hxx"
+#include "profileCache.hxx"
+#include "units.hxx"
+
+using namespace std::literals::string_view_literals;
+using substrate::console;
+using substrate::asHex_t;
+using bmpflash::utils::humanReadableSize;
+
+namespace bmpflash
+{
+	std::vector<usbDevice_t> findBMPs(const usbContext_t &context)
+	{
+		std::vector<usbDevice_t> devices{};
+		for (auto device : context.deviceList())
+		{
+			if (device.vid() == bmp_t::vid && device.pid() == bmp_t::pid)
+			{
+				console.info("Found BMP at USB address "sv, device.busNumber(), '-', device.portNumber());
+				devices.emplace_back(std::move(device));
+			}
+		}
+		return devices;
+	}
+
+	spiDevice_t busToDevice(const spiBus_t &bus)
+	{
+		switch (bus)
+		{
+			case spiBus_t::internal:
+				return spiDevice_t::intFlash;
+			case spiBus_t::external:
+				return spiDevice_t::extFlash;
+			case spiBus_t::none:
+			default:
+				throw std::domain_error{"SPI bus requested is unhandled or unknown"};
+		}
+	}
+
+	std::string readSerialNumber(const usbDevice_t &device)
+	{
+		const auto handle{device.open()};
+		return handle.readStringDescriptor(device.serialNumberIndex());
+	}
+
+	std::optional<bmp_t> beginComms(const usbDevice_t &device, const spiBus_t &spiBus)
+		{ return beginComms(device, spiBus, busToDevice(spiBus)); }
+
+	std::optional<bmp_t> beginComms(const usbDevice_t &device, const spiBus_t &spiBus, const spiDevice_t spiDevice)
+	{
+		const auto serialNumber{readSerialNumber(device)};
+		// Use the found device to then build the communications structure
+		bmp_t probe{device};
+		if (!probe.valid())
+			return std::nullopt;
+		return beginComms(std::move(probe), serialNumber, spiBus, spiDevice);
+	}
+
+	std::optional<bmp_t> beginComms(bmp_t &&probe, const std::string_view serialNumber, const spiBus_t &spiBus)
+		{ return beginComms(std::move(probe), serialNumber, spiBus, busToDevice(spiBus)); }
+
+	std::optional<bmp_t> beginComms(bmp_t &&probe, const std::string_view serialNumber, const spiBus_t &spiBus,
+		const spiDevice_t spiDevice)
+	{
+		// Initialise remote communications
+		const auto probeVersion{probe.init()};
+		console.info("Remote is "sv, probeVersion);
+
+		// Start by checking the BMP is running a new enough remote protocol, using the cached
+		// capabilities for this probe and firmware version if we've seen them before
+		const auto protocolVersion
+		{
+			[&]()
+			{
+				if (const auto capabilities{profileCache::loadProbeCapabilities(serialNumber, probeVersion)};
+					capabilities)
+					return capabilities->protocolVersion;
+				const auto version{probe.readProtocolVersion()};
+				profileCache::storeProbeCapabilities(serialNumber, probeVersion, {version});
+				return version;
+			}()
+		};
+		if (protocolVersion < 3U || !probe.begin(spiBus, spiDevice))
+		{
+			console.error("Probe is running firmware that is too old, please update it");
+			return std::nullopt;
+		}
+		return std::move(probe);
+	}
+
+	[[nodiscard]] static std::string_view lookupFlashVendor(const uint8_t manufacturer) noexcept
+	{
+		// Look the Flash manufacturer up by MFR ID
+		const auto vendor{flashVendors.find(manufacturer)};
+		if (vendor == flashVendors.cend())
+			return "<Unknown>"sv;
+		return vendor->second;
+	}
+
+	// Display some useful information about the Flash
+	static void displayFlashID(const spiFlashID_t &chipID) noexcept
+	{
+		console.info("SPI Flash ID: ", asHex_t<2, '0'>{chipID.manufacturer}, ' ',
+			asHex_t<2, '0'>{chipID.type}, ' ', asHex_t<2, '0'>{chipID.capacity});
+	}
+
+	std::optional<spiFlashID_t> identifyFlash(const bmp_t &probe) noexcept
+	{
+		const auto chipID{probe.identifyFlash()};
+		// If the part is one we know about, we can say exactly what it is. This has to be checked first as
+		// some parts we know about don't encode their capacity in the third ID byte, which can then be 0
+		if (const auto *const flashChip{flashChips::findFlashChip(chipID)}; flashChip)
+		{
+			displayFlashID(chipID);
+			const auto [capacityValue, capacityUnits] = humanReadableSize(flashChip->spiFlash.capacity());
+			console.info("Device is a "sv, capacityValue, capacityUnits, ' ', flashChip->name, " from "sv,
+				lookupFlashVendor(chipID.manufacturer));
+			return chipID;
+		}
+		// Otherwise if we got a bad all-highs read back, or the capacity is 0, then there's no device there.
+		if ((chipID.manufacturer == 0xffU && chipID.type == 0xffU && chipID.capacity == 0xffU) ||
+			chipID.capacity == 0U)
+		{
+			console.error("Could not identify a valid Flash device on the requested SPI bus"sv);
+			return std::nullopt;
+		}
+		// Assume the third ID byte is the capacity as that's what most manufacturers do
+		displayFlashID(chipID);
+		const auto flashSize{UINT32_C(1) << chipID.capacity};
+		const auto [capacityValue, capacityUnits] = humanReadableSize(flashSize);
+		console.info("Device is a "sv, capacityValue, capacityUnits, " device from "sv,
+			lookupFlashVendor(chipID.manufacturer));
+		return chipID;
+	}
+
+	std::optional<flashTarget_t> discoverFlash(const bmp_t &probe, const spiBus_t spiBus)
+	{
+		// Try and identify the Flash on the bus
+		const auto chipID{identifyFlash(probe)};
+		if (!chipID)
+			return std::nullopt;
+
+		const auto spiFlash{sfdp::read(probe, *chipID)};
+		if (!spiFlash)
+		{
+			console.error("Could not setup SPI Flash control structures"sv);
+			return std::nullopt;
+		}
+		return flashTarget_t{spiBus, *chipID, *spiFlash};
+	}
+
+	flashSession_t::flashSession_t(const usbDevice_t &device) : _serialNumber{readSerialNumber(device)},
+		_connect{[device](const spiBus_t bus) { return beginComms(device, bus); }} { }
+
+	flashSession_t::flashSession_t(const std::string_view serialNumber, const capture::replayInterface_t &replay) :
+		_serialNumber{serialNumber}, _connect{[replay, serialNumber = _serialNumber](const spiBus_t bus)
+			{ return beginComms(bmp_t{replay}, serialNumber, bus); }} { }
+
+	flashTarget_t *flashSession_t::select(const spiBus_t bus)
+	{
+		if (!_probe)
+		{
+			_probe = _connect(bus);
+			if (!_probe)
+				return nullptr;
+			_probe->cancellation(_cancellation);
+		}
+		else if (bus != _activeBus && (!_probe->end() || !_probe->begin(bus, busToDevice(bus))))
+		{
+			console.error("Failed to switch the probe to the requested SPI bus"sv);
+			return nullptr;
+		}
+		_activeBus = bus;
+
+		auto target{_targets.find(bus)};
+		if (target == _targets.end())
+		{
+			auto discovered{discoverFlash(*_probe, bus)};
+			if (!discovered)
+				return nullptr;
+			target = _targets.emplace(bus, *discovered).first;
+		}
+		return &target->second;
+	}
+
+	void flashSession_t::cancellation(const cancellationToken_t &token) noexcept
+	{
+		_cancellation = token;
+		if (_probe)
+			_probe->cancellation(token);
+	}
+
+	bool flashSession_t::end() noexcept
+	{
+		if (!_probe)
+			return true;
+		const auto result{_probe->end()};
+		_probe.reset();
+		_activeBus = spiBus_t::none;
+		return result;
+	}
+} // namespace bmpflash
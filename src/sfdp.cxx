@@ -8,24 +8,41 @@
 #include <array>
 #include <tuple>
 #include <optional>
+#include <vector>
+#include <cstring>
 #include <substrate/console>
+#include <substrate/fd>
 #include <substrate/index_sequence>
 #include <substrate/indexed_iterator>
 #include <substrate/units>
 #include <substrate/span>
+#include <substrate/buffer_utils>
 #include "bmp.hxx"
 #include "spiFlash.hxx"
 #include "sfdp.hxx"
 #include "sfdpInternal.hxx"
+#include "profileCache.hxx"
+#include "flashChips.hxx"
+#include "crc32.hxx"
 #include "units.hxx"
 
 using namespace std::literals::string_view_literals;
 using substrate::console;
 using substrate::asHex_t;
+using substrate::span;
+using substrate::fd_t;
+using substrate::normalMode;
+using substrate::buffer_utils::readLE;
 using substrate::indexSequence_t;
 using substrate::indexedIterator_t;
 using substrate::operator ""_KiB;
 using bmpflash::utils::humanReadableSize;
+using bmpflash::spiFlash::eraseType_t;
+using bmpflash::spiFlash::defaultEraseTime;
+using bmpflash::spiFlash::maxEraseTypes;
+using bmpflash::spiFlash::opcode_t;
+using bmpflash::spiFlash::opcodeMode_t;
+using bmpflash::spiFlash::dataMode_t;
 
 namespace bmpflash::sfdp
 {
@@ -34,40 +51,134 @@ namespace bmpflash::sfdp
 
 	constexpr static std::array<char, 4> sfdpMagic{{'S', 'F', 'D', 'P'}};
 	constexpr static uint16_t basicSPIParameterTable{0xFF00U};
+	constexpr static uint16_t sectorMapParameterTable{0xFF81U};
 
-	[[nodiscard]] bool sfdpRead(const bmp_t &probe, const uint32_t address, void *const data,
-			const size_t dataLength, const bool displayRaw)
+	// The first read grabs enough of the SFDP region to cover the header and parameter table headers,
+	// along with the tables themselves, on most devices
+	constexpr static size_t sfdpInitialReadLength{256U};
+	// SFDP is nominally addressed with 24-bit addresses, but real parts keep their tables in the first few
+	// hundred bytes. Anything claiming to lie past this is treated as bogus rather than fetched a packet at a time
+	constexpr static size_t sfdpMaxRegionLength{64_KiB};
+	// Limit reads to what will fit, hex encoded, in a single response packet from the probe
+	constexpr static size_t sfdpMaxReadLength{(bmp_t::maxPacketSize - 4U) / 2U};
+
+	void displayRawData(const span<const uint8_t> &sfdpData)
 	{
-		const auto result{probe.read(spiFlashCommand_t::readSFDP, address, data, dataLength)};
-		// Check if we should display the raw data
-		if (displayRaw)
+		console.info("Raw SFDP data:"sv);
+		// Write the data out in blocks of 8 bytes per line
+		for (const auto &[index, value] : indexedIterator_t{sfdpData})
 		{
-			console.info("Raw data for read:"sv);
-			// Turn the buffer into a span so we can iterate through the raw bytes
-			substrate::span sfdpData{reinterpret_cast<const uint8_t *>(data), dataLength};
-			// Write the data out in blocks of 8 bytes per line
-			for (const auto &[index, value] : indexedIterator_t{sfdpData})
+			// If we should start a new line, output a start of line marker
+			if ((index & 7U) == 0)
 			{
-				// If we should start a new line, output a start of line marker
-				if ((index & 7U) == 0)
-				{
-					// Output a new line to terminate the previous
-					if (index)
-						console.writeln();
-					// The trailing nullptr suppresses the automatic new line
-					console.info(asHex_t<6, '0'>{address + index}, ": "sv, nullptr);
-				}
-				console.writeln(asHex_t<2, '0'>{value}, ' ', nullptr);
+				// Output a new line to terminate the previous
+				if (index)
+					console.writeln();
+				// The trailing nullptr suppresses the automatic new line
+				console.info(asHex_t<6, '0'>{index}, ": "sv, nullptr);
+			}
+			console.writeln(asHex_t<2, '0'>{value}, ' ', nullptr);
+		}
+		// Complete the display by completing the last line with a new line
+		console.writeln();
+	}
+
+	[[nodiscard]] bool sfdpRead(const span<const uint8_t> &sfdpData, const size_t address, void *const data,
+		const size_t dataLength) noexcept
+	{
+		// Check that the requested data actually lies within the SFDP data we have
+		if (address >= sfdpData.size() || dataLength > sfdpData.size() - address)
+		{
+			console.error("SFDP data truncated, could not read "sv, dataLength, " bytes from SFDP address "sv,
+				asHex_t<6, '0'>{address});
+			return false;
+		}
+		std::memcpy(data, sfdpData.data() + address, dataLength);
+		return true;
+	}
+
+	template<typename T> [[nodiscard]] bool sfdpRead(const span<const uint8_t> &sfdpData,
+		const size_t address, T &buffer) noexcept
+			{ return sfdpRead(sfdpData, address, &buffer, sizeof(T)); }
+
+	[[nodiscard]] bool sfdpFetch(const bmp_t &probe, std::vector<uint8_t> &sfdpData, const size_t length)
+	{
+		// Grow the buffer to the new length and read in everything we don't already have, in as few reads as possible
+		const auto offset{sfdpData.size()};
+		sfdpData.resize(length);
+		const span<uint8_t> fetchData{sfdpData.data(), sfdpData.size()};
+		for (size_t address{offset}; address < length; address += sfdpMaxReadLength)
+		{
+			const auto amount{std::min(length - address, sfdpMaxReadLength)};
+			if (!probe.read(spiFlashCommand_t::readSFDP, static_cast<uint32_t>(address), fetchData.data() + address,
+				amount))
+				return false;
+		}
+		return true;
+	}
+
+	std::optional<std::vector<uint8_t>> fetch(const bmp_t &probe)
+	{
+		std::vector<uint8_t> sfdpData{};
+		if (!sfdpFetch(probe, sfdpData, sfdpInitialReadLength))
+			return std::nullopt;
+
+		sfdpHeader_t header{};
+		if (!sfdpRead({sfdpData.data(), sfdpData.size()}, sfdpHeaderAddress, header))
+			return std::nullopt;
+		// If the device has no valid SFDP block, there's nothing more to fetch - let the parsing deal with this
+		if (header.magic != sfdpMagic)
+			return sfdpData;
+
+		// Make sure we have all the parameter headers, as there can be more of them than fit in the initial read
+		const auto headersLength
+			{tableHeaderAddress + (sizeof(parameterTableHeader_t) * header.parameterHeadersCount())};
+		if (headersLength > sfdpData.size() && !sfdpFetch(probe, sfdpData, headersLength))
+			return std::nullopt;
+		const span<const uint8_t> headerData{sfdpData.data(), sfdpData.size()};
+
+		// Work out where the last of the parameter tables ends so we know how much of the region we need
+		size_t regionLength{headersLength};
+		for (const auto idx : indexSequence_t{header.parameterHeadersCount()})
+		{
+			parameterTableHeader_t tableHeader{};
+			if (!sfdpRead(headerData, tableHeaderAddress + (sizeof(parameterTableHeader_t) * idx), tableHeader))
+				return std::nullopt;
+			// A table that claims to run past any sane SFDP region length is bogus, so don't go fetching it
+			const auto tableEnd{static_cast<size_t>(tableHeader.tableAddress) + tableHeader.tableLength()};
+			if (tableEnd > sfdpMaxRegionLength)
+			{
+				console.warn("Parameter table "sv, idx, " runs past the end of a sane SFDP region, ignoring it"sv);
+				continue;
 			}
-			// Complete the display by completing the last line with a new line
-			console.writeln();
+			regionLength = std::max(regionLength, tableEnd);
 		}
-		return result;
+
+		// Fetch the rest of the region if the tables extend past what we already have, otherwise trim off the excess
+		if (regionLength > sfdpData.size())
+		{
+			if (!sfdpFetch(probe, sfdpData, regionLength))
+				return std::nullopt;
+		}
+		else
+			sfdpData.resize(regionLength);
+		return sfdpData;
 	}
 
-	template<typename T> [[nodiscard]] bool sfdpRead(const bmp_t &probe, const uintptr_t address, T &buffer,
-		const bool displayRaw)
-			{ return sfdpRead(probe, static_cast<uint32_t>(address), &buffer, sizeof(T), displayRaw); }
+	std::optional<std::vector<uint8_t>> fetchHeaders(const bmp_t &probe)
+	{
+		std::vector<uint8_t> sfdpData{};
+		if (!sfdpFetch(probe, sfdpData, sizeof(sfdpHeader_t)))
+			return std::nullopt;
+		sfdpHeader_t header{};
+		if (!sfdpRead({sfdpData.data(), sfdpData.size()}, sfdpHeaderAddress, header))
+			return std::nullopt;
+		if (header.magic == sfdpMagic &&
+			!sfdpFetch(probe, sfdpData,
+				tableHeaderAddress + (sizeof(parameterTableHeader_t) * header.parameterHeadersCount())))
+			return std::nullopt;
+		return sfdpData;
+	}
 
 	void displayHeader(const sfdpHeader_t &header)
 	{
@@ -87,12 +198,21 @@ namespace bmpflash::sfdp
 		console.info("-> table SFDP address: "sv, uint32_t{header.tableAddress});
 	}
 
-	[[nodiscard]] bool displayBasicParameterTable(const bmp_t &probe, const parameterTableHeader_t &header,
-		const bool displayRaw)
+	[[nodiscard]] bool hasTimingInformation(const parameterTableHeader_t &header) noexcept
+		{ return header.versionMajor > 1U || (header.versionMajor == 1U && header.versionMinor >= 5U); }
+
+	void displayTiming(const std::string_view &operation, const timing_t &timing)
+	{
+		console.info(operation, " time: typical "sv, timing.typical.count(), "us, maximum "sv,
+			timing.maximum.count(), "us"sv);
+	}
+
+	[[nodiscard]] bool displayBasicParameterTable(const span<const uint8_t> &sfdpData,
+		const parameterTableHeader_t &header)
 	{
 		basicParameterTable_t parameterTable{};
-		if (!sfdpRead(probe, header.tableAddress, &parameterTable,
-			std::min(sizeof(basicParameterTable_t), header.tableLength()), displayRaw))
+		if (!sfdpRead(sfdpData, header.tableAddress, &parameterTable,
+			std::min(sizeof(basicParameterTable_t), header.tableLength())))
 			return false;
 
 		console.info("Basic parameter table:");
@@ -117,16 +237,87 @@ namespace bmpflash::sfdp
 			else
 				console.writeln("invalid erase type"sv);
 		}
+		if (hasTimingInformation(header))
+		{
+			const auto &timings{parameterTable.programmingAndChipEraseTiming};
+			for (const auto &[idx, eraseType] : indexedIterator_t{parameterTable.eraseTypes})
+			{
+				if (eraseType.eraseSizeExponent == 0U)
+					continue;
+				const auto eraseTime{parameterTable.eraseTimings.eraseTime(idx)};
+				console.info("-> erase type "sv, idx + 1U, " time: typical "sv, eraseTime.typical.count(),
+					"us, maximum "sv, eraseTime.maximum.count(), "us"sv);
+			}
+			displayTiming("-> page program"sv, timings.pageProgramTime());
+			displayTiming("-> first byte program"sv, timings.byteProgramTime());
+			displayTiming("-> additional byte program"sv, timings.additionalByteProgramTime());
+			displayTiming("-> chip erase"sv,
+				timings.chipEraseTime(parameterTable.eraseTimings.maximumMultiplier()));
+		}
 		console.info("-> power down opcode: "sv, asHex_t<2, '0'>(parameterTable.deepPowerdown.enterInstruction()));
 		console.info("-> wake up opcode: "sv, asHex_t<2, '0'>(parameterTable.deepPowerdown.exitInstruction()));
 		return true;
 	}
 
-	bool readAndDisplay(const bmp_t &probe, const bool displayRaw)
+	[[nodiscard]] bool displaySectorMapTable(const span<const uint8_t> &sfdpData,
+		const parameterTableHeader_t &header)
 	{
-		console.info("Reading SFDP data for device"sv);
+		const size_t tableAddress{header.tableAddress};
+		if (tableAddress > sfdpData.size() || header.tableLength() > sfdpData.size() - tableAddress)
+		{
+			console.error("SFDP data truncated, could not read sector map table"sv);
+			return false;
+		}
+		const auto table{sfdpData.subspan(tableAddress, header.tableLength())};
+
+		console.info("Sector map table:"sv);
+		for (size_t offset{0U}; offset + 4U <= table.size();)
+		{
+			const sectorMapDescriptor_t descriptor{readLE<uint32_t>(table.subspan(offset, 4))};
+			if (!descriptor.isMapDescriptor())
+			{
+				if (offset + 8U > table.size())
+					break;
+				console.info("-> detection command: opcode "sv, asHex_t<2, '0'>{descriptor.opcode()}, ", address "sv,
+					asHex_t<8, '0'>{readLE<uint32_t>(table.subspan(offset + 4U, 4))}, ", "sv,
+					descriptor.readLatency(), " latency cycles, data mask "sv,
+					asHex_t<2, '0'>{descriptor.readDataMask()});
+				offset += 8U;
+			}
+			else
+			{
+				const auto regionCount{descriptor.regionCount()};
+				console.info("-> configuration "sv, descriptor.configurationID(), ": "sv, regionCount, " regions"sv);
+				offset += 4U;
+				for (const auto idx : indexSequence_t{regionCount})
+				{
+					if (offset + 4U > table.size())
+						break;
+					const sectorMapRegion_t region{readLE<uint32_t>(table.subspan(offset, 4))};
+					const auto [sizeValue, sizeUnits] = humanReadableSize(region.regionSize());
+					console.info("\t-> region "sv, idx + 1U, ": "sv, sizeValue, sizeUnits, ", erase types "sv, nullptr);
+					for (const auto eraseType : indexSequence_t{4U})
+					{
+						if (region.eraseTypes() & (1U << eraseType))
+							console.writeln(eraseType + 1U, ' ', nullptr);
+					}
+					console.writeln();
+					offset += 4U;
+				}
+			}
+			if (descriptor.isLastDescriptor())
+				break;
+		}
+		return true;
+	}
+
+	bool display(const span<const uint8_t> &sfdpData, const bool displayRaw)
+	{
+		if (displayRaw)
+			displayRawData(sfdpData);
+
 		sfdpHeader_t header{};
-		if (!sfdpRead(probe, sfdpHeaderAddress, header, displayRaw))
+		if (!sfdpRead(sfdpData, sfdpHeaderAddress, header))
 			return false;
 		if (header.magic != sfdpMagic)
 		{
@@ -140,22 +331,98 @@ namespace bmpflash::sfdp
 		for (const auto idx : indexSequence_t{header.parameterHeadersCount()})
 		{
 			parameterTableHeader_t tableHeader{};
-			if (!sfdpRead(probe, tableHeaderAddress + (sizeof(parameterTableHeader_t) * idx), tableHeader, displayRaw))
+			if (!sfdpRead(sfdpData, tableHeaderAddress + (sizeof(parameterTableHeader_t) * idx), tableHeader))
 				return false;
 			displayTableHeader(tableHeader, idx + 1U);
 			if (tableHeader.jedecParameterID() == basicSPIParameterTable)
 			{
 				tableHeader.validate();
-				if (!displayBasicParameterTable(probe, tableHeader, displayRaw))
+				if (!displayBasicParameterTable(sfdpData, tableHeader))
+					return false;
+			}
+			else if (tableHeader.jedecParameterID() == sectorMapParameterTable)
+			{
+				if (!displaySectorMapTable(sfdpData, tableHeader))
 					return false;
 			}
 		}
 		return true;
 	}
 
-	std::optional<spiFlash_t> spiFlashFromID(const bmp_t &probe)
+	bool readAndDisplay(const bmp_t &probe, const spiFlashID_t &chipID, const bool displayRaw,
+		const std::optional<path> &saveFile)
+	{
+		console.info("Reading SFDP data for device"sv);
+		const auto sfdpData{fetch(probe)};
+		if (!sfdpData)
+			return false;
+		const span<const uint8_t> data{sfdpData->data(), sfdpData->size()};
+		if (saveFile && !save(data, *saveFile))
+			return false;
+		if (!display(data, displayRaw))
+			return false;
+
+		// Having read the SFDP data fresh, check that any cached profile for this chip still matches it
+		if (valid(data))
+		{
+			const auto crc{headerCRC(data)};
+			const auto profile{profileCache::loadChipProfile(chipID)};
+			if (!profile || profile->sfdpHeaderCRC != crc)
+			{
+				bool configurationDetected{false};
+				const auto spiFlash{parse(data, &probe, &configurationDetected)};
+				if (spiFlash && !configurationDetected)
+					profileCache::storeChipProfile(chipID, {crc, *spiFlash});
+			}
+		}
+		return true;
+	}
+
+	bool save(const span<const uint8_t> &sfdpData, const path &fileName)
+	{
+		const fd_t file{fileName, O_WRONLY | O_CREAT | O_TRUNC | O_NOCTTY, normalMode};
+		if (!file.valid() || !file.write(sfdpData.data(), sfdpData.size()))
+		{
+			console.error("Failed to write SFDP data to "sv, fileName.string());
+			return false;
+		}
+		console.info("Saved "sv, sfdpData.size(), " bytes of SFDP data to "sv, fileName.string());
+		return true;
+	}
+
+	std::optional<std::vector<uint8_t>> load(const path &fileName)
 	{
-		const auto chipID{probe.identifyFlash()};
+		const fd_t file{fileName, O_RDONLY | O_NOCTTY};
+		if (!file.valid())
+		{
+			console.error("Failed to open SFDP data file "sv, fileName.string());
+			return std::nullopt;
+		}
+		const auto fileLength{file.length()};
+		// SFDP addresses are 24-bit, so anything bigger than that can't be a valid dump
+		if (fileLength <= 0 || fileLength > 0x01000000)
+		{
+			console.error("SFDP data file "sv, fileName.string(), " has an invalid length"sv);
+			return std::nullopt;
+		}
+		std::vector<uint8_t> sfdpData(static_cast<size_t>(fileLength));
+		if (!file.read(sfdpData.data(), sfdpData.size()))
+		{
+			console.error("Failed to read SFDP data file "sv, fileName.string());
+			return std::nullopt;
+		}
+		return sfdpData;
+	}
+
+	std::optional<spiFlash_t> spiFlashFromID(const spiFlashID_t &chipID)
+	{
+		// See if this is a part we know the parameters of already. This has to come first as some of them
+		// don't encode their capacity in the third ID byte, which can then be 0
+		if (const auto *const flashChip{flashChips::findFlashChip(chipID)}; flashChip)
+		{
+			console.info("Using known parameters for "sv, flashChip->name);
+			return flashChip->spiFlash;
+		}
 		// If we got a bad all-highs read back, or the capacity is 0, then there's no device there.
 		if ((chipID.manufacturer == 0xffU && chipID.type == 0xffU && chipID.capacity == 0xffU) ||
 			chipID.capacity == 0U)
@@ -163,16 +430,36 @@ namespace bmpflash::sfdp
 			console.error("Failed to read JEDEC ID"sv);
 			return std::nullopt;
 		}
+		// Otherwise, the only thing we know is the capacity - everything else including
+		// the timings is left at the conservative defaults
 		const auto flashSize{UINT32_C(1) << chipID.capacity};
 		return {flashSize};
 	}
 
-	spiFlash_t readBasicParameterTable(const bmp_t &probe, const parameterTableHeader_t &header)
+	uint32_t headerCRC(const span<const uint8_t> &sfdpData) noexcept
+	{
+		// Compute the CRC over the SFDP header and all the parameter table headers that follow it
+		sfdpHeader_t header{};
+		if (sfdpData.size() < sizeof(sfdpHeader_t))
+			return 0U;
+		std::memcpy(&header, sfdpData.data(), sizeof(sfdpHeader_t));
+		const auto length
+		{
+			std::min(sfdpData.size(), tableHeaderAddress +
+				(sizeof(parameterTableHeader_t) * header.parameterHeadersCount()))
+		};
+		uint32_t crc{0U};
+		crc32_t::crc(crc, sfdpData.subspan(0, length));
+		return crc;
+	}
+
+	std::optional<spiFlash_t> readBasicParameterTable(const span<const uint8_t> &sfdpData,
+		const parameterTableHeader_t &header)
 	{
 		basicParameterTable_t parameterTable{};
-		if (!sfdpRead(probe, header.tableAddress, &parameterTable,
-			std::min(sizeof(basicParameterTable_t), header.tableLength()), false))
-			return {};
+		if (!sfdpRead(sfdpData, header.tableAddress, &parameterTable,
+			std::min(sizeof(basicParameterTable_t), header.tableLength())))
+			return std::nullopt;
 
 		const auto [sectorSize, sectorEraseOpcode]
 		{
@@ -197,34 +484,261 @@ namespace bmpflash::sfdp
 			}()
 		};
 		const auto capacity{parameterTable.flashMemoryDensity.capacity()};
-		return {pageSize, sectorSize, sectorEraseOpcode, capacity};
+		spiFlash_t spiFlash{pageSize, sectorSize, sectorEraseOpcode, capacity};
+
+		// Extract the erase types the device supports so erases can be planned against them, along with
+		// how long each takes if the table is new enough to tell us (JESD216A, v1.5, onwards)
+		const auto hasTimings{hasTimingInformation(header)};
+		std::array<eraseType_t, maxEraseTypes> eraseTypes{};
+		for (const auto &[idx, eraseType] : indexedIterator_t{parameterTable.eraseTypes})
+		{
+			if (eraseType.eraseSizeExponent == 0U || eraseType.eraseSizeExponent >= 32U)
+				continue;
+			const auto eraseSize{static_cast<uint32_t>(eraseType.eraseSize())};
+			eraseTypes[idx] =
+			{
+				eraseSize, eraseType.opcode,
+				hasTimings ? parameterTable.eraseTimings.eraseTime(idx) : defaultEraseTime(eraseSize)
+			};
+		}
+		spiFlash.eraseTypes(eraseTypes);
+
+		if (hasTimings)
+		{
+			const auto &timings{parameterTable.programmingAndChipEraseTiming};
+			spiFlash.timings
+			({
+				timings.pageProgramTime(),
+				timings.byteProgramTime(),
+				timings.additionalByteProgramTime(),
+				timings.chipEraseTime(parameterTable.eraseTimings.maximumMultiplier()),
+			});
+		}
+		return spiFlash;
 	}
 
-	std::optional<spiFlash_t> read(const bmp_t &probe)
+	[[nodiscard]] std::optional<bool> runDetectionCommand(const bmp_t &probe, const sectorMapDescriptor_t &descriptor,
+		const uint32_t address)
 	{
-		console.info("Reading SFDP data for device"sv);
-		sfdpHeader_t header{};
-		if (!sfdpRead(probe, sfdpHeaderAddress, header, false))
+		const auto opcodeMode
+		{
+			[&]() -> std::optional<opcodeMode_t>
+			{
+				switch (descriptor.addressLength())
+				{
+					case detectionAddressLength_t::none:
+						return opcodeMode_t::opcodeOnly;
+					case detectionAddressLength_t::threeByte:
+						return opcodeMode_t::with3BAddress;
+					case detectionAddressLength_t::fourByte:
+					case detectionAddressLength_t::variable:
+					default:
+						return std::nullopt;
+				}
+			}()
+		};
+		if (!opcodeMode)
+		{
+			console.warn("Sector map configuration detection command uses unsupported addressing"sv);
 			return std::nullopt;
-		if (header.magic != sfdpMagic)
+		}
+
+		// Convert the read latency from clock cycles into dummy bytes and build the command to run
+		const auto dummyBytes{static_cast<uint8_t>((descriptor.readLatency() + 7U) / 8U)};
+		const auto command
 		{
-			console.warn("Failed to read SFDP data, falling back on JEDEC ID"sv);
-			return spiFlashFromID(probe);
+			static_cast<spiFlashCommand_t>(spiFlash::command(*opcodeMode, dataMode_t::dataIn, dummyBytes,
+				static_cast<opcode_t>(descriptor.opcode())))
+		};
+		uint8_t value{};
+		if (!probe.read(command, address, &value, sizeof(value)))
+		{
+			console.error("Failed to run sector map configuration detection command"sv);
+			return std::nullopt;
+		}
+		return (value & descriptor.readDataMask()) != 0U;
+	}
+
+	[[nodiscard]] bool readSectorMapTable(const span<const uint8_t> &sfdpData, const parameterTableHeader_t &header,
+		const bmp_t *const probe, spiFlash_t &spiFlash, bool &configurationDetected)
+	{
+		const size_t tableAddress{header.tableAddress};
+		if (tableAddress > sfdpData.size() || header.tableLength() > sfdpData.size() - tableAddress)
+		{
+			console.error("SFDP data truncated, could not read sector map table"sv);
+			return false;
 		}
+		const auto table{sfdpData.subspan(tableAddress, header.tableLength())};
 
+		// Run any detection commands to build the ID of the configuration the device is currently in,
+		// the result of the first command forming the most significant bit, then find the matching map
+		uint8_t configurationID{0U};
+		size_t detectionCommands{0U};
+		for (size_t offset{0U}; offset + 4U <= table.size();)
+		{
+			const sectorMapDescriptor_t descriptor{readLE<uint32_t>(table.subspan(offset, 4))};
+			if (!descriptor.isMapDescriptor())
+			{
+				if (offset + 8U > table.size())
+					break;
+				if (!probe)
+				{
+					console.warn("Sector map requires configuration detection which needs a device, ignoring it"sv);
+					return false;
+				}
+				const auto address{readLE<uint32_t>(table.subspan(offset + 4U, 4))};
+				const auto result{runDetectionCommand(*probe, descriptor, address)};
+				if (!result)
+					return false;
+				configurationID = static_cast<uint8_t>((uint32_t{configurationID} << 1U) | (*result ? 1U : 0U));
+				++detectionCommands;
+				configurationDetected = true;
+				offset += 8U;
+			}
+			else
+			{
+				const auto regionCount{descriptor.regionCount()};
+				if (offset + 4U + (regionCount * 4U) > table.size())
+					break;
+				// If there were no detection commands, there is only one map and it always applies
+				if (!detectionCommands || descriptor.configurationID() == configurationID)
+				{
+					spiFlash.clearEraseRegions();
+					uint64_t mapLength{0U};
+					for (const auto idx : indexSequence_t{regionCount})
+					{
+						const sectorMapRegion_t region{readLE<uint32_t>(table.subspan(offset + 4U + (idx * 4U), 4))};
+						if (!spiFlash.addEraseRegion(region.regionSize(), region.eraseTypes()))
+						{
+							console.warn("Sector map has too many regions, ignoring it"sv);
+							spiFlash.clearEraseRegions();
+							return false;
+						}
+						mapLength += region.regionSize();
+					}
+					if (mapLength != spiFlash.capacity())
+					{
+						console.warn("Sector map does not cover the device's capacity, ignoring it"sv);
+						spiFlash.clearEraseRegions();
+						return false;
+					}
+					console.debug("Using sector map for configuration "sv, configurationID, " with "sv,
+						regionCount, " regions"sv);
+					return true;
+				}
+				offset += 4U + (regionCount * 4U);
+			}
+			if (descriptor.isLastDescriptor())
+				break;
+		}
+		console.warn("Could not find a sector map matching the device's current configuration"sv);
+		return false;
+	}
+
+	/*
+	 * A device with a sector map can have regions (eg, boot sectors) where its larger erase types must not
+	 * be used. If we can't tell where those regions are, only the smallest erase type is safe across the
+	 * whole device, so drop the rest rather than risk erasing more than was asked for.
+	 */
+	static void useSmallestEraseType(spiFlash_t &spiFlash)
+	{
+		eraseType_t smallest{};
+		for (const auto &eraseType : spiFlash.eraseTypes())
+		{
+			if (eraseType.valid() && (!smallest.valid() || eraseType.size < smallest.size))
+				smallest = eraseType;
+		}
+		if (!smallest.valid())
+			return;
+		spiFlash.clearEraseRegions();
+		spiFlash.eraseTypes({{smallest}});
+		const auto [sizeValue, sizeUnits] = humanReadableSize(smallest.size);
+		console.warn("No usable sector map for device, only using "sv, sizeValue, sizeUnits, " erases"sv);
+	}
+
+	bool valid(const span<const uint8_t> &sfdpData) noexcept
+	{
+		sfdpHeader_t header{};
+		if (sfdpData.size() < sizeof(sfdpHeader_t))
+			return false;
+		std::memcpy(&header, sfdpData.data(), sizeof(sfdpHeader_t));
+		return header.magic == sfdpMagic;
+	}
+
+	std::optional<spiFlash_t> parse(const span<const uint8_t> &sfdpData, const bmp_t *const probe,
+		bool *const configurationDetected)
+	{
+		sfdpHeader_t header{};
+		if (!sfdpRead(sfdpData, sfdpHeaderAddress, header) || header.magic != sfdpMagic)
+			return std::nullopt;
+
+		std::optional<parameterTableHeader_t> basicTableHeader{};
+		std::optional<parameterTableHeader_t> sectorMapHeader{};
 		for (const auto idx : indexSequence_t{header.parameterHeadersCount()})
 		{
 			parameterTableHeader_t tableHeader{};
-			if (!sfdpRead(probe, tableHeaderAddress + (sizeof(parameterTableHeader_t) * idx), tableHeader, false))
+			if (!sfdpRead(sfdpData, tableHeaderAddress + (sizeof(parameterTableHeader_t) * idx), tableHeader))
 				return std::nullopt;
 
-			if (tableHeader.jedecParameterID() == basicSPIParameterTable)
+			if (tableHeader.jedecParameterID() == basicSPIParameterTable && !basicTableHeader)
 			{
 				tableHeader.validate();
-				return readBasicParameterTable(probe, tableHeader);
+				basicTableHeader = tableHeader;
+			}
+			else if (tableHeader.jedecParameterID() == sectorMapParameterTable && !sectorMapHeader)
+				sectorMapHeader = tableHeader;
+		}
+		if (!basicTableHeader)
+			return std::nullopt;
+
+		auto spiFlash{readBasicParameterTable(sfdpData, *basicTableHeader)};
+		// If the device has a sector map, use it to find out where each erase type may be used.
+		// If that fails, fall back on the smallest erase type as the only one that's safe everywhere.
+		bool detected{false};
+		if (spiFlash && sectorMapHeader &&
+			!readSectorMapTable(sfdpData, *sectorMapHeader, probe, *spiFlash, detected))
+			useSmallestEraseType(*spiFlash);
+		if (configurationDetected)
+			*configurationDetected = detected;
+		return spiFlash;
+	}
+
+	std::optional<spiFlash_t> read(const bmp_t &probe, const spiFlashID_t &chipID)
+	{
+		// See if we've already seen this chip and can skip reading and parsing its SFDP data. Parts can share
+		// a JEDEC ID while having different SFDP data, so check the headers still match what the profile was
+		// parsed from before trusting it
+		if (const auto profile{profileCache::loadChipProfile(chipID)}; profile)
+		{
+			const auto headers{fetchHeaders(probe)};
+			if (!headers)
+				return std::nullopt;
+			const span<const uint8_t> headerData{headers->data(), headers->size()};
+			if (valid(headerData) && headerCRC(headerData) == profile->sfdpHeaderCRC)
+			{
+				console.debug("Using cached SFDP profile for device"sv);
+				return profile->spiFlash;
 			}
+			console.debug("Cached SFDP profile does not match the device, ignoring it"sv);
+		}
+
+		console.info("Reading SFDP data for device"sv);
+		const auto sfdpData{fetch(probe)};
+		if (!sfdpData)
+			return std::nullopt;
+		const span<const uint8_t> data{sfdpData->data(), sfdpData->size()};
+		if (!valid(data))
+		{
+			console.warn("Failed to read SFDP data, falling back on JEDEC ID"sv);
+			return spiFlashFromID(chipID);
 		}
-		return std::nullopt;
+		// Sector maps picked by running detection commands depend on how the device is currently configured,
+		// which can change between runs, so profiles using them can't be cached
+		bool configurationDetected{false};
+		const auto spiFlash{parse(data, &probe, &configurationDetected)};
+		if (spiFlash && !configurationDetected)
+			profileCache::storeChipProfile(chipID, {headerCRC(data), *spiFlash});
+		return spiFlash;
 	}
 
 	size_t parameterTableHeader_t::lengthForVersion() const noexcept
@@ -3,20 +3,93 @@
 // SPDX-FileContributor: Written by Rachel Mant <git@dragonmux.network>
 #include <cstdint>
 #include <string_view>
+#include <vector>
+#include <chrono>
+#include <thread>
 #include <substrate/console>
 #include <substrate/index_sequence>
+#include <substrate/indexed_iterator>
 #include "bmp.hxx"
 #include "spiFlash.hxx"
+#include "trace.hxx"
 
 using namespace std::literals::string_view_literals;
 using substrate::console;
 using substrate::asHex_t;
 using substrate::indexSequence_t;
+using substrate::indexedIterator_t;
+using namespace std::literals::chrono_literals;
 
 namespace bmpflash::spiFlash
 {
-	bool spiFlash_t::waitFlashIdle(const bmp_t &probe)
+	// How many times to try any one chunk of a Flash operation before giving up on it, and how long to wait
+	// before the first retry (which is then quadrupled for each retry after it)
+	constexpr static size_t maxAttempts{4U};
+	constexpr static auto retryBackoff{10ms};
+	constexpr static auto idleTimeoutSlack{50ms};
+
+	// Run one chunk of a Flash operation, and if communications with the probe break down part way through it,
+	// get back in step with the probe and try the chunk again. The operation is told which attempt it's on so
+	// it can check what state an earlier attempt left things in before it starts over
+	template<typename function_t> [[nodiscard]] static bool withRetries(const bmp_t &probe,
+		const std::string_view &operation, const size_t address, const function_t &function)
+	{
+		for (size_t attempt{1U};; ++attempt)
+		{
+			try
+				{ return function(attempt); }
+			catch (const bmpCommsError_t &)
+			{
+				if (attempt == maxAttempts)
+				{
+					console.error("Giving up on "sv, operation, " at 0x"sv, asHex_t<6, '0'>{address}, " after "sv,
+						attempt, " attempts"sv);
+					throw;
+				}
+				console.warn("Communications error during "sv, operation, " at 0x"sv, asHex_t<6, '0'>{address},
+					", retrying (attempt "sv, attempt + 1U, " of "sv, maxAttempts, ')');
+				trace::span_t span{"remote"sv, "recover"sv};
+				std::this_thread::sleep_for(retryBackoff * (1U << (2U * (attempt - 1U))));
+				if (!probe.recover())
+				{
+					console.error("Failed to resynchronise with the probe"sv);
+					throw;
+				}
+			}
+		}
+	}
+
+	// What state a page is in compared to what we want to program into it
+	enum class pageState_t : uint8_t
+	{
+		programmed,
+		programmable,
+		conflicting,
+	};
+
+	// Programming can only clear bits, so a page an interrupted program got part way through can be programmed
+	// again just so long as every bit we want set is still set
+	[[nodiscard]] static pageState_t pageState(const substrate::span<const uint8_t> &current,
+		const substrate::span<const uint8_t> &wanted) noexcept
 	{
+		auto state{pageState_t::programmed};
+		for (const auto offset : indexSequence_t{wanted.size()})
+		{
+			if ((current[offset] & wanted[offset]) != wanted[offset])
+				return pageState_t::conflicting;
+			if (current[offset] != wanted[offset])
+				state = pageState_t::programmable;
+		}
+		return state;
+	}
+
+	bool spiFlash_t::pollFlashIdle(const bmp_t &probe, const microseconds maximumTime) const
+	{
+		const trace::span_t span{"flash"sv, "status poll"sv};
+		// Give the Flash twice as long as it says the operation can take, plus some slack for the round trips
+		// through the probe, before deciding that it's wedged rather than just slow
+		const auto timeout{maximumTime * 2U + idleTimeoutSlack};
+		const auto deadline{std::chrono::steady_clock::now() + timeout};
 		uint8_t status = spiStatusBusy;
 		while (status & spiStatusBusy)
 		{
@@ -25,52 +98,267 @@ namespace bmpflash::spiFlash
 				console.error("Failed to read SPI Flash status"sv);
 				return false;
 			}
+			if ((status & spiStatusBusy) && std::chrono::steady_clock::now() > deadline)
+			{
+				console.error("SPI Flash still busy after "sv,
+					std::chrono::duration_cast<std::chrono::milliseconds>(timeout).count(), "ms, giving up on it"sv);
+				return false;
+			}
 		}
 		return true;
 	}
 
-	bool spiFlash_t::writeBlock(const bmp_t &probe, const size_t address, const substrate::span<uint8_t> &block)
+	bool spiFlash_t::waitFlashIdle(const bmp_t &probe)
 	{
-		console.debug("Erasing sector at 0x"sv, asHex_t<6, '0'>{address});
-		// Start by erasing the block
-		if (!probe.runCommand(spiFlashCommand_t::writeEnable, 0U) ||
-			!probe.runCommand(spiFlashCommand_t::sectorErase | sectorEraseOpcode_, static_cast<uint32_t>(address)) ||
-			!waitFlashIdle(probe))
-		{
-			console.error("Failed to prepare SPI Flash block for writing"sv);
+		// Without knowing what the Flash is busy with, allow for the longest thing it could be doing
+		return pollFlashIdle(probe, timings_.chipErase.maximum);
+	}
+
+	bool spiFlash_t::waitFlashIdle(const bmp_t &probe, const timing_t &expectedTime)
+	{
+		// Rather than start polling the status register straight away, give the operation
+		// half its typical time to get on with it first - this cuts down on the number of
+		// status reads needed for long-running operations like erases
+		std::this_thread::sleep_for(expectedTime.typical / 2U);
+		return pollFlashIdle(probe, expectedTime.maximum);
+	}
+
+	bool spiFlash_t::addEraseRegion(const uint32_t length, const uint8_t eraseTypes) noexcept
+	{
+		if (eraseRegionCount_ == eraseRegions_.size())
 			return false;
+		// Regions are contiguous, so each new one starts where the previous one ended
+		const auto start{eraseRegionCount_ ? static_cast<uint32_t>(eraseRegions_[eraseRegionCount_ - 1U].end()) : 0U};
+		eraseRegions_[eraseRegionCount_++] = {start, length, eraseTypes};
+		return true;
+	}
+
+	std::array<eraseType_t, maxEraseTypes> spiFlash_t::effectiveEraseTypes() const noexcept
+	{
+		// If we don't know what erase types the device has (eg, no SFDP), the sector erase is the only one we have
+		for (const auto &eraseType : eraseTypes_)
+		{
+			if (eraseType.valid())
+				return eraseTypes_;
 		}
-		// Then loop through each write page worth of data in the block
-		for (const auto offset : indexSequence_t{block.size()}.step(pageSize_))
+		return {{{sectorSize_, sectorEraseOpcode_, defaultEraseTime(sectorSize_)}}};
+	}
+
+	uint8_t spiFlash_t::eraseTypesAt(const size_t address, uint64_t &regionEnd) const noexcept
+	{
+		const auto eraseTypes{effectiveEraseTypes()};
+		uint8_t validTypes{0U};
+		for (const auto &[index, eraseType] : indexedIterator_t{eraseTypes})
+		{
+			if (eraseType.valid())
+				validTypes |= static_cast<uint8_t>(1U << index);
+		}
+
+		// Without a region map, every erase type is valid across the whole device
+		regionEnd = capacity_;
+		if (!eraseRegionCount_)
+			return validTypes;
+		for (const auto &region : eraseRegions())
 		{
-			// Try to enable write
-			if (!probe.runCommand(spiFlashCommand_t::writeEnable, 0U))
+			if (region.contains(address))
+			{
+				regionEnd = region.end();
+				return region.eraseTypes & validTypes;
+			}
+		}
+		return 0U;
+	}
+
+	uint32_t spiFlash_t::eraseGranularity(const size_t address) const noexcept
+	{
+		uint64_t regionEnd{};
+		const auto validTypes{eraseTypesAt(address, regionEnd)};
+		const auto eraseTypes{effectiveEraseTypes()};
+		uint32_t granularity{0U};
+		for (const auto &[index, eraseType] : indexedIterator_t{eraseTypes})
+		{
+			if ((validTypes & (1U << index)) && (!granularity || eraseType.size < granularity))
+				granularity = eraseType.size;
+		}
+		return granularity ? granularity : sectorSize_;
+	}
+
+	std::optional<std::vector<eraseOperation_t>> spiFlash_t::planErase(const size_t address,
+		const size_t length) const
+	{
+		const auto eraseTypes{effectiveEraseTypes()};
+		const auto end{uint64_t{address} + length};
+		std::vector<eraseOperation_t> operations{};
+		uint64_t position{address};
+		while (position < end)
+		{
+			uint64_t regionEnd{};
+			const auto validTypes{eraseTypesAt(position, regionEnd)};
+			if (!validTypes)
+			{
+				console.error("No valid erase type for SPI Flash address 0x"sv, asHex_t<6, '0'>{position});
+				return std::nullopt;
+			}
+
+			// Find the largest erase that is aligned to where we are and fits in both the region and what's left
+			// to erase, keeping track of the smallest erase in case none of them fit
+			eraseType_t largest{};
+			eraseType_t smallest{};
+			for (const auto &[index, eraseType] : indexedIterator_t{eraseTypes})
+			{
+				if (!(validTypes & (1U << index)))
+					continue;
+				if (!smallest.valid() || eraseType.size < smallest.size)
+					smallest = eraseType;
+				const auto eraseEnd{position + eraseType.size};
+				if (position % eraseType.size == 0U && eraseEnd <= end && eraseEnd <= regionEnd &&
+					eraseType.size > largest.size)
+					largest = eraseType;
+			}
+
+			// If nothing fits exactly then the smallest erase has to go past the bounds of what was asked for
+			if (!largest.valid())
+			{
+				const auto eraseAddress{position - (position % smallest.size)};
+				operations.push_back({static_cast<uint32_t>(eraseAddress), smallest});
+				position = eraseAddress + smallest.size;
+			}
+			else
+			{
+				operations.push_back({static_cast<uint32_t>(position), largest});
+				position += largest.size;
+			}
+		}
+		return operations;
+	}
+
+	timing_t spiFlash_t::programTime(const size_t length) const noexcept
+	{
+		const auto pages{(length + pageSize_ - 1U) / pageSize_};
+		return {timings_.pageProgram.typical * pages, timings_.pageProgram.maximum * pages};
+	}
+
+	std::optional<timing_t> spiFlash_t::writeTime(const size_t address, const size_t length) const
+	{
+		const auto plan{planErase(address, length)};
+		if (!plan)
+			return std::nullopt;
+		auto time{programTime(length)};
+		for (const auto &operation : *plan)
+		{
+			time.typical += operation.type.eraseTime.typical;
+			time.maximum += operation.type.eraseTime.maximum;
+		}
+		return time;
+	}
+
+	bool spiFlash_t::erase(const bmp_t &probe, const eraseOperation_t &operation)
+	{
+		console.debug("Erasing "sv, operation.type.size, " bytes at 0x"sv, asHex_t<6, '0'>{operation.address});
+		trace::span_t span{"flash"sv, "erase"sv};
+		span.region(operation.address, operation.type.size);
+		return withRetries(probe, "erase"sv, operation.address, [&](const size_t attempt)
+		{
+			// Erasing is idempotent, so once any erase an earlier attempt might've started has finished,
+			// just erase the block again rather than read back the whole thing to see how far it got
+			if ((attempt > 1U && !waitFlashIdle(probe)) ||
+				!probe.runCommand(spiFlashCommand_t::writeEnable, 0U) ||
+				!probe.runCommand(spiFlashCommand_t::sectorErase | operation.type.opcode, operation.address) ||
+				!waitFlashIdle(probe, operation.type.eraseTime))
 			{
 				console.error("Failed to prepare SPI Flash block for writing"sv);
 				return false;
 			}
-			// Then run the page programming command with the block of data
+			return true;
+		});
+	}
+
+	bool spiFlash_t::eraseSector(const bmp_t &probe, const size_t address)
+	{
+		// Erase the smallest unit that can be erased at this address
+		const auto plan{planErase(address, 1U)};
+		if (!plan)
+			return false;
+		return erase(probe, plan->front());
+	}
+
+	bool spiFlash_t::programBlock(const bmp_t &probe, const size_t address, const substrate::span<const uint8_t> &block)
+	{
+		std::vector<uint8_t> readback{};
+		// Loop through each write page worth of data in the block
+		for (const auto offset : indexSequence_t{block.size()}.step(pageSize_))
+		{
 			const auto subspan{block.subspan(offset, 256U)};
-			console.debug("Writing "sv, subspan.size_bytes(), " bytes to page at 0x"sv,
-				asHex_t<6, '0'>{address + offset});
-			if (!probe.write(spiFlashCommand_t::pageProgram, static_cast<uint32_t>(address + offset),
-				subspan.data(), subspan.size()) || !waitFlashIdle(probe))
+			const auto programmed{withRetries(probe, "page program"sv, address + offset, [&](const size_t attempt)
 			{
-				console.error("Failed to write data to SPI Flash at offset +0x"sv, asHex_t{address + offset});
+				// If an earlier attempt was cut short, wait for the page program to finish if it got that far and
+				// then find out what it left the page holding to work out if it needs to be programmed again
+				if (attempt > 1U)
+				{
+					readback.resize(subspan.size());
+					if (!waitFlashIdle(probe) ||
+						!readBlock(probe, address + offset, {readback.data(), readback.size()}))
+						return false;
+					switch (pageState({readback.data(), readback.size()}, subspan))
+					{
+						case pageState_t::programmed:
+							return true;
+						case pageState_t::programmable:
+							break;
+						case pageState_t::conflicting:
+							console.error("Interrupted write left the SPI Flash page at 0x"sv,
+								asHex_t<6, '0'>{address + offset}, " holding data that can't be programmed over"sv);
+							return false;
+					}
+				}
+				// Try to enable write
+				if (!probe.runCommand(spiFlashCommand_t::writeEnable, 0U))
+				{
+					console.error("Failed to prepare SPI Flash block for writing"sv);
+					return false;
+				}
+				// Then run the page programming command with the block of data
+				trace::span_t span{"flash"sv, "page program"sv};
+				span.region(address + offset, subspan.size());
+				console.debug("Writing "sv, subspan.size_bytes(), " bytes to page at 0x"sv,
+					asHex_t<6, '0'>{address + offset});
+				if (!probe.write(spiFlashCommand_t::pageProgram, static_cast<uint32_t>(address + offset),
+					subspan.data(), subspan.size()) || !pollFlashIdle(probe, timings_.pageProgram.maximum))
+				{
+					console.error("Failed to write data to SPI Flash at offset +0x"sv, asHex_t{address + offset});
+					return false;
+				}
+				return true;
+			})};
+			if (!programmed)
 				return false;
-			}
 		}
 		return true;
 	}
 
+	bool spiFlash_t::writeBlock(const bmp_t &probe, const size_t address, const substrate::span<const uint8_t> &block)
+		{ return eraseSector(probe, address) && programBlock(probe, address, block); }
+
 	bool spiFlash_t::readBlock(const bmp_t &probe, const size_t address, substrate::span<uint8_t> block)
 	{
 		console.debug("Reading Flash starting at 0x"sv, asHex_t<6, '0'>{address});
+		trace::span_t span{"flash"sv, "read"sv};
+		span.region(address, block.size());
+		const auto readCommand
+		{
+			static_cast<command_t>(command(opcodeMode_t::with3BAddress, dataMode_t::dataIn, readDummyBytes_,
+				static_cast<opcode_t>(readOpcode_)))
+		};
 		for (const auto offset : indexSequence_t{block.size()}.step(pageSize_))
 		{
 			auto subspan{block.subspan(offset, 256U)};
-			if (!probe.read(spiFlashCommand_t::pageRead, static_cast<uint32_t>(address + offset),
-				subspan.data(), subspan.size()))
+			// Reads have no side effects on the Flash, so can simply be tried again if they fail
+			const auto read{withRetries(probe, "read"sv, address + offset, [&](const size_t)
+			{
+				return probe.read(readCommand, static_cast<uint32_t>(address + offset), subspan.data(),
+					subspan.size());
+			})};
+			if (!read)
 			{
 				console.error("Failed to read data from SPI Flash at offset +0x"sv, asHex_t{address + offset});
 				return false;
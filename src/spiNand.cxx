@@ -0,0 +1,428 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// SPDX-FileCopyrightText: 2023 1BitSquared <info@1bitsquared.com>
+#include <cstdint>
+#include <algorithm>
+#include <chrono>
+#include <string_view>
+#include <substrate/console>
+#include <substrate/index_sequence>
+#include "bmp.hxx"
+#include "spiNand.hxx"
+#include "flashVendors.hxx"
+#include "trace.hxx"
+#include "units.hxx"
+
+using namespace std::literals::string_view_literals;
+using substrate::console;
+using substrate::asHex_t;
+using substrate::indexSequence_t;
+using substrate::span;
+using bmpflash::spiFlash::command;
+using bmpflash::spiFlash::command_t;
+using bmpflash::spiFlash::opcode_t;
+using bmpflash::spiFlash::opcodeMode_t;
+using bmpflash::spiFlash::dataMode_t;
+using bmpflash::utils::humanReadableSize;
+
+namespace bmpflash::spiNand
+{
+	/*
+	 * The probe only knows how to send an opcode on its own or followed by a 3 byte address, so the NAND
+	 * instructions are fitted to that as follows:
+	 * - Get feature sends the feature address as the first address byte, the device repeating the register's
+	 *   value for as long as it's clocked so the remaining two address bytes don't matter
+	 * - Set feature and the program loads send their address bytes as the start of the data instead
+	 * - Read from cache sends the 2 column address bytes and then its dummy byte as the 3 address bytes
+	 * - Page read, program execute and block erase take a 3 byte row address, which fits as-is
+	 */
+	constexpr static auto readIDCommand
+		{static_cast<command_t>(command(opcodeMode_t::opcodeOnly, dataMode_t::dataIn, 1U, opcode_t::jedecID))};
+	constexpr static auto getFeatureCommand
+		{static_cast<command_t>(command(opcodeMode_t::with3BAddress, dataMode_t::dataIn, 0U, opcode_t::getFeature))};
+	constexpr static auto setFeatureCommand
+		{static_cast<command_t>(command(opcodeMode_t::opcodeOnly, dataMode_t::dataOut, 0U, opcode_t::setFeature))};
+	constexpr static auto pageReadCommand
+		{static_cast<command_t>(command(opcodeMode_t::with3BAddress, 0U, opcode_t::pageAddressRead))};
+	constexpr static auto sequentialReadCommand
+		{static_cast<command_t>(command(opcodeMode_t::opcodeOnly, 0U, opcode_t::pageCacheSequentialRead))};
+	constexpr static auto lastReadCommand
+		{static_cast<command_t>(command(opcodeMode_t::opcodeOnly, 0U, opcode_t::pageCacheLastRead))};
+	constexpr static auto readCacheCommand
+		{static_cast<command_t>(command(opcodeMode_t::with3BAddress, dataMode_t::dataIn, 0U, opcode_t::pageRead))};
+	constexpr static auto programLoadCommand
+		{static_cast<command_t>(command(opcodeMode_t::opcodeOnly, dataMode_t::dataOut, 0U, opcode_t::pageWrite))};
+	constexpr static auto randomProgramLoadCommand
+	{
+		static_cast<command_t>(command(opcodeMode_t::opcodeOnly, dataMode_t::dataOut, 0U,
+			opcode_t::randomProgramLoad))
+	};
+	constexpr static auto programExecuteCommand
+		{static_cast<command_t>(command(opcodeMode_t::with3BAddress, 0U, opcode_t::pageAddressWrite))};
+	constexpr static auto blockEraseCommand
+		{static_cast<command_t>(command(opcodeMode_t::with3BAddress, 0U, opcode_t::blockErase))};
+
+	// How much data to move through the cache per transaction with the probe
+	constexpr static size_t cacheChunkSize{256U};
+	// The parameter page lives at page 1 of the OTP area and is stored 3 times over for redundancy
+	constexpr static uint32_t parameterPage{1U};
+	constexpr static size_t parameterPageLength{256U};
+	constexpr static size_t parameterPageCopies{3U};
+	constexpr static auto readyTimeoutSlack{50ms};
+
+	[[nodiscard]] static uint16_t readLE16(const span<const uint8_t> &data, const size_t offset) noexcept
+		{ return static_cast<uint16_t>(data[offset] | (data[offset + 1U] << 8U)); }
+
+	[[nodiscard]] static uint32_t readLE32(const span<const uint8_t> &data, const size_t offset) noexcept
+		{ return uint32_t{readLE16(data, offset)} | (uint32_t{readLE16(data, offset + 2U)} << 16U); }
+
+	// The CRC-16 used to protect ONFI parameter pages
+	[[nodiscard]] static uint16_t onfiCRC16(const span<const uint8_t> &data) noexcept
+	{
+		uint16_t crc{0x4f4eU};
+		for (const auto byte : data)
+		{
+			crc ^= static_cast<uint16_t>(uint32_t{byte} << 8U);
+			for ([[maybe_unused]] const auto bit : indexSequence_t{8U})
+			{
+				const auto shifted{uint32_t{crc} << 1U};
+				crc = static_cast<uint16_t>((crc & 0x8000U) ? shifted ^ 0x8005U : shifted);
+			}
+		}
+		return crc;
+	}
+
+	// Pull a space padded string field out of the parameter page
+	[[nodiscard]] static std::string_view parameterString(const span<const uint8_t> &data, const size_t offset,
+		const size_t length) noexcept
+	{
+		std::string_view value{reinterpret_cast<const char *>(data.data() + offset), length};
+		const auto end{value.find_last_not_of(' ')};
+		return end == std::string_view::npos ? std::string_view{} : value.substr(0U, end + 1U);
+	}
+
+	[[nodiscard]] static bool allErased(const span<const uint8_t> &data) noexcept
+		{ return std::all_of(data.begin(), data.end(), [](const uint8_t value) { return value == 0xffU; }); }
+
+	std::optional<spiNand_t> spiNand_t::identify(const bmp_t &probe)
+	{
+		spiNand_t nand{};
+		auto &id{nand.id_};
+		if (!probe.read(readIDCommand, 0U, id.data(), id.size()))
+		{
+			console.error("Failed to read SPI NAND ID"sv);
+			return std::nullopt;
+		}
+		if (std::all_of(id.begin(), id.end(), [](const uint8_t value) { return value == 0x00U || value == 0xffU; }))
+		{
+			console.error("Could not identify a valid SPI NAND device on the requested SPI bus"sv);
+			return std::nullopt;
+		}
+		console.info("SPI NAND ID: ", asHex_t<2, '0'>{id[0]}, ' ', asHex_t<2, '0'>{id[1]}, ' ',
+			asHex_t<2, '0'>{id[2]});
+
+		const auto chip
+		{
+			std::find_if(nandChips.begin(), nandChips.end(), [&](const nandChip_t &candidate)
+				{ return std::equal(candidate.id.begin(), candidate.id.begin() + candidate.idLength, id.begin()); })
+		};
+		if (chip != nandChips.end())
+		{
+			nand.name_ = chip->name;
+			nand.geometry_ = chip->geometry;
+		}
+		// If it's not a part we know about, see if it can describe itself
+		else if (!nand.readParameterPage(probe))
+		{
+			console.error("SPI NAND device is not known and does not provide a usable parameter page"sv);
+			return std::nullopt;
+		}
+
+		const auto vendor{flashVendors.find(id[0])};
+		const auto [capacityValue, capacityUnits] = humanReadableSize(nand.geometry_.capacity());
+		console.info("Device is a "sv, capacityValue, capacityUnits, ' ', nand.name_, " from "sv,
+			vendor == flashVendors.cend() ? "<Unknown>"sv : vendor->second, " with "sv, nand.geometry_.pageSize,
+			" byte pages in blocks of "sv, nand.geometry_.pagesPerBlock);
+		nand.badBlocks_.assign(nand.geometry_.blockCount, false);
+		return nand;
+	}
+
+	bool spiNand_t::readParameterPage(const bmp_t &probe)
+	{
+		// The parameter page is read through the OTP area, so switch over to that for the duration
+		const auto config{getFeature(probe, feature_t::config)};
+		if (!config || !setFeature(probe, feature_t::config, *config | configOTPEnable))
+			return false;
+		std::array<uint8_t, parameterPageLength * parameterPageCopies> data{};
+		const auto loaded{loadPage(probe, parameterPage) && readCache(probe, parameterPage, 0U, data)};
+		if (!setFeature(probe, feature_t::config, *config) || !loaded)
+			return false;
+
+		// Use the first copy of the page that's intact
+		for (const auto copy : indexSequence_t{parameterPageCopies})
+		{
+			const auto page{span<const uint8_t>{data}.subspan(copy * parameterPageLength, parameterPageLength)};
+			if (parameterString(page, 0U, 4U) != "ONFI"sv || onfiCRC16(page.first(254U)) != readLE16(page, 254U))
+				continue;
+
+			nandGeometry_t geometry{};
+			geometry.pageSize = readLE32(page, 80U);
+			geometry.spareSize = readLE16(page, 84U);
+			geometry.pagesPerBlock = readLE32(page, 92U);
+			geometry.blockCount = readLE32(page, 96U);
+			geometry.multiPlane = (page[113U] & 0x0fU) != 0U;
+			if (!geometry.pageSize || geometry.pageSize > 4096U || !geometry.pagesPerBlock || !geometry.blockCount)
+				continue;
+			// Only the first die of multi-die devices can be used, as selecting the others is vendor-specific
+			if (page[100U] > 1U)
+				console.warn("SPI NAND device has "sv, page[100U], " dies, only the first will be used"sv);
+			geometry_ = geometry;
+			name_ = std::string{parameterString(page, 32U, 12U)} + ' ' + std::string{parameterString(page, 44U, 20U)};
+			return true;
+		}
+		return false;
+	}
+
+	size_t spiNand_t::badBlockCount() const noexcept
+		{ return static_cast<size_t>(std::count(badBlocks_.begin(), badBlocks_.end(), true)); }
+
+	std::optional<uint8_t> spiNand_t::getFeature(const bmp_t &probe, const feature_t feature) const
+	{
+		uint8_t value{};
+		if (!probe.read(getFeatureCommand, uint32_t{uint8_t(feature)} << 16U, &value, sizeof(value)))
+			return std::nullopt;
+		return value;
+	}
+
+	bool spiNand_t::setFeature(const bmp_t &probe, const feature_t feature, const uint8_t value) const
+	{
+		const std::array<uint8_t, 2U> data{{uint8_t(feature), value}};
+		return probe.write(setFeatureCommand, 0U, data.data(), data.size());
+	}
+
+	std::optional<uint8_t> spiNand_t::waitReady(const bmp_t &probe, const timing_t &expectedTime) const
+	{
+		const trace::span_t span{"flash"sv, "status poll"sv};
+		const auto timeout{expectedTime.maximum * 2U + readyTimeoutSlack};
+		const auto deadline{std::chrono::steady_clock::now() + timeout};
+		while (true)
+		{
+			const auto status{getFeature(probe, feature_t::status)};
+			if (!status)
+			{
+				console.error("Failed to read SPI NAND status"sv);
+				return std::nullopt;
+			}
+			if (!(*status & statusBusy))
+				return status;
+			if (std::chrono::steady_clock::now() > deadline)
+			{
+				console.error("SPI NAND still busy after "sv,
+					std::chrono::duration_cast<std::chrono::milliseconds>(timeout).count(), "ms, giving up on it"sv);
+				return std::nullopt;
+			}
+		}
+	}
+
+	uint32_t spiNand_t::planeSelect(const uint32_t page) const noexcept
+	{
+		// On two plane devices, odd blocks live in the second plane which is picked with bit 12 of the column
+		if (!geometry_.multiPlane)
+			return 0U;
+		return ((page / geometry_.pagesPerBlock) & 1U) << 12U;
+	}
+
+	bool spiNand_t::loadPage(const bmp_t &probe, const uint32_t page) const
+	{
+		if (!probe.runCommand(pageReadCommand, page))
+			return false;
+		const auto status{waitReady(probe, pageReadTime)};
+		if (!status)
+			return false;
+		// An uncorrectable page is still worth reading out, so just say so and carry on
+		if ((*status & statusECCMask) == statusECCUncorrectable)
+			console.warn("Uncorrectable ECC error in SPI NAND page "sv, page);
+		return true;
+	}
+
+	bool spiNand_t::readCache(const bmp_t &probe, const uint32_t page, const uint32_t column,
+		const span<uint8_t> data) const
+	{
+		const auto plane{planeSelect(page)};
+		for (const auto offset : indexSequence_t{data.size()}.step(cacheChunkSize))
+		{
+			const auto chunk{data.subspan(offset, std::min(cacheChunkSize, data.size() - offset))};
+			if (!probe.read(readCacheCommand, ((column + static_cast<uint32_t>(offset)) | plane) << 8U,
+				chunk.data(), chunk.size()))
+				return false;
+		}
+		return true;
+	}
+
+	bool spiNand_t::loadCache(const bmp_t &probe, const uint32_t page, const uint32_t column,
+		const span<const uint8_t> data) const
+	{
+		const auto plane{planeSelect(page)};
+		std::array<uint8_t, cacheChunkSize + 2U> chunk{};
+		for (const auto offset : indexSequence_t{data.size()}.step(cacheChunkSize))
+		{
+			const auto amount{std::min(cacheChunkSize, data.size() - offset)};
+			const auto address{(column + static_cast<uint32_t>(offset)) | plane};
+			chunk[0] = uint8_t(address >> 8U);
+			chunk[1] = uint8_t(address);
+			std::copy_n(data.data() + offset, amount, chunk.data() + 2U);
+			// The first load also sets the rest of the cache to 0xff, later ones must leave what's been loaded alone
+			if (!probe.write(offset ? randomProgramLoadCommand : programLoadCommand, 0U, chunk.data(), amount + 2U))
+				return false;
+		}
+		return true;
+	}
+
+	bool spiNand_t::prepare(const bmp_t &probe) const
+	{
+		// Let anything the device is still in the middle of finish, then take off the power-on block locking
+		if (!waitReady(probe, blockEraseTime) || !setFeature(probe, feature_t::blockLock, 0U))
+			return false;
+		const auto config{getFeature(probe, feature_t::config)};
+		if (!config)
+			return false;
+		if (!(*config & configECCEnable))
+		{
+			console.info("Enabling SPI NAND on-die ECC"sv);
+			return setFeature(probe, feature_t::config, *config | configECCEnable);
+		}
+		return true;
+	}
+
+	bool spiNand_t::scanBadBlocks(const bmp_t &probe)
+	{
+		console.info("Scanning SPI NAND for bad blocks"sv);
+		const trace::span_t span{"flash"sv, "bad block scan"sv};
+		badBlocks_.assign(geometry_.blockCount, false);
+		for (const auto block : indexSequence_t{geometry_.blockCount})
+		{
+			// The factory marks bad blocks by making the first byte of the first page's spare area non-0xff
+			const auto page{static_cast<uint32_t>(block * geometry_.pagesPerBlock)};
+			uint8_t marker{};
+			if (!loadPage(probe, page) || !readCache(probe, page, geometry_.pageSize, {&marker, 1U}))
+			{
+				console.error("Failed to read bad block marker for block "sv, block);
+				return false;
+			}
+			if (marker != 0xffU)
+			{
+				console.warn("Block "sv, block, " is marked bad"sv);
+				badBlocks_[block] = true;
+			}
+		}
+		console.info("Found "sv, badBlockCount(), " bad blocks"sv);
+		return true;
+	}
+
+	void spiNand_t::markBad(const bmp_t &probe, const uint32_t block)
+	{
+		console.warn("Marking block "sv, block, " bad"sv);
+		badBlocks_[block] = true;
+		// Zero the bad block marker, though as the block is bad this may well not take
+		const uint8_t marker{0x00U};
+		const auto page{block * geometry_.pagesPerBlock};
+		if (!probe.runCommand(spiFlashCommand_t::writeEnable, 0U) || !loadCache(probe, page, geometry_.pageSize,
+			{&marker, 1U}) || !probe.runCommand(programExecuteCommand, page) || !waitReady(probe, pageProgramTime))
+			console.warn("Failed to write bad block marker for block "sv, block);
+	}
+
+	bool spiNand_t::readBlock(const bmp_t &probe, const uint32_t block, const span<uint8_t> data) const
+	{
+		trace::span_t span{"flash"sv, "read"sv};
+		span.region(uint64_t{block} * blockSize(), data.size());
+		const auto firstPage{block * geometry_.pagesPerBlock};
+		const auto pages{static_cast<uint32_t>((data.size() + geometry_.pageSize - 1U) / geometry_.pageSize)};
+		const auto pageData
+		{
+			[&](const size_t index)
+			{
+				const auto offset{index * geometry_.pageSize};
+				return data.subspan(offset, std::min<size_t>(geometry_.pageSize, data.size() - offset));
+			}
+		};
+
+		if (!geometry_.sequentialCacheRead || pages < 2U)
+		{
+			for (const auto index : indexSequence_t{pages})
+			{
+				const auto page{firstPage + static_cast<uint32_t>(index)};
+				if (!loadPage(probe, page) || !readCache(probe, page, 0U, pageData(index)))
+				{
+					console.error("Failed to read SPI NAND page "sv, page);
+					return false;
+				}
+			}
+			return true;
+		}
+
+		// With sequential cache reads, the device loads the next page from the array while we read the current
+		// one out of the cache, so the array read time is hidden behind the transfers
+		if (!loadPage(probe, firstPage))
+			return false;
+		for (const auto index : indexSequence_t{pages})
+		{
+			const auto page{firstPage + static_cast<uint32_t>(index)};
+			const auto last{index + 1U == pages};
+			const auto status
+			{
+				probe.runCommand(last ? lastReadCommand : sequentialReadCommand, 0U) ?
+					waitReady(probe, pageReadTime) : std::nullopt
+			};
+			if (!status || !readCache(probe, page, 0U, pageData(index)))
+			{
+				console.error("Failed to read SPI NAND page "sv, page);
+				return false;
+			}
+			if ((*status & statusECCMask) == statusECCUncorrectable)
+				console.warn("Uncorrectable ECC error in SPI NAND page "sv, page);
+		}
+		return true;
+	}
+
+	bool spiNand_t::eraseBlock(const bmp_t &probe, const uint32_t block) const
+	{
+		console.debug("Erasing SPI NAND block "sv, block);
+		trace::span_t span{"flash"sv, "erase"sv};
+		span.region(uint64_t{block} * blockSize(), blockSize());
+		if (!probe.runCommand(spiFlashCommand_t::writeEnable, 0U) ||
+			!probe.runCommand(blockEraseCommand, block * geometry_.pagesPerBlock))
+			return false;
+		const auto status{waitReady(probe, blockEraseTime)};
+		return status && !(*status & statusEraseFailed);
+	}
+
+	bool spiNand_t::programPage(const bmp_t &probe, const uint32_t page, const span<const uint8_t> data) const
+	{
+		trace::span_t span{"flash"sv, "page program"sv};
+		span.region(uint64_t{page} * geometry_.pageSize, data.size());
+		if (!probe.runCommand(spiFlashCommand_t::writeEnable, 0U) || !loadCache(probe, page, 0U, data) ||
+			!probe.runCommand(programExecuteCommand, page))
+			return false;
+		const auto status{waitReady(probe, pageProgramTime)};
+		return status && !(*status & statusProgramFailed);
+	}
+
+	bool spiNand_t::programBlock(const bmp_t &probe, const uint32_t block, const span<const uint8_t> data) const
+	{
+		const auto firstPage{block * geometry_.pagesPerBlock};
+		for (const auto offset : indexSequence_t{data.size()}.step(geometry_.pageSize))
+		{
+			const auto page{firstPage + static_cast<uint32_t>(offset / geometry_.pageSize)};
+			const auto subspan{data.subspan(offset, std::min<size_t>(geometry_.pageSize, data.size() - offset))};
+			// Erased pages are already all 0xff, so there's nothing to program
+			if (allErased(subspan))
+				continue;
+			console.debug("Writing "sv, subspan.size(), " bytes to SPI NAND page "sv, page);
+			if (!programPage(probe, page, subspan))
+			{
+				console.error("Failed to program SPI NAND page "sv, page);
+				return false;
+			}
+		}
+		return true;
+	}
+} // namespace bmpflash::spiNand
@@ -0,0 +1,212 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// SPDX-FileCopyrightText: 2023 1BitSquared <info@1bitsquared.com>
+#include <cctype>
+#include <mutex>
+#include <optional>
+#include <string>
+#if defined(_MSC_VER)
+#pragma warning(push)
+#pragma warning(disable: 4061 4365)
+#elif defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wswitch-enum"
+#pragma GCC diagnostic ignored "-Wsign-conversion"
+#endif
+#include <fmt/format.h>
+#if defined(_MSC_VER)
+#pragma warning(pop)
+#elif defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+#include <substrate/fd>
+#include <substrate/console>
+#include <substrate/conversions>
+#include <substrate/units>
+#include "trace.hxx"
+
+using namespace std::literals::string_view_literals;
+using substrate::fd_t;
+using substrate::normalMode;
+using substrate::console;
+using substrate::toInt_t;
+using substrate::operator ""_KiB;
+
+namespace bmpflash::trace
+{
+	// How much trace data to hold on to before writing it out to the file
+	constexpr static size_t flushThreshold{64_KiB};
+
+	// The trace file and everything needed to write events into it, shared by all threads
+	struct traceFile_t final
+	{
+		std::mutex lock{};
+		fd_t file{};
+		std::string buffer{};
+		steadyClock_t::time_point origin{};
+		bool firstEvent{true};
+	};
+
+	// A request that's been sent to the probe on this thread and is waiting on its response
+	struct pendingRequest_t final
+	{
+		std::string request{};
+		steadyClock_t::time_point begin{};
+	};
+
+	static traceFile_t traceFile{};
+	static std::atomic<uint32_t> nextThreadID{1U};
+	// Each thread gets a small sequential ID for the trace rather than the (rather large) native one
+	thread_local static const uint32_t threadID{nextThreadID++};
+	thread_local static pendingRequest_t pendingRequest{};
+
+	[[nodiscard]] static double timestamp(const steadyClock_t::time_point time) noexcept
+		{ return std::chrono::duration<double, std::micro>{time - traceFile.origin}.count(); }
+
+	static void writeEvent(const std::string_view &category, const std::string_view &name,
+		const steadyClock_t::time_point begin, const steadyClock_t::time_point end, const std::string_view &args)
+	{
+		// Each event is a "complete" event, giving both when it started and how long it took
+		traceFile.buffer += traceFile.firstEvent ? "\n"sv : ",\n"sv;
+		traceFile.buffer += fmt::format(R"({{"name":"{}","cat":"{}","ph":"X","ts":{:.3f},"dur":{:.3f},)", name,
+			category, timestamp(begin), timestamp(end) - timestamp(begin));
+		traceFile.buffer += fmt::format(R"("pid":1,"tid":{},"args":{{{}}}}})", threadID, args);
+		traceFile.firstEvent = false;
+		if (traceFile.buffer.size() >= flushThreshold)
+		{
+			if (!traceFile.file.write(traceFile.buffer.data(), traceFile.buffer.size()))
+				console.warn("Failed to write trace data"sv);
+			traceFile.buffer.clear();
+		}
+	}
+
+	bool start(const path &fileName)
+	{
+		const std::lock_guard lock{traceFile.lock};
+		traceFile.file = fd_t{fileName, O_WRONLY | O_CREAT | O_TRUNC | O_NOCTTY, normalMode};
+		if (!traceFile.file.valid())
+		{
+			console.error("Failed to open trace file "sv, fileName.string());
+			return false;
+		}
+		traceFile.buffer = R"({"displayTimeUnit":"ms","traceEvents":[)";
+		traceFile.origin = steadyClock_t::now();
+		traceFile.firstEvent = true;
+		recording = true;
+		return true;
+	}
+
+	void stop() noexcept
+	{
+		recording = false;
+		const std::lock_guard lock{traceFile.lock};
+		traceFile.buffer += "\n]}\n"sv;
+		if (!traceFile.file.write(traceFile.buffer.data(), traceFile.buffer.size()))
+			console.warn("Failed to write trace data"sv);
+		traceFile.buffer.clear();
+		traceFile.file = fd_t{};
+	}
+
+	// Turn the remote protocol command that starts a request into a readable name for the transaction
+	[[nodiscard]] static std::string_view transactionName(const std::string_view &request) noexcept
+	{
+		if (request.substr(0U, 3U) == "!sr"sv)
+			return "spi read"sv;
+		if (request.substr(0U, 3U) == "!sw"sv)
+			return "spi write"sv;
+		if (request.substr(0U, 3U) == "!sc"sv)
+			return "spi command"sv;
+		if (request.substr(0U, 3U) == "!sB"sv)
+			return "spi begin"sv;
+		if (request.substr(0U, 3U) == "!sE"sv)
+			return "spi end"sv;
+		if (request.substr(0U, 3U) == "!sI"sv)
+			return "spi chip id"sv;
+		if (request.substr(0U, 3U) == "!ss"sv)
+			return "spi select"sv;
+		if (request.substr(0U, 3U) == "!sx"sv)
+			return "spi transfer"sv;
+		if (request.substr(0U, 4U) == "!HC#"sv)
+			return "protocol version"sv;
+		if (request.substr(0U, 4U) == "+#!G"sv)
+			return "remote init"sv;
+		return "remote"sv;
+	}
+
+	[[nodiscard]] static std::optional<uint32_t> hexField(const std::string_view &request, const size_t offset,
+		const size_t length) noexcept
+	{
+		if (request.size() < offset + length)
+			return std::nullopt;
+		const toInt_t<uint32_t> value{request.data() + offset, length};
+		if (!value.isHex())
+			return std::nullopt;
+		return value.fromHex();
+	}
+
+	// Decode the SPI command, address and length fields from a request, which all live in the same place
+	// for the read, write and command requests
+	[[nodiscard]] static std::string transactionArgs(const std::string_view &request, const std::string_view &response,
+		const bool succeeded)
+	{
+		const auto result{succeeded && !response.empty() && std::isalpha(static_cast<unsigned char>(response[0])) ?
+			response[0] : '?'};
+		auto args{fmt::format(R"("requestBytes":{},"responseBytes":{},"result":"{}")", request.size(), response.size(),
+			result)};
+		const auto operation{request.size() > 2U ? request[2] : '\0'};
+		if (request.substr(0U, 2U) != "!s"sv || (operation != 'r' && operation != 'w' && operation != 'c'))
+			return args;
+		if (const auto command{hexField(request, 7U, 4U)}; command)
+			args += fmt::format(R"(,"command":"0x{:04x}")", *command);
+		if (const auto address{hexField(request, 11U, 6U)}; address)
+			args += fmt::format(R"(,"address":"0x{:06x}")", *address);
+		if (operation != 'c')
+		{
+			if (const auto length{hexField(request, 17U, 4U)}; length)
+				args += fmt::format(R"(,"length":{})", *length);
+		}
+		return args;
+	}
+
+	void recordRequest(const std::string_view request) noexcept
+	{
+		try
+		{
+			pendingRequest.request = request;
+			pendingRequest.begin = steadyClock_t::now();
+		}
+		catch (const std::exception &)
+			{ pendingRequest.request.clear(); }
+	}
+
+	void recordResponse(const std::string_view response, const bool succeeded) noexcept
+	{
+		const auto end{steadyClock_t::now()};
+		try
+		{
+			const auto &request{pendingRequest.request};
+			const auto args{transactionArgs(request, response, succeeded)};
+			const std::lock_guard lock{traceFile.lock};
+			if (traceFile.file.valid())
+				writeEvent("remote"sv, transactionName(request), pendingRequest.begin, end, args);
+		}
+		catch (const std::exception &)
+			{ return; }
+	}
+
+	void recordSpan(const std::string_view category, const std::string_view name, const steadyClock_t::time_point begin,
+		const std::string_view args) noexcept
+	{
+		const auto end{steadyClock_t::now()};
+		try
+		{
+			const std::lock_guard lock{traceFile.lock};
+			if (traceFile.file.valid())
+				writeEvent(category, name, begin, end, args);
+		}
+		catch (const std::exception &)
+			{ return; }
+	}
+
+	std::string regionArgs(const uint64_t address, const uint64_t length)
+		{ return fmt::format(R"("address":"0x{:06x}","length":{})", address, length); }
+} // namespace bmpflash::trace
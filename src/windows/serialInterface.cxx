@@ -8,13 +8,18 @@
 #include <string_view>
 #include <algorithm>
 #include <memory>
+#include <chrono>
+#include <thread>
 #include <fmt/format.h>
 #include <substrate/console>
 #include "windows/serialInterface.hxx"
 #include "usbDevice.hxx"
 #include "bmp.hxx"
+#include "trace.hxx"
+#include "capture.hxx"
 
 using namespace std::literals::string_view_literals;
+using namespace std::literals::chrono_literals;
 using substrate::console;
 
 constexpr static auto uncDeviceSuffix{"\\\\.\\"sv};
@@ -264,9 +269,12 @@ void serialInterface_t::swap(serialInterface_t &interface) noexcept
 }
 
 // NOLINTNEXTLINE(readability-convert-member-functions-to-static)
-void serialInterface_t::writePacket(const std::string_view &packet) const
+// Writes are bounded by the write timeout set up on the port when it was opened rather than the one given here
+void serialInterface_t::writePacket(const std::string_view &packet, const milliseconds_t) const
 {
 	console.debug("Remote write: "sv, packet);
+	bmpflash::trace::requestSent(packet);
+	bmpflash::capture::requestSent(packet);
 	DWORD written{0};
 	for (size_t offset{0}; offset < packet.length(); offset += written)
 	{
@@ -279,10 +287,10 @@ void serialInterface_t::writePacket(const std::string_view &packet) const
 }
 
 // NOLINTNEXTLINE(readability-convert-member-functions-to-static)
-void serialInterface_t::refillBuffer() const
+void serialInterface_t::refillBuffer(const milliseconds_t timeout) const
 {
-	// Try to wait for up to 100ms for data to become available
-	if (WaitForSingleObject(device, 100) != WAIT_OBJECT_0)
+	// Try to wait for up to the timeout for data to become available
+	if (WaitForSingleObject(device, static_cast<DWORD>(timeout.count())) != WAIT_OBJECT_0)
 	{
 		console.error("Waiting for data from device failed ("sv, GetLastError(), ")"sv);
 		throw bmpCommsError_t{};
@@ -300,7 +308,7 @@ void serialInterface_t::refillBuffer() const
 }
 
 // NOLINTNEXTLINE(readability-convert-member-functions-to-static)
-std::string serialInterface_t::readPacket() const
+std::string serialInterface_t::readPacket(const milliseconds_t timeout) const
 {
 	std::array<char, bmp_t::maxPacketSize> packet{};
 	size_t length{0U};
@@ -309,7 +317,7 @@ std::string serialInterface_t::readPacket() const
 	{
 		// Check if we need more data or should use what's in the buffer already
 		if (readBufferOffset == readBufferFullness)
-			refillBuffer();
+			refillBuffer(timeout);
 
 		const auto *const bufferBegin{readBuffer.data() + readBufferOffset};
 		const auto *const bufferEnd{readBuffer.data() + readBufferFullness};
@@ -329,9 +337,29 @@ std::string serialInterface_t::readPacket() const
 		}
 	}
 
+	// Check the response is properly framed before trying to use it
+	if (!length || packet[0] != '&')
+	{
+		bmpflash::trace::responseReceived({}, false);
+		bmpflash::capture::responseReceived({}, false);
+		throw bmpCommsError_t{};
+	}
+
 	// Make a new std::string of an appropriate length, copying the data in to return it
 	// Skip the first byte to remove the beginning '&' (the ending '#' is already taken care of in the read loop)
 	std::string result{packet.data() + 1U, length};
 	console.debug("Remote read: "sv, result);
+	bmpflash::trace::responseReceived(result);
+	bmpflash::capture::responseReceived(result);
 	return result;
 }
+
+// NOLINTNEXTLINE(readability-convert-member-functions-to-static)
+void serialInterface_t::resync() const noexcept
+{
+	// Throw away anything left in the read buffer along with anything the probe still has queued for us
+	// (the rest of a mangled or late response, typically) so the next read starts on a packet boundary again
+	readBufferOffset = readBufferFullness;
+	std::this_thread::sleep_for(10ms);
+	PurgeComm(device, PURGE_RXCLEAR);
+}
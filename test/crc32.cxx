@@ -0,0 +1,146 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// SPDX-FileCopyrightText: 2023 1BitSquared <info@1bitsquared.com>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <random>
+#include <substrate/span>
+#include "crc32.hxx"
+#include "testing.hxx"
+
+using namespace std::literals::string_literals;
+using namespace std::literals::string_view_literals;
+using substrate::span;
+using bmpflash::crc32_t;
+using bmpflash::testing::testContext_t;
+
+namespace
+{
+	// The plain bit-at-a-time CRC-32 that every engine has to agree with
+	[[nodiscard]] uint32_t referenceCRC(const span<const uint8_t> data) noexcept
+	{
+		uint32_t crc{UINT32_C(0xffffffff)};
+		for (const auto byte : data)
+		{
+			crc ^= byte;
+			for (size_t bit{0U}; bit < 8U; ++bit)
+				crc = (crc & 1U) ? (crc >> 1U) ^ crc32_t::poly : crc >> 1U;
+		}
+		return crc ^ UINT32_C(0xffffffff);
+	}
+
+	[[nodiscard]] uint32_t crcOf(const span<const uint8_t> data) noexcept
+	{
+		uint32_t crc{0U};
+		crc32_t::crc(crc, data);
+		return crc;
+	}
+
+	// Random data, the same every run, so any failure is reproducible
+	[[nodiscard]] std::vector<uint8_t> randomData(const size_t length)
+	{
+		std::mt19937 generator{UINT32_C(0x62a3f1c5)};
+		std::uniform_int_distribution<uint32_t> distribution{0U, 255U};
+		std::vector<uint8_t> data(length);
+		for (auto &byte : data)
+			byte = static_cast<uint8_t>(distribution(generator));
+		return data;
+	}
+
+	[[nodiscard]] std::string describe(const std::string_view what, const size_t length, const size_t offset)
+	{
+		return std::string{what} + " for " + std::to_string(length) + " bytes at offset " +
+			std::to_string(offset);
+	}
+
+	void testCheckValue(testContext_t &context)
+	{
+		constexpr auto check{"123456789"sv};
+		// NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+		const span<const uint8_t> data{reinterpret_cast<const uint8_t *>(check.data()), check.size()};
+		context.expect(crcOf(data) == UINT32_C(0xcbf43926), "the CRC-32 check value to be 0xcbf43926"sv);
+		context.expect(crcOf({}) == 0U, "the CRC of no data to be 0"sv);
+	}
+
+	void testSmallLengths(testContext_t &context)
+	{
+		// Every length up to 2000 bytes at every alignment within 16 bytes, so each engine's head, body
+		// and tail handling gets exercised with the data at all the offsets it can start at
+		const auto data{randomData(2016U)};
+		for (size_t offset{0U}; offset <= 16U; ++offset)
+		{
+			for (size_t length{0U}; length <= 2000U; ++length)
+			{
+				const span<const uint8_t> block{data.data() + offset, length};
+				if (!context.expect(crcOf(block) == referenceCRC(block),
+						describe("a matching CRC"sv, length, offset)))
+					return;
+			}
+		}
+	}
+
+	void testLargeLengths(testContext_t &context)
+	{
+		const auto data{randomData(1048592U)};
+		for (const size_t length : {65535U, 65536U, 65537U, 131071U, 262147U, 1048576U})
+		{
+			for (const size_t offset : {0U, 1U, 7U, 15U})
+			{
+				const span<const uint8_t> block{data.data() + offset, length};
+				context.expect(crcOf(block) == referenceCRC(block), describe("a matching CRC"sv, length, offset));
+			}
+		}
+	}
+
+	void testIncremental(testContext_t &context)
+	{
+		// Feeding the data through in pieces must give the same result as doing it in one go
+		const auto data{randomData(70000U)};
+		const auto expected{referenceCRC(data)};
+		for (const size_t pieceLength : {1U, 3U, 15U, 16U, 17U, 63U, 64U, 65U, 4096U, 65537U})
+		{
+			uint32_t crc{0U};
+			for (size_t offset{0U}; offset < data.size(); offset += pieceLength)
+				crc32_t::crc(crc, {data.data() + offset, std::min(pieceLength, data.size() - offset)});
+			context.expect(crc == expected,
+				"a matching CRC when fed through in "s + std::to_string(pieceLength) + " byte pieces");
+		}
+	}
+
+	void testCombine(testContext_t &context)
+	{
+		// Split the data at points either side of the block sizes the engines work in, CRC both halves
+		// independently and check combining them gives the CRC of the whole
+		const auto data{randomData(200000U)};
+		for (const size_t length : {0U, 1U, 64U, 1000U, 65536U, 200000U})
+		{
+			const span<const uint8_t> block{data.data(), length};
+			const auto expected{referenceCRC(block)};
+			for (const size_t split : {0U, 1U, 7U, 8U, 15U, 16U, 17U, 63U, 64U, 65U, 127U, 128U, 129U, 999U,
+				4096U, 65535U, 65536U, 65537U, 131072U, 199999U, 200000U})
+			{
+				if (split > length)
+					continue;
+				const auto crcA{crcOf(block.subspan(0U, split))};
+				const auto crcB{crcOf(block.subspan(split))};
+				context.expect(crc32_t::combine(crcA, crcB, length - split) == expected,
+					describe("combine() to give the CRC of the whole"sv, length, split));
+			}
+		}
+	}
+} // namespace
+
+int main()
+{
+	return bmpflash::testing::runTests(
+	{
+		{"checkValue"sv, testCheckValue},
+		{"smallLengths"sv, testSmallLengths},
+		{"largeLengths"sv, testLargeLengths},
+		{"incremental"sv, testIncremental},
+		{"combine"sv, testCombine},
+	});
+}
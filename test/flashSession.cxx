@@ -0,0 +1,115 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// SPDX-FileCopyrightText: 2023 1BitSquared <info@1bitsquared.com>
+#include <cstdint>
+#include <array>
+#include <algorithm>
+#include <string_view>
+#include <substrate/span>
+#include <substrate/index_sequence>
+#include "session.hxx"
+#include "testing.hxx"
+#include "replay.hxx"
+
+using namespace std::literals::string_view_literals;
+using substrate::span;
+using substrate::indexSequence_t;
+using bmpflash::flashSession_t;
+using bmpflash::testing::testContext_t;
+using bmpflash::testing::loadCapture;
+using bmpflash::testing::fillBCD;
+
+/*
+ * These replay captures/flashSession.capture, a session with a probe that has a 1MiB Flash with JESD216 SFDP
+ * data on its internal bus. The Flash starts out holding a counting pattern in its first 8KiB and is erased
+ * beyond that. Any change to the requests a session makes shows up here as the replay diverging from the capture.
+ */
+namespace
+{
+	constexpr auto captureFile{"captures/flashSession.capture"sv};
+
+	[[nodiscard]] uint8_t initialContent(const size_t address) noexcept
+		{ return address < 0x2000U ? static_cast<uint8_t>((address * 13U) + 7U) : 0xffU; }
+
+	[[nodiscard]] bool holdsInitialContent(const span<const uint8_t> data, const size_t address) noexcept
+	{
+		for (const auto offset : indexSequence_t{data.size()})
+		{
+			if (data[offset] != initialContent(address + offset))
+				return false;
+		}
+		return true;
+	}
+
+	void testReadWriteErase(testContext_t &context)
+	{
+		const auto replay{loadCapture(context, captureFile)};
+		if (!replay)
+			return;
+		flashSession_t session{"replay"sv, *replay};
+
+		auto *const target{session.select(spiBus_t::internal)};
+		if (!context.expect(target != nullptr, "the Flash on the internal bus to be discovered"sv))
+			return;
+		auto &flash{target->spiFlash};
+		const auto &probe{session.probe()};
+		context.expect(target->chipID.manufacturer == 0xefU && target->chipID.type == 0x40U &&
+			target->chipID.capacity == 0x14U, "the Flash's JEDEC ID to be ef 40 14"sv);
+		context.expect(flash.capacity() == 1048576U, "the SFDP data to give a 1MiB capacity"sv);
+		context.expect(flash.sectorSize() == 4096U, "the SFDP data to give 4KiB sectors"sv);
+
+		std::array<uint8_t, 512U> data{};
+		context.expect(flash.readBlock(probe, 0U, data) && holdsInitialContent(data, 0U),
+			"the first 512 bytes to read back as the initial content"sv);
+
+		// Rewrite the first page of the second sector, which erases the rest of the sector along with it
+		std::array<uint8_t, 256U> page{};
+		fillBCD(page);
+		context.expect(flash.writeBlock(probe, 0x1000U, page), "the page write to succeed"sv);
+		std::array<uint8_t, 256U> readback{};
+		context.expect(flash.readBlock(probe, 0x1000U, readback) && readback == page,
+			"the written page to read back"sv);
+		context.expect(flash.readBlock(probe, 0x1100U, readback) &&
+			std::all_of(readback.begin(), readback.end(), [](const uint8_t value) { return value == 0xffU; }),
+			"the rest of the sector to have been erased"sv);
+
+		// Erase a whole 64KiB block, which should pick the block erase instruction
+		const auto plan{flash.planErase(0x10000U, 0x10000U)};
+		if (!context.expect(plan && plan->size() == 1U && plan->front().type.opcode == 0xd8U,
+				"a 64KiB erase to be planned as one block erase"sv))
+			return;
+		context.expect(flash.erase(probe, plan->front()), "the block erase to succeed"sv);
+
+		context.expect(session.end(), "the session to end cleanly"sv);
+		context.expect(replay->complete(), "the whole capture to have been replayed"sv);
+	}
+
+	void testDivergence(testContext_t &context)
+	{
+		const auto replay{loadCapture(context, captureFile)};
+		if (!replay)
+			return;
+		flashSession_t session{"replay"sv, *replay};
+
+		auto *const target{session.select(spiBus_t::internal)};
+		if (!context.expect(target != nullptr, "the Flash on the internal bus to be discovered"sv))
+			return;
+		// The capture reads from address 0 next, so reading anywhere else has to be caught as a divergence
+		std::array<uint8_t, 512U> data{};
+		try
+		{
+			static_cast<void>(target->spiFlash.readBlock(session.probe(), 0x800U, data));
+			context.expect(false, "a read the capture doesn't have to fail"sv);
+		}
+		catch (const bmpCommsError_t &)
+			{ context.expect(!replay->complete(), "the capture to not have been fully replayed"sv); }
+	}
+} // namespace
+
+int main()
+{
+	return bmpflash::testing::runTests(
+	{
+		{"readWriteErase"sv, testReadWriteErase},
+		{"divergence"sv, testDivergence},
+	});
+}
@@ -0,0 +1,349 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// SPDX-FileCopyrightText: 2023 1BitSquared <info@1bitsquared.com>
+#include <cstdint>
+#include <array>
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <optional>
+#include <filesystem>
+#include <random>
+#include <substrate/fd>
+#include <substrate/span>
+#include <substrate/buffer_utils>
+#include "imageFormats.hxx"
+#include "testing.hxx"
+
+using namespace std::literals::string_view_literals;
+using substrate::fd_t;
+using substrate::span;
+using substrate::normalMode;
+using substrate::buffer_utils::writeLE;
+using bmpflash::testing::testContext_t;
+using bmpflash::imageFormats::format_t;
+using bmpflash::imageFormats::extent_t;
+using bmpflash::imageFormats::detectFormat;
+using bmpflash::imageFormats::parse;
+
+namespace
+{
+	using std::filesystem::path;
+
+	// A scratch file holding some test input, removed again once the test is done with it
+	struct scratchFile_t final
+	{
+	private:
+		path _fileName;
+
+	public:
+		scratchFile_t(const std::string_view extension, const span<const uint8_t> content) :
+			_fileName{std::filesystem::temp_directory_path() /
+				("bmpflash-test-" + std::to_string(std::random_device{}()) + std::string{extension})}
+		{
+			const fd_t file{_fileName, O_WRONLY | O_CREAT | O_TRUNC, normalMode};
+			static_cast<void>(file.write(content.data(), content.size()));
+		}
+		scratchFile_t(const std::string_view extension, const std::string_view content) :
+			// NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+			scratchFile_t{extension, {reinterpret_cast<const uint8_t *>(content.data()), content.size()}} { }
+		scratchFile_t(const scratchFile_t &) = delete;
+		scratchFile_t(scratchFile_t &&) = delete;
+		~scratchFile_t() noexcept { std::filesystem::remove(_fileName); }
+		scratchFile_t &operator =(const scratchFile_t &) = delete;
+		scratchFile_t &operator =(scratchFile_t &&) = delete;
+
+		[[nodiscard]] auto &fileName() const noexcept { return _fileName; }
+	};
+
+	// Parse the given input, handing back the extents it produced if it parsed successfully
+	[[nodiscard]] std::optional<std::vector<extent_t>> parseInput(const format_t format,
+		const std::string_view extension, const span<const uint8_t> content)
+	{
+		const scratchFile_t input{extension, content};
+		const fd_t file{input.fileName(), O_RDONLY};
+		std::vector<extent_t> extents{};
+		if (!parse(format, file, [&](extent_t &&extent) { extents.emplace_back(std::move(extent)); return true; }))
+			return std::nullopt;
+		return extents;
+	}
+
+	[[nodiscard]] std::optional<std::vector<extent_t>> parseInput(const format_t format,
+		const std::string_view extension, const std::string_view content)
+	{
+		// NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+		return parseInput(format, extension, {reinterpret_cast<const uint8_t *>(content.data()), content.size()});
+	}
+
+	[[nodiscard]] std::vector<uint8_t> counting(const size_t length, const uint8_t first = 0U)
+	{
+		std::vector<uint8_t> data(length);
+		for (size_t index{0U}; index < length; ++index)
+			data[index] = static_cast<uint8_t>(first + index);
+		return data;
+	}
+
+	[[nodiscard]] std::string hexBytes(const std::vector<uint8_t> &bytes)
+	{
+		constexpr auto digits{"0123456789ABCDEF"sv};
+		std::string result{};
+		for (const auto byte : bytes)
+		{
+			result += digits[byte >> 4U];
+			result += digits[byte & 0x0fU];
+		}
+		return result;
+	}
+
+	// Build an Intel HEX record, with a correct checksum unless told to spoil it
+	[[nodiscard]] std::string hexRecord(const uint8_t type, const uint16_t address, const std::vector<uint8_t> &data,
+		const uint8_t checksumError = 0U)
+	{
+		std::vector<uint8_t> record{static_cast<uint8_t>(data.size()), static_cast<uint8_t>(address >> 8U),
+			static_cast<uint8_t>(address), type};
+		record.insert(record.end(), data.begin(), data.end());
+		uint8_t sum{0U};
+		for (const auto byte : record)
+			sum = static_cast<uint8_t>(sum + byte);
+		record.push_back(static_cast<uint8_t>(0x100U - sum + checksumError));
+		return ':' + hexBytes(record) + '\n';
+	}
+
+	// Build an S-record with an address of the length its type calls for
+	[[nodiscard]] std::string srecRecord(const uint8_t type, const uint32_t address, const std::vector<uint8_t> &data,
+		const uint8_t checksumError = 0U)
+	{
+		const size_t addressLength{type == 2U || type == 8U ? 3U : type == 3U || type == 7U ? 4U : 2U};
+		std::vector<uint8_t> record{static_cast<uint8_t>(addressLength + data.size() + 1U)};
+		for (size_t index{addressLength}; index > 0U; --index)
+			record.push_back(static_cast<uint8_t>(address >> ((index - 1U) * 8U)));
+		record.insert(record.end(), data.begin(), data.end());
+		uint8_t sum{0U};
+		for (const auto byte : record)
+			sum = static_cast<uint8_t>(sum + byte);
+		record.push_back(static_cast<uint8_t>(~sum + checksumError));
+		return 'S' + std::string(1U, static_cast<char>('0' + type)) + hexBytes(record) + '\n';
+	}
+
+	// Build a UF2 block carrying the given payload
+	[[nodiscard]] std::array<uint8_t, 512U> uf2Block(const uint32_t flags, const uint32_t address,
+		const std::vector<uint8_t> &payload, const uint32_t blockNumber, const uint32_t blockCount)
+	{
+		std::array<uint8_t, 512U> block{};
+		const span<uint8_t> blockData{block.data(), block.size()};
+		writeLE(UINT32_C(0x0a324655), blockData.subspan(0, 4));
+		writeLE(UINT32_C(0x9e5d5157), blockData.subspan(4, 4));
+		writeLE(flags, blockData.subspan(8, 4));
+		writeLE(address, blockData.subspan(12, 4));
+		writeLE(static_cast<uint32_t>(payload.size()), blockData.subspan(16, 4));
+		writeLE(blockNumber, blockData.subspan(20, 4));
+		writeLE(blockCount, blockData.subspan(24, 4));
+		std::copy(payload.begin(), payload.end(), block.begin() + 32);
+		writeLE(UINT32_C(0x0ab16f30), blockData.subspan(508, 4));
+		return block;
+	}
+
+	[[nodiscard]] bool extentIs(const extent_t &extent, const uint64_t address, const std::vector<uint8_t> &data)
+		{ return extent.address == address && extent.data == data; }
+
+	void testDetectFormat(testContext_t &context)
+	{
+		const auto detect
+		{
+			[](const std::string_view extension, const std::string_view content)
+			{
+				const scratchFile_t input{extension, content};
+				const fd_t file{input.fileName(), O_RDONLY};
+				return detectFormat(input.fileName(), file);
+			}
+		};
+		context.expect(detect(".hex"sv, ""sv) == format_t::intelHex, ".hex to be Intel HEX"sv);
+		context.expect(detect(".S37"sv, ""sv) == format_t::srec, ".S37 to be an S-record file"sv);
+		context.expect(detect(".uf2"sv, ""sv) == format_t::uf2, ".uf2 to be UF2"sv);
+		context.expect(detect(".bin"sv, ":10000000"sv) == format_t::binary, ".bin to be raw binary"sv);
+		context.expect(detect(".img"sv, ":1000"sv) == format_t::intelHex, "sniffing to find Intel HEX"sv);
+		context.expect(detect(".img"sv, "S113"sv) == format_t::srec, "sniffing to find an S-record file"sv);
+		context.expect(detect(".img"sv, "UF2\n"sv) == format_t::uf2, "sniffing to find UF2"sv);
+		context.expect(detect(".img"sv, "\x7f" "ELF"sv) == format_t::binary, "unknown content to be raw binary"sv);
+	}
+
+	void testIntelHexData(testContext_t &context)
+	{
+		// Two adjacent records should be merged, and anything after the end of file record ignored
+		const auto input
+		{
+			hexRecord(0x00U, 0x0100U, counting(16U)) + hexRecord(0x00U, 0x0110U, counting(16U, 16U)) +
+			hexRecord(0x00U, 0x0200U, counting(4U)) + hexRecord(0x01U, 0x0000U, {}) +
+			hexRecord(0x00U, 0x0300U, counting(4U))
+		};
+		const auto extents{parseInput(format_t::intelHex, ".hex"sv, input)};
+		if (!context.expect(extents.has_value(), "valid Intel HEX to parse"sv) ||
+			!context.expect(extents->size() == 2U, "two extents"sv))
+			return;
+		context.expect(extentIs((*extents)[0], 0x0100U, counting(32U)), "adjacent records to be merged"sv);
+		context.expect(extentIs((*extents)[1], 0x0200U, counting(4U)), "a separate extent after a gap"sv);
+	}
+
+	void testIntelHexLinearAddress(testContext_t &context)
+	{
+		// Extended linear addresses carry on into the next 64KiB
+		const auto input
+		{
+			hexRecord(0x04U, 0x0000U, {0x08U, 0x00U}) + hexRecord(0x00U, 0xfff8U, counting(16U)) +
+			hexRecord(0x05U, 0x0000U, {0x08U, 0x00U, 0x01U, 0x01U}) + hexRecord(0x01U, 0x0000U, {})
+		};
+		const auto extents{parseInput(format_t::intelHex, ".hex"sv, input)};
+		if (!context.expect(extents.has_value(), "valid Intel HEX to parse"sv) ||
+			!context.expect(extents->size() == 1U, "one extent"sv))
+			return;
+		context.expect(extentIs((*extents)[0], 0x0800fff8U, counting(16U)), "data at the linear address"sv);
+	}
+
+	void testIntelHexSegmentAddress(testContext_t &context)
+	{
+		// Extended segment addresses wrap data running off the end of the segment back to its start
+		const auto input
+		{
+			hexRecord(0x02U, 0x0000U, {0x10U, 0x00U}) + hexRecord(0x00U, 0xfff8U, counting(16U)) +
+			hexRecord(0x01U, 0x0000U, {})
+		};
+		const auto extents{parseInput(format_t::intelHex, ".hex"sv, input)};
+		if (!context.expect(extents.has_value(), "valid Intel HEX to parse"sv) ||
+			!context.expect(extents->size() == 2U, "the record to be split in two"sv))
+			return;
+		context.expect(extentIs((*extents)[0], 0x1fff8U, counting(8U)), "the start of the record at 0x1fff8"sv);
+		context.expect(extentIs((*extents)[1], 0x10000U, counting(8U, 8U)),
+			"the rest of the record wrapped to 0x10000"sv);
+	}
+
+	void testIntelHexCRLF(testContext_t &context)
+	{
+		auto input{hexRecord(0x00U, 0x0000U, counting(4U))};
+		input.insert(input.size() - 1U, "\r");
+		const auto extents{parseInput(format_t::intelHex, ".hex"sv, input)};
+		context.expect(extents && extents->size() == 1U && extentIs((*extents)[0], 0U, counting(4U)),
+			"CRLF line endings to be accepted"sv);
+	}
+
+	void testIntelHexMalformed(testContext_t &context)
+	{
+		const auto good{hexRecord(0x00U, 0x0000U, counting(4U))};
+		context.expect(!parseInput(format_t::intelHex, ".hex"sv, good + hexRecord(0x00U, 0x0004U, counting(4U), 1U)),
+			"a bad checksum to be rejected"sv);
+		context.expect(!parseInput(format_t::intelHex, ".hex"sv, good + ":0500000000010203F5\n"),
+			"a record length not matching its data to be rejected"sv);
+		context.expect(!parseInput(format_t::intelHex, ".hex"sv, good + "0400000000010203F6\n"),
+			"a record not starting with ':' to be rejected"sv);
+		context.expect(!parseInput(format_t::intelHex, ".hex"sv, good + ":04000000000102G3F6\n"),
+			"a record with a non-hex digit to be rejected"sv);
+		context.expect(!parseInput(format_t::intelHex, ".hex"sv, good + hexRecord(0x06U, 0x0000U, {})),
+			"an unknown record type to be rejected"sv);
+		context.expect(!parseInput(format_t::intelHex, ".hex"sv, good + hexRecord(0x04U, 0x0000U, {0x08U})),
+			"an extended address record of the wrong length to be rejected"sv);
+		context.expect(!parseInput(format_t::intelHex, ".hex"sv, ":00\n"sv),
+			"a truncated record to be rejected"sv);
+	}
+
+	void testSRecordData(testContext_t &context)
+	{
+		const auto input
+		{
+			srecRecord(0U, 0x0000U, {'h', 'd', 'r'}) + srecRecord(1U, 0x1000U, counting(8U)) +
+			srecRecord(2U, 0x201000U, counting(8U)) + srecRecord(3U, 0x08000000U, counting(8U)) +
+			srecRecord(3U, 0x08000008U, counting(8U, 8U)) + srecRecord(5U, 0x0004U, {}) +
+			srecRecord(7U, 0x08000000U, {}) + srecRecord(3U, 0x09000000U, counting(8U))
+		};
+		const auto extents{parseInput(format_t::srec, ".srec"sv, input)};
+		if (!context.expect(extents.has_value(), "valid S-records to parse"sv) ||
+			!context.expect(extents->size() == 3U, "three extents"sv))
+			return;
+		context.expect(extentIs((*extents)[0], 0x1000U, counting(8U)), "S1 data at a 16-bit address"sv);
+		context.expect(extentIs((*extents)[1], 0x201000U, counting(8U)), "S2 data at a 24-bit address"sv);
+		context.expect(extentIs((*extents)[2], 0x08000000U, counting(16U)),
+			"adjacent S3 records to be merged at a 32-bit address"sv);
+	}
+
+	void testSRecordMalformed(testContext_t &context)
+	{
+		const auto good{srecRecord(1U, 0x0000U, counting(4U))};
+		context.expect(!parseInput(format_t::srec, ".srec"sv, good + srecRecord(1U, 0x0004U, counting(4U), 1U)),
+			"a bad checksum to be rejected"sv);
+		context.expect(!parseInput(format_t::srec, ".srec"sv, good + "S10900000001020304EE\n"),
+			"a count not matching the record to be rejected"sv);
+		context.expect(!parseInput(format_t::srec, ".srec"sv, good + "X1070000000102030"),
+			"a record not starting with 'S' to be rejected"sv);
+		context.expect(!parseInput(format_t::srec, ".srec"sv, good + "S304000000FB\n"),
+			"a data record too short for its address to be rejected"sv);
+		context.expect(!parseInput(format_t::srec, ".srec"sv, "S1\n"sv), "a truncated record to be rejected"sv);
+	}
+
+	void testUF2Data(testContext_t &context)
+	{
+		std::vector<uint8_t> input{};
+		for (const auto &block :
+			{
+				uf2Block(0x00002000U, 0x10000000U, counting(256U), 0U, 3U),
+				uf2Block(0x00000001U, 0x20000000U, counting(256U), 1U, 3U),
+				uf2Block(0x00002000U, 0x10000100U, counting(256U), 2U, 3U),
+			})
+			input.insert(input.end(), block.begin(), block.end());
+		const auto extents{parseInput(format_t::uf2, ".uf2"sv, {input.data(), input.size()})};
+		if (!context.expect(extents.has_value(), "valid UF2 to parse"sv) ||
+			!context.expect(extents->size() == 1U, "one extent"sv))
+			return;
+		auto expected{counting(256U)};
+		const auto secondBlock{counting(256U)};
+		expected.insert(expected.end(), secondBlock.begin(), secondBlock.end());
+		context.expect(extentIs((*extents)[0], 0x10000000U, expected),
+			"blocks not for the main Flash to be skipped and the rest merged"sv);
+	}
+
+	void testUF2Malformed(testContext_t &context)
+	{
+		const auto good{uf2Block(0U, 0U, counting(256U), 0U, 2U)};
+		std::vector<uint8_t> input{good.begin(), good.end()};
+
+		auto badMagic{uf2Block(0U, 0x100U, counting(256U), 1U, 2U)};
+		badMagic[0] ^= 0xffU;
+		auto withBadMagic{input};
+		withBadMagic.insert(withBadMagic.end(), badMagic.begin(), badMagic.end());
+		context.expect(!parseInput(format_t::uf2, ".uf2"sv, {withBadMagic.data(), withBadMagic.size()}),
+			"a block with a bad magic number to be rejected"sv);
+
+		auto badEnd{uf2Block(0U, 0x100U, counting(256U), 1U, 2U)};
+		badEnd[511] ^= 0xffU;
+		auto withBadEnd{input};
+		withBadEnd.insert(withBadEnd.end(), badEnd.begin(), badEnd.end());
+		context.expect(!parseInput(format_t::uf2, ".uf2"sv, {withBadEnd.data(), withBadEnd.size()}),
+			"a block with a bad end magic to be rejected"sv);
+
+		auto tooLong{uf2Block(0U, 0x100U, counting(256U), 1U, 2U)};
+		writeLE(UINT32_C(477), span<uint8_t>{tooLong.data() + 16U, 4U});
+		auto withTooLong{input};
+		withTooLong.insert(withTooLong.end(), tooLong.begin(), tooLong.end());
+		context.expect(!parseInput(format_t::uf2, ".uf2"sv, {withTooLong.data(), withTooLong.size()}),
+			"a payload longer than a block can hold to be rejected"sv);
+
+		auto truncated{input};
+		truncated.insert(truncated.end(), good.begin(), good.begin() + 100);
+		context.expect(!parseInput(format_t::uf2, ".uf2"sv, {truncated.data(), truncated.size()}),
+			"a truncated block to be rejected"sv);
+	}
+} // namespace
+
+int main()
+{
+	return bmpflash::testing::runTests(
+	{
+		{"detectFormat"sv, testDetectFormat},
+		{"intelHexData"sv, testIntelHexData},
+		{"intelHexLinearAddress"sv, testIntelHexLinearAddress},
+		{"intelHexSegmentAddress"sv, testIntelHexSegmentAddress},
+		{"intelHexCRLF"sv, testIntelHexCRLF},
+		{"intelHexMalformed"sv, testIntelHexMalformed},
+		{"srecData"sv, testSRecordData},
+		{"srecMalformed"sv, testSRecordMalformed},
+		{"uf2Data"sv, testUF2Data},
+		{"uf2Malformed"sv, testUF2Malformed},
+	});
+}
@@ -0,0 +1,37 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// SPDX-FileCopyrightText: 2023 1BitSquared <info@1bitsquared.com>
+#ifndef REPLAY_HXX
+#define REPLAY_HXX
+
+#include <cstdint>
+#include <cstddef>
+#include <string_view>
+#include <optional>
+#include <substrate/span>
+#include "capture.hxx"
+#include "profileCache.hxx"
+#include "testing.hxx"
+
+// Helpers for the tests that replay the captured sessions with a probe in captures/
+namespace bmpflash::testing
+{
+	[[nodiscard]] inline std::optional<capture::replayInterface_t> loadCapture(testContext_t &context,
+		const std::string_view fileName)
+	{
+		// The replay has to make exactly the same requests as were captured, so discovery can't come from the cache
+		profileCache::bypassDiscoveryCache();
+		auto replay{capture::load(fileName, false)};
+		context.expect(replay.has_value(), "the capture to load"sv);
+		return replay;
+	}
+
+	// Fill with the offset of each byte in BCD, so the data's hex encoding in a capture has no letter digits
+	// whose case could differ between hex encoders
+	inline void fillBCD(const substrate::span<uint8_t> data) noexcept
+	{
+		for (size_t offset{0U}; offset < data.size(); ++offset)
+			data[offset] = static_cast<uint8_t>((((offset / 10U) % 10U) << 4U) | (offset % 10U));
+	}
+} // namespace bmpflash::testing
+
+#endif /*REPLAY_HXX*/
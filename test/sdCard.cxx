@@ -0,0 +1,85 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// SPDX-FileCopyrightText: 2023 1BitSquared <info@1bitsquared.com>
+#include <cstdint>
+#include <array>
+#include <string_view>
+#include <substrate/span>
+#include <substrate/index_sequence>
+#include "session.hxx"
+#include "sdCard.hxx"
+#include "testing.hxx"
+#include "replay.hxx"
+
+using namespace std::literals::string_view_literals;
+using substrate::span;
+using substrate::indexSequence_t;
+using bmpflash::beginComms;
+using bmpflash::sdCard::sdCard_t;
+using bmpflash::sdCard::blockSize;
+using bmpflash::testing::testContext_t;
+using bmpflash::testing::loadCapture;
+using bmpflash::testing::fillBCD;
+
+/*
+ * These replay sessions with a probe that has a 64MiB high capacity SD card on its external bus. Each brings the
+ * card up, reads two blocks from block 0 with CMD18, writes two blocks to block 8 with CMD25 and reads those back.
+ * The card's blocks start out holding a pattern based on the block number. captures/sdCard.capture is with a probe
+ * that does block transfers, and captures/sdCardByteTransfers.capture is with one whose firmware predates them.
+ */
+namespace
+{
+	constexpr size_t transferBlocks{2U};
+	constexpr size_t transferLength{transferBlocks * blockSize};
+
+	[[nodiscard]] bool holdsInitialContent(const span<const uint8_t> data, const uint64_t block) noexcept
+	{
+		for (const auto offset : indexSequence_t{data.size()})
+		{
+			const auto blockNumber{block + (offset / blockSize)};
+			if (data[offset] != static_cast<uint8_t>((blockNumber * 3U) + ((offset % blockSize) * 7U)))
+				return false;
+		}
+		return true;
+	}
+
+	void replaySession(testContext_t &context, const std::string_view captureFile)
+	{
+		const auto replay{loadCapture(context, captureFile)};
+		if (!replay)
+			return;
+		auto probe{beginComms(bmp_t{*replay}, "replay"sv, spiBus_t::external, spiDevice_t::sdcard)};
+		if (!context.expect(probe.has_value(), "communications with the probe to begin"sv))
+			return;
+
+		auto card{sdCard_t::initialise(*probe)};
+		if (!context.expect(card.has_value(), "the SD card to initialise"sv))
+			return;
+		context.expect(card->capacity() == 67108864U, "the card's CSD to give a 64MiB capacity"sv);
+		context.expect(card->name() == "SIM64"sv, "the card's CID to name it SIM64"sv);
+
+		std::array<uint8_t, transferLength> data{};
+		context.expect(card->readBlocks(*probe, 0U, data) && holdsInitialContent(data, 0U),
+			"the first two blocks to read back as the initial content"sv);
+
+		std::array<uint8_t, transferLength> written{};
+		fillBCD(written);
+		context.expect(card->writeBlocks(*probe, 8U, written), "the write to blocks 8 and 9 to succeed"sv);
+		context.expect(card->readBlocks(*probe, 8U, data) && data == written, "the written blocks to read back"sv);
+
+		context.expect(probe->end(), "the session to end cleanly"sv);
+		context.expect(replay->complete(), "the whole capture to have been replayed"sv);
+	}
+
+	void testBlockTransfers(testContext_t &context) { replaySession(context, "captures/sdCard.capture"sv); }
+	void testByteTransfers(testContext_t &context)
+		{ replaySession(context, "captures/sdCardByteTransfers.capture"sv); }
+} // namespace
+
+int main()
+{
+	return bmpflash::testing::runTests(
+	{
+		{"blockTransfers"sv, testBlockTransfers},
+		{"byteTransfers"sv, testByteTransfers},
+	});
+}
@@ -0,0 +1,95 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// SPDX-FileCopyrightText: 2023 1BitSquared <info@1bitsquared.com>
+#include <cstdint>
+#include <array>
+#include <algorithm>
+#include <string_view>
+#include <substrate/span>
+#include <substrate/index_sequence>
+#include "session.hxx"
+#include "spiNand.hxx"
+#include "testing.hxx"
+#include "replay.hxx"
+
+using namespace std::literals::string_view_literals;
+using substrate::span;
+using substrate::indexSequence_t;
+using bmpflash::beginComms;
+using bmpflash::spiNand::spiNand_t;
+using bmpflash::testing::testContext_t;
+using bmpflash::testing::loadCapture;
+using bmpflash::testing::fillBCD;
+
+/*
+ * These replay captures/nandSession.capture, a session with a probe that has a 128KiB SPI NAND device on its
+ * internal bus. The device isn't in the table of known parts so describes itself with an ONFI parameter page,
+ * giving 16 blocks of 4 2KiB pages. Block 5 carries the factory bad block marker and block 7 fails to erase.
+ * The pages start out holding a pattern based on the page number.
+ */
+namespace
+{
+	constexpr auto captureFile{"captures/nandSession.capture"sv};
+	constexpr size_t pageSize{2048U};
+	constexpr size_t blockSize{pageSize * 4U};
+
+	[[nodiscard]] bool holdsInitialContent(const span<const uint8_t> data, const uint32_t block) noexcept
+	{
+		for (const auto offset : indexSequence_t{data.size()})
+		{
+			const auto page{(block * 4U) + (offset / pageSize)};
+			if (data[offset] != static_cast<uint8_t>((page * 5U) + ((offset % pageSize) * 3U)))
+				return false;
+		}
+		return true;
+	}
+
+	void testReadWriteErase(testContext_t &context)
+	{
+		const auto replay{loadCapture(context, captureFile)};
+		if (!replay)
+			return;
+		auto probe{beginComms(bmp_t{*replay}, "replay"sv, spiBus_t::internal)};
+		if (!context.expect(probe.has_value(), "communications with the probe to begin"sv))
+			return;
+
+		auto nand{spiNand_t::identify(*probe)};
+		if (!context.expect(nand.has_value(), "the NAND device to be identified from its parameter page"sv))
+			return;
+		context.expect(nand->name() == "SIMULATOR SN128K"sv, "the parameter page to name the device"sv);
+		context.expect(nand->geometry().pageSize == pageSize && nand->blockSize() == blockSize &&
+			nand->blockCount() == 16U, "the parameter page to give 16 blocks of 4 2KiB pages"sv);
+		if (!context.expect(nand->prepare(*probe) && nand->scanBadBlocks(*probe),
+				"the device to be prepared and scanned for bad blocks"sv))
+			return;
+		context.expect(nand->isBad(5U) && nand->badBlockCount() == 1U, "only block 5 to be marked bad"sv);
+
+		std::array<uint8_t, blockSize> data{};
+		context.expect(nand->readBlock(*probe, 0U, data) && holdsInitialContent(data, 0U),
+			"the first block to read back as the initial content"sv);
+
+		// Leave the last page all 0xff so programming the block has to skip over it
+		std::array<uint8_t, blockSize> written{};
+		fillBCD(span<uint8_t>{written}.first(blockSize - pageSize));
+		std::fill(written.end() - pageSize, written.end(), 0xffU);
+		context.expect(nand->eraseBlock(*probe, 1U) && nand->programBlock(*probe, 1U, written),
+			"erasing and programming block 1 to succeed"sv);
+		context.expect(nand->readBlock(*probe, 1U, data) && data == written, "the written block to read back"sv);
+
+		// Block 7 reports its erase failed, which has to take it out of use
+		context.expect(!nand->eraseBlock(*probe, 7U), "the erase of block 7 to fail"sv);
+		nand->markBad(*probe, 7U);
+		context.expect(nand->isBad(7U) && nand->usableCapacity() == blockSize * 14U,
+			"block 7 to be marked bad along with block 5"sv);
+
+		context.expect(probe->end(), "the session to end cleanly"sv);
+		context.expect(replay->complete(), "the whole capture to have been replayed"sv);
+	}
+} // namespace
+
+int main()
+{
+	return bmpflash::testing::runTests(
+	{
+		{"readWriteErase"sv, testReadWriteErase},
+	});
+}
@@ -0,0 +1,77 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// SPDX-FileCopyrightText: 2023 1BitSquared <info@1bitsquared.com>
+#ifndef TESTING_HXX
+#define TESTING_HXX
+
+#include <cstddef>
+#include <cstdio>
+#include <exception>
+#include <initializer_list>
+#include <string_view>
+#include <substrate/console>
+
+/*
+ * A minimal harness for the test programs run by `meson test`. Each test case is a function taking a
+ * context that it checks its expectations through, and the program exits non-zero if any of them failed.
+ */
+namespace bmpflash::testing
+{
+	using namespace std::literals::string_view_literals;
+	using substrate::console;
+
+	struct testContext_t final
+	{
+	private:
+		std::string_view _name;
+		size_t _failures{0U};
+
+	public:
+		testContext_t(const std::string_view name) noexcept : _name{name} { }
+
+		[[nodiscard]] auto failures() const noexcept { return _failures; }
+
+		// Check an expectation holds, reporting it if not and handing back the result so a test can bail early
+		bool expect(const bool result, const std::string_view what)
+		{
+			if (!result)
+			{
+				++_failures;
+				console.error(_name, ": expected "sv, what);
+			}
+			return result;
+		}
+	};
+
+	using testCase_t = void (*)(testContext_t &);
+
+	struct test_t final
+	{
+		std::string_view name;
+		testCase_t run;
+	};
+
+	// Run each test in turn, giving back the exit code for the test program
+	[[nodiscard]] inline int runTests(const std::initializer_list<test_t> tests)
+	{
+		console = {stdout, stderr};
+		size_t failed{0U};
+		for (const auto &test : tests)
+		{
+			testContext_t context{test.name};
+			try
+				{ test.run(context); }
+			catch (const std::exception &error)
+			{
+				context.expect(false, "the test not to throw"sv);
+				console.error(test.name, ": threw "sv, error.what());
+			}
+			if (context.failures())
+				++failed;
+			console.info(context.failures() ? "FAIL "sv : "PASS "sv, test.name);
+		}
+		console.info(tests.size() - failed, " of "sv, tests.size(), " tests passed"sv);
+		return failed ? 1 : 0;
+	}
+} // namespace bmpflash::testing
+
+#endif /*TESTING_HXX*/